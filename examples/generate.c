@@ -96,11 +96,15 @@ main(int argc, const char* argv[]) {
 	};
 
 	LLMD_CHECK(load_driver(&driver_config, &argparse, &loader, &driver));
-	LLMD_CHECK(llmd_create_session(NULL, driver, &session));
+	LLMD_CHECK(llmd_create_session(NULL, driver, NULL, &session));
 
 	struct llmd_model_info model_info;
 	LLMD_CHECK(llmd_get_model_info(session, &model_info));
 	logits = malloc(sizeof(float) * model_info.vocab_size);
+	struct llmd_logits_output logits_output = {
+		.mode = LLMD_LOGITS_FULL,
+		.logits = logits,
+	};
 	scratch_buf = malloc(sizeof(float) * model_info.vocab_size);
 	mirostat.scratch_buf = scratch_buf;
 
@@ -163,7 +167,7 @@ main(int argc, const char* argv[]) {
 		gen_handle,
 		prompt_buf, num_tokens + 1,
 		0,
-		logits
+		&logits_output
 	));
 	unsigned int offset = num_tokens + 1;
 
@@ -195,7 +199,7 @@ main(int argc, const char* argv[]) {
 			gen_handle,
 			&next_token, 1,
 			offset++,
-			logits
+			&logits_output
 		));
 	}
 
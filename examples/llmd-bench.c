@@ -0,0 +1,464 @@
+#include <stddef.h>
+#include <llmd/loader.h>
+#include <llmd/core.h>
+#include <llmd/sampling.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "common.h"
+
+struct bench_options {
+	int num_contexts;
+	int num_rounds;
+	int min_prompt_tokens;
+	int max_prompt_tokens;
+	int min_generated_tokens;
+	int max_generated_tokens;
+	float shared_prefix;
+	const char* context_type;
+	int max_batch_tokens;
+	int max_batch_wait_us;
+	int seed;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	const struct bench_options* options;
+	struct llmd_context* context;
+	const llmd_token_t* shared_tokens;
+	unsigned int vocab_size;
+
+	struct llmd_sampling_default_rng_state rng_state;
+	struct llmd_sampling_rng rng;
+	llmd_token_t* prompt;
+
+	// One per request and one per generated token after the first
+	uint64_t* time_to_first_token_ns;
+	unsigned int num_requests;
+	uint64_t* inter_token_ns;
+	unsigned int num_inter_tokens;
+
+	uint64_t num_prompt_tokens;
+	uint64_t num_generated_tokens;
+	enum llmd_error status;
+};
+
+static uint64_t
+bench_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static unsigned int
+bench_uniform(struct llmd_sampling_rng* rng, int min, int max) {
+	unsigned int range = (unsigned int)(max - min) + 1;
+	unsigned int value = (unsigned int)(rng->next(rng->state) * (float)range);
+	return (unsigned int)min + (value < range ? value : range - 1);
+}
+
+static void*
+bench_run_worker(void* userdata) {
+	struct bench_worker* worker = userdata;
+	const struct bench_options* options = worker->options;
+	struct llmd_generate_handle* handle = NULL;
+	enum llmd_error status = LLMD_OK;
+
+	float top_logit;
+	llmd_token_t top_token;
+	struct llmd_logits_output output = {
+		.mode = LLMD_LOGITS_TOP_K,
+		.top_k = 1,
+		.logits = &top_logit,
+		.tokens = &top_token,
+	};
+
+	for (int round = 0; round < options->num_rounds; ++round) {
+		unsigned int num_prompt_tokens = bench_uniform(
+			&worker->rng, options->min_prompt_tokens, options->max_prompt_tokens
+		);
+		unsigned int num_generated_tokens = bench_uniform(
+			&worker->rng, options->min_generated_tokens, options->max_generated_tokens
+		);
+
+		// A common head like a system prompt, then something unique
+		unsigned int num_shared_tokens = (unsigned int)(options->shared_prefix * (float)num_prompt_tokens);
+		memcpy(worker->prompt, worker->shared_tokens, sizeof(llmd_token_t) * num_shared_tokens);
+		for (unsigned int i = num_shared_tokens; i < num_prompt_tokens; ++i) {
+			worker->prompt[i] = bench_uniform(&worker->rng, 0, (int)worker->vocab_size - 1);
+		}
+
+		LLMD_CHECK(llmd_begin_generate(worker->context, &handle));
+
+		uint64_t start_ns = bench_now_ns();
+		LLMD_CHECK(llmd_generate_next(handle, worker->prompt, num_prompt_tokens, 0, &output));
+		worker->time_to_first_token_ns[worker->num_requests++] = bench_now_ns() - start_ns;
+
+		// Greedy and ignoring EOS so every run does the same amount of work
+		unsigned int offset = num_prompt_tokens;
+		for (unsigned int i = 1; i < num_generated_tokens; ++i) {
+			llmd_token_t token = top_token;
+
+			start_ns = bench_now_ns();
+			LLMD_CHECK(llmd_generate_next(handle, &token, 1, offset++, &output));
+			worker->inter_token_ns[worker->num_inter_tokens++] = bench_now_ns() - start_ns;
+		}
+
+		LLMD_CHECK(llmd_end_generate(handle));
+		handle = NULL;
+
+		worker->num_prompt_tokens += num_prompt_tokens;
+		worker->num_generated_tokens += num_generated_tokens;
+	}
+
+end:
+	if (handle != NULL) {
+		llmd_end_generate(handle);
+	}
+
+	worker->status = status;
+	return NULL;
+}
+
+static int
+bench_compare_ns(const void* lhs, const void* rhs) {
+	uint64_t a = *(const uint64_t*)lhs;
+	uint64_t b = *(const uint64_t*)rhs;
+	return (a > b) - (a < b);
+}
+
+static double
+bench_percentile_ms(const uint64_t* sorted_ns, unsigned int count, double percentile) {
+	if (count == 0) { return 0.0; }
+
+	unsigned int index = (unsigned int)(percentile / 100.0 * (count - 1) + 0.5);
+	return (double)sorted_ns[index] / 1e6;
+}
+
+static void
+bench_print_latency(const char* name, uint64_t* samples_ns, unsigned int count, bool last) {
+	qsort(samples_ns, count, sizeof(uint64_t), bench_compare_ns);
+
+	uint64_t total_ns = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		total_ns += samples_ns[i];
+	}
+
+	printf("\t\"%s\": {\n", name);
+	printf("\t\t\"count\": %u,\n", count);
+	printf("\t\t\"mean\": %.3f,\n", count > 0 ? (double)total_ns / count / 1e6 : 0.0);
+	printf("\t\t\"p50\": %.3f,\n", bench_percentile_ms(samples_ns, count, 50.0));
+	printf("\t\t\"p90\": %.3f,\n", bench_percentile_ms(samples_ns, count, 90.0));
+	printf("\t\t\"p99\": %.3f,\n", bench_percentile_ms(samples_ns, count, 99.0));
+	printf("\t\t\"max\": %.3f\n", count > 0 ? (double)samples_ns[count - 1] / 1e6 : 0.0);
+	printf("\t}%s\n", last ? "" : ",");
+}
+
+int
+main(int argc, const char* argv[]) {
+	struct driver_config driver_config = { 0 };
+	struct bench_options options = {
+		.num_contexts = 4,
+		.num_rounds = 4,
+		.min_prompt_tokens = 64,
+		.max_prompt_tokens = 256,
+		.min_generated_tokens = 32,
+		.max_generated_tokens = 128,
+		.shared_prefix = 0.5f,
+		.context_type = "min_upload",
+		.max_batch_wait_us = 1000,
+	};
+
+	struct argparse_option argparse_options[] = {
+		COMMON_OPTIONS,
+		OPT_GROUP("Workload options"),
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "contexts",
+			.help = "Number of concurrent virtual contexts, one thread each (default: 4)",
+			.value = &options.num_contexts,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "rounds",
+			.help = "Number of requests made by each context (default: 4)",
+			.value = &options.num_rounds,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "min-prompt",
+			.help = "Minimum prompt length in tokens (default: 64)",
+			.value = &options.min_prompt_tokens,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "max-prompt",
+			.help = "Maximum prompt length in tokens (default: 256)",
+			.value = &options.max_prompt_tokens,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "min-generate",
+			.help = "Minimum number of generated tokens (default: 32)",
+			.value = &options.min_generated_tokens,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "max-generate",
+			.help = "Maximum number of generated tokens (default: 128)",
+			.value = &options.max_generated_tokens,
+		},
+		{
+			.type = ARGPARSE_OPT_FLOAT,
+			.long_name = "shared-prefix",
+			.help = "Fraction of every prompt which is the same for all requests (default: 0.5)",
+			.value = &options.shared_prefix,
+		},
+		{
+			.type = ARGPARSE_OPT_STRING,
+			.long_name = "context-type",
+			.help = "direct, min_upload, min_discard or min_cost (default: min_upload)",
+			.value = &options.context_type,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "max-batch-tokens",
+			.help = "Token budget of the scheduler, 0 disables it (default: 0)",
+			.value = &options.max_batch_tokens,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "max-batch-wait-us",
+			.help = "How long a call waits for a batch to fill (default: 1000)",
+			.value = &options.max_batch_wait_us,
+		},
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "seed",
+			.help = "The seed for the workload (default: 0)",
+			.value = &options.seed,
+		},
+		OPT_END()
+	};
+	struct argparse argparse;
+	argparse_init(&argparse, argparse_options, NULL, ARGPARSE_STOP_AT_NON_OPTION);
+	argparse_describe(
+		&argparse,
+		"Run a synthetic workload and report throughput and latency as JSON",
+		NULL
+	);
+	argparse_parse(&argparse, argc, argv);
+
+	enum llmd_error status = LLMD_OK;
+	struct llmd_driver_loader* loader = NULL;
+	struct llmd_driver* driver = NULL;
+	struct llmd_session* session = NULL;
+	struct bench_worker* workers = NULL;
+	llmd_token_t* shared_tokens = NULL;
+	uint64_t* time_to_first_token_ns = NULL;
+	uint64_t* inter_token_ns = NULL;
+	int num_started = 0;
+
+	enum llmd_context_type context_type;
+	if (strcmp(options.context_type, "direct") == 0) {
+		context_type = LLMD_CONTEXT_DIRECT;
+	} else if (strcmp(options.context_type, "min_upload") == 0) {
+		context_type = LLMD_CONTEXT_MIN_UPLOAD;
+	} else if (strcmp(options.context_type, "min_discard") == 0) {
+		context_type = LLMD_CONTEXT_MIN_DISCARD;
+	} else if (strcmp(options.context_type, "min_cost") == 0) {
+		context_type = LLMD_CONTEXT_MIN_COST;
+	} else {
+		fprintf(stderr, "Invalid context type: %s\n", options.context_type);
+		status = LLMD_ERR_INVALID;
+		goto end;
+	}
+
+	if (
+		options.num_contexts <= 0
+		|| options.num_rounds <= 0
+		|| options.min_prompt_tokens <= 0
+		|| options.min_prompt_tokens > options.max_prompt_tokens
+		|| options.min_generated_tokens <= 0
+		|| options.min_generated_tokens > options.max_generated_tokens
+		|| options.shared_prefix < 0.f
+		|| options.shared_prefix > 1.f
+		|| options.max_batch_tokens < 0
+		|| options.max_batch_wait_us < 0
+	) {
+		fprintf(stderr, "Invalid workload options\n");
+		status = LLMD_ERR_INVALID;
+		goto end;
+	}
+
+	LLMD_CHECK(load_driver(&driver_config, &argparse, &loader, &driver));
+
+	struct llmd_session_config session_config = {
+		// Contexts can outnumber what the driver can hold
+		.admission_timeout_ms = 60000,
+		.max_batch_tokens = options.max_batch_tokens,
+		.max_batch_wait_us = options.max_batch_wait_us,
+	};
+	LLMD_CHECK(llmd_create_session(NULL, driver, &session_config, &session));
+
+	struct llmd_model_info model_info;
+	LLMD_CHECK(llmd_get_model_info(session, &model_info));
+	if (
+		(unsigned int)(options.max_prompt_tokens + options.max_generated_tokens)
+		> model_info.max_context_length
+	) {
+		fprintf(
+			stderr, "Requests can be longer than the context length of %u\n",
+			model_info.max_context_length
+		);
+		status = LLMD_ERR_INVALID;
+		goto end;
+	}
+
+	struct llmd_sampling_default_rng_state rng_state;
+	struct llmd_sampling_rng rng = llmd_sampling_init_default_rng(&rng_state, options.seed);
+	shared_tokens = malloc(sizeof(llmd_token_t) * options.max_prompt_tokens);
+	shared_tokens[0] = model_info.bos_token;
+	for (int i = 1; i < options.max_prompt_tokens; ++i) {
+		shared_tokens[i] = bench_uniform(&rng, 0, (int)model_info.vocab_size - 1);
+	}
+
+	unsigned int max_requests = options.num_contexts * options.num_rounds;
+	unsigned int max_inter_tokens_per_worker = options.num_rounds * options.max_generated_tokens;
+	time_to_first_token_ns = malloc(sizeof(uint64_t) * max_requests);
+	inter_token_ns = malloc(sizeof(uint64_t) * max_inter_tokens_per_worker * options.num_contexts);
+	workers = calloc(options.num_contexts, sizeof(struct bench_worker));
+
+	for (int i = 0; i < options.num_contexts; ++i) {
+		struct bench_worker* worker = &workers[i];
+		worker->options = &options;
+		worker->shared_tokens = shared_tokens;
+		worker->vocab_size = model_info.vocab_size;
+		worker->rng = llmd_sampling_init_default_rng(&worker->rng_state, options.seed + i + 1);
+		worker->prompt = malloc(sizeof(llmd_token_t) * options.max_prompt_tokens);
+		worker->time_to_first_token_ns = time_to_first_token_ns + i * options.num_rounds;
+		worker->inter_token_ns = inter_token_ns + i * max_inter_tokens_per_worker;
+
+		LLMD_CHECK(llmd_create_context(session, context_type, &worker->context));
+	}
+
+	uint64_t start_ns = bench_now_ns();
+	for (; num_started < options.num_contexts; ++num_started) {
+		if (pthread_create(&workers[num_started].thread, NULL, bench_run_worker, &workers[num_started]) != 0) {
+			fprintf(stderr, "Could not start worker\n");
+			status = LLMD_ERR_IO;
+			break;
+		}
+	}
+
+	for (int i = 0; i < num_started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	num_started = 0;
+	uint64_t elapsed_ns = bench_now_ns() - start_ns;
+	if (status != LLMD_OK) { goto end; }
+
+	// Pack samples of all workers together
+	unsigned int num_requests = 0;
+	unsigned int num_inter_tokens = 0;
+	uint64_t num_prompt_tokens = 0;
+	uint64_t num_generated_tokens = 0;
+	for (int i = 0; i < options.num_contexts; ++i) {
+		struct bench_worker* worker = &workers[i];
+		if (worker->status != LLMD_OK) {
+			fprintf(
+				stderr, "Worker %d failed with %d (%s)\n",
+				i, worker->status, llmd_error_to_str(worker->status)
+			);
+			status = worker->status;
+		}
+
+		memmove(
+			time_to_first_token_ns + num_requests,
+			worker->time_to_first_token_ns,
+			sizeof(uint64_t) * worker->num_requests
+		);
+		num_requests += worker->num_requests;
+		memmove(
+			inter_token_ns + num_inter_tokens,
+			worker->inter_token_ns,
+			sizeof(uint64_t) * worker->num_inter_tokens
+		);
+		num_inter_tokens += worker->num_inter_tokens;
+
+		num_prompt_tokens += worker->num_prompt_tokens;
+		num_generated_tokens += worker->num_generated_tokens;
+	}
+
+	struct llmd_session_stats stats;
+	LLMD_CHECK(llmd_get_session_stats(session, &stats));
+
+	// ru_maxrss is in kilobytes on Linux
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	double elapsed_s = (double)elapsed_ns / 1e9;
+	printf("{\n");
+	printf("\t\"driver\": \"%s\",\n", driver_config.driver_path);
+	printf("\t\"contexts\": %d,\n", options.num_contexts);
+	printf("\t\"rounds\": %d,\n", options.num_rounds);
+	printf("\t\"context_type\": \"%s\",\n", options.context_type);
+	printf("\t\"prompt_tokens_range\": [%d, %d],\n", options.min_prompt_tokens, options.max_prompt_tokens);
+	printf("\t\"generated_tokens_range\": [%d, %d],\n", options.min_generated_tokens, options.max_generated_tokens);
+	printf("\t\"shared_prefix\": %.3f,\n", options.shared_prefix);
+	printf("\t\"max_batch_tokens\": %d,\n", options.max_batch_tokens);
+	printf("\t\"seed\": %d,\n", options.seed);
+	printf("\t\"ok\": %s,\n", status == LLMD_OK ? "true" : "false");
+	printf("\t\"elapsed_s\": %.3f,\n", elapsed_s);
+	printf("\t\"requests\": %u,\n", num_requests);
+	printf("\t\"prompt_tokens\": %llu,\n", (unsigned long long)num_prompt_tokens);
+	printf("\t\"generated_tokens\": %llu,\n", (unsigned long long)num_generated_tokens);
+	printf("\t\"prompt_tokens_per_s\": %.3f,\n", (double)num_prompt_tokens / elapsed_s);
+	printf("\t\"generated_tokens_per_s\": %.3f,\n", (double)num_generated_tokens / elapsed_s);
+	printf("\t\"prefix_hits\": %llu,\n", (unsigned long long)stats.num_prefix_hits);
+	printf("\t\"tokens_reused\": %llu,\n", (unsigned long long)stats.num_tokens_reused);
+	printf("\t\"tokens_uploaded\": %llu,\n", (unsigned long long)stats.num_tokens_uploaded);
+	printf(
+		"\t\"prefix_reuse_ratio\": %.4f,\n",
+		num_prompt_tokens > 0 ? (double)stats.num_tokens_reused / (double)num_prompt_tokens : 0.0
+	);
+	printf("\t\"pooled_contexts\": %u,\n", stats.admission.num_pooled_contexts);
+	printf("\t\"admission_waits\": %llu,\n", (unsigned long long)stats.admission.num_waits);
+	printf("\t\"batches\": %llu,\n", (unsigned long long)stats.batch.num_batches);
+	printf("\t\"peak_rss_kb\": %ld,\n", usage.ru_maxrss);
+	bench_print_latency("time_to_first_token_ms", time_to_first_token_ns, num_requests, false);
+	bench_print_latency("inter_token_ms", inter_token_ns, num_inter_tokens, true);
+	printf("}\n");
+end:
+	for (int i = 0; i < num_started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	if (workers != NULL) {
+		for (int i = 0; i < options.num_contexts; ++i) {
+			if (workers[i].context != NULL) {
+				llmd_destroy_context(workers[i].context);
+			}
+			free(workers[i].prompt);
+		}
+	}
+
+	if (session != NULL) {
+		llmd_destroy_session(session);
+	}
+
+	if (loader != NULL) {
+		llmd_unload_driver(loader);
+	}
+
+	free(workers);
+	free(inter_token_ns);
+	free(time_to_first_token_ns);
+	free(shared_tokens);
+	cleanup_driver_config(&driver_config);
+
+	return status == LLMD_OK ? 0 : 1;
+}
@@ -26,14 +26,24 @@ main(int argc, const char* argv[]) {
 		.name = "llmd-ipc",
 	};
 
+	int prefill_chunk_size = 512;
+
 	struct argparse_option options[] = {
 		COMMON_OPTIONS,
+		OPT_GROUP("Server options"),
+		{
+			.type = ARGPARSE_OPT_INTEGER,
+			.long_name = "prefill-chunk",
+			.help = "Evaluate prompts this many tokens at a time, serving other requests in between. 0 disables it (default: 512)",
+			.value = &prefill_chunk_size,
+		},
 		OPT_END()
 	};
 	struct argparse argparse;
 	argparse_init(&argparse, options, NULL, ARGPARSE_STOP_AT_NON_OPTION);
 	argparse_describe(&argparse, "Run an IPC server", NULL);
 	argparse_parse(&argparse, argc, argv);
+	server_config.prefill_chunk_size = prefill_chunk_size > 0 ? (unsigned int)prefill_chunk_size : 0;
 
 	enum llmd_error status = LLMD_OK;
 	struct llmd_driver_loader* loader = NULL;
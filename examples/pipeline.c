@@ -70,7 +70,7 @@ main(int argc, const char* argv[]) {
 	struct lm_pipeline_ctx* pipeline = NULL;
 
 	LLMD_CHECK(load_driver(&driver_config, &argparse, &loader, &driver));
-	LLMD_CHECK(llmd_create_session(NULL, driver, &session));
+	LLMD_CHECK(llmd_create_session(NULL, driver, NULL, &session));
 	LLMD_CHECK(llmd_create_context(session, LLMD_CONTEXT_MIN_UPLOAD, &context));
 
 	pipeline = lm_pipeline_create_ctx(NULL);
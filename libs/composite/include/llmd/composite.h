@@ -0,0 +1,88 @@
+#ifndef LLMD_COMPOSITE_H
+#define LLMD_COMPOSITE_H
+
+#include <llmd/core.h>
+
+#ifdef LLMD_COMPOSITE_SHARED
+#    if defined(_WIN32) && !defined(__MINGW32__)
+#        ifdef LLMD_COMPOSITE_BUILD
+#            define LLMD_COMPOSITE_API __declspec(dllexport)
+#        else
+#            define LLMD_COMPOSITE_API __declspec(dllimport)
+#        endif
+#    else
+#        define LLMD_COMPOSITE_API __attribute__((visibility ("default")))
+#    endif
+#else
+#    define LLMD_COMPOSITE_API
+#endif
+
+// How many leading tokens of each context are remembered for routing
+#define LLMD_COMPOSITE_MAX_AFFINITY_TOKENS 64
+
+// Spreads contexts over several drivers serving the same model
+struct llmd_composite_driver_config {
+	struct llmd_driver** backends;
+	unsigned int num_backends;
+
+	unsigned int max_contexts;
+	// A new context moves to the backend already holding at least this many
+	// of its first tokens in another context
+	unsigned int min_affinity_tokens;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+LLMD_COMPOSITE_API enum llmd_error
+llmd_create_composite_driver(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config* config,
+	struct llmd_driver** driver_out
+);
+
+LLMD_COMPOSITE_API enum llmd_error
+llmd_destroy_composite_driver(
+	struct llmd_driver* driver
+);
+
+#ifdef LLMD_COMPOSITE_BUILD
+
+// Backends are loaded from [backend.<name>] sections with a driver_path and
+// an optional config_path
+
+LLMD_COMPOSITE_API enum llmd_error
+llmd_begin_create_driver(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config** config
+);
+
+LLMD_COMPOSITE_API enum llmd_error
+llmd_set_driver_config(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config* config,
+	const char* section,
+	const char* key,
+	const char* value
+);
+
+LLMD_COMPOSITE_API enum llmd_error
+llmd_end_create_driver(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config* config,
+	struct llmd_driver** driver_out
+);
+
+LLMD_COMPOSITE_API enum llmd_error
+llmd_destroy_driver(
+	struct llmd_driver* driver
+);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
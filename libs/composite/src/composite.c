@@ -0,0 +1,1030 @@
+#include <llmd/composite.h>
+#include <llmd/loader.h>
+#include <llmd/core.h>
+#include <llmd/utils/host.h>
+#include <llmd/utils/buffer.h>
+#include <llmd/utils/cfg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define LLMD_COMPOSITE_DEFAULT_MAX_CONTEXTS 64
+#define LLMD_COMPOSITE_DEFAULT_MIN_AFFINITY_TOKENS 16
+
+// Part of a batch going to one backend
+struct llmd_composite_job {
+	const struct llmd_driver_generate_item* items;
+	unsigned int num_items;
+
+	enum llmd_error status;
+	bool done;
+	struct llmd_composite_job* next;
+};
+
+struct llmd_composite_backend {
+	struct llmd_driver* driver;
+
+	// Under the driver lock
+	unsigned int num_contexts;
+	_Atomic(unsigned int) num_busy;
+
+	// Runs batches so backends work in parallel
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct llmd_composite_job* jobs_head;
+	struct llmd_composite_job* jobs_tail;
+	bool quit;
+};
+
+struct llmd_composite_context {
+	// -1 for a free slot
+	int backend;
+	int descriptor;
+
+	// The first tokens, for routing other contexts
+	unsigned int num_prefix_tokens;
+	llmd_token_t prefix[LLMD_COMPOSITE_MAX_AFFINITY_TOKENS];
+};
+
+struct llmd_composite_driver {
+	struct llmd_driver header;
+	struct llmd_host* host;
+	struct llmd_composite_driver_config* config;
+	struct llmd_model_info model_info;
+	unsigned int max_contexts;
+	unsigned int min_affinity_tokens;
+
+	// Guards placement and prefixes
+	pthread_mutex_t lock;
+	struct llmd_composite_context* contexts;
+
+	unsigned int num_workers;
+	struct llmd_composite_backend backends[];
+};
+
+static enum llmd_error
+llmd_composite_run_batch(
+	struct llmd_driver* driver,
+	const struct llmd_driver_generate_item* items,
+	unsigned int num_items
+) {
+	if (driver->interface->generate_batch != NULL) {
+		return driver->interface->generate_batch(driver, items, num_items);
+	}
+
+	for (unsigned int i = 0; i < num_items; ++i) {
+		enum llmd_error status = driver->interface->generate(
+			driver,
+			items[i].context_descriptor,
+			items[i].tokens, items[i].num_tokens, items[i].offset,
+			items[i].output
+		);
+		if (status != LLMD_OK) { return status; }
+	}
+
+	return LLMD_OK;
+}
+
+static void*
+llmd_composite_worker(void* userdata) {
+	struct llmd_composite_backend* backend = userdata;
+
+	pthread_mutex_lock(&backend->lock);
+	while (true) {
+		while (backend->jobs_head == NULL && !backend->quit) {
+			pthread_cond_wait(&backend->cond, &backend->lock);
+		}
+		if (backend->jobs_head == NULL) { break; }
+
+		struct llmd_composite_job* job = backend->jobs_head;
+		backend->jobs_head = job->next;
+		if (backend->jobs_head == NULL) { backend->jobs_tail = NULL; }
+		pthread_mutex_unlock(&backend->lock);
+
+		enum llmd_error status = llmd_composite_run_batch(
+			backend->driver, job->items, job->num_items
+		);
+
+		pthread_mutex_lock(&backend->lock);
+		job->status = status;
+		job->done = true;
+		pthread_cond_broadcast(&backend->cond);
+	}
+	pthread_mutex_unlock(&backend->lock);
+
+	return NULL;
+}
+
+static unsigned int
+llmd_composite_load_of(struct llmd_composite_backend* backend) {
+	return backend->num_contexts
+		+ atomic_load_explicit(&backend->num_busy, memory_order_relaxed);
+}
+
+static struct llmd_composite_context*
+llmd_composite_context_of(
+	struct llmd_composite_driver* driver,
+	int descriptor
+) {
+	if (descriptor < 0 || descriptor >= (int)driver->max_contexts) {
+		return NULL;
+	}
+
+	struct llmd_composite_context* ctx = &driver->contexts[descriptor];
+	return ctx->backend >= 0 ? ctx : NULL;
+}
+
+// Move an empty context or one about to be overwritten.
+// Stays where it is if the new backend has no room.
+static void
+llmd_composite_move_locked(
+	struct llmd_composite_driver* driver,
+	struct llmd_composite_context* ctx,
+	int backend_index
+) {
+	if (ctx->backend == backend_index) { return; }
+
+	struct llmd_composite_backend* new_backend = &driver->backends[backend_index];
+	int descriptor;
+	if (
+		new_backend->driver->interface->create_context(new_backend->driver, &descriptor)
+		!= LLMD_OK
+	) {
+		return;
+	}
+
+	struct llmd_composite_backend* old_backend = &driver->backends[ctx->backend];
+	old_backend->driver->interface->destroy_context(old_backend->driver, ctx->descriptor);
+	--old_backend->num_contexts;
+
+	ctx->backend = backend_index;
+	ctx->descriptor = descriptor;
+	++new_backend->num_contexts;
+}
+
+// Send a context starting over to the backend which already has the most of
+// its tokens in another context
+static void
+llmd_composite_follow_prefix_locked(
+	struct llmd_composite_driver* driver,
+	struct llmd_composite_context* ctx,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+) {
+	unsigned int num_compared = num_tokens < LLMD_COMPOSITE_MAX_AFFINITY_TOKENS
+		? num_tokens
+		: LLMD_COMPOSITE_MAX_AFFINITY_TOKENS;
+	unsigned int best_length = 0;
+	int best_backend = -1;
+
+	for (unsigned int i = 0; i < driver->max_contexts; ++i) {
+		struct llmd_composite_context* other = &driver->contexts[i];
+		if (other == ctx || other->backend < 0) { continue; }
+
+		unsigned int limit = other->num_prefix_tokens < num_compared
+			? other->num_prefix_tokens
+			: num_compared;
+		unsigned int length = 0;
+		while (length < limit && other->prefix[length] == tokens[length]) {
+			++length;
+		}
+
+		if (
+			length > best_length
+			|| (
+				length == best_length
+				&& best_backend >= 0
+				&& llmd_composite_load_of(&driver->backends[other->backend])
+					< llmd_composite_load_of(&driver->backends[best_backend])
+			)
+		) {
+			best_length = length;
+			best_backend = other->backend;
+		}
+	}
+
+	if (best_backend >= 0 && best_length >= driver->min_affinity_tokens) {
+		llmd_composite_move_locked(driver, ctx, best_backend);
+	}
+}
+
+static void
+llmd_composite_record_prefix_locked(
+	struct llmd_composite_context* ctx,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset
+) {
+	if (offset > ctx->num_prefix_tokens || offset >= LLMD_COMPOSITE_MAX_AFFINITY_TOKENS) {
+		return;
+	}
+
+	unsigned int num_recorded = LLMD_COMPOSITE_MAX_AFFINITY_TOKENS - offset;
+	num_recorded = num_tokens < num_recorded ? num_tokens : num_recorded;
+	memcpy(ctx->prefix + offset, tokens, num_recorded * sizeof(llmd_token_t));
+	ctx->num_prefix_tokens = offset + num_recorded;
+}
+
+// Route and remember the tokens of a generate call
+static void
+llmd_composite_prepare_generate(
+	struct llmd_composite_driver* driver,
+	struct llmd_composite_context* ctx,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset
+) {
+	if (offset >= LLMD_COMPOSITE_MAX_AFFINITY_TOKENS) { return; }
+
+	pthread_mutex_lock(&driver->lock);
+	if (offset == 0) {
+		llmd_composite_follow_prefix_locked(driver, ctx, tokens, num_tokens);
+	}
+	llmd_composite_record_prefix_locked(ctx, tokens, num_tokens, offset);
+	pthread_mutex_unlock(&driver->lock);
+}
+
+static enum llmd_error
+llmd_composite_get_model_info(
+	struct llmd_driver* header,
+	struct llmd_model_info* info_out
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+
+	*info_out = driver->model_info;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_composite_create_context(
+	struct llmd_driver* header,
+	int* descriptor_out
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	enum llmd_error status = LLMD_ERR_OOM;
+
+	pthread_mutex_lock(&driver->lock);
+
+	int slot = -1;
+	for (unsigned int i = 0; i < driver->max_contexts; ++i) {
+		if (driver->contexts[i].backend < 0) {
+			slot = (int)i;
+			break;
+		}
+	}
+
+	// Least loaded first, moving on to the next one when a backend is full
+	unsigned int num_backends = driver->config->num_backends;
+	uint64_t tried = 0;
+	for (unsigned int attempt = 0; slot >= 0 && attempt < num_backends; ++attempt) {
+		int chosen = -1;
+		for (unsigned int i = 0; i < num_backends; ++i) {
+			if (i < 64 && (tried & (1ull << i))) { continue; }
+
+			if (
+				chosen < 0
+				|| llmd_composite_load_of(&driver->backends[i])
+					< llmd_composite_load_of(&driver->backends[chosen])
+			) {
+				chosen = (int)i;
+			}
+		}
+		if (chosen < 0) { break; }
+		if (chosen < 64) { tried |= 1ull << chosen; }
+
+		struct llmd_composite_backend* backend = &driver->backends[chosen];
+		int descriptor;
+		status = backend->driver->interface->create_context(backend->driver, &descriptor);
+		if (status == LLMD_OK) {
+			driver->contexts[slot] = (struct llmd_composite_context) {
+				.backend = chosen,
+				.descriptor = descriptor,
+			};
+			++backend->num_contexts;
+			*descriptor_out = slot;
+			break;
+		} else if (status != LLMD_ERR_OOM) {
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&driver->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_composite_destroy_context(
+	struct llmd_driver* header,
+	int descriptor
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_composite_context* ctx = llmd_composite_context_of(driver, descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	pthread_mutex_lock(&driver->lock);
+	struct llmd_composite_backend* backend = &driver->backends[ctx->backend];
+	enum llmd_error status = backend->driver->interface->destroy_context(
+		backend->driver, ctx->descriptor
+	);
+	--backend->num_contexts;
+	ctx->backend = -1;
+	ctx->num_prefix_tokens = 0;
+	pthread_mutex_unlock(&driver->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_composite_generate(
+	struct llmd_driver* header,
+	int descriptor,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_composite_context* ctx = llmd_composite_context_of(driver, descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	llmd_composite_prepare_generate(driver, ctx, tokens, num_tokens, offset);
+
+	struct llmd_composite_backend* backend = &driver->backends[ctx->backend];
+	atomic_fetch_add_explicit(&backend->num_busy, 1, memory_order_relaxed);
+	enum llmd_error status = backend->driver->interface->generate(
+		backend->driver, ctx->descriptor,
+		tokens, num_tokens, offset,
+		output
+	);
+	atomic_fetch_sub_explicit(&backend->num_busy, 1, memory_order_relaxed);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_composite_generate_batch(
+	struct llmd_driver* header,
+	const struct llmd_driver_generate_item* items,
+	unsigned int num_items
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_host* host = driver->host;
+	unsigned int num_backends = driver->config->num_backends;
+
+	for (unsigned int i = 0; i < num_items; ++i) {
+		struct llmd_composite_context* ctx = llmd_composite_context_of(
+			driver, items[i].context_descriptor
+		);
+		if (ctx == NULL) {
+			return LLMD_ERR_INVALID;
+		}
+
+		llmd_composite_prepare_generate(
+			driver, ctx, items[i].tokens, items[i].num_tokens, items[i].offset
+		);
+	}
+
+	struct llmd_driver_generate_item* backend_items = llmd_malloc(
+		host, sizeof(struct llmd_driver_generate_item) * num_items
+	);
+	struct llmd_composite_job* jobs = llmd_malloc(
+		host, sizeof(struct llmd_composite_job) * num_backends
+	);
+	if (backend_items == NULL || jobs == NULL) {
+		llmd_free(host, backend_items);
+		llmd_free(host, jobs);
+		return LLMD_ERR_OOM;
+	}
+
+	// Group by backend, with descriptors of the backend
+	unsigned int num_grouped = 0;
+	for (unsigned int b = 0; b < num_backends; ++b) {
+		jobs[b] = (struct llmd_composite_job) {
+			.items = backend_items + num_grouped,
+		};
+
+		for (unsigned int i = 0; i < num_items; ++i) {
+			struct llmd_composite_context* ctx = &driver->contexts[items[i].context_descriptor];
+			if (ctx->backend != (int)b) { continue; }
+
+			backend_items[num_grouped] = items[i];
+			backend_items[num_grouped].context_descriptor = ctx->descriptor;
+			++num_grouped;
+			++jobs[b].num_items;
+		}
+	}
+
+	for (unsigned int b = 0; b < num_backends; ++b) {
+		struct llmd_composite_backend* backend = &driver->backends[b];
+		if (jobs[b].num_items == 0) { continue; }
+
+		atomic_fetch_add_explicit(&backend->num_busy, jobs[b].num_items, memory_order_relaxed);
+
+		pthread_mutex_lock(&backend->lock);
+		if (backend->jobs_tail != NULL) {
+			backend->jobs_tail->next = &jobs[b];
+		} else {
+			backend->jobs_head = &jobs[b];
+		}
+		backend->jobs_tail = &jobs[b];
+		pthread_cond_broadcast(&backend->cond);
+		pthread_mutex_unlock(&backend->lock);
+	}
+
+	enum llmd_error status = LLMD_OK;
+	for (unsigned int b = 0; b < num_backends; ++b) {
+		struct llmd_composite_backend* backend = &driver->backends[b];
+		if (jobs[b].num_items == 0) { continue; }
+
+		pthread_mutex_lock(&backend->lock);
+		while (!jobs[b].done) {
+			pthread_cond_wait(&backend->cond, &backend->lock);
+		}
+		pthread_mutex_unlock(&backend->lock);
+
+		atomic_fetch_sub_explicit(&backend->num_busy, jobs[b].num_items, memory_order_relaxed);
+		if (status == LLMD_OK) { status = jobs[b].status; }
+	}
+
+	llmd_free(host, jobs);
+	llmd_free(host, backend_items);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_composite_tokenize(
+	struct llmd_driver* header,
+	const char* string,
+	unsigned int num_chars,
+	llmd_token_t* tokens_out,
+	unsigned int* num_tokens_inout
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+
+	// Every backend has the same model
+	struct llmd_driver* backend = driver->backends[0].driver;
+	return backend->interface->tokenize(
+		backend, string, num_chars, tokens_out, num_tokens_inout
+	);
+}
+
+static enum llmd_error
+llmd_composite_decode_token(
+	struct llmd_driver* header,
+	llmd_token_t token,
+	char* string_out,
+	unsigned int* num_chars_inout
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+
+	struct llmd_driver* backend = driver->backends[0].driver;
+	return backend->interface->decode_token(
+		backend, token, string_out, num_chars_inout
+	);
+}
+
+// Through host memory, also works between backends
+static enum llmd_error
+llmd_composite_transfer_state(
+	struct llmd_host* host,
+	struct llmd_driver* source,
+	int source_descriptor,
+	struct llmd_driver* dest,
+	int dest_descriptor
+) {
+	if (source->interface->save_state == NULL || dest->interface->load_state == NULL) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	size_t state_size = 0;
+	enum llmd_error status = source->interface->save_state(
+		source, source_descriptor, NULL, &state_size
+	);
+	if (status != LLMD_ERR_BUF_SIZE) {
+		return status == LLMD_OK ? LLMD_ERR_INVALID : status;
+	}
+
+	void* state = llmd_malloc(host, state_size);
+	if (state == NULL) { return LLMD_ERR_OOM; }
+
+	status = source->interface->save_state(source, source_descriptor, state, &state_size);
+	if (status == LLMD_OK) {
+		status = dest->interface->load_state(dest, dest_descriptor, state, state_size);
+	}
+
+	llmd_free(host, state);
+	return status;
+}
+
+static enum llmd_error
+llmd_composite_copy_context(
+	struct llmd_driver* header,
+	int source_descriptor,
+	int dest_descriptor,
+	unsigned int num_tokens
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_composite_context* source = llmd_composite_context_of(driver, source_descriptor);
+	struct llmd_composite_context* dest = llmd_composite_context_of(driver, dest_descriptor);
+	if (source == NULL || dest == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	// The destination is overwritten anyway so it may as well join the source
+	pthread_mutex_lock(&driver->lock);
+	llmd_composite_move_locked(driver, dest, source->backend);
+	dest->num_prefix_tokens = source->num_prefix_tokens < num_tokens
+		? source->num_prefix_tokens
+		: num_tokens;
+	memcpy(dest->prefix, source->prefix, dest->num_prefix_tokens * sizeof(llmd_token_t));
+	pthread_mutex_unlock(&driver->lock);
+
+	struct llmd_driver* source_backend = driver->backends[source->backend].driver;
+	struct llmd_driver* dest_backend = driver->backends[dest->backend].driver;
+	if (source_backend == dest_backend && source_backend->interface->copy_context != NULL) {
+		return source_backend->interface->copy_context(
+			source_backend, source->descriptor, dest->descriptor, num_tokens
+		);
+	}
+
+	return llmd_composite_transfer_state(
+		driver->host,
+		source_backend, source->descriptor,
+		dest_backend, dest->descriptor
+	);
+}
+
+static enum llmd_error
+llmd_composite_save_state(
+	struct llmd_driver* header,
+	int descriptor,
+	void* state_out,
+	size_t* size_inout
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_composite_context* ctx = llmd_composite_context_of(driver, descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	struct llmd_driver* backend = driver->backends[ctx->backend].driver;
+	if (backend->interface->save_state == NULL) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	return backend->interface->save_state(backend, ctx->descriptor, state_out, size_inout);
+}
+
+static enum llmd_error
+llmd_composite_load_state(
+	struct llmd_driver* header,
+	int descriptor,
+	const void* state,
+	size_t size
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_composite_context* ctx = llmd_composite_context_of(driver, descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	struct llmd_driver* backend = driver->backends[ctx->backend].driver;
+	if (backend->interface->load_state == NULL) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	// The state does not say which tokens it holds
+	pthread_mutex_lock(&driver->lock);
+	ctx->num_prefix_tokens = 0;
+	pthread_mutex_unlock(&driver->lock);
+
+	return backend->interface->load_state(backend, ctx->descriptor, state, size);
+}
+
+static enum llmd_error
+llmd_composite_shift_context(
+	struct llmd_driver* header,
+	int descriptor,
+	unsigned int num_keep,
+	unsigned int num_discard,
+	unsigned int num_tokens
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_composite_context* ctx = llmd_composite_context_of(driver, descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	struct llmd_driver* backend = driver->backends[ctx->backend].driver;
+	if (backend->interface->shift_context == NULL) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	pthread_mutex_lock(&driver->lock);
+	if (ctx->num_prefix_tokens > num_keep) {
+		ctx->num_prefix_tokens = num_keep;
+	}
+	pthread_mutex_unlock(&driver->lock);
+
+	return backend->interface->shift_context(
+		backend, ctx->descriptor, num_keep, num_discard, num_tokens
+	);
+}
+
+static struct llmd_driver_interface llmd_composite_driver_interface = {
+	.get_model_info = llmd_composite_get_model_info,
+	.create_context = llmd_composite_create_context,
+	.destroy_context = llmd_composite_destroy_context,
+	.generate = llmd_composite_generate,
+	.tokenize = llmd_composite_tokenize,
+	.decode_token = llmd_composite_decode_token,
+	.generate_batch = llmd_composite_generate_batch,
+	.copy_context = llmd_composite_copy_context,
+	.save_state = llmd_composite_save_state,
+	.load_state = llmd_composite_load_state,
+	.shift_context = llmd_composite_shift_context,
+};
+
+static enum llmd_error
+llmd_composite_init_model_info(
+	struct llmd_composite_driver* driver
+) {
+	for (unsigned int i = 0; i < driver->config->num_backends; ++i) {
+		struct llmd_driver* backend = driver->config->backends[i];
+		struct llmd_model_info info;
+		enum llmd_error status = backend->interface->get_model_info(backend, &info);
+		if (status != LLMD_OK) { return status; }
+
+		if (i == 0) {
+			driver->model_info = info;
+		} else if (
+			info.vocab_size != driver->model_info.vocab_size
+			|| info.bos_token != driver->model_info.bos_token
+			|| info.eos_token != driver->model_info.eos_token
+			|| info.nl_token != driver->model_info.nl_token
+		) {
+			llmd_log(driver->host, LLMD_LOG_ERROR, "Backend %u has a different model", i);
+			return LLMD_ERR_INVALID;
+		} else if (info.max_context_length < driver->model_info.max_context_length) {
+			// Contexts can land anywhere
+			driver->model_info.max_context_length = info.max_context_length;
+		}
+	}
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_create_composite_driver(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config* config,
+	struct llmd_driver** driver_out
+) {
+	if (host == NULL) {
+		host = &llmd_default_host;
+	}
+
+	if (config->num_backends == 0) {
+		return LLMD_ERR_INVALID;
+	}
+
+	struct llmd_composite_driver* driver = llmd_malloc(
+		host,
+		sizeof(struct llmd_composite_driver)
+		+ sizeof(struct llmd_composite_backend) * config->num_backends
+	);
+	if (driver == NULL) {
+		return LLMD_ERR_OOM;
+	}
+
+	unsigned int min_affinity_tokens = config->min_affinity_tokens > 0
+		? config->min_affinity_tokens
+		: LLMD_COMPOSITE_DEFAULT_MIN_AFFINITY_TOKENS;
+	*driver = (struct llmd_composite_driver) {
+		.header = {
+			.interface = &llmd_composite_driver_interface,
+		},
+		.host = host,
+		.config = config,
+		.max_contexts = config->max_contexts > 0
+			? config->max_contexts
+			: LLMD_COMPOSITE_DEFAULT_MAX_CONTEXTS,
+		.min_affinity_tokens = min_affinity_tokens < LLMD_COMPOSITE_MAX_AFFINITY_TOKENS
+			? min_affinity_tokens
+			: LLMD_COMPOSITE_MAX_AFFINITY_TOKENS,
+	};
+
+	enum llmd_error status = llmd_composite_init_model_info(driver);
+	if (status != LLMD_OK) {
+		llmd_free(host, driver);
+		return status;
+	}
+
+	driver->contexts = llmd_malloc(
+		host, sizeof(struct llmd_composite_context) * driver->max_contexts
+	);
+	if (driver->contexts == NULL) {
+		llmd_free(host, driver);
+		return LLMD_ERR_OOM;
+	}
+
+	for (unsigned int i = 0; i < driver->max_contexts; ++i) {
+		driver->contexts[i].backend = -1;
+		driver->contexts[i].num_prefix_tokens = 0;
+	}
+
+	if (pthread_mutex_init(&driver->lock, NULL) != 0) {
+		llmd_free(host, driver->contexts);
+		llmd_free(host, driver);
+		return LLMD_ERR_OOM;
+	}
+
+	for (unsigned int i = 0; i < config->num_backends; ++i) {
+		struct llmd_composite_backend* backend = &driver->backends[i];
+		*backend = (struct llmd_composite_backend) {
+			.driver = config->backends[i],
+		};
+
+		if (pthread_mutex_init(&backend->lock, NULL) != 0) {
+			break;
+		}
+
+		if (pthread_cond_init(&backend->cond, NULL) != 0) {
+			pthread_mutex_destroy(&backend->lock);
+			break;
+		}
+
+		if (pthread_create(&backend->worker, NULL, llmd_composite_worker, backend) != 0) {
+			pthread_cond_destroy(&backend->cond);
+			pthread_mutex_destroy(&backend->lock);
+			break;
+		}
+
+		++driver->num_workers;
+	}
+
+	if (driver->num_workers != config->num_backends) {
+		llmd_destroy_composite_driver(&driver->header);
+		return LLMD_ERR_OOM;
+	}
+
+	*driver_out = &driver->header;
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_destroy_composite_driver(
+	struct llmd_driver* header
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+
+	for (unsigned int i = 0; i < driver->num_workers; ++i) {
+		struct llmd_composite_backend* backend = &driver->backends[i];
+
+		pthread_mutex_lock(&backend->lock);
+		backend->quit = true;
+		pthread_cond_broadcast(&backend->cond);
+		pthread_mutex_unlock(&backend->lock);
+
+		pthread_join(backend->worker, NULL);
+		pthread_cond_destroy(&backend->cond);
+		pthread_mutex_destroy(&backend->lock);
+	}
+
+	for (unsigned int i = 0; i < driver->max_contexts; ++i) {
+		struct llmd_composite_context* ctx = &driver->contexts[i];
+		if (ctx->backend < 0) { continue; }
+
+		struct llmd_driver* backend = driver->backends[ctx->backend].driver;
+		backend->interface->destroy_context(backend, ctx->descriptor);
+	}
+
+	pthread_mutex_destroy(&driver->lock);
+	llmd_free(driver->host, driver->contexts);
+	llmd_free(driver->host, driver);
+
+	return LLMD_OK;
+}
+
+// Loader contract
+
+struct llmd_composite_backend_spec {
+	char* name;
+	char* driver_path;
+	char* config_path;
+};
+
+// The public config comes first so the loader can pass either around
+struct llmd_composite_loader_config {
+	struct llmd_composite_driver_config config;
+
+	llmd_buffer(struct llmd_composite_backend_spec) specs;
+	struct llmd_driver_loader** loaders;
+};
+
+static char*
+llmd_composite_strdup(struct llmd_host* host, const char* str) {
+	size_t len = strlen(str);
+	char* copy = llmd_malloc(host, len + 1);
+	if (copy != NULL) {
+		memcpy(copy, str, len + 1);
+	}
+
+	return copy;
+}
+
+static void
+llmd_composite_free_loader_config(
+	struct llmd_host* host,
+	struct llmd_composite_loader_config* loader_config
+) {
+	for (unsigned int i = 0; i < loader_config->config.num_backends; ++i) {
+		if (loader_config->loaders[i] != NULL) {
+			llmd_unload_driver(loader_config->loaders[i]);
+		}
+	}
+
+	for (size_t i = 0; i < llmd_buffer_size(loader_config->specs); ++i) {
+		llmd_free(host, loader_config->specs[i].name);
+		llmd_free(host, loader_config->specs[i].driver_path);
+		llmd_free(host, loader_config->specs[i].config_path);
+	}
+
+	llmd_free(host, loader_config->loaders);
+	llmd_free(host, loader_config->config.backends);
+	llmd_free_buffer(host, loader_config->specs);
+	llmd_free(host, loader_config);
+}
+
+enum llmd_error
+llmd_begin_create_driver(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config** config_out
+) {
+	struct llmd_composite_loader_config* loader_config = llmd_malloc(
+		host,
+		sizeof(struct llmd_composite_loader_config)
+	);
+	if (loader_config == NULL) {
+		return LLMD_ERR_OOM;
+	}
+	memset(loader_config, 0, sizeof(*loader_config));
+
+	*config_out = &loader_config->config;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_set_driver_config(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config* config,
+	const char* section,
+	const char* key,
+	const char* value
+) {
+	struct llmd_composite_loader_config* loader_config = (struct llmd_composite_loader_config*)config;
+	const char* backend_prefix = "backend.";
+	size_t backend_prefix_len = strlen(backend_prefix);
+
+	if (strcmp(section, "main") == 0) {
+		if (strcmp(key, "max_contexts") == 0) {
+			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->max_contexts);
+		} else if (strcmp(key, "min_affinity_tokens") == 0) {
+			return llmd_cfg_parse_uint(
+				value, 0, LLMD_COMPOSITE_MAX_AFFINITY_TOKENS, &config->min_affinity_tokens
+			);
+		} else {
+			return LLMD_ERR_INVALID;
+		}
+	} else if (strncmp(section, backend_prefix, backend_prefix_len) == 0) {
+		const char* name = section + backend_prefix_len;
+		size_t num_specs = llmd_buffer_size(loader_config->specs);
+
+		struct llmd_composite_backend_spec* spec = NULL;
+		for (size_t i = 0; i < num_specs; ++i) {
+			if (strcmp(loader_config->specs[i].name, name) == 0) {
+				spec = &loader_config->specs[i];
+				break;
+			}
+		}
+
+		if (spec == NULL) {
+			llmd_buffer(struct llmd_composite_backend_spec) specs = llmd_resize_buffer(
+				host, loader_config->specs, num_specs + 1
+			);
+			if (specs == NULL) {
+				return LLMD_ERR_OOM;
+			}
+			loader_config->specs = specs;
+
+			spec = &specs[num_specs];
+			*spec = (struct llmd_composite_backend_spec) {
+				.name = llmd_composite_strdup(host, name),
+			};
+			if (spec->name == NULL) {
+				return LLMD_ERR_OOM;
+			}
+		}
+
+		char** field;
+		if (strcmp(key, "driver_path") == 0) {
+			field = &spec->driver_path;
+		} else if (strcmp(key, "config_path") == 0) {
+			field = &spec->config_path;
+		} else {
+			return LLMD_ERR_INVALID;
+		}
+
+		llmd_free(host, *field);
+		*field = llmd_composite_strdup(host, value);
+		return *field != NULL ? LLMD_OK : LLMD_ERR_OOM;
+	} else if (strcmp(section, "llmd") == 0) {
+		return LLMD_OK;
+	} else {
+		return LLMD_ERR_INVALID;
+	}
+}
+
+enum llmd_error
+llmd_end_create_driver(
+	struct llmd_host* host,
+	struct llmd_composite_driver_config* config,
+	struct llmd_driver** driver_out
+) {
+	struct llmd_composite_loader_config* loader_config = (struct llmd_composite_loader_config*)config;
+
+	if (driver_out == NULL) {
+		llmd_composite_free_loader_config(host, loader_config);
+		return LLMD_OK;
+	}
+
+	enum llmd_error status = LLMD_OK;
+	unsigned int num_specs = (unsigned int)llmd_buffer_size(loader_config->specs);
+	config->backends = llmd_malloc(host, sizeof(struct llmd_driver*) * num_specs);
+	loader_config->loaders = llmd_malloc(host, sizeof(struct llmd_driver_loader*) * num_specs);
+	if (num_specs > 0 && (config->backends == NULL || loader_config->loaders == NULL)) {
+		status = LLMD_ERR_OOM;
+		goto error;
+	}
+
+	for (unsigned int i = 0; i < num_specs; ++i) {
+		struct llmd_composite_backend_spec* spec = &loader_config->specs[i];
+		if (spec->driver_path == NULL) {
+			llmd_log(host, LLMD_LOG_ERROR, "Backend %s has no driver_path", spec->name);
+			status = LLMD_ERR_INVALID;
+			goto error;
+		}
+
+		struct llmd_driver_loader* loader;
+		if ((status = llmd_begin_load_driver(host, spec->driver_path, &loader)) != LLMD_OK) {
+			goto error;
+		}
+		loader_config->loaders[config->num_backends++] = loader;
+
+		if (
+			spec->config_path != NULL
+			&& (status = llmd_load_driver_config_from_file(loader, spec->config_path)) != LLMD_OK
+		) {
+			goto error;
+		}
+
+		if ((status = llmd_end_load_driver(loader, &config->backends[i])) != LLMD_OK) {
+			goto error;
+		}
+	}
+
+	if ((status = llmd_create_composite_driver(host, config, driver_out)) != LLMD_OK) {
+		goto error;
+	}
+
+	return LLMD_OK;
+error:
+	llmd_composite_free_loader_config(host, loader_config);
+	return status;
+}
+
+enum llmd_error
+llmd_destroy_driver(
+	struct llmd_driver* header
+) {
+	struct llmd_composite_driver* driver = (struct llmd_composite_driver*)header;
+	struct llmd_host* host = driver->host;
+	struct llmd_composite_loader_config* loader_config =
+		(struct llmd_composite_loader_config*)driver->config;
+
+	llmd_destroy_composite_driver(header);
+	llmd_composite_free_loader_config(host, loader_config);
+
+	return LLMD_OK;
+}
@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
 
 #ifdef LLMD_CORE_SHARED
@@ -34,6 +36,21 @@ enum llmd_context_type {
 	LLMD_CONTEXT_DIRECT,
 	LLMD_CONTEXT_MIN_UPLOAD,
 	LLMD_CONTEXT_MIN_DISCARD,
+	// Weigh tokens to upload against cached tokens thrown away and the cost
+	// of a new pooled context, see llmd_session_config
+	LLMD_CONTEXT_MIN_COST,
+};
+
+#define LLMD_NUM_CONTEXT_TYPES 4
+
+enum llmd_eviction_policy {
+	// Overwrite the least recently used context
+	LLMD_EVICT_LRU,
+	// Overwrite the least frequently used context
+	LLMD_EVICT_LFU,
+	// Overwrite the context whose lost prefix is expected to save the least
+	// tokens, weighted by how often it was reused
+	LLMD_EVICT_LEAST_VALUABLE,
 };
 
 enum llmd_log_level {
@@ -75,11 +92,266 @@ struct llmd_model_info {
 	unsigned int max_context_length;
 };
 
+// Decoded text of every token, built once per session and never modified.
+// Token i is text[offsets[i]..offsets[i + 1] - 1), followed by a null
+// terminator.
+struct llmd_vocab_table {
+	unsigned int num_tokens;
+	unsigned int max_token_length;
+
+	const char* text;
+	const unsigned int* offsets;
+};
+
+struct llmd_session_config {
+	// How long generation waits for a pooled context when all are busy and
+	// no new one can be created.
+	// A released context goes to the waiter sharing the longest prefix with
+	// it among the oldest few, the oldest one is only passed over a few times.
+	// 0 fails immediately with LLMD_ERR_OOM.
+	unsigned int admission_timeout_ms;
+
+	// Maximum number of pooled physical contexts.
+	// 0 keeps creating contexts until the driver refuses.
+	unsigned int max_pooled_contexts;
+
+	// Which idle context gets overwritten once the pool cannot grow
+	enum llmd_eviction_policy eviction_policy;
+
+	// Bytes of host memory for the state of evicted contexts.
+	// 0 disables swapping. Requires driver support for save_state and load_state.
+	size_t swap_space_size;
+
+	// Minimum number of tokens a swap has to save for it to happen
+	unsigned int min_swap_tokens;
+
+	// Directory for evaluation states which outlive the session.
+	// NULL disables it. Requires driver support for save_state and load_state.
+	// The state is copied when a generation ends and written to a file on a
+	// background thread. Destroying the session waits for pending writes.
+	const char* disk_cache_path;
+	// Bytes of disk for the cache, 0 is unbounded
+	size_t disk_cache_size;
+	// A window is written once it extends what the cache holds by this many
+	// tokens and a file is only loaded if it saves as many.
+	// 0 uses the default.
+	unsigned int disk_cache_min_tokens;
+	// Required with disk_cache_path.
+	// Files are only used by a session with the same model id, vocabulary and
+	// state size bound. Models sharing a vocabulary, like fine-tunes, can only
+	// be told apart by this, for example the path or hash of the model file.
+	const char* disk_cache_model_id;
+
+	// Token budget of a batch formed by the scheduler.
+	// 0 disables the scheduler and every generate call goes straight to the
+	// driver.
+	unsigned int max_batch_tokens;
+
+	// How long the oldest pending call waits for others to join its batch
+	unsigned int max_batch_wait_us;
+
+	// Bytes of host memory for remembering the tokens of recent strings.
+	// 0 disables the cache.
+	size_t tokenize_cache_size;
+
+	// Costs for LLMD_CONTEXT_MIN_COST, in evaluated tokens.
+	// How much a cached token thrown away is worth.
+	// 0 learns it from the share of cached tokens which were reused so far.
+	float min_cost_discard_weight;
+	// The cost of growing the pool instead of overwriting a context.
+	// 0 uses the default.
+	float min_cost_new_context;
+};
+
+struct llmd_admission_stats {
+	unsigned int queue_depth;
+	unsigned int max_queue_depth;
+	unsigned int num_pooled_contexts;
+
+	uint64_t num_waits;
+	uint64_t num_timeouts;
+	uint64_t total_wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t num_evictions;
+};
+
+struct llmd_tokenize_stats {
+	uint64_t num_hits;
+	uint64_t num_misses;
+	uint64_t num_evictions;
+
+	unsigned int num_entries;
+	size_t cache_size;
+};
+
+struct llmd_disk_cache_stats {
+	uint64_t num_hits;
+	uint64_t num_writes;
+	uint64_t num_evictions;
+	// Files of another model or which failed their checksum
+	uint64_t num_rejected;
+	uint64_t num_tokens_restored;
+
+	unsigned int num_entries;
+	size_t cache_size;
+};
+
+struct llmd_batch_stats {
+	uint64_t num_batches;
+	uint64_t num_items;
+	uint64_t num_tokens;
+	// Items which were prompt chunks with more to come
+	uint64_t num_partial_chunks;
+	uint64_t total_eval_ns;
+
+	unsigned int max_batch_tokens;
+	unsigned int last_batch_items;
+	unsigned int last_batch_tokens;
+	uint64_t last_eval_ns;
+};
+
+enum llmd_logits_mode {
+	// All vocab_size logits
+	LLMD_LOGITS_FULL,
+	// Nothing, e.g. while processing a prompt
+	LLMD_LOGITS_NONE,
+	// The top_k highest logits and their tokens in descending order
+	LLMD_LOGITS_TOP_K,
+	// vocab_size logits for every token passed to the call, one row each.
+	// Drivers which cannot return them fail with LLMD_ERR_NOT_SUPPORTED.
+	LLMD_LOGITS_ALL,
+	// Like LLMD_LOGITS_ALL but only the rows listed in positions
+	LLMD_LOGITS_POSITIONS,
+};
+
+// Where a generate call writes the logits of its last token, or of others.
+// Passing NULL instead is the same as LLMD_LOGITS_NONE.
+struct llmd_logits_output {
+	enum llmd_logits_mode mode;
+	unsigned int top_k;
+
+	// vocab_size entries for LLMD_LOGITS_FULL, top_k for LLMD_LOGITS_TOP_K,
+	// num_tokens * vocab_size for LLMD_LOGITS_ALL and
+	// num_positions * vocab_size for LLMD_LOGITS_POSITIONS
+	float* logits;
+	// top_k entries, only for LLMD_LOGITS_TOP_K
+	llmd_token_t* tokens;
+
+	// Only for LLMD_LOGITS_POSITIONS.
+	// Indices into the tokens passed to the call, in any order.
+	const unsigned int* positions;
+	unsigned int num_positions;
+};
+
+// Bucket i counts calls taking [2^i, 2^(i+1)) microseconds, the first and
+// the last buckets are open ended
+#define LLMD_LATENCY_HISTOGRAM_SIZE 24
+
+struct llmd_latency_histogram {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[LLMD_LATENCY_HISTOGRAM_SIZE];
+};
+
+struct llmd_session_stats {
+	// Virtual contexts bound to a pooled one, indexed by context type
+	uint64_t num_binds[LLMD_NUM_CONTEXT_TYPES];
+	// Binds which kept part of what a pooled context held
+	uint64_t num_prefix_hits;
+	uint64_t num_tokens_reused;
+	uint64_t num_tokens_uploaded;
+	// Evaluated tokens overwritten by a bind, not counting swapped out ones
+	uint64_t num_tokens_discarded;
+
+	uint64_t num_contexts_created;
+	uint64_t num_ooms;
+
+	// From the start of a generate call until its logits are ready.
+	// Calls evaluating a single token count as decode, others as prefill.
+	struct llmd_latency_histogram prefill_latency;
+	struct llmd_latency_histogram decode_latency;
+
+	struct llmd_admission_stats admission;
+	struct llmd_batch_stats batch;
+	struct llmd_tokenize_stats tokenize;
+	struct llmd_disk_cache_stats disk_cache;
+};
+
+struct llmd_context_stats {
+	uint64_t num_generate_calls;
+	uint64_t num_binds;
+	uint64_t num_tokens_reused;
+	uint64_t num_tokens_evaluated;
+	uint64_t total_generate_ns;
+
+	uint64_t num_window_shifts;
+	uint64_t num_tokens_dropped;
+
+	// Of the context being verified in llmd_generate_speculative
+	uint64_t num_draft_tokens;
+	uint64_t num_draft_tokens_accepted;
+};
+
 struct llmd_session;
 struct llmd_context;
 struct llmd_generate_handle;
+
+struct llmd_generate_request {
+	struct llmd_generate_handle* generate_handle;
+	const llmd_token_t* tokens;
+	unsigned int num_tokens;
+	unsigned int offset;
+	const struct llmd_logits_output* output;
+
+	// Set by llmd_generate_next_batch
+	enum llmd_error status;
+};
+
+// Chooses a token from a row of logits, which it may modify
+struct llmd_token_picker {
+	llmd_token_t (*pick)(void* state, float* logits, unsigned int num_logits);
+	void* state;
+};
+
+struct llmd_speculative_config {
+	// How many tokens the draft model guesses per call
+	unsigned int num_draft_tokens;
+
+	// Picks every token written out, from the target's logits
+	struct llmd_token_picker picker;
+
+	// Picks the draft's guesses.
+	// A sampling picker needs its own state here so that guessing does not
+	// advance the random sequence of picker.
+	// picker is used when this has no pick function, which is only exact for
+	// deterministic pickers.
+	struct llmd_token_picker draft_picker;
+};
+
+struct llmd_generate_ticket;
+
+typedef void (*llmd_generate_callback_t)(
+	void* userdata,
+	struct llmd_generate_ticket* ticket,
+	enum llmd_error status
+);
+
 struct llmd_driver;
 
+struct llmd_driver_generate_item {
+	int context_descriptor;
+	const llmd_token_t* tokens;
+	unsigned int num_tokens;
+	unsigned int offset;
+	const struct llmd_logits_output* output;
+};
+
+// A session may be used from multiple threads as long as each context is only
+// used by one thread at a time.
+// The session serializes all driver calls except the ones working on context
+// descriptors (generate, generate_batch, save_state and load_state) which can
+// be called concurrently on different descriptors.
 struct llmd_driver_interface {
 	enum llmd_error (*get_model_info)(
 		struct llmd_driver* driver,
@@ -102,7 +374,7 @@ struct llmd_driver_interface {
 		const llmd_token_t* tokens,
 		unsigned int num_tokens,
 		unsigned int offset,
-		float* logits_out
+		const struct llmd_logits_output* output
 	);
 
 	enum llmd_error (*tokenize)(
@@ -119,6 +391,57 @@ struct llmd_driver_interface {
 		char* string_out,
 		unsigned int* num_chars_inout
 	);
+
+	// Optional.
+	// Evaluate several distinct contexts in one pass.
+	enum llmd_error (*generate_batch)(
+		struct llmd_driver* driver,
+		const struct llmd_driver_generate_item* items,
+		unsigned int num_items
+	);
+
+	// Optional.
+	// Make the destination context hold the state of the first num_tokens
+	// tokens evaluated in the source context.
+	enum llmd_error (*copy_context)(
+		struct llmd_driver* driver,
+		int source_descriptor,
+		int dest_descriptor,
+		unsigned int num_tokens
+	);
+
+	// Optional.
+	// Copy the evaluation state of a context out.
+	// Returns LLMD_ERR_BUF_SIZE with the required size if the buffer is too small.
+	// With a NULL buffer, the size is an upper bound for any state of the
+	// model, whatever the context holds.
+	// The size written to size_inout on success may be smaller.
+	enum llmd_error (*save_state)(
+		struct llmd_driver* driver,
+		int context_descriptor,
+		void* state_out,
+		size_t* size_inout
+	);
+
+	// Optional.
+	// Restore a state previously saved from any context of the same driver.
+	enum llmd_error (*load_state)(
+		struct llmd_driver* driver,
+		int context_descriptor,
+		const void* state,
+		size_t size
+	);
+
+	// Optional.
+	// Remove tokens [num_keep, num_keep + num_discard) from a context holding
+	// num_tokens and move the ones after down without evaluating them again.
+	enum llmd_error (*shift_context)(
+		struct llmd_driver* driver,
+		int context_descriptor,
+		unsigned int num_keep,
+		unsigned int num_discard,
+		unsigned int num_tokens
+	);
 };
 
 struct llmd_driver {
@@ -146,6 +469,7 @@ LLMD_CORE_API enum llmd_error
 llmd_create_session(
 	struct llmd_host* host,
 	struct llmd_driver* driver,
+	const struct llmd_session_config* config,
 	struct llmd_session** session_out
 );
 
@@ -154,12 +478,50 @@ llmd_destroy_session(
 	struct llmd_session* session
 );
 
+LLMD_CORE_API enum llmd_error
+llmd_get_admission_stats(
+	struct llmd_session* session,
+	struct llmd_admission_stats* stats_out
+);
+
+LLMD_CORE_API enum llmd_error
+llmd_get_batch_stats(
+	struct llmd_session* session,
+	struct llmd_batch_stats* stats_out
+);
+
+LLMD_CORE_API enum llmd_error
+llmd_get_tokenize_stats(
+	struct llmd_session* session,
+	struct llmd_tokenize_stats* stats_out
+);
+
+LLMD_CORE_API enum llmd_error
+llmd_get_disk_cache_stats(
+	struct llmd_session* session,
+	struct llmd_disk_cache_stats* stats_out
+);
+
+// Every counter of the session, each group is read atomically
+LLMD_CORE_API enum llmd_error
+llmd_get_session_stats(
+	struct llmd_session* session,
+	struct llmd_session_stats* stats_out
+);
+
 LLMD_CORE_API enum llmd_error
 llmd_get_model_info(
 	struct llmd_session* session,
 	struct llmd_model_info* info_out
 );
 
+// The table lives as long as the session
+LLMD_CORE_API enum llmd_error
+llmd_get_vocab_table(
+	struct llmd_session* session,
+	const struct llmd_vocab_table** table_out
+);
+
 LLMD_CORE_API enum llmd_error
 llmd_create_context(
 	struct llmd_session* session,
@@ -172,6 +534,39 @@ llmd_destroy_context(
 	struct llmd_context* context
 );
 
+// Make generate calls which would overflow the context drop the oldest tokens
+// after the first num_keep instead of failing.
+// Offsets keep counting from the start so they stay the same for the caller.
+// Offsets into the dropped range are invalid and one at or below num_keep
+// starts over.
+// num_discard is how many tokens are dropped at once, 0 drops half of what
+// can be dropped.
+// A driver without shift_context evaluates every token after num_keep again
+// on each shift, which logs a warning here.
+// Must be called before a direct context starts generating.
+LLMD_CORE_API enum llmd_error
+llmd_set_sliding_window(
+	struct llmd_context* context,
+	bool enabled,
+	unsigned int num_keep,
+	unsigned int num_discard
+);
+
+LLMD_CORE_API enum llmd_error
+llmd_get_context_stats(
+	struct llmd_context* context,
+	struct llmd_context_stats* stats_out
+);
+
+// Create a context of the same type holding the same tokens.
+// The evaluated state is copied in the driver when possible so the child
+// does not evaluate the shared prefix again.
+LLMD_CORE_API enum llmd_error
+llmd_fork_context(
+	struct llmd_context* ctx,
+	struct llmd_context** child_out
+);
+
 LLMD_CORE_API struct llmd_session*
 llmd_get_session_of_context(
 	struct llmd_context* context
@@ -206,7 +601,92 @@ llmd_generate_next(
 	const llmd_token_t* tokens,
 	unsigned int num_tokens,
 	unsigned int offset,
-	float* logits_out
+	const struct llmd_logits_output* output
+);
+
+// Step several contexts of the same session at once.
+// Returns the first error, every request has its own status.
+// A batch with more pooled contexts than max_pooled_contexts fails
+// immediately with LLMD_ERR_OOM instead of waiting on itself.
+LLMD_CORE_API enum llmd_error
+llmd_generate_next_batch(
+	struct llmd_generate_request* requests,
+	unsigned int num_requests
+);
+
+// Start a generate call without waiting for it.
+// The context, the tokens and the logits buffers must not be touched until
+// the ticket is waited on.
+// The callback, if any, runs on the thread completing the call: the
+// scheduler thread, or the calling thread when the session has no scheduler.
+LLMD_CORE_API enum llmd_error
+llmd_generate_submit(
+	struct llmd_generate_handle* generate_handle,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output,
+	llmd_generate_callback_t callback,
+	void* userdata,
+	struct llmd_generate_ticket** ticket_out
+);
+
+LLMD_CORE_API enum llmd_error
+llmd_generate_poll(
+	struct llmd_generate_ticket* ticket,
+	bool* done_out
+);
+
+// Wait for a submitted call to finish and release its ticket.
+// Every ticket must be waited on exactly once.
+LLMD_CORE_API enum llmd_error
+llmd_generate_wait(
+	struct llmd_generate_ticket* ticket
+);
+
+// Let a cheaper draft context guess the next tokens and check them all with
+// one call on the target context.
+// Both contexts receive the same tokens at the same offset and must come from
+// sessions with the same vocabulary.
+// Writes between 1 and num_draft_tokens + 1 tokens picked from the target's
+// logits to tokens_out.
+// picker sees the same rows in the same order as when generating one token at
+// a time so the output does not change, as long as it does not share state
+// with draft_picker.
+// The next call should pass the last of them at offset + num_tokens +
+// (*num_tokens_out - 1).
+// The target's driver must support LLMD_LOGITS_POSITIONS.
+LLMD_CORE_API enum llmd_error
+llmd_generate_speculative(
+	struct llmd_generate_handle* target_handle,
+	struct llmd_generate_handle* draft_handle,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_speculative_config* config,
+	llmd_token_t* tokens_out,
+	unsigned int* num_tokens_out
+);
+
+// Log probabilities of tokens[1..num_tokens) following everything before
+// them, in one call.
+// tokens[0] is evaluated at offset like the others and is usually the last
+// token of the prompt.
+// Writes num_tokens - 1 values to log_probs_out.
+LLMD_CORE_API enum llmd_error
+llmd_score_tokens(
+	struct llmd_generate_handle* generate_handle,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	float* log_probs_out
+);
+
+// An eventfd signaled every time a submitted call finishes
+LLMD_CORE_API enum llmd_error
+llmd_get_completion_fd(
+	struct llmd_session* session,
+	int* fd_out
 );
 
 LLMD_CORE_API enum llmd_error
@@ -0,0 +1,48 @@
+#ifndef LLMD_CORE_COMMON_H
+#define LLMD_CORE_COMMON_H
+
+#include <llmd/core.h>
+#include <llmd/utils/host.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LLMD_TRY enum llmd_error llmd_status = LLMD_OK;
+#define LLMD_EXCEPT_BEGIN llmd_except:
+#define LLMD_EXCEPT_END return llmd_status;
+#define LLMD_THROW(error) \
+	do { llmd_status = (error); goto llmd_except; } while(0)
+
+#define LLMD_CHECKED_MALLOC(out, host, size) \
+	do { \
+		if((out = llmd_malloc(host, size)) == NULL) { \
+			LLMD_THROW(LLMD_ERR_OOM); \
+		} \
+	} while(0)
+
+#define LLMD_CHECK_THROW(op) \
+	do { \
+		if ((llmd_status = (op)) != LLMD_OK) { LLMD_THROW(llmd_status); } \
+	} while(0)
+
+#define LLMD_CHECK_RETURN(op) \
+	do { \
+		enum llmd_error llmd_status; \
+		if ((llmd_status = (op)) != LLMD_OK) { return llmd_status; } \
+	} while(0)
+
+static inline uint64_t
+llmd_monotonic_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static inline struct timespec
+llmd_timespec_from_ns(uint64_t ns) {
+	return (struct timespec) {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+}
+
+#endif
@@ -1,41 +1,152 @@
 #include <llmd/core.h>
 #include <llmd/utils/buffer.h>
 #include <llmd/utils/host.h>
+#include <llmd/utils/vocab.h>
+#include "common.h"
+#include "disk_cache.h"
+#include "prefix_index.h"
+#include "state_cache.h"
+#include "scheduler.h"
+#include "token_cache.h"
+#include "token_store.h"
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <string.h>
-
-#define LLMD_TRY enum llmd_error llmd_status = LLMD_OK;
-#define LLMD_EXCEPT_BEGIN llmd_except:
-#define LLMD_EXCEPT_END return llmd_status;
-#define LLMD_THROW(error) \
-	do { llmd_status = (error); goto llmd_except; } while(0)
-
-#define LLMD_CHECKED_MALLOC(out, host, size) \
-	do { \
-		if((out = llmd_malloc(host, size)) == NULL) { \
-			LLMD_THROW(LLMD_ERR_OOM); \
-		} \
-	} while(0)
-
-#define LLMD_CHECK_THROW(op) \
-	do { \
-		if ((llmd_status = (op)) != LLMD_OK) { LLMD_THROW(llmd_status); } \
-	} while(0)
-
-#define LLMD_CHECK_RETURN(op) \
-	do { \
-		enum llmd_error llmd_status; \
-		if ((llmd_status = (op)) != LLMD_OK) { return llmd_status; } \
-	} while(0)
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+// In evaluated tokens, for LLMD_CONTEXT_MIN_COST
+#define LLMD_DEFAULT_NEW_CONTEXT_COST 64.f
+#define LLMD_DEFAULT_DISK_CACHE_MIN_TOKENS 256
+// Windows waiting for the disk writer, more are not persisted
+#define LLMD_MAX_PENDING_DISK_WRITES 4
+// How many waiters after the oldest one may take a released context from it
+// and how often the oldest one can be passed over
+#define LLMD_ADMISSION_LOOKAHEAD 8
+#define LLMD_ADMISSION_MAX_SKIPS 4
+
+static const struct llmd_session_config llmd_default_session_config = {
+	.admission_timeout_ms = 0,
+	.max_pooled_contexts = 0,
+	.eviction_policy = LLMD_EVICT_LRU,
+	.swap_space_size = 0,
+	.min_swap_tokens = 0,
+	.disk_cache_path = NULL,
+	.disk_cache_size = 0,
+	.disk_cache_min_tokens = 0,
+	.disk_cache_model_id = NULL,
+	.max_batch_tokens = 0,
+	.max_batch_wait_us = 0,
+	.tokenize_cache_size = 0,
+	.min_cost_discard_weight = 0.f,
+	.min_cost_new_context = 0.f,
+};
 
 struct llmd_session {
 	struct llmd_host* host;
 	struct llmd_driver* driver;
 
 	struct llmd_model_info model_info;
+	struct llmd_vocab_table vocab_table;
+
+	// The whole pool is guarded by this one mutex: the list of pooled
+	// contexts, their owners, the prefix index which tracks which of them are
+	// idle and the admission queue. Slow work such as evaluation and swapping
+	// is done outside of it.
+	pthread_mutex_t pool_lock;
+	// All pooled physical contexts, only ever removed when the session is
+	// destroyed
 	struct llmd_physical_context* free_contexts;
+	struct llmd_prefix_index prefix_index;
+
+	// Serializes driver calls which are not bound to a single descriptor
+	pthread_mutex_t driver_lock;
+
+	struct llmd_session_config config;
+
+	// Callers waiting for a pooled context, oldest first, guarded by pool_lock
+	struct llmd_admission_waiter* waiters_head;
+	struct llmd_admission_waiter* waiters_tail;
+	struct llmd_admission_stats admission_stats;
+
+	// Eviction bookkeeping, guarded by pool_lock
+	unsigned int num_pooled_contexts;
+	uint64_t use_clock;
+
+	// Host memory and disk tiers for the state of evicted contexts
+	pthread_mutex_t swap_lock;
+	struct llmd_state_cache state_cache;
+	bool has_disk_cache;
+	struct llmd_disk_cache disk_cache;
+	// What save_state reports for any context, part of the model fingerprint
+	size_t max_state_size;
+
+	// Files of the disk cache are written on their own thread, the queue is
+	// guarded by swap_lock
+	bool has_disk_writer;
+	pthread_t disk_writer;
+	pthread_cond_t disk_write_cond;
+	struct llmd_disk_write* disk_writes_head;
+	struct llmd_disk_write* disk_writes_tail;
+	unsigned int num_pending_disk_writes;
+	bool stop_disk_writer;
+
+	bool has_scheduler;
+	struct llmd_scheduler scheduler;
+
+	pthread_mutex_t token_cache_lock;
+	struct llmd_token_cache token_cache;
+
+	// Windows of unbound virtual contexts
+	pthread_mutex_t token_store_lock;
+	struct llmd_token_store token_store;
+
+	pthread_mutex_t stats_lock;
+	struct llmd_session_stats stats;
+
+	// Completion of asynchronous generate calls
+	pthread_mutex_t ticket_lock;
+	pthread_cond_t ticket_cond;
+	_Atomic(int) completion_fd;
+};
+
+struct llmd_generate_ticket {
+	struct llmd_scheduler_job job;
+	struct llmd_context* ctx;
+
+	llmd_generate_callback_t callback;
+	void* userdata;
+	struct llmd_logits_output output;
+
+	// Guarded by ticket_lock of the session
+	bool done;
+	enum llmd_error status;
+};
+
+// A window and its state waiting to be written to the disk cache
+struct llmd_disk_write {
+	llmd_token_t* tokens;
+	unsigned int num_tokens;
+	void* state;
+	size_t state_size;
+	struct llmd_disk_write* next;
+};
+
+struct llmd_admission_waiter {
+	pthread_cond_t cond;
+	struct llmd_context* virtual_ctx;
+	unsigned int lookup_length;
+	unsigned int num_skips;
+	struct llmd_physical_context* granted;
+	struct llmd_admission_waiter* next;
 };
 
 struct llmd_context {
@@ -45,33 +156,73 @@ struct llmd_context {
 	struct llmd_physical_context* physical_ctx;
 	bool generating;
 
-	llmd_token_t* context_window;
+	// Chunks are shared through the token store of the session
+	struct llmd_token_seq tokens;
+	// A flat copy of tokens for lookups, only kept while bound
+	llmd_buffer(llmd_token_t) context_window;
+	// Start of what changed in the physical window since binding
+	unsigned int dirty_from;
 	llmd_buffer(llmd_token_t) token_buf;
-	llmd_buffer(char) text_buf;
+
+	// Sliding window mode
+	bool sliding_window;
+	unsigned int window_keep;
+	unsigned int window_discard;
+	// Tokens dropped since the window last started over
+	unsigned int num_dropped;
+
+	uint64_t generate_start_ns;
+	struct llmd_context_stats stats;
 };
 
 struct llmd_physical_context {
 	int descriptor;
 
-	llmd_token_t* context_window;
+	// Grows as tokens are written into it
+	llmd_buffer(llmd_token_t) context_window;
 	unsigned int filled_size;
+	// Owner of a pooled context, guarded by pool_lock
 	struct llmd_context* virtual_ctx;
 	struct llmd_physical_context* next;
+
+	struct llmd_prefix_entry prefix_entry;
+
+	// Eviction bookkeeping, guarded by pool_lock
+	uint64_t last_used;
+	unsigned int use_count;
+	uint64_t tokens_saved;
 };
 
-static unsigned int
-llmd_count_shared_prefix(
-	const llmd_token_t* buf1,
-	const llmd_token_t* buf2,
-	unsigned int len
+// Must be called with pool_lock held
+static bool
+llmd_claim_physical_ctx_locked(
+	struct llmd_physical_context* physical_ctx,
+	struct llmd_context* virtual_ctx
 ) {
-	for (unsigned int i = 0; i < len; ++i) {
-		if (buf1[i] != buf2[i]) {
-			return i;
-		}
-	}
+	if (physical_ctx->virtual_ctx != NULL) { return false; }
+
+	physical_ctx->virtual_ctx = virtual_ctx;
+	return true;
+}
+
+// Must be called with pool_lock held
+static void
+llmd_push_free_context_locked(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx
+) {
+	physical_ctx->next = session->free_contexts;
+	session->free_contexts = physical_ctx;
+}
 
-	return len;
+// Must be called with pool_lock held
+static void
+llmd_touch_physical_ctx_locked(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx
+) {
+	physical_ctx->last_used = ++session->use_clock;
+	++physical_ctx->use_count;
 }
 
 static enum llmd_error
@@ -86,7 +237,10 @@ LLMD_TRY
 	int descriptor = -1;
 	struct llmd_physical_context* context = NULL;
 
-	LLMD_CHECK_THROW(driver->interface->create_context(driver, &descriptor));
+	pthread_mutex_lock(&session->driver_lock);
+	llmd_status = driver->interface->create_context(driver, &descriptor);
+	pthread_mutex_unlock(&session->driver_lock);
+	LLMD_CHECK_THROW(llmd_status);
 	LLMD_CHECKED_MALLOC(context, host, sizeof(*context));
 
 	*context = (struct llmd_physical_context) {
@@ -94,12 +248,18 @@ LLMD_TRY
 	};
 	*context_out = context;
 
+	pthread_mutex_lock(&session->stats_lock);
+	++session->stats.num_contexts_created;
+	pthread_mutex_unlock(&session->stats_lock);
+
 	return LLMD_OK;
 LLMD_EXCEPT_BEGIN
 	llmd_free(host, context);
 
 	if (descriptor >= 0) {
+		pthread_mutex_lock(&session->driver_lock);
 		enum llmd_error status = driver->interface->destroy_context(driver, descriptor);
+		pthread_mutex_unlock(&session->driver_lock);
 		if (status != LLMD_OK) {
 			llmd_log(
 				host, LLMD_LOG_WARNING,
@@ -118,8 +278,15 @@ llmd_destroy_physical_ctx(
 	struct llmd_driver* driver = session->driver;
 	struct llmd_host* host = session->host;
 
-	llmd_free(host, context->context_window);
+	pthread_mutex_lock(&session->pool_lock);
+	llmd_prefix_index_remove(&session->prefix_index, &context->prefix_entry);
+	pthread_mutex_unlock(&session->pool_lock);
+
+	llmd_free_buffer(host, context->context_window);
+
+	pthread_mutex_lock(&session->driver_lock);
 	enum llmd_error status = driver->interface->destroy_context(driver, context->descriptor);
+	pthread_mutex_unlock(&session->driver_lock);
 	if (status != LLMD_OK) {
 		llmd_log(
 			host, LLMD_LOG_WARNING,
@@ -132,292 +299,1690 @@ llmd_destroy_physical_ctx(
 	return LLMD_OK;
 }
 
+static enum llmd_error
+llmd_reserve_window(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx,
+	unsigned int size
+) {
+	size_t capacity = llmd_buffer_size(physical_ctx->context_window);
+	if (capacity > 0 && capacity >= size) { return LLMD_OK; }
+
+	size_t max_context_length = session->model_info.max_context_length;
+	size_t new_capacity = capacity > 0 ? capacity * 2 : LLMD_TOKEN_CHUNK_SIZE;
+	while (new_capacity < size) { new_capacity *= 2; }
+	if (new_capacity > max_context_length) {
+		new_capacity = size > max_context_length ? size : max_context_length;
+	}
+
+	llmd_buffer(llmd_token_t) window = llmd_resize_buffer(
+		session->host, physical_ctx->context_window, new_capacity
+	);
+	if (window == NULL) { return LLMD_ERR_OOM; }
+
+	physical_ctx->context_window = window;
+	return LLMD_OK;
+}
+
+// The new context is returned already claimed by virtual_ctx
 static enum llmd_error
 llmd_create_shared_physical_ctx(
 	struct llmd_session* session,
+	struct llmd_context* virtual_ctx,
 	struct llmd_physical_context** context_out
 ) {
-	struct llmd_host* host = session->host;
 	struct llmd_physical_context* physical_ctx;
 
 	if (llmd_create_physical_ctx(session, &physical_ctx) != LLMD_OK) {
 		return LLMD_ERR_OOM;
 	}
 
-	physical_ctx->context_window = llmd_malloc(
-		host, sizeof(llmd_token_t) * session->model_info.max_context_length
-	);
-
-	if (physical_ctx->context_window == NULL) {
+	if (llmd_reserve_window(session, physical_ctx, 0) != LLMD_OK) {
 		llmd_destroy_physical_ctx(session, physical_ctx);
 		return LLMD_ERR_OOM;
 	}
 
+	pthread_mutex_lock(&session->pool_lock);
+	llmd_claim_physical_ctx_locked(physical_ctx, virtual_ctx);
+	llmd_prefix_index_add(&session->prefix_index, &physical_ctx->prefix_entry);
+	llmd_touch_physical_ctx_locked(session, physical_ctx);
 	// Link into list of free contexts for reuse after unbind
-	// TODO: CAS?
-	physical_ctx->next = session->free_contexts;
-	session->free_contexts = physical_ctx;
+	llmd_push_free_context_locked(session, physical_ctx);
+	pthread_mutex_unlock(&session->pool_lock);
 
 	*context_out = physical_ctx;
 	return LLMD_OK;
 }
 
-static enum llmd_error
-llmd_bind_virtual_ctx(
-	struct llmd_session* session,
-	struct llmd_context* virtual_ctx,
-	unsigned int num_tokens,
-	unsigned int* eval_offset_out
+static unsigned int
+llmd_count_shared_prefix(
+	const llmd_token_t* lhs,
+	const llmd_token_t* rhs,
+	unsigned int length
 ) {
-	// TODO: lock and wait for context to become free instead of OOM?
-	switch (virtual_ctx->type) {
-		case LLMD_CONTEXT_MIN_UPLOAD: {
-			struct llmd_physical_context* chosen_context = NULL;
-			unsigned int upload_size = session->model_info.max_context_length;
-
-			for (
-				struct llmd_physical_context* itr = session->free_contexts;
-				itr != NULL;
-				itr = itr->next
-			) {
-				// TODO: CAS
-				if (itr->virtual_ctx != NULL) {
-					continue;
-				}
-
-				unsigned int ctx_filled_size = itr->filled_size;
-				unsigned int shared_prefix_length = llmd_count_shared_prefix(
-					virtual_ctx->context_window, itr->context_window,
-					ctx_filled_size < num_tokens ? ctx_filled_size : num_tokens
-				);
-				unsigned int ctx_upload_size = num_tokens - shared_prefix_length;
+	unsigned int i = 0;
+	while (i < length && lhs[i] == rhs[i]) { ++i; }
+	return i;
+}
 
-				if (ctx_upload_size < upload_size) {
-					chosen_context = itr;
-					upload_size = ctx_upload_size;
-				}
-			}
+// Must be called with pool_lock held
+static unsigned int
+llmd_waiter_shared_prefix(
+	struct llmd_physical_context* physical_ctx,
+	struct llmd_admission_waiter* waiter
+) {
+	// The window of a waiting context does not change until it is granted
+	unsigned int filled_size = physical_ctx->filled_size;
+	unsigned int lookup_length = waiter->lookup_length;
+	return llmd_count_shared_prefix(
+		physical_ctx->context_window, waiter->virtual_ctx->context_window,
+		filled_size < lookup_length ? filled_size : lookup_length
+	);
+}
 
-			if (chosen_context == NULL) {
-				if (llmd_create_shared_physical_ctx(session, &chosen_context) != LLMD_OK) {
-					return LLMD_ERR_OOM;
-				} else {
-					upload_size = num_tokens;
-				}
+// Must be called with pool_lock held.
+// Hands a released context to the waiter which reuses most of it or marks it
+// idle.
+static void
+llmd_offer_physical_ctx_locked(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx
+) {
+	struct llmd_admission_waiter* head = session->waiters_head;
+	struct llmd_admission_waiter* waiter = head;
+	struct llmd_admission_waiter* prev = NULL;
+
+	if (head != NULL && head->num_skips < LLMD_ADMISSION_MAX_SKIPS) {
+		unsigned int best_prefix = llmd_waiter_shared_prefix(physical_ctx, head);
+		struct llmd_admission_waiter* itr_prev = head;
+		for (
+			unsigned int i = 0;
+			i < LLMD_ADMISSION_LOOKAHEAD && itr_prev->next != NULL;
+			++i, itr_prev = itr_prev->next
+		) {
+			unsigned int prefix = llmd_waiter_shared_prefix(physical_ctx, itr_prev->next);
+			if (prefix > best_prefix) {
+				best_prefix = prefix;
+				waiter = itr_prev->next;
+				prev = itr_prev;
 			}
+		}
 
-			chosen_context->virtual_ctx = virtual_ctx;
-			virtual_ctx->physical_ctx = chosen_context;
-
-			*eval_offset_out = num_tokens - upload_size;
+		if (waiter != head) { ++head->num_skips; }
+	}
 
-			return LLMD_OK;
+	if (waiter != NULL) {
+		if (prev != NULL) {
+			prev->next = waiter->next;
+		} else {
+			session->waiters_head = waiter->next;
+		}
+		if (session->waiters_tail == waiter) {
+			session->waiters_tail = prev;
 		}
-		case LLMD_CONTEXT_MIN_DISCARD: {
-			struct llmd_physical_context* chosen_context = NULL;
-			unsigned int discard_size = session->model_info.max_context_length;
+		--session->admission_stats.queue_depth;
 
-			for (
-				struct llmd_physical_context* itr = session->free_contexts;
-				itr != NULL;
-				itr = itr->next
-			) {
-				// TODO: CAS
-				if (itr->virtual_ctx != NULL) {
-					continue;
-				}
+		// The context stays busy in the index, it only changes owner
+		physical_ctx->virtual_ctx = waiter->virtual_ctx;
+		llmd_touch_physical_ctx_locked(session, physical_ctx);
+		waiter->granted = physical_ctx;
+		pthread_cond_signal(&waiter->cond);
+	} else {
+		llmd_prefix_index_set_idle(&session->prefix_index, &physical_ctx->prefix_entry, true);
+		physical_ctx->virtual_ctx = NULL;
+	}
+}
 
-				unsigned int ctx_filled_size = itr->filled_size;
-				unsigned int shared_prefix_length = llmd_count_shared_prefix(
-					virtual_ctx->context_window, itr->context_window,
-					ctx_filled_size < num_tokens ? ctx_filled_size : num_tokens
-				);
-				unsigned int ctx_discard_size = ctx_filled_size - shared_prefix_length;
+static void
+llmd_release_physical_ctx(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx
+) {
+	pthread_mutex_lock(&session->pool_lock);
+	llmd_offer_physical_ctx_locked(session, physical_ctx);
+	pthread_mutex_unlock(&session->pool_lock);
+}
 
-				if (ctx_discard_size < discard_size) {
-					chosen_context = itr;
-					discard_size = ctx_discard_size;
-				}
-			}
+// Must be called with pool_lock held
+static enum llmd_error
+llmd_find_match_locked(
+	struct llmd_session* session,
+	struct llmd_context* virtual_ctx,
+	unsigned int lookup_length,
+	struct llmd_physical_context** context_out,
+	unsigned int* shared_prefix_out
+) {
+	struct llmd_prefix_entry* entry = NULL;
+	enum llmd_error status;
 
-			if (chosen_context == NULL || discard_size > 0) {
-				// Try to create a new context to reduce discard_size
-				if (llmd_create_shared_physical_ctx(session, &chosen_context) != LLMD_OK) {
-					// If we never found a context
-					if (chosen_context == NULL) {
-						return LLMD_ERR_OOM;
-					}
-					// Continue with the chosen context
-				} else {
-					discard_size = 0;
-				}
-			}
+	*context_out = NULL;
+	*shared_prefix_out = 0;
 
-			chosen_context->virtual_ctx = virtual_ctx;
-			virtual_ctx->physical_ctx = chosen_context;
+	switch (virtual_ctx->type) {
+		case LLMD_CONTEXT_MIN_UPLOAD:
+		case LLMD_CONTEXT_MIN_COST:
+			status = llmd_prefix_index_find_longest(
+				&session->prefix_index,
+				virtual_ctx->context_window, lookup_length,
+				&entry, shared_prefix_out
+			);
+			break;
+		case LLMD_CONTEXT_MIN_DISCARD:
+			status = llmd_prefix_index_find_least_discard(
+				&session->prefix_index,
+				virtual_ctx->context_window, lookup_length,
+				&entry, shared_prefix_out
+			);
+			break;
+		default:
+			status = LLMD_ERR_NOT_SUPPORTED;
+			break;
+	}
 
-			*eval_offset_out = chosen_context->filled_size - discard_size;
+	if (status == LLMD_OK && entry != NULL) {
+		*context_out = llmd_container_of(entry, struct llmd_physical_context, prefix_entry);
+	}
 
-			return LLMD_OK;
-		}
-		default:
-			return LLMD_ERR_NOT_SUPPORTED;
+	return status;
+}
+
+// What a cached token is expected to save later
+static float
+llmd_discard_weight(struct llmd_session* session) {
+	if (session->config.min_cost_discard_weight > 0.f) {
+		return session->config.min_cost_discard_weight;
 	}
+
+	pthread_mutex_lock(&session->stats_lock);
+	uint64_t num_reused = session->stats.num_tokens_reused;
+	uint64_t num_discarded = session->stats.num_tokens_discarded;
+	pthread_mutex_unlock(&session->stats_lock);
+
+	// Until there is history, as much as uploading it again
+	return num_reused + num_discarded > 0
+		? (float)num_reused / (float)(num_reused + num_discarded)
+		: 1.f;
 }
 
+// Must be called with pool_lock held.
+// Compares the longest and the least discarding matches with growing the
+// pool, in evaluated tokens.
+// Returns no context when growing the pool is cheaper.
 static enum llmd_error
-llmd_unbind_virtual_ctx(
+llmd_find_min_cost_locked(
 	struct llmd_session* session,
-	struct llmd_context* virtual_ctx
+	struct llmd_context* virtual_ctx,
+	unsigned int num_tokens,
+	unsigned int lookup_length,
+	float discard_weight,
+	struct llmd_physical_context** context_out,
+	unsigned int* shared_prefix_out
 ) {
-	(void)session;
-	struct llmd_physical_context* physical_ctx = virtual_ctx->physical_ctx;
+	*context_out = NULL;
+	*shared_prefix_out = 0;
+
+	struct llmd_prefix_entry* candidates[2] = { NULL, NULL };
+	unsigned int candidate_shared[2] = { 0, 0 };
+	LLMD_CHECK_RETURN(
+		llmd_prefix_index_find_longest(
+			&session->prefix_index,
+			virtual_ctx->context_window, lookup_length,
+			&candidates[0], &candidate_shared[0]
+		)
+	);
+	LLMD_CHECK_RETURN(
+		llmd_prefix_index_find_least_discard(
+			&session->prefix_index,
+			virtual_ctx->context_window, lookup_length,
+			&candidates[1], &candidate_shared[1]
+		)
+	);
 
-	// TODO: barrier?
-	if (physical_ctx) {
-		physical_ctx->virtual_ctx = NULL;
-		virtual_ctx->physical_ctx = NULL;
+	unsigned int max_pooled_contexts = session->config.max_pooled_contexts;
+	bool can_grow = max_pooled_contexts == 0
+		|| session->num_pooled_contexts < max_pooled_contexts;
+	float new_context_cost = session->config.min_cost_new_context > 0.f
+		? session->config.min_cost_new_context
+		: LLMD_DEFAULT_NEW_CONTEXT_COST;
+	float best_cost = can_grow ? (float)num_tokens + new_context_cost : INFINITY;
+
+	for (unsigned int i = 0; i < 2; ++i) {
+		if (candidates[i] == NULL) { continue; }
+
+		unsigned int discard = candidates[i]->length - candidate_shared[i];
+		float cost = (float)(num_tokens - candidate_shared[i])
+			+ discard_weight * (float)discard;
+		if (cost < best_cost) {
+			best_cost = cost;
+			*context_out = llmd_container_of(
+				candidates[i], struct llmd_physical_context, prefix_entry
+			);
+			*shared_prefix_out = candidate_shared[i];
+		}
 	}
 
 	return LLMD_OK;
 }
 
-enum llmd_error
-llmd_create_session(
-	struct llmd_host* host,
-	struct llmd_driver* driver,
-	struct llmd_session** session_out
+// Must be called with pool_lock held
+static bool
+llmd_claim_idle_physical_ctx_locked(
+	struct llmd_session* session,
+	struct llmd_context* virtual_ctx,
+	struct llmd_physical_context* physical_ctx
 ) {
-LLMD_TRY
-	if (host == NULL) {
-		host = &llmd_default_host;
-	}
-
-	struct llmd_session* session = NULL;
-	LLMD_CHECKED_MALLOC(session, host, sizeof(struct llmd_session));
-
-	*session = (struct llmd_session) {
-		.host = host,
-		.driver = driver
-	};
-
-	LLMD_CHECK_THROW(driver->interface->get_model_info(driver, &session->model_info));
+	if (!llmd_claim_physical_ctx_locked(physical_ctx, virtual_ctx)) { return false; }
 
-	*session_out = session;
-	return LLMD_OK;
-LLMD_EXCEPT_BEGIN
-	llmd_free(host, session);
-LLMD_EXCEPT_END
+	llmd_prefix_index_set_idle(&session->prefix_index, &physical_ctx->prefix_entry, false);
+	llmd_touch_physical_ctx_locked(session, physical_ctx);
+	return true;
 }
 
-enum llmd_error
-llmd_destroy_session(
-	struct llmd_session* session
+// Must be called with pool_lock held.
+// Picks an idle context to overwrite according to the eviction policy.
+// This scans the whole pool so it is only done when the pool cannot grow.
+static void
+llmd_evict_physical_ctx_locked(
+	struct llmd_session* session,
+	struct llmd_context* virtual_ctx,
+	unsigned int lookup_length,
+	struct llmd_physical_context** context_out,
+	unsigned int* shared_prefix_out
 ) {
+	struct llmd_physical_context* victim = NULL;
+	unsigned int victim_shared = 0;
+	double victim_cost = 0.0;
+
 	for (
 		struct llmd_physical_context* itr = session->free_contexts;
 		itr != NULL;
 		itr = itr->next
 	) {
-		llmd_destroy_physical_ctx(session, itr);
+		if (!itr->prefix_entry.idle) { continue; }
+
+		unsigned int length = itr->prefix_entry.length;
+		unsigned int shared = llmd_count_shared_prefix(
+			itr->context_window, virtual_ctx->context_window,
+			length < lookup_length ? length : lookup_length
+		);
+		unsigned int discard = length - shared;
+
+		double cost;
+		if (discard == 0) {
+			// Nothing is lost
+			cost = -INFINITY;
+		} else {
+			switch (session->config.eviction_policy) {
+				case LLMD_EVICT_LFU:
+					cost = itr->use_count;
+					break;
+				case LLMD_EVICT_LEAST_VALUABLE: {
+					// The share of past savings that is about to be thrown
+					// away, decayed by age, against what is saved right now
+					double age = (double)(session->use_clock - itr->last_used);
+					cost = (double)itr->tokens_saved * discard / length / (1.0 + age)
+						- shared;
+				} break;
+				case LLMD_EVICT_LRU:
+				default:
+					cost = itr->last_used;
+					break;
+			}
+		}
+
+		if (
+			victim == NULL
+			|| cost < victim_cost
+			|| (cost == victim_cost && shared > victim_shared)
+		) {
+			victim = itr;
+			victim_shared = shared;
+			victim_cost = cost;
+		}
 	}
 
-	llmd_free(session->host, session);
-	return LLMD_OK;
+	if (victim != NULL) {
+		llmd_claim_idle_physical_ctx_locked(session, virtual_ctx, victim);
+		++session->admission_stats.num_evictions;
+	}
+
+	*context_out = victim;
+	*shared_prefix_out = victim_shared;
 }
 
-enum llmd_error
-llmd_get_model_info(
+static enum llmd_error
+llmd_grow_pool(
 	struct llmd_session* session,
-	struct llmd_model_info* info_out
+	struct llmd_context* virtual_ctx,
+	struct llmd_physical_context** context_out
 ) {
-	*info_out = session->model_info;
-	return LLMD_OK;
+	unsigned int max_pooled_contexts = session->config.max_pooled_contexts;
+
+	pthread_mutex_lock(&session->pool_lock);
+	if (max_pooled_contexts > 0 && session->num_pooled_contexts >= max_pooled_contexts) {
+		pthread_mutex_unlock(&session->pool_lock);
+		return LLMD_ERR_OOM;
+	}
+	++session->num_pooled_contexts;
+	pthread_mutex_unlock(&session->pool_lock);
+
+	enum llmd_error status = llmd_create_shared_physical_ctx(session, virtual_ctx, context_out);
+	if (status != LLMD_OK) {
+		pthread_mutex_lock(&session->pool_lock);
+		--session->num_pooled_contexts;
+		pthread_mutex_unlock(&session->pool_lock);
+	}
+
+	return status;
 }
 
-enum llmd_error
-llmd_create_context(
+static enum llmd_error
+llmd_wait_for_physical_ctx(
 	struct llmd_session* session,
-	enum llmd_context_type context_type,
-	struct llmd_context** context_out
+	struct llmd_context* virtual_ctx,
+	unsigned int lookup_length,
+	struct llmd_physical_context** context_out,
+	unsigned int* shared_prefix_out
 ) {
-LLMD_TRY
-	struct llmd_host* host = session->host;
-
-	struct llmd_context* context = NULL;
-
-	LLMD_CHECKED_MALLOC(context, host, sizeof(struct llmd_context));
+	unsigned int timeout_ms = session->config.admission_timeout_ms;
+	if (timeout_ms == 0) { return LLMD_ERR_OOM; }
 
-	*context = (struct llmd_context) {
-		.session = session,
-		.type = context_type,
+	struct llmd_admission_waiter waiter = {
+		.virtual_ctx = virtual_ctx,
+		.lookup_length = lookup_length,
 	};
+	pthread_condattr_t cond_attr;
+	if (pthread_condattr_init(&cond_attr) != 0) { return LLMD_ERR_OOM; }
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	int init_result = pthread_cond_init(&waiter.cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if (init_result != 0) { return LLMD_ERR_OOM; }
+
+	uint64_t start_ns = llmd_monotonic_ns();
+	uint64_t deadline_ns = start_ns + (uint64_t)timeout_ms * 1000000ull;
+	struct timespec deadline = llmd_timespec_from_ns(deadline_ns);
+
+	pthread_mutex_lock(&session->pool_lock);
+
+	// A context may have been released since the last look
+	llmd_evict_physical_ctx_locked(
+		session, virtual_ctx, lookup_length,
+		context_out, shared_prefix_out
+	);
+	if (*context_out != NULL) {
+		pthread_mutex_unlock(&session->pool_lock);
+		pthread_cond_destroy(&waiter.cond);
+		return LLMD_OK;
+	}
 
-	if (context_type == LLMD_CONTEXT_DIRECT) {
-		LLMD_CHECK_THROW(
-			llmd_create_physical_ctx(session, &context->physical_ctx)
-		);
+	if (session->waiters_tail != NULL) {
+		session->waiters_tail->next = &waiter;
 	} else {
-		LLMD_CHECKED_MALLOC(
-			context->context_window, host,
-			sizeof(llmd_token_t) * session->model_info.max_context_length
-		);
+		session->waiters_head = &waiter;
 	}
+	session->waiters_tail = &waiter;
 
-	*context_out = context;
+	struct llmd_admission_stats* stats = &session->admission_stats;
+	++stats->queue_depth;
+	if (stats->queue_depth > stats->max_queue_depth) {
+		stats->max_queue_depth = stats->queue_depth;
+	}
+	++stats->num_waits;
+
+	while (waiter.granted == NULL) {
+		if (pthread_cond_timedwait(&waiter.cond, &session->pool_lock, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	if (waiter.granted == NULL) {
+		// Dequeue ourselves
+		struct llmd_admission_waiter** itr = &session->waiters_head;
+		struct llmd_admission_waiter* prev = NULL;
+		while (*itr != &waiter) {
+			prev = *itr;
+			itr = &(*itr)->next;
+		}
+		*itr = waiter.next;
+		if (session->waiters_tail == &waiter) {
+			session->waiters_tail = prev;
+		}
+		--stats->queue_depth;
+		++stats->num_timeouts;
+	}
+
+	uint64_t wait_ns = llmd_monotonic_ns() - start_ns;
+	stats->total_wait_ns += wait_ns;
+	if (wait_ns > stats->max_wait_ns) {
+		stats->max_wait_ns = wait_ns;
+	}
+
+	pthread_mutex_unlock(&session->pool_lock);
+	pthread_cond_destroy(&waiter.cond);
+
+	if (waiter.granted == NULL) { return LLMD_ERR_OOM; }
+
+	// Nobody else can touch the window of a bound context
+	struct llmd_physical_context* granted = waiter.granted;
+	unsigned int filled_size = granted->filled_size;
+	*context_out = granted;
+	*shared_prefix_out = llmd_count_shared_prefix(
+		granted->context_window, virtual_ctx->context_window,
+		filled_size < lookup_length ? filled_size : lookup_length
+	);
 
 	return LLMD_OK;
-LLMD_EXCEPT_BEGIN
-	llmd_free(host, context);
-LLMD_EXCEPT_END
 }
 
-enum llmd_error
-llmd_destroy_context(
-	struct llmd_context* context
+static enum llmd_error
+llmd_swap_out_physical_ctx(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx
 ) {
-	struct llmd_session* session = context->session;
+LLMD_TRY
+	struct llmd_driver* driver = session->driver;
 	struct llmd_host* host = session->host;
+	unsigned int num_tokens = physical_ctx->filled_size;
+	struct llmd_state_snapshot* snapshot = NULL;
+	size_t state_size = 0;
 
-	if (context->generating) {
-		llmd_log(host, LLMD_LOG_WARNING, "Context %p is still generating", (void*)context);
-		llmd_unbind_virtual_ctx(session, context);
-		context->generating = false;
+	llmd_status = driver->interface->save_state(
+		driver, physical_ctx->descriptor, NULL, &state_size
+	);
+	if (llmd_status != LLMD_ERR_BUF_SIZE) {
+		LLMD_THROW(llmd_status == LLMD_OK ? LLMD_ERR_INVALID : llmd_status);
 	}
 
-	if (context->type == LLMD_CONTEXT_DIRECT) {
-		// Recycle the context
-		// TODO: Lock
-		struct llmd_session* session = context->session;
-		struct llmd_physical_context* physical_context = context->physical_ctx;
+	LLMD_CHECKED_MALLOC(snapshot, host, sizeof(*snapshot));
+	*snapshot = (struct llmd_state_snapshot) {
+		.num_tokens = num_tokens,
+	};
+	LLMD_CHECKED_MALLOC(snapshot->tokens, host, num_tokens * sizeof(llmd_token_t));
+	LLMD_CHECKED_MALLOC(snapshot->state, host, state_size);
 
-		physical_context->context_window = llmd_malloc(
-			host, sizeof(llmd_token_t) * session->model_info.max_context_length
-		);
+	LLMD_CHECK_THROW(
+		driver->interface->save_state(
+			driver, physical_ctx->descriptor, snapshot->state, &state_size
+		)
+	);
+	memcpy(snapshot->tokens, physical_ctx->context_window, num_tokens * sizeof(llmd_token_t));
 
-		if (!physical_context->context_window) {
-			llmd_destroy_physical_ctx(session, physical_context);
-		} else {
-			physical_context->virtual_ctx = NULL;
-			physical_context->next = session->free_contexts;
-			session->free_contexts = physical_context;
-		}
-	}
+	// The reported size is an upper bound
+	void* state = llmd_realloc(host, snapshot->state, state_size);
+	if (state != NULL) { snapshot->state = state; }
+	snapshot->state_size = state_size;
 
-	llmd_free_buffer(host, context->text_buf);
-	llmd_free_buffer(host, context->token_buf);
-	llmd_free(host, context->context_window);
-	llmd_free(host, context);
+	pthread_mutex_lock(&session->swap_lock);
+	llmd_state_cache_insert(&session->state_cache, snapshot);
+	pthread_mutex_unlock(&session->swap_lock);
 
 	return LLMD_OK;
+LLMD_EXCEPT_BEGIN
+	llmd_free_state_snapshot(host, snapshot);
+LLMD_EXCEPT_END
 }
 
-struct llmd_session*
-llmd_get_session_of_context(
-	struct llmd_context* context
+// Returns the new shared prefix length
+static unsigned int
+llmd_swap_in_physical_ctx(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx,
+	const llmd_token_t* tokens,
+	unsigned int lookup_length,
+	unsigned int shared_prefix_length
 ) {
-	return context->session;
-}
+	struct llmd_driver* driver = session->driver;
+	unsigned int min_gain = session->config.min_swap_tokens > 0
+		? session->config.min_swap_tokens
+		: 1;
+	unsigned int snapshot_shared;
+
+	pthread_mutex_lock(&session->swap_lock);
+	struct llmd_state_snapshot* snapshot = llmd_state_cache_take_longest(
+		&session->state_cache, tokens, lookup_length,
+		shared_prefix_length + min_gain - 1, &snapshot_shared
+	);
+	pthread_mutex_unlock(&session->swap_lock);
+
+	if (snapshot == NULL) { return shared_prefix_length; }
+
+	if (llmd_reserve_window(session, physical_ctx, snapshot->num_tokens) != LLMD_OK) {
+		pthread_mutex_lock(&session->swap_lock);
+		llmd_state_cache_insert(&session->state_cache, snapshot);
+		pthread_mutex_unlock(&session->swap_lock);
+		return shared_prefix_length;
+	}
+
+	enum llmd_error status = driver->interface->load_state(
+		driver, physical_ctx->descriptor, snapshot->state, snapshot->state_size
+	);
+
+	if (status == LLMD_OK) {
+		memcpy(
+			physical_ctx->context_window,
+			snapshot->tokens,
+			snapshot->num_tokens * sizeof(llmd_token_t)
+		);
+		physical_ctx->filled_size = snapshot->num_tokens;
+		shared_prefix_length = snapshot_shared;
+	} else {
+		llmd_log(
+			session->host, LLMD_LOG_WARNING,
+			"Could not load state into context %d: %d", physical_ctx->descriptor, status
+		);
+		// Whatever the driver holds now is unknown
+		physical_ctx->filled_size = 0;
+		shared_prefix_length = 0;
+	}
+
+	pthread_mutex_lock(&session->pool_lock);
+	llmd_prefix_index_update(
+		&session->prefix_index, &physical_ctx->prefix_entry,
+		physical_ctx->context_window, 0, physical_ctx->filled_size
+	);
+	pthread_mutex_unlock(&session->pool_lock);
+
+	llmd_free_state_snapshot(session->host, snapshot);
+	return shared_prefix_length;
+}
+
+// Returns the new shared prefix length
+static unsigned int
+llmd_restore_physical_ctx(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx,
+	const llmd_token_t* tokens,
+	unsigned int lookup_length,
+	unsigned int shared_prefix_length
+) {
+	struct llmd_driver* driver = session->driver;
+	unsigned int min_gain = session->config.disk_cache_min_tokens > 0
+		? session->config.disk_cache_min_tokens
+		: LLMD_DEFAULT_DISK_CACHE_MIN_TOKENS;
+	struct llmd_disk_cache_mapping mapping;
+	unsigned int entry_shared;
+
+	// The file stays readable through the mapping even if it is evicted
+	pthread_mutex_lock(&session->swap_lock);
+	struct llmd_disk_cache_entry* entry = llmd_disk_cache_find_longest(
+		&session->disk_cache, tokens, lookup_length,
+		shared_prefix_length + min_gain - 1, &entry_shared
+	);
+	enum llmd_error status = entry != NULL
+		? llmd_disk_cache_map(&session->disk_cache, entry, &mapping)
+		: LLMD_ERR_INVALID;
+	pthread_mutex_unlock(&session->swap_lock);
+
+	if (status != LLMD_OK) { return shared_prefix_length; }
+
+	// The fingerprint already makes this unlikely but a state from another
+	// model must never reach the driver
+	if (mapping.state_size > session->max_state_size) {
+		llmd_log(
+			session->host, LLMD_LOG_WARNING,
+			"Cached state of %zu bytes is larger than the %zu bytes the driver allows",
+			mapping.state_size, session->max_state_size
+		);
+		llmd_disk_cache_unmap(&mapping);
+		return shared_prefix_length;
+	}
+
+	if (llmd_reserve_window(session, physical_ctx, mapping.num_tokens) != LLMD_OK) {
+		llmd_disk_cache_unmap(&mapping);
+		return shared_prefix_length;
+	}
+
+	status = driver->interface->load_state(
+		driver, physical_ctx->descriptor, mapping.state, mapping.state_size
+	);
+
+	if (status == LLMD_OK) {
+		memcpy(
+			physical_ctx->context_window,
+			mapping.tokens,
+			mapping.num_tokens * sizeof(llmd_token_t)
+		);
+		physical_ctx->filled_size = mapping.num_tokens;
+
+		pthread_mutex_lock(&session->swap_lock);
+		session->disk_cache.num_tokens_restored += entry_shared - shared_prefix_length;
+		pthread_mutex_unlock(&session->swap_lock);
+		shared_prefix_length = entry_shared;
+	} else {
+		llmd_log(
+			session->host, LLMD_LOG_WARNING,
+			"Could not load cached state into context %d: %d", physical_ctx->descriptor, status
+		);
+		physical_ctx->filled_size = 0;
+		shared_prefix_length = 0;
+	}
+	llmd_disk_cache_unmap(&mapping);
+
+	pthread_mutex_lock(&session->pool_lock);
+	llmd_prefix_index_update(
+		&session->prefix_index, &physical_ctx->prefix_entry,
+		physical_ctx->context_window, 0, physical_ctx->filled_size
+	);
+	pthread_mutex_unlock(&session->pool_lock);
+
+	return shared_prefix_length;
+}
+
+static void
+llmd_free_disk_write(
+	struct llmd_host* host,
+	struct llmd_disk_write* write
+) {
+	if (write == NULL) { return; }
+
+	llmd_free(host, write->tokens);
+	llmd_free(host, write->state);
+	llmd_free(host, write);
+}
+
+static void*
+llmd_disk_writer_main(void* userdata) {
+	struct llmd_session* session = userdata;
+
+	pthread_mutex_lock(&session->swap_lock);
+	while (true) {
+		struct llmd_disk_write* write = session->disk_writes_head;
+		if (write == NULL) {
+			// Pending writes are finished before stopping
+			if (session->stop_disk_writer) { break; }
+
+			pthread_cond_wait(&session->disk_write_cond, &session->swap_lock);
+			continue;
+		}
+
+		session->disk_writes_head = write->next;
+		if (session->disk_writes_head == NULL) {
+			session->disk_writes_tail = NULL;
+		}
+		--session->num_pending_disk_writes;
+		pthread_mutex_unlock(&session->swap_lock);
+
+		struct llmd_disk_cache_entry* entry;
+		char* tmp_path;
+		bool written = llmd_disk_cache_write(
+			&session->disk_cache,
+			write->tokens, write->num_tokens,
+			write->state, write->state_size,
+			&entry, &tmp_path
+		) == LLMD_OK;
+		llmd_free_disk_write(session->host, write);
+
+		pthread_mutex_lock(&session->swap_lock);
+		if (written) {
+			llmd_disk_cache_commit(&session->disk_cache, entry, tmp_path);
+		}
+	}
+	pthread_mutex_unlock(&session->swap_lock);
+
+	return NULL;
+}
+
+static enum llmd_error
+llmd_start_disk_writer(
+	struct llmd_session* session
+) {
+	if (pthread_cond_init(&session->disk_write_cond, NULL) != 0) {
+		return LLMD_ERR_OOM;
+	}
+
+	if (pthread_create(&session->disk_writer, NULL, llmd_disk_writer_main, session) != 0) {
+		pthread_cond_destroy(&session->disk_write_cond);
+		return LLMD_ERR_OOM;
+	}
+
+	session->has_disk_writer = true;
+	return LLMD_OK;
+}
+
+static void
+llmd_stop_disk_writer(
+	struct llmd_session* session
+) {
+	if (!session->has_disk_writer) { return; }
+
+	pthread_mutex_lock(&session->swap_lock);
+	session->stop_disk_writer = true;
+	pthread_cond_signal(&session->disk_write_cond);
+	pthread_mutex_unlock(&session->swap_lock);
+	pthread_join(session->disk_writer, NULL);
+
+	pthread_cond_destroy(&session->disk_write_cond);
+	session->has_disk_writer = false;
+}
+
+// Queue the window of a bound context for the disk writer if it extends what
+// the cache holds by enough tokens.
+// Only the state is copied here, the file is written in the background.
+// This is best effort.
+static void
+llmd_persist_physical_ctx(
+	struct llmd_session* session,
+	struct llmd_physical_context* physical_ctx
+) {
+	struct llmd_driver* driver = session->driver;
+	struct llmd_host* host = session->host;
+	unsigned int num_tokens = physical_ctx->filled_size;
+	unsigned int min_tokens = session->config.disk_cache_min_tokens > 0
+		? session->config.disk_cache_min_tokens
+		: LLMD_DEFAULT_DISK_CACHE_MIN_TOKENS;
+	if (num_tokens < min_tokens) { return; }
+
+	unsigned int shared;
+	pthread_mutex_lock(&session->swap_lock);
+	bool is_cached = llmd_disk_cache_find_longest(
+		&session->disk_cache, physical_ctx->context_window, num_tokens,
+		num_tokens - min_tokens, &shared
+	) != NULL;
+	bool is_full = session->num_pending_disk_writes >= LLMD_MAX_PENDING_DISK_WRITES;
+	pthread_mutex_unlock(&session->swap_lock);
+	if (is_cached || is_full) { return; }
+
+	size_t state_size = 0;
+	if (
+		driver->interface->save_state(
+			driver, physical_ctx->descriptor, NULL, &state_size
+		) != LLMD_ERR_BUF_SIZE
+	) {
+		return;
+	}
+
+	struct llmd_disk_write* write = llmd_malloc(host, sizeof(*write));
+	if (write == NULL) { return; }
+
+	*write = (struct llmd_disk_write) {
+		.tokens = llmd_malloc(host, num_tokens * sizeof(llmd_token_t)),
+		.num_tokens = num_tokens,
+		.state = llmd_malloc(host, state_size),
+		.state_size = state_size,
+	};
+	if (
+		write->tokens == NULL
+		|| write->state == NULL
+		|| driver->interface->save_state(
+			driver, physical_ctx->descriptor, write->state, &write->state_size
+		) != LLMD_OK
+	) {
+		llmd_free_disk_write(host, write);
+		return;
+	}
+	memcpy(write->tokens, physical_ctx->context_window, num_tokens * sizeof(llmd_token_t));
+
+	pthread_mutex_lock(&session->swap_lock);
+	if (session->disk_writes_tail != NULL) {
+		session->disk_writes_tail->next = write;
+	} else {
+		session->disk_writes_head = write;
+	}
+	session->disk_writes_tail = write;
+	++session->num_pending_disk_writes;
+	pthread_cond_signal(&session->disk_write_cond);
+	pthread_mutex_unlock(&session->swap_lock);
+}
+
+static void
+llmd_record_latency(
+	struct llmd_latency_histogram* histogram,
+	uint64_t latency_ns
+) {
+	unsigned int bucket = 0;
+	for (
+		uint64_t latency_us = latency_ns / 1000;
+		latency_us > 1 && bucket < LLMD_LATENCY_HISTOGRAM_SIZE - 1;
+		latency_us >>= 1
+	) {
+		++bucket;
+	}
+
+	++histogram->count;
+	++histogram->buckets[bucket];
+	histogram->total_ns += latency_ns;
+	if (latency_ns > histogram->max_ns) { histogram->max_ns = latency_ns; }
+}
+
+static enum llmd_error
+llmd_bind_virtual_ctx(
+	struct llmd_session* session,
+	struct llmd_context* virtual_ctx,
+	unsigned int num_tokens,
+	unsigned int* eval_offset_out
+) {
+	struct llmd_physical_context* chosen_context = NULL;
+	unsigned int shared_prefix_length = 0;
+	// Always leave at least one token to evaluate so there are logits
+	unsigned int lookup_length = num_tokens > 0 ? num_tokens - 1 : 0;
+	bool min_cost = virtual_ctx->type == LLMD_CONTEXT_MIN_COST;
+	float discard_weight = min_cost ? llmd_discard_weight(session) : 0.f;
+
+	// Only search and claim under the lock, driver calls happen outside
+	pthread_mutex_lock(&session->pool_lock);
+	struct llmd_physical_context* match;
+	unsigned int match_shared;
+	enum llmd_error status = min_cost
+		? llmd_find_min_cost_locked(
+			session, virtual_ctx, num_tokens, lookup_length, discard_weight,
+			&match, &match_shared
+		)
+		: llmd_find_match_locked(
+			session, virtual_ctx, lookup_length,
+			&match, &match_shared
+		);
+
+	if (status == LLMD_OK && match != NULL) {
+		unsigned int discard_size = match->prefix_entry.length - match_shared;
+
+		// Extending a context loses nothing.
+		// For MIN_UPLOAD, overwriting is also fine when it saves more than it
+		// throws away.
+		// MIN_COST has already weighed it.
+		bool use_match = discard_size == 0
+			|| (virtual_ctx->type == LLMD_CONTEXT_MIN_UPLOAD && match_shared >= discard_size)
+			|| min_cost;
+
+		if (use_match && llmd_claim_idle_physical_ctx_locked(session, virtual_ctx, match)) {
+			chosen_context = match;
+			shared_prefix_length = match_shared;
+		}
+	}
+	pthread_mutex_unlock(&session->pool_lock);
+
+	if (status != LLMD_OK) { return status; }
+
+	if (chosen_context == NULL) {
+		if (llmd_grow_pool(session, virtual_ctx, &chosen_context) == LLMD_OK) {
+			shared_prefix_length = 0;
+		} else {
+			pthread_mutex_lock(&session->pool_lock);
+			llmd_evict_physical_ctx_locked(
+				session, virtual_ctx, lookup_length,
+				&chosen_context, &shared_prefix_length
+			);
+			pthread_mutex_unlock(&session->pool_lock);
+
+			if (chosen_context == NULL) {
+				LLMD_CHECK_RETURN(
+					llmd_wait_for_physical_ctx(
+						session, virtual_ctx, lookup_length,
+						&chosen_context, &shared_prefix_length
+					)
+				);
+			}
+		}
+	}
+
+	unsigned int num_discarded = chosen_context->filled_size > shared_prefix_length
+		? chosen_context->filled_size - shared_prefix_length
+		: 0;
+
+	if (
+		session->config.swap_space_size > 0
+		&& session->driver->interface->save_state != NULL
+		&& session->driver->interface->load_state != NULL
+	) {
+		// Keep what is about to be overwritten and look for something better
+		unsigned int min_discard = session->config.min_swap_tokens > 0
+			? session->config.min_swap_tokens
+			: 1;
+		if (
+			chosen_context->filled_size >= shared_prefix_length + min_discard
+			&& llmd_swap_out_physical_ctx(session, chosen_context) == LLMD_OK
+		) {
+			num_discarded = 0;
+		}
+
+		shared_prefix_length = llmd_swap_in_physical_ctx(
+			session, chosen_context,
+			virtual_ctx->context_window, lookup_length,
+			shared_prefix_length
+		);
+	}
+
+	if (session->has_disk_cache) {
+		shared_prefix_length = llmd_restore_physical_ctx(
+			session, chosen_context,
+			virtual_ctx->context_window, lookup_length,
+			shared_prefix_length
+		);
+	}
+
+	pthread_mutex_lock(&session->pool_lock);
+	chosen_context->tokens_saved += shared_prefix_length;
+	pthread_mutex_unlock(&session->pool_lock);
+
+	virtual_ctx->physical_ctx = chosen_context;
+	*eval_offset_out = shared_prefix_length;
+
+	++virtual_ctx->stats.num_binds;
+	virtual_ctx->stats.num_tokens_reused += shared_prefix_length;
+
+	pthread_mutex_lock(&session->stats_lock);
+	++session->stats.num_binds[virtual_ctx->type];
+	session->stats.num_prefix_hits += shared_prefix_length > 0;
+	session->stats.num_tokens_reused += shared_prefix_length;
+	session->stats.num_tokens_uploaded += num_tokens - shared_prefix_length;
+	session->stats.num_tokens_discarded += num_discarded;
+	pthread_mutex_unlock(&session->stats_lock);
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_unbind_virtual_ctx(
+	struct llmd_session* session,
+	struct llmd_context* virtual_ctx
+) {
+	struct llmd_physical_context* physical_ctx = virtual_ctx->physical_ctx;
+
+	if (physical_ctx) {
+		virtual_ctx->physical_ctx = NULL;
+		llmd_release_physical_ctx(session, physical_ctx);
+	}
+
+	llmd_free_buffer(session->host, virtual_ctx->context_window);
+	virtual_ctx->context_window = NULL;
+
+	return LLMD_OK;
+}
+
+// Lookups and uploads read the first num_tokens of the window from a flat copy
+static enum llmd_error
+llmd_flatten_virtual_ctx(
+	struct llmd_session* session,
+	struct llmd_context* virtual_ctx,
+	unsigned int num_tokens
+) {
+	llmd_buffer(llmd_token_t) window = virtual_ctx->context_window;
+	if (llmd_buffer_size(window) < num_tokens || window == NULL) {
+		window = llmd_resize_buffer(
+			session->host, window, num_tokens > 0 ? num_tokens : 1
+		);
+		if (window == NULL) { return LLMD_ERR_OOM; }
+		virtual_ctx->context_window = window;
+	}
+
+	// Shared chunks are never written so only the owner has to be excluded
+	unsigned int length = virtual_ctx->tokens.length;
+	llmd_token_seq_read(
+		&virtual_ctx->tokens, 0,
+		num_tokens < length ? num_tokens : length,
+		window
+	);
+
+	return LLMD_OK;
+}
+
+// Tells apart models whose states cannot be exchanged
+// The upper bound of a state from a throwaway context
+static enum llmd_error
+llmd_probe_max_state_size(
+	struct llmd_session* session,
+	size_t* size_out
+) {
+	struct llmd_driver* driver = session->driver;
+	int descriptor;
+
+	pthread_mutex_lock(&session->driver_lock);
+	enum llmd_error status = driver->interface->create_context(driver, &descriptor);
+	pthread_mutex_unlock(&session->driver_lock);
+	if (status != LLMD_OK) { return status; }
+
+	*size_out = 0;
+	status = driver->interface->save_state(driver, descriptor, NULL, size_out);
+
+	pthread_mutex_lock(&session->driver_lock);
+	driver->interface->destroy_context(driver, descriptor);
+	pthread_mutex_unlock(&session->driver_lock);
+
+	if (status == LLMD_ERR_BUF_SIZE) { return LLMD_OK; }
+	return status == LLMD_OK ? LLMD_ERR_INVALID : status;
+}
+
+static uint64_t
+llmd_model_fingerprint(struct llmd_session* session) {
+	const struct llmd_model_info* info = &session->model_info;
+	const struct llmd_vocab_table* vocab = &session->vocab_table;
+	const char* model_id = session->config.disk_cache_model_id;
+	// The state size tells apart models of different shapes
+	uint64_t fields[] = {
+		info->bos_token, info->eos_token, info->nl_token,
+		info->vocab_size, info->max_context_length,
+		session->max_state_size,
+	};
+
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const unsigned char* bytes = (const unsigned char*)fields;
+	for (size_t i = 0; i < sizeof(fields); ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+
+	bytes = (const unsigned char*)vocab->text;
+	for (size_t i = 0; i < vocab->offsets[vocab->num_tokens]; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+
+	for (size_t i = 0; model_id != NULL && model_id[i] != '\0'; ++i) {
+		hash = (hash ^ (unsigned char)model_id[i]) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+enum llmd_error
+llmd_create_session(
+	struct llmd_host* host,
+	struct llmd_driver* driver,
+	const struct llmd_session_config* config,
+	struct llmd_session** session_out
+) {
+LLMD_TRY
+	if (host == NULL) {
+		host = &llmd_default_host;
+	}
+
+	if (config == NULL) {
+		config = &llmd_default_session_config;
+	}
+
+	struct llmd_session* session = NULL;
+	bool pool_lock_initialized = false;
+	bool driver_lock_initialized = false;
+	bool swap_lock_initialized = false;
+	bool ticket_lock_initialized = false;
+	bool ticket_cond_initialized = false;
+	bool token_cache_lock_initialized = false;
+	bool token_store_lock_initialized = false;
+	bool stats_lock_initialized = false;
+	bool caches_initialized = false;
+	LLMD_CHECKED_MALLOC(session, host, sizeof(struct llmd_session));
+
+	*session = (struct llmd_session) {
+		.host = host,
+		.driver = driver,
+		.config = *config,
+	};
+
+	LLMD_CHECK_THROW(driver->interface->get_model_info(driver, &session->model_info));
+	LLMD_CHECK_THROW(
+		llmd_build_vocab_table(
+			host, driver, session->model_info.vocab_size, &session->vocab_table
+		)
+	);
+	LLMD_CHECK_THROW(llmd_prefix_index_init(host, &session->prefix_index));
+
+	if (pthread_mutex_init(&session->pool_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	pool_lock_initialized = true;
+
+	if (pthread_mutex_init(&session->driver_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	driver_lock_initialized = true;
+
+	if (pthread_mutex_init(&session->swap_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	swap_lock_initialized = true;
+
+	if (pthread_mutex_init(&session->ticket_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	ticket_lock_initialized = true;
+
+	if (pthread_cond_init(&session->ticket_cond, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	ticket_cond_initialized = true;
+
+	if (pthread_mutex_init(&session->token_cache_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	token_cache_lock_initialized = true;
+
+	if (pthread_mutex_init(&session->token_store_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	token_store_lock_initialized = true;
+
+	if (pthread_mutex_init(&session->stats_lock, NULL) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+	stats_lock_initialized = true;
+
+	atomic_init(&session->completion_fd, -1);
+	llmd_state_cache_init(host, config->swap_space_size, &session->state_cache);
+	llmd_token_cache_init(host, config->tokenize_cache_size, &session->token_cache);
+	llmd_token_store_init(host, &session->token_store);
+	caches_initialized = true;
+
+	if (config->disk_cache_path != NULL) {
+		if (config->disk_cache_model_id == NULL) {
+			llmd_log(host, LLMD_LOG_ERROR, "disk_cache_model_id is required with disk_cache_path");
+			LLMD_THROW(LLMD_ERR_INVALID);
+		}
+
+		if (
+			driver->interface->save_state != NULL
+			&& driver->interface->load_state != NULL
+		) {
+			LLMD_CHECK_THROW(llmd_probe_max_state_size(session, &session->max_state_size));
+			LLMD_CHECK_THROW(
+				llmd_disk_cache_init(
+					host, config->disk_cache_path, config->disk_cache_size,
+					llmd_model_fingerprint(session), &session->disk_cache
+				)
+			);
+			session->has_disk_cache = true;
+			LLMD_CHECK_THROW(llmd_start_disk_writer(session));
+		} else {
+			llmd_log(host, LLMD_LOG_WARNING, "Driver cannot save states, disk cache is disabled");
+		}
+	}
+
+	if (config->max_batch_tokens > 0) {
+		LLMD_CHECK_THROW(
+			llmd_scheduler_init(
+				host, driver,
+				config->max_batch_tokens, config->max_batch_wait_us,
+				&session->scheduler
+			)
+		);
+		session->has_scheduler = true;
+	}
+
+	*session_out = session;
+	return LLMD_OK;
+LLMD_EXCEPT_BEGIN
+	if (session != NULL) {
+		llmd_stop_disk_writer(session);
+		if (session->has_disk_cache) {
+			llmd_disk_cache_cleanup(&session->disk_cache);
+		}
+		if (caches_initialized) {
+			llmd_token_store_cleanup(&session->token_store);
+			llmd_token_cache_cleanup(&session->token_cache);
+			llmd_state_cache_cleanup(&session->state_cache);
+		}
+		if (stats_lock_initialized) { pthread_mutex_destroy(&session->stats_lock); }
+		if (token_store_lock_initialized) { pthread_mutex_destroy(&session->token_store_lock); }
+		if (token_cache_lock_initialized) { pthread_mutex_destroy(&session->token_cache_lock); }
+		if (ticket_cond_initialized) { pthread_cond_destroy(&session->ticket_cond); }
+		if (ticket_lock_initialized) { pthread_mutex_destroy(&session->ticket_lock); }
+		if (swap_lock_initialized) { pthread_mutex_destroy(&session->swap_lock); }
+		if (driver_lock_initialized) { pthread_mutex_destroy(&session->driver_lock); }
+		if (pool_lock_initialized) { pthread_mutex_destroy(&session->pool_lock); }
+		llmd_prefix_index_cleanup(&session->prefix_index);
+		llmd_free_vocab_table(host, &session->vocab_table);
+	}
+	llmd_free(host, session);
+LLMD_EXCEPT_END
+}
+
+enum llmd_error
+llmd_destroy_session(
+	struct llmd_session* session
+) {
+	// A batch in flight may still use pooled contexts
+	if (session->has_scheduler) {
+		llmd_scheduler_cleanup(&session->scheduler);
+	}
+
+	struct llmd_physical_context* itr = session->free_contexts;
+	while (itr != NULL) {
+		struct llmd_physical_context* next = itr->next;
+		llmd_destroy_physical_ctx(session, itr);
+		itr = next;
+	}
+
+	llmd_prefix_index_cleanup(&session->prefix_index);
+
+	llmd_state_cache_cleanup(&session->state_cache);
+	// Waits for pending writes
+	llmd_stop_disk_writer(session);
+	if (session->has_disk_cache) {
+		llmd_disk_cache_cleanup(&session->disk_cache);
+	}
+	llmd_token_cache_cleanup(&session->token_cache);
+	llmd_token_store_cleanup(&session->token_store);
+	llmd_free_vocab_table(session->host, &session->vocab_table);
+	pthread_mutex_destroy(&session->pool_lock);
+	pthread_mutex_destroy(&session->driver_lock);
+	pthread_mutex_destroy(&session->swap_lock);
+	pthread_cond_destroy(&session->ticket_cond);
+	pthread_mutex_destroy(&session->ticket_lock);
+	pthread_mutex_destroy(&session->token_cache_lock);
+	pthread_mutex_destroy(&session->token_store_lock);
+	pthread_mutex_destroy(&session->stats_lock);
+#ifdef __linux__
+	int completion_fd = atomic_load(&session->completion_fd);
+	if (completion_fd >= 0) {
+		close(completion_fd);
+	}
+#endif
+	llmd_free(session->host, session);
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_admission_stats(
+	struct llmd_session* session,
+	struct llmd_admission_stats* stats_out
+) {
+	pthread_mutex_lock(&session->pool_lock);
+	*stats_out = session->admission_stats;
+	stats_out->num_pooled_contexts = session->num_pooled_contexts;
+	pthread_mutex_unlock(&session->pool_lock);
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_batch_stats(
+	struct llmd_session* session,
+	struct llmd_batch_stats* stats_out
+) {
+	if (session->has_scheduler) {
+		llmd_scheduler_get_stats(&session->scheduler, stats_out);
+	} else {
+		*stats_out = (struct llmd_batch_stats) { 0 };
+	}
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_tokenize_stats(
+	struct llmd_session* session,
+	struct llmd_tokenize_stats* stats_out
+) {
+	pthread_mutex_lock(&session->token_cache_lock);
+	*stats_out = (struct llmd_tokenize_stats) {
+		.num_hits = session->token_cache.num_hits,
+		.num_misses = session->token_cache.num_misses,
+		.num_evictions = session->token_cache.num_evictions,
+		.num_entries = session->token_cache.num_entries,
+		.cache_size = session->token_cache.size,
+	};
+	pthread_mutex_unlock(&session->token_cache_lock);
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_disk_cache_stats(
+	struct llmd_session* session,
+	struct llmd_disk_cache_stats* stats_out
+) {
+	*stats_out = (struct llmd_disk_cache_stats) { 0 };
+	if (!session->has_disk_cache) { return LLMD_OK; }
+
+	pthread_mutex_lock(&session->swap_lock);
+	*stats_out = (struct llmd_disk_cache_stats) {
+		.num_hits = session->disk_cache.num_hits,
+		.num_writes = session->disk_cache.num_writes,
+		.num_evictions = session->disk_cache.num_evictions,
+		.num_rejected = session->disk_cache.num_rejected,
+		.num_tokens_restored = session->disk_cache.num_tokens_restored,
+		.num_entries = session->disk_cache.num_entries,
+		.cache_size = session->disk_cache.size,
+	};
+	pthread_mutex_unlock(&session->swap_lock);
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_session_stats(
+	struct llmd_session* session,
+	struct llmd_session_stats* stats_out
+) {
+	pthread_mutex_lock(&session->stats_lock);
+	*stats_out = session->stats;
+	pthread_mutex_unlock(&session->stats_lock);
+
+	llmd_get_admission_stats(session, &stats_out->admission);
+	llmd_get_batch_stats(session, &stats_out->batch);
+	llmd_get_tokenize_stats(session, &stats_out->tokenize);
+	llmd_get_disk_cache_stats(session, &stats_out->disk_cache);
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_model_info(
+	struct llmd_session* session,
+	struct llmd_model_info* info_out
+) {
+	*info_out = session->model_info;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_get_vocab_table(
+	struct llmd_session* session,
+	const struct llmd_vocab_table** table_out
+) {
+	*table_out = &session->vocab_table;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_create_context(
+	struct llmd_session* session,
+	enum llmd_context_type context_type,
+	struct llmd_context** context_out
+) {
+LLMD_TRY
+	struct llmd_host* host = session->host;
+
+	struct llmd_context* context = NULL;
+
+	LLMD_CHECKED_MALLOC(context, host, sizeof(struct llmd_context));
+
+	*context = (struct llmd_context) {
+		.session = session,
+		.type = context_type,
+	};
+
+	if (context_type == LLMD_CONTEXT_DIRECT) {
+		LLMD_CHECK_THROW(
+			llmd_create_physical_ctx(session, &context->physical_ctx)
+		);
+
+		// Bound for its whole life
+		context->stats.num_binds = 1;
+		pthread_mutex_lock(&session->stats_lock);
+		++session->stats.num_binds[LLMD_CONTEXT_DIRECT];
+		pthread_mutex_unlock(&session->stats_lock);
+	}
+
+	*context_out = context;
+
+	return LLMD_OK;
+LLMD_EXCEPT_BEGIN
+	llmd_free(host, context);
+LLMD_EXCEPT_END
+}
+
+enum llmd_error
+llmd_get_context_stats(
+	struct llmd_context* context,
+	struct llmd_context_stats* stats_out
+) {
+	*stats_out = context->stats;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_destroy_context(
+	struct llmd_context* context
+) {
+	struct llmd_session* session = context->session;
+	struct llmd_host* host = session->host;
+
+	if (context->generating) {
+		llmd_log(host, LLMD_LOG_WARNING, "Context %p is still generating", (void*)context);
+		if (context->type != LLMD_CONTEXT_DIRECT) {
+			llmd_unbind_virtual_ctx(session, context);
+		}
+		context->generating = false;
+	}
+
+	if (context->type == LLMD_CONTEXT_DIRECT) {
+		// Recycle the context into the pool if there is room
+		struct llmd_physical_context* physical_context = context->physical_ctx;
+		unsigned int max_pooled_contexts = session->config.max_pooled_contexts;
+		bool has_room;
+
+		pthread_mutex_lock(&session->pool_lock);
+		has_room = max_pooled_contexts == 0
+			|| session->num_pooled_contexts < max_pooled_contexts;
+		if (has_room) { ++session->num_pooled_contexts; }
+		pthread_mutex_unlock(&session->pool_lock);
+
+		// A sliding window already has one
+		bool has_window = has_room
+			&& llmd_reserve_window(session, physical_context, 0) == LLMD_OK;
+
+		if (!has_window) {
+			if (has_room) {
+				pthread_mutex_lock(&session->pool_lock);
+				--session->num_pooled_contexts;
+				pthread_mutex_unlock(&session->pool_lock);
+			}
+
+			llmd_destroy_physical_ctx(session, physical_context);
+		} else {
+			// The window content is unknown so it is indexed as empty
+			physical_context->filled_size = 0;
+
+			pthread_mutex_lock(&session->pool_lock);
+			physical_context->virtual_ctx = NULL;
+			llmd_prefix_index_add(&session->prefix_index, &physical_context->prefix_entry);
+			llmd_offer_physical_ctx_locked(session, physical_context);
+			llmd_push_free_context_locked(session, physical_context);
+			pthread_mutex_unlock(&session->pool_lock);
+		}
+	}
+
+	pthread_mutex_lock(&session->token_store_lock);
+	llmd_token_seq_release(&session->token_store, &context->tokens);
+	pthread_mutex_unlock(&session->token_store_lock);
+
+	llmd_free_buffer(host, context->token_buf);
+	llmd_free_buffer(host, context->context_window);
+	llmd_free(host, context);
+
+	return LLMD_OK;
+}
+
+struct llmd_session*
+llmd_get_session_of_context(
+	struct llmd_context* context
+) {
+	return context->session;
+}
+
+static enum llmd_error
+llmd_copy_physical_ctx(
+	struct llmd_session* session,
+	struct llmd_physical_context* source,
+	struct llmd_physical_context* dest,
+	unsigned int num_tokens
+) {
+	struct llmd_driver* driver = session->driver;
+	struct llmd_host* host = session->host;
+
+	if (driver->interface->copy_context != NULL) {
+		return driver->interface->copy_context(
+			driver, source->descriptor, dest->descriptor, num_tokens
+		);
+	}
+
+	if (driver->interface->save_state == NULL || driver->interface->load_state == NULL) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	// Go through host memory
+	size_t state_size = 0;
+	enum llmd_error status = driver->interface->save_state(
+		driver, source->descriptor, NULL, &state_size
+	);
+	if (status != LLMD_ERR_BUF_SIZE) {
+		return status == LLMD_OK ? LLMD_ERR_INVALID : status;
+	}
+
+	void* state = llmd_malloc(host, state_size);
+	if (state == NULL) { return LLMD_ERR_OOM; }
+
+	status = driver->interface->save_state(driver, source->descriptor, state, &state_size);
+	if (status == LLMD_OK) {
+		status = driver->interface->load_state(driver, dest->descriptor, state, state_size);
+	}
+
+	llmd_free(host, state);
+	return status;
+}
+
+// Copy the KV state of the parent into an idle pooled context so the child
+// finds it on its first bind.
+// This is best effort, on failure the child evaluates its window again.
+static void
+llmd_materialize_fork(
+	struct llmd_session* session,
+	struct llmd_context* parent,
+	struct llmd_context* child
+) {
+	struct llmd_physical_context* source = parent->physical_ctx;
+	struct llmd_physical_context* dest = NULL;
+	unsigned int shared_prefix_length = source != NULL ? source->filled_size : 0;
+	unsigned int dest_shared_prefix_length;
+	bool source_claimed = false;
+
+	if (llmd_flatten_virtual_ctx(session, child, child->tokens.length) != LLMD_OK) {
+		return;
+	}
+
+	if (source == NULL) {
+		pthread_mutex_lock(&session->pool_lock);
+		enum llmd_error status = llmd_find_match_locked(
+			session, child, child->tokens.length,
+			&source, &shared_prefix_length
+		);
+		if (
+			status == LLMD_OK
+			&& source != NULL
+			&& llmd_claim_idle_physical_ctx_locked(session, child, source)
+		) {
+			source_claimed = true;
+		} else {
+			source = NULL;
+		}
+		pthread_mutex_unlock(&session->pool_lock);
+	}
+
+	if (source == NULL || shared_prefix_length == 0) { goto end; }
+
+	if (llmd_grow_pool(session, child, &dest) != LLMD_OK) {
+		pthread_mutex_lock(&session->pool_lock);
+		llmd_evict_physical_ctx_locked(
+			session, child, child->tokens.length,
+			&dest, &dest_shared_prefix_length
+		);
+		pthread_mutex_unlock(&session->pool_lock);
+	}
+
+	if (dest == NULL) { goto end; }
+
+	if (
+		llmd_reserve_window(session, dest, shared_prefix_length) == LLMD_OK
+		&& llmd_copy_physical_ctx(session, source, dest, shared_prefix_length) == LLMD_OK
+	) {
+		memcpy(
+			dest->context_window,
+			source->context_window,
+			shared_prefix_length * sizeof(llmd_token_t)
+		);
+		dest->filled_size = shared_prefix_length;
+	} else {
+		// Whatever the driver holds now is unknown
+		dest->filled_size = 0;
+	}
+
+	pthread_mutex_lock(&session->pool_lock);
+	llmd_prefix_index_update(
+		&session->prefix_index, &dest->prefix_entry,
+		dest->context_window, 0, dest->filled_size
+	);
+	pthread_mutex_unlock(&session->pool_lock);
+
+	llmd_release_physical_ctx(session, dest);
+
+end:
+	if (source_claimed) {
+		llmd_release_physical_ctx(session, source);
+	}
+
+	llmd_free_buffer(session->host, child->context_window);
+	child->context_window = NULL;
+}
+
+enum llmd_error
+llmd_fork_context(
+	struct llmd_context* ctx,
+	struct llmd_context** child_out
+) {
+LLMD_TRY
+	struct llmd_session* session = ctx->session;
+	struct llmd_context* child = NULL;
+
+	LLMD_CHECK_THROW(llmd_create_context(session, ctx->type, &child));
+
+	if (ctx->sliding_window) {
+		LLMD_CHECK_THROW(
+			llmd_set_sliding_window(child, true, ctx->window_keep, ctx->window_discard)
+		);
+		child->num_dropped = ctx->num_dropped;
+	}
+
+	if (ctx->type == LLMD_CONTEXT_DIRECT) {
+		unsigned int num_tokens = ctx->physical_ctx->filled_size;
+
+		if (ctx->physical_ctx->context_window != NULL) {
+			LLMD_CHECK_THROW(llmd_reserve_window(session, child->physical_ctx, num_tokens));
+			memcpy(
+				child->physical_ctx->context_window,
+				ctx->physical_ctx->context_window,
+				num_tokens * sizeof(llmd_token_t)
+			);
+		}
+
+		if (num_tokens > 0) {
+			LLMD_CHECK_THROW(
+				llmd_copy_physical_ctx(
+					session, ctx->physical_ctx, child->physical_ctx, num_tokens
+				)
+			);
+		}
+
+		child->physical_ctx->filled_size = num_tokens;
+	} else {
+		pthread_mutex_lock(&session->token_store_lock);
+		llmd_status = llmd_token_seq_copy(
+			&session->token_store, &child->tokens, &ctx->tokens
+		);
+
+		// A bound context has its latest tokens in the physical window
+		struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+		if (llmd_status == LLMD_OK && physical_ctx != NULL) {
+			unsigned int num_tokens = physical_ctx->filled_size;
+			unsigned int dirty_from = ctx->dirty_from < num_tokens
+				? ctx->dirty_from
+				: num_tokens;
+			llmd_status = llmd_token_seq_write(
+				&session->token_store, &child->tokens, dirty_from,
+				physical_ctx->context_window + dirty_from, num_tokens - dirty_from
+			);
+		}
+		pthread_mutex_unlock(&session->token_store_lock);
+		LLMD_CHECK_THROW(llmd_status);
+
+		llmd_materialize_fork(session, ctx, child);
+	}
+
+	*child_out = child;
+	return LLMD_OK;
+LLMD_EXCEPT_BEGIN
+	if (child != NULL) {
+		llmd_destroy_context(child);
+	}
+LLMD_EXCEPT_END
+}
 
 enum llmd_error
 llmd_tokenize(
@@ -427,185 +1992,1061 @@ llmd_tokenize(
 	const llmd_token_t** tokens_out,
 	unsigned int* num_tokens_out
 ) {
-	struct llmd_driver* driver = ctx->session->driver;
-	struct llmd_host* host = ctx->session->host;
+	struct llmd_session* session = ctx->session;
+	struct llmd_driver* driver = session->driver;
+	struct llmd_host* host = session->host;
+
+	bool use_cache = session->config.tokenize_cache_size > 0;
+	uint64_t hash = 0;
+	unsigned int num_tokens;
+	if (use_cache) {
+		hash = llmd_token_cache_hash(string, num_chars);
+
+		enum llmd_error status = LLMD_OK;
+		pthread_mutex_lock(&session->token_cache_lock);
+		const struct llmd_token_cache_entry* entry = llmd_token_cache_lookup(
+			&session->token_cache, hash, string, num_chars
+		);
+		if (entry != NULL) {
+			num_tokens = entry->num_tokens;
+			if (llmd_buffer_size(ctx->token_buf) < num_tokens) {
+				llmd_buffer(llmd_token_t) new_token_buf = llmd_resize_buffer(
+					host, ctx->token_buf, num_tokens
+				);
+				if (new_token_buf != NULL) {
+					ctx->token_buf = new_token_buf;
+				} else {
+					status = LLMD_ERR_OOM;
+				}
+			}
+
+			if (status == LLMD_OK) {
+				memcpy(ctx->token_buf, entry->tokens, num_tokens * sizeof(llmd_token_t));
+			}
+		}
+		pthread_mutex_unlock(&session->token_cache_lock);
+
+		if (entry != NULL) {
+			if (status != LLMD_OK) { return status; }
+			goto end;
+		}
+	}
+
+	num_tokens = llmd_buffer_size(ctx->token_buf);
+	pthread_mutex_lock(&ctx->session->driver_lock);
+	enum llmd_error status = driver->interface->tokenize(
+		driver,
+		string, num_chars,
+		ctx->token_buf, &num_tokens
+	);
+
+	if (status == LLMD_ERR_BUF_SIZE) {
+		llmd_buffer(llmd_token_t) new_token_buf = llmd_resize_buffer(
+			host, ctx->token_buf, num_tokens
+		);
+
+		if (new_token_buf == NULL) {
+			status = LLMD_ERR_OOM;
+		} else {
+			ctx->token_buf = new_token_buf;
+			status = driver->interface->tokenize(
+				driver,
+				string, num_chars,
+				ctx->token_buf, &num_tokens
+			);
+		}
+	}
+	pthread_mutex_unlock(&ctx->session->driver_lock);
+
+	if (status != LLMD_OK) { return status; }
+
+	if (use_cache) {
+		// A failed insert only costs a future miss
+		pthread_mutex_lock(&session->token_cache_lock);
+		llmd_token_cache_insert(
+			&session->token_cache, hash,
+			string, num_chars,
+			ctx->token_buf, num_tokens
+		);
+		pthread_mutex_unlock(&session->token_cache_lock);
+	}
+
+end:
+	if (tokens_out) {
+		*tokens_out = ctx->token_buf;
+	}
+
+	if (num_tokens_out) {
+		*num_tokens_out = num_tokens;
+	}
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_decode_token(
+	struct llmd_context* ctx,
+	llmd_token_t token,
+	const char** string_out,
+	unsigned int* num_chars_out
+) {
+	const struct llmd_vocab_table* table = &ctx->session->vocab_table;
+	if (token >= table->num_tokens) { return LLMD_ERR_INVALID; }
+
+	if (string_out) {
+		*string_out = table->text + table->offsets[token];
+	}
+
+	if (num_chars_out) {
+		*num_chars_out = table->offsets[token + 1] - table->offsets[token] - 1;
+	}
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_set_sliding_window(
+	struct llmd_context* ctx,
+	bool enabled,
+	unsigned int num_keep,
+	unsigned int num_discard
+) {
+	struct llmd_session* session = ctx->session;
+	struct llmd_host* host = session->host;
+
+	if (ctx->generating || num_keep >= session->model_info.max_context_length) {
+		return LLMD_ERR_INVALID;
+	}
+
+	// A direct context needs its tokens to evaluate them again after a shift
+	struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+	if (
+		enabled
+		&& ctx->type == LLMD_CONTEXT_DIRECT
+		&& physical_ctx->context_window == NULL
+	) {
+		if (physical_ctx->filled_size > 0) {
+			llmd_log(host, LLMD_LOG_ERROR, "Context %p already has unknown tokens", (void*)ctx);
+			return LLMD_ERR_INVALID;
+		}
+
+		LLMD_CHECK_RETURN(llmd_reserve_window(session, physical_ctx, 0));
+	}
+
+	if (enabled && session->driver->interface->shift_context == NULL) {
+		llmd_log(
+			host, LLMD_LOG_WARNING,
+			"The driver cannot shift contexts, context %p will evaluate what it keeps again on every shift",
+			(void*)ctx
+		);
+	}
+
+	ctx->sliding_window = enabled;
+	ctx->window_keep = num_keep;
+	ctx->window_discard = num_discard;
+	ctx->num_dropped = 0;
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_begin_generate(
+	struct llmd_context* ctx,
+	struct llmd_generate_handle** generate_handle_out
+) {
+	struct llmd_session* session = ctx->session;
+	struct llmd_host* host = session->host;
+
+	if (ctx->generating) {
+		llmd_log(host, LLMD_LOG_ERROR, "Context %p is already generating", (void*)ctx);
+		return LLMD_ERR_INVALID;
+	}
+
+	ctx->generating = true;
+	*generate_handle_out = (void*)ctx;
+
+	return LLMD_OK;
+}
+
+// Translate the offset of a generate call into the window and drop tokens if
+// the call would overflow it.
+// A virtual context is bound when a shift happens.
+// Evaluation restarts from eval_offset_out, before the new tokens if the
+// driver cannot shift its state.
+static enum llmd_error
+llmd_slide_window(
+	struct llmd_context* ctx,
+	unsigned int num_tokens,
+	unsigned int* offset_inout,
+	unsigned int* eval_offset_out
+) {
+	struct llmd_session* session = ctx->session;
+	struct llmd_host* host = session->host;
+	struct llmd_driver* driver = session->driver;
+	unsigned int max_context_length = session->model_info.max_context_length;
+	unsigned int num_keep = ctx->window_keep;
+	unsigned int offset = *offset_inout;
+
+	if (offset <= num_keep) {
+		ctx->num_dropped = 0;
+	} else if (offset < num_keep + ctx->num_dropped) {
+		llmd_log(host, LLMD_LOG_ERROR, "Context %p dropped token %u", (void*)ctx, offset);
+		return LLMD_ERR_INVALID;
+	} else {
+		offset -= ctx->num_dropped;
+	}
+
+	*offset_inout = offset;
+	*eval_offset_out = offset;
+	if (offset + num_tokens <= max_context_length) { return LLMD_OK; }
+
+	if (num_keep + num_tokens > max_context_length) {
+		llmd_log(host, LLMD_LOG_ERROR, "Context %p will overflow", (void*)ctx);
+		return LLMD_ERR_INVALID;
+	}
+
+	struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+	unsigned int num_evaluated;
+	if (physical_ctx == NULL) {
+		if (offset > ctx->tokens.length) { return LLMD_ERR_INVALID; }
+
+		// Bind to whatever holds the current window so it can be shifted
+		LLMD_CHECK_RETURN(llmd_flatten_virtual_ctx(session, ctx, offset));
+		LLMD_CHECK_RETURN(llmd_bind_virtual_ctx(session, ctx, offset + 1, &num_evaluated));
+		physical_ctx = ctx->physical_ctx;
+		ctx->dirty_from = offset;
+		LLMD_CHECK_RETURN(llmd_reserve_window(session, physical_ctx, offset));
+		memcpy(
+			physical_ctx->context_window + num_evaluated,
+			ctx->context_window + num_evaluated,
+			(offset - num_evaluated) * sizeof(llmd_token_t)
+		);
+	} else {
+		if (offset > physical_ctx->filled_size) { return LLMD_ERR_INVALID; }
+
+		// Anything past the offset is about to be overwritten
+		num_evaluated = offset;
+	}
+
+	unsigned int num_droppable = offset - num_keep;
+	unsigned int num_needed = offset + num_tokens - max_context_length;
+	unsigned int num_discard = ctx->window_discard > 0
+		? ctx->window_discard
+		: num_droppable / 2;
+	if (num_discard < num_needed) { num_discard = num_needed; }
+	if (num_discard > num_droppable) { num_discard = num_droppable; }
+
+	llmd_token_t* window = physical_ctx->context_window;
+	memmove(
+		window + num_keep,
+		window + num_keep + num_discard,
+		(num_droppable - num_discard) * sizeof(llmd_token_t)
+	);
+	if (ctx->dirty_from > num_keep) { ctx->dirty_from = num_keep; }
+
+	enum llmd_error shift_status = LLMD_ERR_NOT_SUPPORTED;
+	if (
+		num_evaluated >= num_keep + num_discard
+		&& driver->interface->shift_context != NULL
+	) {
+		shift_status = driver->interface->shift_context(
+			driver, physical_ctx->descriptor,
+			num_keep, num_discard, num_evaluated
+		);
+		if (shift_status != LLMD_OK) {
+			llmd_log(
+				host, LLMD_LOG_WARNING,
+				"Could not shift context %p: %s",
+				(void*)ctx, llmd_error_to_str(shift_status)
+			);
+		}
+	}
+
+	if (shift_status == LLMD_OK) {
+		physical_ctx->filled_size = num_evaluated - num_discard;
+	} else {
+		// Evaluate what was moved again
+		physical_ctx->filled_size = num_evaluated < num_keep ? num_evaluated : num_keep;
+	}
+
+	if (ctx->type != LLMD_CONTEXT_DIRECT) {
+		unsigned int num_unchanged = physical_ctx->prefix_entry.length < num_keep
+			? physical_ctx->prefix_entry.length
+			: num_keep;
+		if (num_unchanged > num_evaluated) { num_unchanged = num_evaluated; }
+
+		pthread_mutex_lock(&session->pool_lock);
+		llmd_prefix_index_update(
+			&session->prefix_index, &physical_ctx->prefix_entry,
+			window, num_unchanged, physical_ctx->filled_size
+		);
+		pthread_mutex_unlock(&session->pool_lock);
+	}
+
+	*offset_inout = offset - num_discard;
+	*eval_offset_out = physical_ctx->filled_size;
+	ctx->num_dropped += num_discard;
+	++ctx->stats.num_window_shifts;
+	ctx->stats.num_tokens_dropped += num_discard;
+
+	return LLMD_OK;
+}
+
+static bool
+llmd_wants_every_row(const struct llmd_logits_output* output) {
+	return output != NULL
+		&& (output->mode == LLMD_LOGITS_ALL || output->mode == LLMD_LOGITS_POSITIONS);
+}
+
+// Rows of logits are only wanted for the caller's tokens so anything which
+// has to be evaluated again before them is done in a separate call
+static enum llmd_error
+llmd_catch_up_generate(
+	struct llmd_context* ctx,
+	unsigned int offset,
+	struct llmd_driver_generate_item* item
+) {
+	if (!llmd_wants_every_row(item->output) || item->offset >= offset) {
+		return LLMD_OK;
+	}
+
+	struct llmd_session* session = ctx->session;
+	struct llmd_driver* driver = session->driver;
+	struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+	unsigned int num_behind = offset - item->offset;
+
+	enum llmd_error status = driver->interface->generate(
+		driver,
+		item->context_descriptor,
+		item->tokens, num_behind, item->offset,
+		NULL
+	);
+	physical_ctx->filled_size = status == LLMD_OK ? offset : item->offset;
+
+	if (ctx->type != LLMD_CONTEXT_DIRECT) {
+		pthread_mutex_lock(&session->pool_lock);
+		llmd_prefix_index_update(
+			&session->prefix_index, &physical_ctx->prefix_entry,
+			physical_ctx->context_window,
+			item->offset, physical_ctx->filled_size
+		);
+		pthread_mutex_unlock(&session->pool_lock);
+	}
+
+	if (status != LLMD_OK) { return status; }
+
+	ctx->stats.num_tokens_evaluated += num_behind;
+	item->tokens += num_behind;
+	item->num_tokens -= num_behind;
+	item->offset = offset;
+
+	return LLMD_OK;
+}
+
+// Validate a generate call and work out what the driver has to evaluate
+static enum llmd_error
+llmd_prepare_generate(
+	struct llmd_context* ctx,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output,
+	struct llmd_driver_generate_item* item_out
+) {
+	struct llmd_session* session = ctx->session;
+	struct llmd_host* host = session->host;
+
+	ctx->generate_start_ns = llmd_monotonic_ns();
+
+	if (!ctx->generating) {
+		llmd_log(host, LLMD_LOG_ERROR, "Context %p is not generating", (void*)ctx);
+		return LLMD_ERR_INVALID;
+	}
+
+	unsigned int eval_from = offset;
+	if (ctx->sliding_window) {
+		LLMD_CHECK_RETURN(llmd_slide_window(ctx, num_tokens, &offset, &eval_from));
+	}
+
+	if (offset + num_tokens > session->model_info.max_context_length) {
+		llmd_log(host, LLMD_LOG_ERROR, "Context %p will overflow", (void*)ctx);
+		return LLMD_ERR_INVALID;
+	}
+
+	if (
+		output != NULL
+		&& output->mode == LLMD_LOGITS_TOP_K
+		&& (output->top_k == 0 || output->top_k > session->model_info.vocab_size)
+	) {
+		llmd_log(host, LLMD_LOG_ERROR, "Invalid top_k: %u", output->top_k);
+		return LLMD_ERR_INVALID;
+	}
+
+	if (output != NULL && output->mode == LLMD_LOGITS_POSITIONS) {
+		for (unsigned int i = 0; i < output->num_positions; ++i) {
+			if (output->positions[i] >= num_tokens) {
+				llmd_log(host, LLMD_LOG_ERROR, "Invalid position: %u", output->positions[i]);
+				return LLMD_ERR_INVALID;
+			}
+		}
+	}
+
+	if (ctx->type == LLMD_CONTEXT_DIRECT) {
+		// Only kept in sliding window mode
+		llmd_token_t* window = ctx->physical_ctx->context_window;
+		if (window != NULL) {
+			LLMD_CHECK_RETURN(
+				llmd_reserve_window(session, ctx->physical_ctx, offset + num_tokens)
+			);
+			window = ctx->physical_ctx->context_window;
+			memcpy(window + offset, tokens, num_tokens * sizeof(llmd_token_t));
+			tokens = window + eval_from;
+		}
+
+		*item_out = (struct llmd_driver_generate_item) {
+			.context_descriptor = ctx->physical_ctx->descriptor,
+			.tokens = tokens,
+			.num_tokens = offset + num_tokens - eval_from,
+			.offset = eval_from,
+			.output = output,
+		};
+
+		return llmd_catch_up_generate(ctx, offset, item_out);
+	}
 
-	unsigned int num_tokens = llmd_buffer_size(ctx->token_buf);
-	enum llmd_error status = driver->interface->tokenize(
-		driver,
-		string, num_chars,
-		ctx->token_buf, &num_tokens
-	);
+	unsigned int eval_offset;
+	unsigned int eval_len;
+	if (ctx->physical_ctx == NULL) {
+		if (offset > ctx->tokens.length) {
+			llmd_log(host, LLMD_LOG_ERROR, "Context %p has no token %u", (void*)ctx, offset);
+			return LLMD_ERR_INVALID;
+		}
 
-	if (status == LLMD_ERR_BUF_SIZE) {
-		ctx->token_buf = llmd_resize_buffer(host, ctx->token_buf, num_tokens);
-		if (ctx->token_buf == NULL) { return LLMD_ERR_OOM; }
+		enum llmd_error status = llmd_flatten_virtual_ctx(session, ctx, offset + num_tokens);
+		if (status == LLMD_OK) {
+			memcpy(ctx->context_window + offset, tokens, num_tokens * sizeof(llmd_token_t));
+			status = llmd_bind_virtual_ctx(session, ctx, offset + num_tokens, &eval_offset);
+		}
+		if (status != LLMD_OK) {
+			if (status == LLMD_ERR_OOM) {
+				pthread_mutex_lock(&session->stats_lock);
+				++session->stats.num_ooms;
+				pthread_mutex_unlock(&session->stats_lock);
+			}
+
+			return status;
+		}
+
+		// Reused tokens have no logits
+		if (llmd_wants_every_row(output) && eval_offset > offset) {
+			eval_offset = offset;
+		}
+
+		eval_len = offset + num_tokens - eval_offset;
+		ctx->dirty_from = offset;
 
 		LLMD_CHECK_RETURN(
-			driver->interface->tokenize(
-				driver,
-				string, num_chars,
-				ctx->token_buf, &num_tokens
-			)
+			llmd_reserve_window(session, ctx->physical_ctx, offset + num_tokens)
+		);
+		memcpy(
+			ctx->physical_ctx->context_window + eval_offset,
+			ctx->context_window + eval_offset,
+			eval_len * sizeof(llmd_token_t)
+		);
+	} else {
+		// In multi-client system, setting offset at the end can be used to
+		// extract existing data left by other clients.
+		if (eval_from > ctx->physical_ctx->filled_size) {
+			return LLMD_ERR_INVALID;
+		}
+
+		eval_offset = eval_from;
+		eval_len = offset + num_tokens - eval_from;
+		if (ctx->dirty_from > offset) { ctx->dirty_from = offset; }
+
+		LLMD_CHECK_RETURN(
+			llmd_reserve_window(session, ctx->physical_ctx, offset + num_tokens)
+		);
+		memcpy(
+			ctx->physical_ctx->context_window + offset,
+			tokens,
+			num_tokens * sizeof(llmd_token_t)
 		);
 	}
 
-	if (tokens_out) {
-		*tokens_out = ctx->token_buf;
+	struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+	*item_out = (struct llmd_driver_generate_item) {
+		.context_descriptor = physical_ctx->descriptor,
+		.tokens = physical_ctx->context_window + eval_offset,
+		.num_tokens = eval_len,
+		.offset = eval_offset,
+		.output = output,
+	};
+
+	return llmd_catch_up_generate(ctx, offset, item_out);
+}
+
+static void
+llmd_finish_generate(
+	struct llmd_context* ctx,
+	const struct llmd_driver_generate_item* item,
+	enum llmd_error status
+) {
+	struct llmd_session* session = ctx->session;
+	struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+
+	// Whatever was past the evaluation offset is gone even if the driver
+	// failed.
+	physical_ctx->filled_size = status == LLMD_OK
+		? item->offset + item->num_tokens
+		: item->offset;
+
+	if (ctx->type != LLMD_CONTEXT_DIRECT) {
+		// An index update can only fail to grow, leaving a shorter prefix
+		// indexed which is still valid.
+		pthread_mutex_lock(&session->pool_lock);
+		llmd_prefix_index_update(
+			&session->prefix_index, &physical_ctx->prefix_entry,
+			physical_ctx->context_window,
+			item->offset, physical_ctx->filled_size
+		);
+		pthread_mutex_unlock(&session->pool_lock);
 	}
 
-	if (num_tokens_out) {
-		*num_tokens_out = num_tokens;
+	uint64_t latency_ns = llmd_monotonic_ns() - ctx->generate_start_ns;
+	++ctx->stats.num_generate_calls;
+	ctx->stats.total_generate_ns += latency_ns;
+	if (status == LLMD_OK) {
+		ctx->stats.num_tokens_evaluated += item->num_tokens;
 	}
 
-	return LLMD_OK;
+	pthread_mutex_lock(&session->stats_lock);
+	llmd_record_latency(
+		item->num_tokens > 1
+			? &session->stats.prefill_latency
+			: &session->stats.decode_latency,
+		latency_ns
+	);
+	pthread_mutex_unlock(&session->stats_lock);
 }
 
 enum llmd_error
-llmd_decode_token(
-	struct llmd_context* ctx,
-	llmd_token_t token,
-	const char** string_out,
-	unsigned int* num_chars_out
+llmd_generate_next(
+	struct llmd_generate_handle* generate_handle,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output
 ) {
+	struct llmd_context* ctx = (struct llmd_context*)generate_handle;
 	struct llmd_driver* driver = ctx->session->driver;
-	struct llmd_host* host = ctx->session->host;
+	struct llmd_driver_generate_item item;
 
-	unsigned int existing_num_chars, num_chars;
-   	existing_num_chars = num_chars = llmd_buffer_size(ctx->text_buf);
-	enum llmd_error status = driver->interface->decode_token(
-		driver,
-		token,
-		ctx->text_buf, &num_chars
+	LLMD_CHECK_RETURN(
+		llmd_prepare_generate(ctx, tokens, num_tokens, offset, output, &item)
 	);
 
-	if (status == LLMD_ERR_BUF_SIZE || num_chars >= existing_num_chars) {
-		// Need space for the null terminator
-		ctx->text_buf = llmd_resize_buffer(
-			host, ctx->text_buf, (num_chars + 1) * sizeof(char)
+	enum llmd_error status;
+	if (ctx->session->has_scheduler) {
+		// Rows of logits are indexed against the whole call
+		struct llmd_scheduler_job job = {
+			.item = item,
+			.whole = llmd_wants_every_row(item.output),
+		};
+		llmd_scheduler_run(&ctx->session->scheduler, &job, 1);
+		status = job.status;
+	} else {
+		status = driver->interface->generate(
+			driver,
+			item.context_descriptor,
+			item.tokens, item.num_tokens, item.offset,
+			item.output
 		);
-		if (ctx->text_buf == NULL) { return LLMD_ERR_OOM; }
+	}
+	llmd_finish_generate(ctx, &item, status);
 
-		LLMD_CHECK_RETURN(
-			driver->interface->decode_token(
-				driver,
-				token,
-				ctx->text_buf, &num_chars
-			)
-		);
+	return status;
+}
+
+static void
+llmd_complete_ticket(
+	struct llmd_generate_ticket* ticket,
+	enum llmd_error status
+) {
+	struct llmd_context* ctx = ticket->ctx;
+	struct llmd_session* session = ctx->session;
+
+	llmd_finish_generate(ctx, &ticket->job.item, status);
+
+	if (ticket->callback != NULL) {
+		ticket->callback(ticket->userdata, ticket, status);
 	}
-	ctx->text_buf[num_chars] = 0;
 
-	if (string_out) {
-		*string_out = ctx->text_buf;
+	// The ticket can be released as soon as it is marked done
+	pthread_mutex_lock(&session->ticket_lock);
+	ticket->status = status;
+	ticket->done = true;
+	pthread_cond_broadcast(&session->ticket_cond);
+	pthread_mutex_unlock(&session->ticket_lock);
+
+#ifdef __linux__
+	int completion_fd = atomic_load_explicit(&session->completion_fd, memory_order_acquire);
+	if (completion_fd >= 0) {
+		eventfd_write(completion_fd, 1);
 	}
+#endif
+}
 
-	if (num_chars_out) {
-		*num_chars_out = num_chars;
+static void
+llmd_on_ticket_job_done(struct llmd_scheduler_job* job) {
+	struct llmd_generate_ticket* ticket = llmd_container_of(
+		job, struct llmd_generate_ticket, job
+	);
+
+	llmd_complete_ticket(ticket, job->status);
+}
+
+enum llmd_error
+llmd_generate_submit(
+	struct llmd_generate_handle* generate_handle,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output,
+	llmd_generate_callback_t callback,
+	void* userdata,
+	struct llmd_generate_ticket** ticket_out
+) {
+	struct llmd_context* ctx = (struct llmd_context*)generate_handle;
+	struct llmd_session* session = ctx->session;
+	struct llmd_driver* driver = session->driver;
+
+	struct llmd_generate_ticket* ticket = llmd_malloc(session->host, sizeof(*ticket));
+	if (ticket == NULL) { return LLMD_ERR_OOM; }
+
+	*ticket = (struct llmd_generate_ticket) {
+		.ctx = ctx,
+		.callback = callback,
+		.userdata = userdata,
+	};
+
+	// The caller's copy does not have to outlive this call
+	if (output != NULL) {
+		ticket->output = *output;
+		output = &ticket->output;
+	}
+
+	enum llmd_error status = llmd_prepare_generate(
+		ctx, tokens, num_tokens, offset, output,
+		&ticket->job.item
+	);
+	if (status != LLMD_OK) {
+		llmd_free(session->host, ticket);
+		return status;
+	}
+
+	*ticket_out = ticket;
+
+	if (session->has_scheduler) {
+		ticket->job.whole = llmd_wants_every_row(ticket->job.item.output);
+		ticket->job.on_done = llmd_on_ticket_job_done;
+		llmd_scheduler_submit(&session->scheduler, &ticket->job, 1);
+	} else {
+		// Without a scheduler there is nothing to overlap with
+		status = driver->interface->generate(
+			driver,
+			ticket->job.item.context_descriptor,
+			ticket->job.item.tokens, ticket->job.item.num_tokens, ticket->job.item.offset,
+			ticket->job.item.output
+		);
+		llmd_complete_ticket(ticket, status);
 	}
 
 	return LLMD_OK;
 }
 
 enum llmd_error
-llmd_begin_generate(
-	struct llmd_context* ctx,
-	struct llmd_generate_handle** generate_handle_out
+llmd_generate_poll(
+	struct llmd_generate_ticket* ticket,
+	bool* done_out
 ) {
-	struct llmd_session* session = ctx->session;
-	struct llmd_host* host = session->host;
+	struct llmd_session* session = ticket->ctx->session;
 
-	if (ctx->generating) {
-		llmd_log(host, LLMD_LOG_ERROR, "Context %p is already generating", (void*)ctx);
+	pthread_mutex_lock(&session->ticket_lock);
+	*done_out = ticket->done;
+	pthread_mutex_unlock(&session->ticket_lock);
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_generate_wait(
+	struct llmd_generate_ticket* ticket
+) {
+	struct llmd_session* session = ticket->ctx->session;
+
+	pthread_mutex_lock(&session->ticket_lock);
+	while (!ticket->done) {
+		pthread_cond_wait(&session->ticket_cond, &session->ticket_lock);
+	}
+	enum llmd_error status = ticket->status;
+	pthread_mutex_unlock(&session->ticket_lock);
+
+	llmd_free(session->host, ticket);
+	return status;
+}
+
+enum llmd_error
+llmd_generate_speculative(
+	struct llmd_generate_handle* target_handle,
+	struct llmd_generate_handle* draft_handle,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_speculative_config* config,
+	llmd_token_t* tokens_out,
+	unsigned int* num_tokens_out
+) {
+LLMD_TRY
+	struct llmd_context* target = (struct llmd_context*)target_handle;
+	struct llmd_context* draft = (struct llmd_context*)draft_handle;
+	struct llmd_host* host = target->session->host;
+	const struct llmd_token_picker* picker = &config->picker;
+	const struct llmd_token_picker* draft_picker = config->draft_picker.pick != NULL
+		? &config->draft_picker
+		: picker;
+	unsigned int vocab_size = target->session->model_info.vocab_size;
+	unsigned int num_drafts = config->num_draft_tokens;
+	unsigned int num_rows = num_tokens + num_drafts;
+	llmd_token_t* input = NULL;
+	unsigned int* positions = NULL;
+	float* logits = NULL;
+
+	if (
+		num_tokens == 0
+		|| num_drafts == 0
+		|| draft->session->model_info.vocab_size != vocab_size
+	) {
 		return LLMD_ERR_INVALID;
 	}
 
-	ctx->generating = true;
-	*generate_handle_out = (void*)ctx;
+	LLMD_CHECKED_MALLOC(input, host, sizeof(llmd_token_t) * num_rows);
+	LLMD_CHECKED_MALLOC(positions, host, sizeof(unsigned int) * (num_drafts + 1));
+	LLMD_CHECKED_MALLOC(logits, host, sizeof(float) * vocab_size * (num_drafts + 1));
+	memcpy(input, tokens, sizeof(llmd_token_t) * num_tokens);
+
+	// Each guess is fed back to the draft
+	for (unsigned int i = 0; i < num_drafts; ++i) {
+		struct llmd_logits_output draft_output = {
+			.mode = LLMD_LOGITS_FULL,
+			.logits = logits,
+		};
+		LLMD_CHECK_THROW(
+			i == 0
+				? llmd_generate_next(draft_handle, tokens, num_tokens, offset, &draft_output)
+				: llmd_generate_next(
+					draft_handle,
+					&input[num_tokens + i - 1], 1, offset + num_tokens + i - 1,
+					&draft_output
+				)
+		);
 
-	return LLMD_OK;
+		input[num_tokens + i] = draft_picker->pick(draft_picker->state, logits, vocab_size);
+	}
+
+	// Only the rows from the last given token onward matter
+	for (unsigned int i = 0; i <= num_drafts; ++i) {
+		positions[i] = num_tokens - 1 + i;
+	}
+
+	// Rows are indexed against the whole call so llmd_generate_next keeps it
+	// in one chunk even with a scheduler
+	struct llmd_logits_output target_output = {
+		.mode = LLMD_LOGITS_POSITIONS,
+		.logits = logits,
+		.positions = positions,
+		.num_positions = num_drafts + 1,
+	};
+	LLMD_CHECK_THROW(
+		llmd_generate_next(target_handle, input, num_rows, offset, &target_output)
+	);
+
+	// Row i is the target's prediction for what follows the i-th guess.
+	// The picker is called on each row up to the first rejected guess, just
+	// like without a draft, so even a sampling picker gives the same output
+	// provided the draft has its own.
+	unsigned int num_accepted = 0;
+	while (true) {
+		llmd_token_t token = picker->pick(
+			picker->state,
+			logits + (size_t)num_accepted * vocab_size,
+			vocab_size
+		);
+		tokens_out[num_accepted] = token;
+
+		if (num_accepted == num_drafts || token != input[num_tokens + num_accepted]) {
+			break;
+		}
+
+		++num_accepted;
+	}
+	*num_tokens_out = num_accepted + 1;
+
+	// The draft has yet to see its last guess
+	if (num_accepted == num_drafts) {
+		LLMD_CHECK_THROW(
+			llmd_generate_next(
+				draft_handle, &input[num_rows - 1], 1, offset + num_rows - 1, NULL
+			)
+		);
+	}
+
+	target->stats.num_draft_tokens += num_drafts;
+	target->stats.num_draft_tokens_accepted += num_accepted;
+LLMD_EXCEPT_BEGIN
+	llmd_free(host, logits);
+	llmd_free(host, positions);
+	llmd_free(host, input);
+LLMD_EXCEPT_END
 }
 
 enum llmd_error
-llmd_generate_next(
+llmd_score_tokens(
 	struct llmd_generate_handle* generate_handle,
 	const llmd_token_t* tokens,
 	unsigned int num_tokens,
 	unsigned int offset,
-	float* logits_out
+	float* log_probs_out
 ) {
+LLMD_TRY
 	struct llmd_context* ctx = (struct llmd_context*)generate_handle;
-	struct llmd_session* session = ctx->session;
+	struct llmd_host* host = ctx->session->host;
+	unsigned int vocab_size = ctx->session->model_info.vocab_size;
+	unsigned int* positions = NULL;
+	float* logits = NULL;
+
+	if (num_tokens < 2) { return LLMD_ERR_INVALID; }
+
+	// The last token predicts nothing that is being scored
+	unsigned int num_rows = num_tokens - 1;
+	LLMD_CHECKED_MALLOC(positions, host, sizeof(unsigned int) * num_rows);
+	LLMD_CHECKED_MALLOC(logits, host, sizeof(float) * vocab_size * num_rows);
+	for (unsigned int i = 0; i < num_rows; ++i) {
+		positions[i] = i;
+	}
+
+	// Rows are indexed against the whole call so llmd_generate_next keeps it
+	// in one chunk even with a scheduler
+	struct llmd_logits_output output = {
+		.mode = LLMD_LOGITS_POSITIONS,
+		.logits = logits,
+		.positions = positions,
+		.num_positions = num_rows,
+	};
+	LLMD_CHECK_THROW(
+		llmd_generate_next(generate_handle, tokens, num_tokens, offset, &output)
+	);
+
+	// Log softmax, only at the token which came next
+	for (unsigned int i = 0; i < num_rows; ++i) {
+		const float* row = logits + (size_t)i * vocab_size;
+
+		float max_logit = -INFINITY;
+		for (unsigned int j = 0; j < vocab_size; ++j) {
+			max_logit = row[j] > max_logit ? row[j] : max_logit;
+		}
+
+		float sum = 0.f;
+		for (unsigned int j = 0; j < vocab_size; ++j) {
+			sum += expf(row[j] - max_logit);
+		}
+
+		log_probs_out[i] = row[tokens[i + 1]] - max_logit - logf(sum);
+	}
+LLMD_EXCEPT_BEGIN
+	llmd_free(host, logits);
+	llmd_free(host, positions);
+LLMD_EXCEPT_END
+}
+
+enum llmd_error
+llmd_get_completion_fd(
+	struct llmd_session* session,
+	int* fd_out
+) {
+#ifdef __linux__
+	int fd = atomic_load_explicit(&session->completion_fd, memory_order_acquire);
+	if (fd < 0) {
+		int new_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (new_fd < 0) { return LLMD_ERR_IO; }
+
+		// Another thread may have raced us
+		if (
+			atomic_compare_exchange_strong_explicit(
+				&session->completion_fd, &fd, new_fd,
+				memory_order_acq_rel, memory_order_acquire
+			)
+		) {
+			fd = new_fd;
+		} else {
+			close(new_fd);
+		}
+	}
+
+	*fd_out = fd;
+	return LLMD_OK;
+#else
+	(void)session;
+	(void)fd_out;
+	return LLMD_ERR_NOT_SUPPORTED;
+#endif
+}
+
+enum llmd_error
+llmd_generate_next_batch(
+	struct llmd_generate_request* requests,
+	unsigned int num_requests
+) {
+	if (num_requests == 0) { return LLMD_OK; }
+
+	struct llmd_session* session = ((struct llmd_context*)requests[0].generate_handle)->session;
 	struct llmd_host* host = session->host;
 	struct llmd_driver* driver = session->driver;
 
-	if (!ctx->generating) {
-		llmd_log(host, LLMD_LOG_ERROR, "Context %p is not generating", (void*)ctx);
-		return LLMD_ERR_INVALID;
+	unsigned int num_pooled = 0;
+	unsigned int num_unbound = 0;
+	for (unsigned int i = 0; i < num_requests; ++i) {
+		struct llmd_context* ctx = (struct llmd_context*)requests[i].generate_handle;
+		requests[i].status = LLMD_OK;
+
+		if (ctx->session != session) {
+			llmd_log(host, LLMD_LOG_ERROR, "Batch spans multiple sessions");
+			return LLMD_ERR_INVALID;
+		}
+
+		for (unsigned int j = 0; j < i; ++j) {
+			if (requests[j].generate_handle == requests[i].generate_handle) {
+				llmd_log(host, LLMD_LOG_ERROR, "Context %p appears twice in a batch", (void*)ctx);
+				return LLMD_ERR_INVALID;
+			}
+		}
+
+		if (ctx->type != LLMD_CONTEXT_DIRECT) {
+			++num_pooled;
+			if (ctx->physical_ctx == NULL) { ++num_unbound; }
+		}
 	}
 
-	if (offset + num_tokens > session->model_info.max_context_length) {
-		llmd_log(host, LLMD_LOG_ERROR, "Context %p will overflow", (void*)ctx);
-		return LLMD_ERR_INVALID;
+	// Members are bound one by one and keep their context until the batch is
+	// done. With more of them than the pool holds, the last ones would wait
+	// in the admission queue for contexts the batch itself holds.
+	unsigned int max_pooled_contexts = session->config.max_pooled_contexts;
+	if (num_unbound > 0 && max_pooled_contexts > 0 && num_pooled > max_pooled_contexts) {
+		llmd_log(
+			host, LLMD_LOG_ERROR,
+			"Batch needs %u pooled contexts but the pool holds at most %u",
+			num_pooled, max_pooled_contexts
+		);
+		for (unsigned int i = 0; i < num_requests; ++i) {
+			requests[i].status = LLMD_ERR_OOM;
+		}
+
+		pthread_mutex_lock(&session->stats_lock);
+		++session->stats.num_ooms;
+		pthread_mutex_unlock(&session->stats_lock);
+
+		return LLMD_ERR_OOM;
 	}
 
-	if (ctx->type == LLMD_CONTEXT_DIRECT) {
-		LLMD_CHECK_RETURN(
-			driver->interface->generate(
-				driver,
-				ctx->physical_ctx->descriptor,
-				tokens, num_tokens, offset,
-				logits_out
-			)
+	struct llmd_driver_generate_item* items = llmd_malloc(
+		host, sizeof(struct llmd_driver_generate_item) * num_requests
+	);
+	unsigned int* item_requests = llmd_malloc(host, sizeof(unsigned int) * num_requests);
+	if (items == NULL || item_requests == NULL) {
+		llmd_free(host, items);
+		llmd_free(host, item_requests);
+		return LLMD_ERR_OOM;
+	}
+
+	unsigned int num_items = 0;
+	for (unsigned int i = 0; i < num_requests; ++i) {
+		struct llmd_generate_request* request = &requests[i];
+
+		request->status = llmd_prepare_generate(
+			(struct llmd_context*)request->generate_handle,
+			request->tokens, request->num_tokens, request->offset,
+			request->output,
+			&items[num_items]
 		);
-	} else {
-		unsigned int eval_offset;
-		unsigned int eval_len;
-		if (ctx->physical_ctx == NULL) {
-			memcpy(ctx->context_window + offset, tokens, num_tokens * sizeof(llmd_token_t));
 
-			LLMD_CHECK_RETURN(
-				llmd_bind_virtual_ctx(session, ctx, offset + num_tokens, &eval_offset)
-			);
+		if (request->status == LLMD_OK) {
+			item_requests[num_items++] = i;
+		}
+	}
 
-			eval_len = offset + num_tokens - eval_offset;
+	if (num_items > 0 && session->has_scheduler) {
+		struct llmd_scheduler_job* jobs = llmd_malloc(
+			host, sizeof(struct llmd_scheduler_job) * num_items
+		);
 
-			memcpy(
-				ctx->physical_ctx->context_window + eval_offset,
-				ctx->context_window + eval_offset,
-				eval_len * sizeof(llmd_token_t)
-			);
+		if (jobs == NULL) {
+			for (unsigned int i = 0; i < num_items; ++i) {
+				requests[item_requests[i]].status = LLMD_ERR_OOM;
+			}
 		} else {
-			// In multi-client system, setting offset at the end can be used to
-			// extract existing data left by other clients.
-			if (offset > ctx->physical_ctx->filled_size) {
-				return LLMD_ERR_INVALID;
+			for (unsigned int i = 0; i < num_items; ++i) {
+				jobs[i] = (struct llmd_scheduler_job) {
+					.item = items[i],
+					.whole = llmd_wants_every_row(items[i].output),
+				};
 			}
 
-			eval_offset = offset;
-			eval_len = num_tokens;
+			llmd_scheduler_run(&session->scheduler, jobs, num_items);
 
-			memcpy(
-				ctx->physical_ctx->context_window + eval_offset,
-				tokens,
-				eval_len * sizeof(llmd_token_t)
-			);
-		}
+			for (unsigned int i = 0; i < num_items; ++i) {
+				requests[item_requests[i]].status = jobs[i].status;
+			}
 
-		ctx->physical_ctx->filled_size = offset + num_tokens;
+			llmd_free(host, jobs);
+		}
+	} else if (num_items > 0 && driver->interface->generate_batch != NULL) {
+		enum llmd_error batch_status = driver->interface->generate_batch(driver, items, num_items);
 
-		LLMD_CHECK_RETURN(
-			driver->interface->generate(
+		for (unsigned int i = 0; i < num_items; ++i) {
+			requests[item_requests[i]].status = batch_status;
+		}
+	} else {
+		for (unsigned int i = 0; i < num_items; ++i) {
+			requests[item_requests[i]].status = driver->interface->generate(
 				driver,
-				ctx->physical_ctx->descriptor,
-				ctx->physical_ctx->context_window + eval_offset,
-				eval_len, eval_offset,
-				logits_out
-			)
+				items[i].context_descriptor,
+				items[i].tokens, items[i].num_tokens, items[i].offset,
+				items[i].output
+			);
+		}
+	}
+
+	enum llmd_error status = LLMD_OK;
+	for (unsigned int i = 0; i < num_items; ++i) {
+		struct llmd_generate_request* request = &requests[item_requests[i]];
+		llmd_finish_generate(
+			(struct llmd_context*)request->generate_handle,
+			&items[i],
+			request->status
 		);
 	}
 
-	return LLMD_OK;
+	for (unsigned int i = 0; i < num_requests; ++i) {
+		if (requests[i].status != LLMD_OK) {
+			status = requests[i].status;
+			break;
+		}
+	}
+
+	llmd_free(host, items);
+	llmd_free(host, item_requests);
+
+	return status;
 }
 
 enum llmd_error
@@ -621,15 +3062,40 @@ llmd_end_generate(
 		return LLMD_ERR_INVALID;
 	}
 
-	if (ctx->physical_ctx->context_window) {
-		// Copy back context window
-		memcpy(
-			ctx->context_window,
-			ctx->physical_ctx->context_window,
-			ctx->physical_ctx->filled_size * sizeof(llmd_token_t)
+	enum llmd_error status = LLMD_OK;
+	struct llmd_physical_context* physical_ctx = ctx->physical_ctx;
+	if (ctx->type != LLMD_CONTEXT_DIRECT && physical_ctx != NULL) {
+		if (session->has_disk_cache) {
+			llmd_persist_physical_ctx(session, physical_ctx);
+		}
+
+		// Copy back what changed in the context window
+		unsigned int num_tokens = physical_ctx->filled_size;
+		unsigned int dirty_from = ctx->dirty_from < num_tokens
+			? ctx->dirty_from
+			: num_tokens;
+
+		pthread_mutex_lock(&session->token_store_lock);
+		status = llmd_token_seq_write(
+			&session->token_store, &ctx->tokens, dirty_from,
+			physical_ctx->context_window + dirty_from, num_tokens - dirty_from
 		);
+		pthread_mutex_unlock(&session->token_store_lock);
+
+		if (status != LLMD_OK) {
+			llmd_log(
+				host, LLMD_LOG_WARNING,
+				"Context %p kept %u of %u tokens", (void*)ctx, ctx->tokens.length, num_tokens
+			);
+		}
 	}
 
 	ctx->generating = false;
-	return llmd_unbind_virtual_ctx(session, ctx);
+	if (ctx->type == LLMD_CONTEXT_DIRECT) {
+		// A direct context owns its physical context for its whole lifetime
+		return LLMD_OK;
+	} else {
+		llmd_unbind_virtual_ctx(session, ctx);
+		return status;
+	}
 }
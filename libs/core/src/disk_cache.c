@@ -0,0 +1,616 @@
+#include "disk_cache.h"
+#include <llmd/utils/host.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// "LLMDKV01"
+#define LLMD_DISK_CACHE_MAGIC 0x3130564b444d4c4cull
+#define LLMD_DISK_CACHE_STATE_ALIGN 64
+#define LLMD_DISK_CACHE_FNV_OFFSET 0xcbf29ce484222325ull
+#define LLMD_DISK_CACHE_FNV_PRIME 0x100000001b3ull
+
+struct llmd_disk_cache_header {
+	uint64_t magic;
+	uint64_t model_hash;
+	uint64_t key;
+	// Of the tokens and the state
+	uint64_t checksum;
+	uint64_t state_size;
+	uint32_t num_tokens;
+	uint32_t reserved;
+};
+
+static size_t
+llmd_disk_cache_state_offset(unsigned int num_tokens) {
+	size_t end = sizeof(struct llmd_disk_cache_header) + num_tokens * sizeof(llmd_token_t);
+	return (end + LLMD_DISK_CACHE_STATE_ALIGN - 1) & ~(size_t)(LLMD_DISK_CACHE_STATE_ALIGN - 1);
+}
+
+static uint64_t
+llmd_disk_cache_checksum(uint64_t hash, const void* data, size_t size) {
+	// FNV-1a over words, the state can be large
+	const unsigned char* bytes = data;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash ^= word;
+		hash *= LLMD_DISK_CACHE_FNV_PRIME;
+	}
+
+	for (; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= LLMD_DISK_CACHE_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static char*
+llmd_disk_cache_file_path(
+	struct llmd_host* host,
+	const char* dir,
+	const char* name
+) {
+	size_t size = strlen(dir) + strlen(name) + 2;
+	char* path = llmd_malloc(host, size);
+	if (path != NULL) {
+		snprintf(path, size, "%s/%s", dir, name);
+	}
+
+	return path;
+}
+
+static char*
+llmd_disk_cache_entry_path(
+	const struct llmd_disk_cache* cache,
+	uint64_t key
+) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.kv", (unsigned long long)key);
+	return llmd_disk_cache_file_path(cache->host, cache->path, name);
+}
+
+static void
+llmd_disk_cache_free_entry(
+	struct llmd_host* host,
+	struct llmd_disk_cache_entry* entry
+) {
+	if (entry == NULL) { return; }
+
+	llmd_free(host, entry->tokens);
+	llmd_free(host, entry);
+}
+
+static void
+llmd_disk_cache_push_front(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry
+) {
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head != NULL) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+
+	cache->size += entry->file_size;
+	++cache->num_entries;
+}
+
+static void
+llmd_disk_cache_unlink(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry
+) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+	cache->size -= entry->file_size;
+	--cache->num_entries;
+}
+
+// Unlink the entry and delete its file
+static void
+llmd_disk_cache_remove(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry
+) {
+	char* path = llmd_disk_cache_entry_path(cache, entry->key);
+	if (path != NULL) {
+		unlink(path);
+		llmd_free(cache->host, path);
+	}
+
+	llmd_disk_cache_unlink(cache, entry);
+	llmd_disk_cache_free_entry(cache->host, entry);
+}
+
+static bool
+llmd_disk_cache_read_all(int fd, void* buf, size_t size) {
+	char* itr = buf;
+	while (size > 0) {
+		ssize_t num_read = read(fd, itr, size);
+		if (num_read < 0 && errno == EINTR) { continue; }
+		if (num_read <= 0) { return false; }
+
+		itr += num_read;
+		size -= (size_t)num_read;
+	}
+
+	return true;
+}
+
+static bool
+llmd_disk_cache_write_all(int fd, const void* buf, size_t size) {
+	const char* itr = buf;
+	while (size > 0) {
+		ssize_t num_written = write(fd, itr, size);
+		if (num_written < 0 && errno == EINTR) { continue; }
+		if (num_written <= 0) { return false; }
+
+		itr += num_written;
+		size -= (size_t)num_written;
+	}
+
+	return true;
+}
+
+static bool
+llmd_disk_cache_check_header(
+	const struct llmd_disk_cache* cache,
+	const struct llmd_disk_cache_header* header,
+	size_t file_size
+) {
+	return header->magic == LLMD_DISK_CACHE_MAGIC
+		&& header->model_hash == cache->model_hash
+		&& file_size >= llmd_disk_cache_state_offset(header->num_tokens)
+		&& file_size - llmd_disk_cache_state_offset(header->num_tokens) == header->state_size;
+}
+
+// Only the header and the tokens are read, the checksum is verified on use
+static struct llmd_disk_cache_entry*
+llmd_disk_cache_load_entry(
+	struct llmd_disk_cache* cache,
+	const char* path,
+	struct timespec* mtime_out
+) {
+	struct llmd_disk_cache_entry* entry = NULL;
+	struct llmd_disk_cache_header header;
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) { return NULL; }
+
+	if (
+		fstat(fd, &st) != 0
+		|| !llmd_disk_cache_read_all(fd, &header, sizeof(header))
+		|| !llmd_disk_cache_check_header(cache, &header, (size_t)st.st_size)
+	) {
+		goto end;
+	}
+
+	entry = llmd_malloc(cache->host, sizeof(*entry));
+	if (entry == NULL) { goto end; }
+
+	*entry = (struct llmd_disk_cache_entry) {
+		.key = header.key,
+		.num_tokens = header.num_tokens,
+		.file_size = (size_t)st.st_size,
+	};
+	entry->tokens = llmd_malloc(
+		cache->host, (header.num_tokens > 0 ? header.num_tokens : 1) * sizeof(llmd_token_t)
+	);
+	if (
+		entry->tokens == NULL
+		|| !llmd_disk_cache_read_all(fd, entry->tokens, header.num_tokens * sizeof(llmd_token_t))
+		|| llmd_disk_cache_key(entry->tokens, entry->num_tokens) != header.key
+	) {
+		llmd_disk_cache_free_entry(cache->host, entry);
+		entry = NULL;
+		goto end;
+	}
+
+	*mtime_out = st.st_mtim;
+
+end:
+	close(fd);
+	return entry;
+}
+
+// An entry found while indexing the directory
+struct llmd_disk_cache_file {
+	struct llmd_disk_cache_entry* entry;
+	struct timespec mtime;
+};
+
+static int
+llmd_disk_cache_compare_files(const void* lhs, const void* rhs) {
+	const struct timespec* lhs_mtime = &((const struct llmd_disk_cache_file*)lhs)->mtime;
+	const struct timespec* rhs_mtime = &((const struct llmd_disk_cache_file*)rhs)->mtime;
+
+	if (lhs_mtime->tv_sec != rhs_mtime->tv_sec) {
+		return lhs_mtime->tv_sec < rhs_mtime->tv_sec ? -1 : 1;
+	} else if (lhs_mtime->tv_nsec != rhs_mtime->tv_nsec) {
+		return lhs_mtime->tv_nsec < rhs_mtime->tv_nsec ? -1 : 1;
+	} else {
+		return 0;
+	}
+}
+
+static void
+llmd_disk_cache_evict(
+	struct llmd_disk_cache* cache,
+	size_t incoming_size
+) {
+	if (cache->capacity == 0) { return; }
+
+	while (cache->tail != NULL && cache->size + incoming_size > cache->capacity) {
+		llmd_disk_cache_remove(cache, cache->tail);
+		++cache->num_evictions;
+	}
+}
+
+enum llmd_error
+llmd_disk_cache_init(
+	struct llmd_host* host,
+	const char* path,
+	size_t capacity,
+	uint64_t model_hash,
+	struct llmd_disk_cache* cache
+) {
+	*cache = (struct llmd_disk_cache) {
+		.host = host,
+		.capacity = capacity,
+		.model_hash = model_hash,
+	};
+
+	size_t path_size = strlen(path) + 1;
+	cache->path = llmd_malloc(host, path_size);
+	if (cache->path == NULL) { return LLMD_ERR_OOM; }
+	memcpy(cache->path, path, path_size);
+
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		llmd_log(host, LLMD_LOG_ERROR, "Could not create %s: %s", path, strerror(errno));
+		llmd_disk_cache_cleanup(cache);
+		return LLMD_ERR_IO;
+	}
+
+	DIR* dir = opendir(path);
+	if (dir == NULL) {
+		llmd_log(host, LLMD_LOG_ERROR, "Could not open %s: %s", path, strerror(errno));
+		llmd_disk_cache_cleanup(cache);
+		return LLMD_ERR_IO;
+	}
+
+	struct llmd_disk_cache_file* files = NULL;
+	size_t num_files = 0;
+	struct dirent* dirent;
+	while ((dirent = readdir(dir)) != NULL) {
+		const char* name = dirent->d_name;
+		bool is_tmp = strncmp(name, "tmp-", 4) == 0;
+		bool is_entry = strlen(name) == 19 && strcmp(name + 16, ".kv") == 0;
+		if (!is_tmp && !is_entry) { continue; }
+
+		char* file_path = llmd_disk_cache_file_path(host, path, name);
+		if (file_path == NULL) { break; }
+
+		// Left behind by a crash while writing
+		if (is_tmp) {
+			unlink(file_path);
+			llmd_free(host, file_path);
+			continue;
+		}
+
+		struct llmd_disk_cache_file file;
+		file.entry = llmd_disk_cache_load_entry(cache, file_path, &file.mtime);
+		llmd_free(host, file_path);
+		if (file.entry == NULL) {
+			++cache->num_rejected;
+			continue;
+		}
+
+		struct llmd_disk_cache_file* new_files = llmd_realloc(
+			host, files, (num_files + 1) * sizeof(struct llmd_disk_cache_file)
+		);
+		if (new_files == NULL) {
+			llmd_disk_cache_free_entry(host, file.entry);
+			break;
+		}
+		files = new_files;
+		files[num_files++] = file;
+	}
+	closedir(dir);
+
+	// The most recently modified ends up first
+	if (num_files > 0) {
+		qsort(files, num_files, sizeof(struct llmd_disk_cache_file), llmd_disk_cache_compare_files);
+	}
+	for (size_t i = 0; i < num_files; ++i) {
+		llmd_disk_cache_push_front(cache, files[i].entry);
+	}
+	llmd_free(host, files);
+
+	if (cache->num_rejected > 0) {
+		llmd_log(
+			host, LLMD_LOG_WARNING,
+			"Ignored %llu files in %s",
+			(unsigned long long)cache->num_rejected, path
+		);
+	}
+
+	llmd_disk_cache_evict(cache, 0);
+
+	return LLMD_OK;
+}
+
+void
+llmd_disk_cache_cleanup(
+	struct llmd_disk_cache* cache
+) {
+	struct llmd_disk_cache_entry* itr = cache->head;
+	while (itr != NULL) {
+		struct llmd_disk_cache_entry* next = itr->next;
+		llmd_disk_cache_free_entry(cache->host, itr);
+		itr = next;
+	}
+
+	llmd_free(cache->host, cache->path);
+	cache->path = NULL;
+	cache->head = cache->tail = NULL;
+	cache->num_entries = 0;
+	cache->size = 0;
+}
+
+uint64_t
+llmd_disk_cache_key(
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+) {
+	// Rolling so that the key of every prefix is known along the way
+	uint64_t hash = LLMD_DISK_CACHE_FNV_OFFSET;
+	for (unsigned int i = 0; i < num_tokens; ++i) {
+		hash = hash * LLMD_DISK_CACHE_FNV_PRIME + (uint64_t)tokens[i] + 1;
+	}
+
+	return hash;
+}
+
+struct llmd_disk_cache_entry*
+llmd_disk_cache_find_longest(
+	struct llmd_disk_cache* cache,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int min_shared_prefix,
+	unsigned int* shared_prefix_out
+) {
+	struct llmd_disk_cache_entry* best = NULL;
+	unsigned int best_shared = min_shared_prefix;
+
+	for (struct llmd_disk_cache_entry* itr = cache->head; itr != NULL; itr = itr->next) {
+		unsigned int limit = itr->num_tokens < num_tokens ? itr->num_tokens : num_tokens;
+		if (limit <= best_shared) { continue; }
+
+		unsigned int shared = 0;
+		while (shared < limit && itr->tokens[shared] == tokens[shared]) { ++shared; }
+
+		if (shared > best_shared) {
+			best = itr;
+			best_shared = shared;
+		}
+	}
+
+	if (best != NULL) {
+		llmd_disk_cache_unlink(cache, best);
+		llmd_disk_cache_push_front(cache, best);
+		*shared_prefix_out = best_shared;
+	}
+
+	return best;
+}
+
+enum llmd_error
+llmd_disk_cache_map(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry,
+	struct llmd_disk_cache_mapping* mapping_out
+) {
+	char* path = llmd_disk_cache_entry_path(cache, entry->key);
+	if (path == NULL) { return LLMD_ERR_OOM; }
+
+	void* base = MAP_FAILED;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size == entry->file_size) {
+			base = mmap(NULL, entry->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+	}
+
+	if (base != MAP_FAILED) {
+		const struct llmd_disk_cache_header* header = base;
+		size_t state_offset = llmd_disk_cache_state_offset(entry->num_tokens);
+		const llmd_token_t* tokens = (const llmd_token_t*)(header + 1);
+		const char* state = (const char*)base + state_offset;
+
+		if (
+			llmd_disk_cache_check_header(cache, header, entry->file_size)
+			&& header->key == entry->key
+			&& header->num_tokens == entry->num_tokens
+			&& memcmp(tokens, entry->tokens, entry->num_tokens * sizeof(llmd_token_t)) == 0
+			&& llmd_disk_cache_checksum(
+				llmd_disk_cache_checksum(
+					LLMD_DISK_CACHE_FNV_OFFSET,
+					tokens, entry->num_tokens * sizeof(llmd_token_t)
+				),
+				state, header->state_size
+			) == header->checksum
+		) {
+			*mapping_out = (struct llmd_disk_cache_mapping) {
+				.base = base,
+				.size = entry->file_size,
+				.tokens = tokens,
+				.num_tokens = entry->num_tokens,
+				.state = state,
+				.state_size = header->state_size,
+			};
+
+			// The modification time orders entries after a restart
+			utimensat(AT_FDCWD, path, NULL, 0);
+			llmd_free(cache->host, path);
+			++cache->num_hits;
+			return LLMD_OK;
+		}
+
+		munmap(base, entry->file_size);
+	}
+
+	llmd_log(cache->host, LLMD_LOG_WARNING, "Rejected cache file %s", path);
+	llmd_free(cache->host, path);
+	llmd_disk_cache_remove(cache, entry);
+	++cache->num_rejected;
+
+	return LLMD_ERR_INVALID;
+}
+
+void
+llmd_disk_cache_unmap(
+	struct llmd_disk_cache_mapping* mapping
+) {
+	munmap(mapping->base, mapping->size);
+	mapping->base = NULL;
+}
+
+enum llmd_error
+llmd_disk_cache_write(
+	const struct llmd_disk_cache* cache,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	const void* state,
+	size_t state_size,
+	struct llmd_disk_cache_entry** entry_out,
+	char** tmp_path_out
+) {
+	struct llmd_host* host = cache->host;
+	struct llmd_disk_cache_entry* entry = NULL;
+	char* tmp_path = NULL;
+	int fd = -1;
+	enum llmd_error status = LLMD_ERR_OOM;
+
+	size_t tokens_size = num_tokens * sizeof(llmd_token_t);
+	size_t state_offset = llmd_disk_cache_state_offset(num_tokens);
+	struct llmd_disk_cache_header header = {
+		.magic = LLMD_DISK_CACHE_MAGIC,
+		.model_hash = cache->model_hash,
+		.key = llmd_disk_cache_key(tokens, num_tokens),
+		.checksum = llmd_disk_cache_checksum(
+			llmd_disk_cache_checksum(LLMD_DISK_CACHE_FNV_OFFSET, tokens, tokens_size),
+			state, state_size
+		),
+		.state_size = state_size,
+		.num_tokens = num_tokens,
+	};
+
+	entry = llmd_malloc(host, sizeof(*entry));
+	if (entry == NULL) { goto error; }
+	*entry = (struct llmd_disk_cache_entry) {
+		.key = header.key,
+		.num_tokens = num_tokens,
+		.file_size = state_offset + state_size,
+	};
+	entry->tokens = llmd_malloc(host, tokens_size > 0 ? tokens_size : 1);
+	if (entry->tokens == NULL) { goto error; }
+	memcpy(entry->tokens, tokens, tokens_size);
+
+	tmp_path = llmd_disk_cache_file_path(host, cache->path, "tmp-XXXXXX");
+	if (tmp_path == NULL) { goto error; }
+
+	status = LLMD_ERR_IO;
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		llmd_free(host, tmp_path);
+		tmp_path = NULL;
+		goto error;
+	}
+
+	static const char padding[LLMD_DISK_CACHE_STATE_ALIGN] = { 0 };
+	if (
+		!llmd_disk_cache_write_all(fd, &header, sizeof(header))
+		|| !llmd_disk_cache_write_all(fd, tokens, tokens_size)
+		|| !llmd_disk_cache_write_all(
+			fd, padding, state_offset - sizeof(header) - tokens_size
+		)
+		|| !llmd_disk_cache_write_all(fd, state, state_size)
+		|| close(fd) != 0
+	) {
+		fd = -1;
+		goto error;
+	}
+
+	*entry_out = entry;
+	*tmp_path_out = tmp_path;
+	return LLMD_OK;
+
+error:
+	if (fd >= 0) { close(fd); }
+	if (tmp_path != NULL) {
+		unlink(tmp_path);
+		llmd_free(host, tmp_path);
+	}
+	llmd_disk_cache_free_entry(host, entry);
+
+	return status;
+}
+
+void
+llmd_disk_cache_commit(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry,
+	char* tmp_path
+) {
+	bool keep = cache->capacity == 0 || entry->file_size <= cache->capacity;
+
+	for (struct llmd_disk_cache_entry* itr = cache->head; keep && itr != NULL; itr = itr->next) {
+		if (itr->key == entry->key && itr->num_tokens == entry->num_tokens) {
+			keep = false;
+		}
+	}
+
+	char* path = keep ? llmd_disk_cache_entry_path(cache, entry->key) : NULL;
+	if (path != NULL) {
+		llmd_disk_cache_evict(cache, entry->file_size);
+
+		if (rename(tmp_path, path) == 0) {
+			llmd_disk_cache_push_front(cache, entry);
+			++cache->num_writes;
+			entry = NULL;
+		}
+		llmd_free(cache->host, path);
+	}
+
+	if (entry != NULL) {
+		unlink(tmp_path);
+		llmd_disk_cache_free_entry(cache->host, entry);
+	}
+	llmd_free(cache->host, tmp_path);
+}
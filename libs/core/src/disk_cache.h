@@ -0,0 +1,126 @@
+#ifndef LLMD_CORE_DISK_CACHE_H
+#define LLMD_CORE_DISK_CACHE_H
+
+#include <llmd/core.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A file of the cache, whose tokens are kept in memory for lookups
+struct llmd_disk_cache_entry {
+	// Rolling hash of the tokens, also the name of the file
+	uint64_t key;
+	llmd_token_t* tokens;
+	unsigned int num_tokens;
+	size_t file_size;
+
+	struct llmd_disk_cache_entry* prev;
+	struct llmd_disk_cache_entry* next;
+};
+
+// A size bounded LRU directory of evaluation states which survives restarts.
+// Files written for a different model are ignored.
+struct llmd_disk_cache {
+	struct llmd_host* host;
+	char* path;
+	size_t capacity;
+	size_t size;
+	uint64_t model_hash;
+
+	// Most recently used first
+	struct llmd_disk_cache_entry* head;
+	struct llmd_disk_cache_entry* tail;
+	unsigned int num_entries;
+
+	uint64_t num_hits;
+	uint64_t num_writes;
+	uint64_t num_evictions;
+	uint64_t num_rejected;
+	// Counted by the user of the cache
+	uint64_t num_tokens_restored;
+};
+
+// A validated file mapped into memory
+struct llmd_disk_cache_mapping {
+	void* base;
+	size_t size;
+
+	const llmd_token_t* tokens;
+	unsigned int num_tokens;
+	const void* state;
+	size_t state_size;
+};
+
+// Creates the directory if needed and indexes the files already in it
+enum llmd_error
+llmd_disk_cache_init(
+	struct llmd_host* host,
+	const char* path,
+	size_t capacity,
+	uint64_t model_hash,
+	struct llmd_disk_cache* cache
+);
+
+// Files are kept
+void
+llmd_disk_cache_cleanup(
+	struct llmd_disk_cache* cache
+);
+
+uint64_t
+llmd_disk_cache_key(
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+);
+
+// Find the entry sharing the longest prefix with tokens if it is longer than
+// min_shared_prefix.
+// It becomes the most recently used.
+struct llmd_disk_cache_entry*
+llmd_disk_cache_find_longest(
+	struct llmd_disk_cache* cache,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int min_shared_prefix,
+	unsigned int* shared_prefix_out
+);
+
+// Map the file of an entry and verify its checksum.
+// A file which fails is deleted together with its entry.
+enum llmd_error
+llmd_disk_cache_map(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry,
+	struct llmd_disk_cache_mapping* mapping_out
+);
+
+void
+llmd_disk_cache_unmap(
+	struct llmd_disk_cache_mapping* mapping
+);
+
+// Write a state into a temporary file.
+// This only reads what is immutable in the cache so it can be done without
+// holding its lock.
+enum llmd_error
+llmd_disk_cache_write(
+	const struct llmd_disk_cache* cache,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	const void* state,
+	size_t state_size,
+	struct llmd_disk_cache_entry** entry_out,
+	char** tmp_path_out
+);
+
+// Move a written file into place, evicting older ones to make room.
+// The file is dropped if an entry with the same tokens exists or it can never
+// fit.
+void
+llmd_disk_cache_commit(
+	struct llmd_disk_cache* cache,
+	struct llmd_disk_cache_entry* entry,
+	char* tmp_path
+);
+
+#endif
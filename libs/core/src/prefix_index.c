@@ -0,0 +1,620 @@
+#include "prefix_index.h"
+#include "common.h"
+#include <llmd/utils/host.h>
+#include <string.h>
+
+#define LLMD_PREFIX_INDEX_MIN_NODES 64
+#define LLMD_PREFIX_INDEX_MIN_SLOTS 128
+
+static inline uint64_t
+llmd_prefix_index_make_key(unsigned int parent, llmd_token_t token) {
+	return ((uint64_t)parent << 32) | (uint64_t)token;
+}
+
+// splitmix64 finalizer
+static inline uint64_t
+llmd_prefix_index_hash(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+static unsigned int
+llmd_prefix_index_find_slot(
+	const struct llmd_prefix_index* index,
+	uint64_t key
+) {
+	size_t mask = llmd_buffer_size(index->slots) - 1;
+	size_t slot = llmd_prefix_index_hash(key) & mask;
+
+	while (index->slots[slot].node != LLMD_PREFIX_NIL) {
+		if (index->slots[slot].key == key) {
+			return (unsigned int)slot;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	return (unsigned int)slot;
+}
+
+static enum llmd_error
+llmd_prefix_index_grow_slots(struct llmd_prefix_index* index) {
+	size_t old_capacity = llmd_buffer_size(index->slots);
+	size_t new_capacity = old_capacity * 2;
+
+	llmd_buffer(struct llmd_prefix_slot) old_slots = index->slots;
+	llmd_buffer(struct llmd_prefix_slot) new_slots = llmd_resize_buffer(
+		index->host, (struct llmd_prefix_slot*)NULL, new_capacity
+	);
+	if (new_slots == NULL) { return LLMD_ERR_OOM; }
+
+	for (size_t i = 0; i < new_capacity; ++i) {
+		new_slots[i].node = LLMD_PREFIX_NIL;
+	}
+
+	index->slots = new_slots;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		if (old_slots[i].node == LLMD_PREFIX_NIL) { continue; }
+
+		unsigned int slot = llmd_prefix_index_find_slot(index, old_slots[i].key);
+		index->slots[slot] = old_slots[i];
+	}
+
+	llmd_free_buffer(index->host, old_slots);
+	return LLMD_OK;
+}
+
+static void
+llmd_prefix_index_remove_slot(
+	struct llmd_prefix_index* index,
+	uint64_t key
+) {
+	size_t mask = llmd_buffer_size(index->slots) - 1;
+	size_t hole = llmd_prefix_index_find_slot(index, key);
+	if (index->slots[hole].node == LLMD_PREFIX_NIL) { return; }
+
+	// Backward shift deletion so lookups never need tombstones
+	size_t slot = hole;
+	while (true) {
+		slot = (slot + 1) & mask;
+		if (index->slots[slot].node == LLMD_PREFIX_NIL) { break; }
+
+		size_t home = llmd_prefix_index_hash(index->slots[slot].key) & mask;
+		bool movable = hole <= slot
+			? (home <= hole || home > slot)
+			: (home <= hole && home > slot);
+		if (movable) {
+			index->slots[hole] = index->slots[slot];
+			hole = slot;
+		}
+	}
+
+	index->slots[hole].node = LLMD_PREFIX_NIL;
+	--index->num_slots_used;
+}
+
+static enum llmd_error
+llmd_prefix_index_alloc_node(
+	struct llmd_prefix_index* index,
+	unsigned int* node_out
+) {
+	if (index->free_nodes != LLMD_PREFIX_NIL) {
+		*node_out = index->free_nodes;
+		index->free_nodes = index->nodes[index->free_nodes].next_sibling;
+		return LLMD_OK;
+	}
+
+	size_t capacity = llmd_buffer_size(index->nodes);
+	if (index->num_nodes >= capacity) {
+		size_t new_capacity = capacity > 0 ? capacity * 2 : LLMD_PREFIX_INDEX_MIN_NODES;
+		if (new_capacity >= LLMD_PREFIX_NIL) { return LLMD_ERR_OOM; }
+
+		llmd_buffer(struct llmd_prefix_node) new_nodes = llmd_resize_buffer(
+			index->host, index->nodes, new_capacity
+		);
+		if (new_nodes == NULL) { return LLMD_ERR_OOM; }
+
+		index->nodes = new_nodes;
+	}
+
+	*node_out = index->num_nodes++;
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_prefix_index_get_child(
+	struct llmd_prefix_index* index,
+	unsigned int parent,
+	llmd_token_t token,
+	unsigned int* child_out
+) {
+	uint64_t key = llmd_prefix_index_make_key(parent, token);
+	unsigned int slot = llmd_prefix_index_find_slot(index, key);
+	if (index->slots[slot].node != LLMD_PREFIX_NIL) {
+		*child_out = index->slots[slot].node;
+		return LLMD_OK;
+	}
+
+	// Keep the load factor under 3/4
+	if ((index->num_slots_used + 1) * 4 > llmd_buffer_size(index->slots) * 3) {
+		LLMD_CHECK_RETURN(llmd_prefix_index_grow_slots(index));
+		slot = llmd_prefix_index_find_slot(index, key);
+	}
+
+	unsigned int child;
+	LLMD_CHECK_RETURN(llmd_prefix_index_alloc_node(index, &child));
+
+	struct llmd_prefix_node* parent_node = &index->nodes[parent];
+	index->nodes[child] = (struct llmd_prefix_node) {
+		.token = token,
+		.depth = parent_node->depth + 1,
+		.parent = parent,
+		.first_child = LLMD_PREFIX_NIL,
+		.prev_sibling = LLMD_PREFIX_NIL,
+		.next_sibling = parent_node->first_child,
+		.min_idle_end = LLMD_PREFIX_NIL,
+	};
+	if (parent_node->first_child != LLMD_PREFIX_NIL) {
+		index->nodes[parent_node->first_child].prev_sibling = child;
+	}
+	parent_node->first_child = child;
+
+	index->slots[slot] = (struct llmd_prefix_slot) {
+		.key = key,
+		.node = child,
+	};
+	++index->num_slots_used;
+
+	*child_out = child;
+	return LLMD_OK;
+}
+
+static void
+llmd_prefix_index_release_node(
+	struct llmd_prefix_index* index,
+	unsigned int node_id
+) {
+	struct llmd_prefix_node* node = &index->nodes[node_id];
+	struct llmd_prefix_node* parent = &index->nodes[node->parent];
+
+	if (node->prev_sibling != LLMD_PREFIX_NIL) {
+		index->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+	} else {
+		parent->first_child = node->next_sibling;
+	}
+
+	if (node->next_sibling != LLMD_PREFIX_NIL) {
+		index->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+	}
+
+	llmd_prefix_index_remove_slot(
+		index, llmd_prefix_index_make_key(node->parent, node->token)
+	);
+
+	node->next_sibling = index->free_nodes;
+	index->free_nodes = node_id;
+}
+
+static inline unsigned int
+llmd_prefix_index_end_node(const struct llmd_prefix_entry* entry) {
+	return entry->length > 0 ? entry->path[entry->length - 1] : 0;
+}
+
+// An idle entry now ends at node_id
+static void
+llmd_prefix_index_add_idle_end(
+	struct llmd_prefix_index* index,
+	unsigned int node_id
+) {
+	unsigned int depth = index->nodes[node_id].depth;
+	while (node_id != LLMD_PREFIX_NIL && index->nodes[node_id].min_idle_end > depth) {
+		index->nodes[node_id].min_idle_end = depth;
+		node_id = index->nodes[node_id].parent;
+	}
+}
+
+// An idle entry no longer ends at node_id.
+// Only the ancestors it was the shallowest end for are recomputed, from their
+// children.
+static void
+llmd_prefix_index_remove_idle_end(
+	struct llmd_prefix_index* index,
+	unsigned int node_id
+) {
+	unsigned int depth = index->nodes[node_id].depth;
+	while (node_id != LLMD_PREFIX_NIL) {
+		struct llmd_prefix_node* node = &index->nodes[node_id];
+		if (node->min_idle_end != depth) { break; }
+
+		unsigned int min_idle_end = node->idle_terminal_count > 0
+			? node->depth
+			: LLMD_PREFIX_NIL;
+		for (
+			unsigned int child = node->first_child;
+			child != LLMD_PREFIX_NIL && min_idle_end > depth;
+			child = index->nodes[child].next_sibling
+		) {
+			if (index->nodes[child].min_idle_end < min_idle_end) {
+				min_idle_end = index->nodes[child].min_idle_end;
+			}
+		}
+
+		node->min_idle_end = min_idle_end;
+		if (min_idle_end == depth) { break; }
+
+		node_id = node->parent;
+	}
+}
+
+static void
+llmd_prefix_index_link_terminal(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry
+) {
+	struct llmd_prefix_node* node = &index->nodes[llmd_prefix_index_end_node(entry)];
+
+	entry->prev_terminal = NULL;
+	entry->next_terminal = node->terminals;
+	if (node->terminals != NULL) {
+		node->terminals->prev_terminal = entry;
+	}
+	node->terminals = entry;
+
+	if (entry->idle) {
+		++node->idle_terminal_count;
+		llmd_prefix_index_add_idle_end(index, llmd_prefix_index_end_node(entry));
+	}
+}
+
+static void
+llmd_prefix_index_unlink_terminal(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry
+) {
+	struct llmd_prefix_node* node = &index->nodes[llmd_prefix_index_end_node(entry)];
+
+	if (entry->prev_terminal != NULL) {
+		entry->prev_terminal->next_terminal = entry->next_terminal;
+	} else {
+		node->terminals = entry->next_terminal;
+	}
+
+	if (entry->next_terminal != NULL) {
+		entry->next_terminal->prev_terminal = entry->prev_terminal;
+	}
+
+	entry->prev_terminal = entry->next_terminal = NULL;
+
+	if (entry->idle) {
+		--node->idle_terminal_count;
+		llmd_prefix_index_remove_idle_end(index, llmd_prefix_index_end_node(entry));
+	}
+}
+
+// The entry must not be linked as a terminal
+static void
+llmd_prefix_index_truncate(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry,
+	unsigned int length
+) {
+	for (unsigned int depth = entry->length; depth > length; --depth) {
+		unsigned int node_id = entry->path[depth - 1];
+		struct llmd_prefix_node* node = &index->nodes[node_id];
+
+		if (entry->idle) { --node->idle_count; }
+		if (--node->ref_count == 0) {
+			llmd_prefix_index_release_node(index, node_id);
+		}
+	}
+
+	entry->length = length < entry->length ? length : entry->length;
+}
+
+static struct llmd_prefix_entry*
+llmd_prefix_index_idle_terminal_of(
+	struct llmd_prefix_index* index,
+	unsigned int node_id
+) {
+	for (
+		struct llmd_prefix_entry* itr = index->nodes[node_id].terminals;
+		itr != NULL;
+		itr = itr->next_terminal
+	) {
+		if (itr->idle) { return itr; }
+	}
+
+	return NULL;
+}
+
+// Returns the depth of the deepest node along tokens with an idle entry below
+// it and store the path in the scratch buffer.
+static enum llmd_error
+llmd_prefix_index_walk(
+	struct llmd_prefix_index* index,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int* depth_out
+) {
+	if (llmd_buffer_size(index->scratch) < (size_t)num_tokens + 1) {
+		llmd_buffer(unsigned int) new_scratch = llmd_resize_buffer(
+			index->host, index->scratch, (size_t)num_tokens + 1
+		);
+		if (new_scratch == NULL) { return LLMD_ERR_OOM; }
+
+		index->scratch = new_scratch;
+	}
+
+	unsigned int node = 0;
+	unsigned int depth = 0;
+	index->scratch[0] = node;
+	while (depth < num_tokens) {
+		unsigned int slot = llmd_prefix_index_find_slot(
+			index, llmd_prefix_index_make_key(node, tokens[depth])
+		);
+		unsigned int child = index->slots[slot].node;
+		if (child == LLMD_PREFIX_NIL || index->nodes[child].idle_count == 0) {
+			break;
+		}
+
+		node = child;
+		index->scratch[++depth] = node;
+	}
+
+	*depth_out = depth;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_prefix_index_init(
+	struct llmd_host* host,
+	struct llmd_prefix_index* index
+) {
+	*index = (struct llmd_prefix_index) {
+		.host = host,
+		.free_nodes = LLMD_PREFIX_NIL,
+	};
+
+	index->slots = llmd_resize_buffer(
+		host, (struct llmd_prefix_slot*)NULL, LLMD_PREFIX_INDEX_MIN_SLOTS
+	);
+	if (index->slots == NULL) { return LLMD_ERR_OOM; }
+
+	for (size_t i = 0; i < LLMD_PREFIX_INDEX_MIN_SLOTS; ++i) {
+		index->slots[i].node = LLMD_PREFIX_NIL;
+	}
+
+	// Root node is never released
+	unsigned int root;
+	if (llmd_prefix_index_alloc_node(index, &root) != LLMD_OK) {
+		llmd_prefix_index_cleanup(index);
+		return LLMD_ERR_OOM;
+	}
+
+	index->nodes[root] = (struct llmd_prefix_node) {
+		.parent = LLMD_PREFIX_NIL,
+		.first_child = LLMD_PREFIX_NIL,
+		.prev_sibling = LLMD_PREFIX_NIL,
+		.next_sibling = LLMD_PREFIX_NIL,
+		.min_idle_end = LLMD_PREFIX_NIL,
+	};
+
+	return LLMD_OK;
+}
+
+void
+llmd_prefix_index_cleanup(
+	struct llmd_prefix_index* index
+) {
+	llmd_free_buffer(index->host, index->nodes);
+	llmd_free_buffer(index->host, index->slots);
+	llmd_free_buffer(index->host, index->scratch);
+	index->nodes = NULL;
+	index->slots = NULL;
+	index->scratch = NULL;
+}
+
+void
+llmd_prefix_index_add(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry
+) {
+	entry->length = 0;
+	entry->idle = false;
+	entry->linked = true;
+
+	++index->nodes[0].ref_count;
+	llmd_prefix_index_link_terminal(index, entry);
+}
+
+void
+llmd_prefix_index_remove(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry
+) {
+	if (!entry->linked) { return; }
+
+	llmd_prefix_index_unlink_terminal(index, entry);
+	llmd_prefix_index_truncate(index, entry, 0);
+
+	struct llmd_prefix_node* root = &index->nodes[0];
+	--root->ref_count;
+	if (entry->idle) { --root->idle_count; }
+
+	llmd_free_buffer(index->host, entry->path);
+	entry->path = NULL;
+	entry->linked = false;
+}
+
+void
+llmd_prefix_index_set_idle(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry,
+	bool idle
+) {
+	if (!entry->linked || entry->idle == idle) { return; }
+
+	llmd_prefix_index_unlink_terminal(index, entry);
+
+	if (idle) {
+		++index->nodes[0].idle_count;
+		for (unsigned int i = 0; i < entry->length; ++i) {
+			++index->nodes[entry->path[i]].idle_count;
+		}
+	} else {
+		--index->nodes[0].idle_count;
+		for (unsigned int i = 0; i < entry->length; ++i) {
+			--index->nodes[entry->path[i]].idle_count;
+		}
+	}
+	entry->idle = idle;
+
+	llmd_prefix_index_link_terminal(index, entry);
+}
+
+enum llmd_error
+llmd_prefix_index_update(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry,
+	const llmd_token_t* tokens,
+	unsigned int keep,
+	unsigned int length
+) {
+	if (!entry->linked) { return LLMD_ERR_INVALID; }
+
+	enum llmd_error status = LLMD_OK;
+	llmd_prefix_index_unlink_terminal(index, entry);
+
+	keep = keep < entry->length ? keep : entry->length;
+	keep = keep < length ? keep : length;
+	// Rewriting the same tokens is common, don't churn the nodes for them
+	while (
+		keep < entry->length
+		&& keep < length
+		&& index->nodes[entry->path[keep]].token == tokens[keep]
+	) {
+		++keep;
+	}
+
+	llmd_prefix_index_truncate(index, entry, keep);
+
+	size_t path_capacity = llmd_buffer_size(entry->path);
+	if (path_capacity < length) {
+		path_capacity = path_capacity * 2 > length ? path_capacity * 2 : length;
+		llmd_buffer(unsigned int) new_path = llmd_resize_buffer(
+			index->host, entry->path, path_capacity
+		);
+		if (new_path == NULL) {
+			status = LLMD_ERR_OOM;
+			length = keep;
+		} else {
+			entry->path = new_path;
+		}
+	}
+
+	for (unsigned int i = keep; i < length; ++i) {
+		unsigned int parent = i > 0 ? entry->path[i - 1] : 0;
+		unsigned int child;
+		if ((status = llmd_prefix_index_get_child(index, parent, tokens[i], &child)) != LLMD_OK) {
+			break;
+		}
+
+		struct llmd_prefix_node* node = &index->nodes[child];
+		++node->ref_count;
+		if (entry->idle) { ++node->idle_count; }
+
+		entry->path[i] = child;
+		entry->length = i + 1;
+	}
+
+	llmd_prefix_index_link_terminal(index, entry);
+	return status;
+}
+
+enum llmd_error
+llmd_prefix_index_find_longest(
+	struct llmd_prefix_index* index,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	struct llmd_prefix_entry** entry_out,
+	unsigned int* shared_prefix_out
+) {
+	*entry_out = NULL;
+	*shared_prefix_out = 0;
+	if (index->nodes[0].idle_count == 0) { return LLMD_OK; }
+
+	unsigned int depth;
+	LLMD_CHECK_RETURN(llmd_prefix_index_walk(index, tokens, num_tokens, &depth));
+
+	// Any idle entry below the deepest node will do, follow the first branch
+	// which still has one
+	unsigned int node = index->scratch[depth];
+	while (index->nodes[node].idle_terminal_count == 0) {
+		unsigned int child = index->nodes[node].first_child;
+		while (index->nodes[child].idle_count == 0) {
+			child = index->nodes[child].next_sibling;
+		}
+
+		node = child;
+	}
+
+	*entry_out = llmd_prefix_index_idle_terminal_of(index, node);
+	*shared_prefix_out = depth;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_prefix_index_find_least_discard(
+	struct llmd_prefix_index* index,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	struct llmd_prefix_entry** entry_out,
+	unsigned int* shared_prefix_out
+) {
+	*entry_out = NULL;
+	*shared_prefix_out = 0;
+	if (index->nodes[0].idle_count == 0) { return LLMD_OK; }
+
+	unsigned int depth;
+	LLMD_CHECK_RETURN(llmd_prefix_index_walk(index, tokens, num_tokens, &depth));
+
+	// The entries ending below a node on the path share at least its depth
+	// with tokens so the least discard through it is bounded by its
+	// min_idle_end minus its depth.
+	// The bound is reached at the node where the best entry leaves the path.
+	// Prefer the deepest one on a tie.
+	unsigned int best_depth = 0;
+	unsigned int best_discard = LLMD_PREFIX_NIL;
+	for (unsigned int d = depth + 1; d > 0; --d) {
+		const struct llmd_prefix_node* node = &index->nodes[index->scratch[d - 1]];
+		if (node->min_idle_end == LLMD_PREFIX_NIL) { continue; }
+
+		unsigned int discard = node->min_idle_end - node->depth;
+		if (discard < best_discard) {
+			best_discard = discard;
+			best_depth = d - 1;
+		}
+	}
+
+	if (best_discard == LLMD_PREFIX_NIL) { return LLMD_OK; }
+
+	// Follow the branch holding the shallowest end
+	unsigned int end_depth = best_depth + best_discard;
+	unsigned int node = index->scratch[best_depth];
+	while (index->nodes[node].depth < end_depth) {
+		unsigned int child = index->nodes[node].first_child;
+		while (index->nodes[child].min_idle_end != end_depth) {
+			child = index->nodes[child].next_sibling;
+		}
+
+		node = child;
+	}
+
+	*entry_out = llmd_prefix_index_idle_terminal_of(index, node);
+	*shared_prefix_out = best_depth;
+	return LLMD_OK;
+}
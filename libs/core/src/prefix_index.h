@@ -0,0 +1,127 @@
+#ifndef LLMD_CORE_PREFIX_INDEX_H
+#define LLMD_CORE_PREFIX_INDEX_H
+
+#include <llmd/core.h>
+#include <llmd/utils/buffer.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LLMD_PREFIX_NIL UINT_MAX
+
+#define llmd_container_of(ptr, type, member) \
+	((type*)((char*)(ptr) - offsetof(type, member)))
+
+// A token trie over the windows of the pooled physical contexts.
+// Every node counts how many indexed entries pass through it and how many of
+// those are idle, and knows the shallowest depth an idle entry ends at below
+// it, so that a lookup only has to follow the prompt.
+struct llmd_prefix_node {
+	llmd_token_t token;
+	unsigned int depth;
+	unsigned int parent;
+	unsigned int first_child;
+	unsigned int prev_sibling;
+	unsigned int next_sibling;
+
+	unsigned int ref_count;
+	unsigned int idle_count;
+	unsigned int idle_terminal_count;
+	// LLMD_PREFIX_NIL when no idle entry ends in the subtree
+	unsigned int min_idle_end;
+	struct llmd_prefix_entry* terminals;
+};
+
+struct llmd_prefix_slot {
+	uint64_t key;
+	unsigned int node;
+};
+
+struct llmd_prefix_index {
+	struct llmd_host* host;
+
+	llmd_buffer(struct llmd_prefix_node) nodes;
+	unsigned int num_nodes;
+	unsigned int free_nodes;
+
+	// Open addressing map from (parent, token) to child
+	llmd_buffer(struct llmd_prefix_slot) slots;
+	unsigned int num_slots_used;
+
+	llmd_buffer(unsigned int) scratch;
+};
+
+// Embedded in an indexed object, usually a physical context
+struct llmd_prefix_entry {
+	llmd_buffer(unsigned int) path;
+	unsigned int length;
+	bool idle;
+	bool linked;
+
+	struct llmd_prefix_entry* prev_terminal;
+	struct llmd_prefix_entry* next_terminal;
+};
+
+enum llmd_error
+llmd_prefix_index_init(
+	struct llmd_host* host,
+	struct llmd_prefix_index* index
+);
+
+void
+llmd_prefix_index_cleanup(
+	struct llmd_prefix_index* index
+);
+
+void
+llmd_prefix_index_add(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry
+);
+
+void
+llmd_prefix_index_remove(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry
+);
+
+void
+llmd_prefix_index_set_idle(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry,
+	bool idle
+);
+
+// Make the entry hold tokens[0..length) where the first `keep` tokens are
+// assumed to be unchanged.
+// On error, the entry is left holding a valid but shorter prefix.
+enum llmd_error
+llmd_prefix_index_update(
+	struct llmd_prefix_index* index,
+	struct llmd_prefix_entry* entry,
+	const llmd_token_t* tokens,
+	unsigned int keep,
+	unsigned int length
+);
+
+// Find the idle entry sharing the longest prefix with tokens
+enum llmd_error
+llmd_prefix_index_find_longest(
+	struct llmd_prefix_index* index,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	struct llmd_prefix_entry** entry_out,
+	unsigned int* shared_prefix_out
+);
+
+// Find the idle entry with the least tokens after its prefix shared with tokens
+enum llmd_error
+llmd_prefix_index_find_least_discard(
+	struct llmd_prefix_index* index,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	struct llmd_prefix_entry** entry_out,
+	unsigned int* shared_prefix_out
+);
+
+#endif
@@ -0,0 +1,407 @@
+#include "scheduler.h"
+#include "common.h"
+#include <errno.h>
+
+static unsigned int
+llmd_scheduler_remaining(const struct llmd_scheduler_job* job) {
+	return job->item.num_tokens - job->num_evaluated;
+}
+
+// Must be called with the lock held.
+// Take up to budget tokens from the job into the batch, returns the number
+// taken.
+// A whole job is only taken if it fits, or past the budget if it is the
+// oldest.
+static unsigned int
+llmd_scheduler_take(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* job,
+	unsigned int* num_items_inout,
+	unsigned int budget
+) {
+	unsigned int remaining = llmd_scheduler_remaining(job);
+	unsigned int num_tokens = remaining < budget ? remaining : budget;
+	if (job->whole && num_tokens < remaining) {
+		if (job != scheduler->head) { return 0; }
+		num_tokens = remaining;
+	}
+	if (num_tokens == 0) { return 0; }
+
+	// Only the last chunk of a job produces logits
+	unsigned int index = (*num_items_inout)++;
+	scheduler->batch_items[index] = (struct llmd_driver_generate_item) {
+		.context_descriptor = job->item.context_descriptor,
+		.tokens = job->item.tokens + job->num_evaluated,
+		.num_tokens = num_tokens,
+		.offset = job->item.offset + job->num_evaluated,
+		.output = num_tokens == remaining ? job->item.output : NULL,
+	};
+	scheduler->batch_jobs[index] = job;
+
+	return num_tokens;
+}
+
+// Must be called with the lock held
+static unsigned int
+llmd_scheduler_form_batch(
+	struct llmd_scheduler* scheduler,
+	unsigned int* num_tokens_out
+) {
+	unsigned int budget = scheduler->max_batch_tokens;
+	unsigned int num_items = 0;
+	unsigned int num_tokens = 0;
+
+	// Single token decodes go first so they are not stuck behind a long
+	// prompt, then chunks of prompts from the oldest.
+	// A token is kept for the oldest job so it always makes progress.
+	unsigned int reserved = llmd_scheduler_remaining(scheduler->head) > 1 ? 1 : 0;
+	for (
+		struct llmd_scheduler_job* itr = scheduler->head;
+		itr != NULL && budget > reserved;
+		itr = itr->next
+	) {
+		if (llmd_scheduler_remaining(itr) == 1) {
+			budget -= llmd_scheduler_take(scheduler, itr, &num_items, budget);
+			++num_tokens;
+		}
+	}
+
+	for (
+		struct llmd_scheduler_job* itr = scheduler->head;
+		itr != NULL && budget > 0;
+		itr = itr->next
+	) {
+		if (llmd_scheduler_remaining(itr) > 1) {
+			unsigned int taken = llmd_scheduler_take(scheduler, itr, &num_items, budget);
+			budget = taken < budget ? budget - taken : 0;
+			num_tokens += taken;
+		}
+	}
+
+	*num_tokens_out = num_tokens;
+	return num_items;
+}
+
+// Must be called with the lock held
+static void
+llmd_scheduler_dequeue(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* job
+) {
+	struct llmd_scheduler_job** itr = &scheduler->head;
+	struct llmd_scheduler_job* prev = NULL;
+	while (*itr != job) {
+		prev = *itr;
+		itr = &(*itr)->next;
+	}
+
+	*itr = job->next;
+	if (scheduler->tail == job) {
+		scheduler->tail = prev;
+	}
+
+	scheduler->num_queued_tokens -= llmd_scheduler_remaining(job);
+}
+
+// Must be called with the lock held.
+// Jobs with a callback are collected to be notified after unlocking.
+static void
+llmd_scheduler_complete(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* job,
+	enum llmd_error status,
+	struct llmd_scheduler_job** completed_inout
+) {
+	llmd_scheduler_dequeue(scheduler, job);
+	job->status = status;
+
+	if (job->on_done != NULL) {
+		job->next = *completed_inout;
+		*completed_inout = job;
+	} else {
+		job->done = true;
+	}
+}
+
+static void
+llmd_scheduler_notify(struct llmd_scheduler_job* completed) {
+	while (completed != NULL) {
+		// The job may be gone after its callback
+		struct llmd_scheduler_job* next = completed->next;
+		completed->on_done(completed);
+		completed = next;
+	}
+}
+
+static void*
+llmd_scheduler_main(void* userdata) {
+	struct llmd_scheduler* scheduler = userdata;
+	struct llmd_driver* driver = scheduler->driver;
+
+	pthread_mutex_lock(&scheduler->lock);
+	while (true) {
+		while (!scheduler->stop && scheduler->head == NULL) {
+			pthread_cond_wait(&scheduler->work_cond, &scheduler->lock);
+		}
+
+		if (scheduler->stop) { break; }
+
+		// Give other callers a chance to join the batch
+		uint64_t deadline_ns = scheduler->head->enqueue_time_ns
+			+ (uint64_t)scheduler->max_wait_us * 1000ull;
+		struct timespec deadline = llmd_timespec_from_ns(deadline_ns);
+		while (
+			!scheduler->stop
+			&& scheduler->num_queued_tokens < scheduler->max_batch_tokens
+		) {
+			if (
+				pthread_cond_timedwait(&scheduler->work_cond, &scheduler->lock, &deadline)
+				== ETIMEDOUT
+			) {
+				break;
+			}
+		}
+
+		if (scheduler->stop) { break; }
+
+		unsigned int num_tokens;
+		unsigned int num_items = llmd_scheduler_form_batch(scheduler, &num_tokens);
+		struct llmd_driver_generate_item* items = scheduler->batch_items;
+		pthread_mutex_unlock(&scheduler->lock);
+
+		uint64_t start_ns = llmd_monotonic_ns();
+		enum llmd_error batch_status = LLMD_OK;
+		if (driver->interface->generate_batch != NULL) {
+			batch_status = driver->interface->generate_batch(driver, items, num_items);
+		}
+		uint64_t eval_ns = llmd_monotonic_ns() - start_ns;
+
+		pthread_mutex_lock(&scheduler->lock);
+		struct llmd_scheduler_job* completed = NULL;
+		unsigned int num_chunks = 0;
+		for (unsigned int i = 0; i < num_items; ++i) {
+			struct llmd_scheduler_job* job = scheduler->batch_jobs[i];
+			enum llmd_error status = batch_status;
+
+			if (driver->interface->generate_batch == NULL) {
+				// The lock is not needed for the driver call
+				pthread_mutex_unlock(&scheduler->lock);
+				status = driver->interface->generate(
+					driver,
+					items[i].context_descriptor,
+					items[i].tokens, items[i].num_tokens, items[i].offset,
+					items[i].output
+				);
+				pthread_mutex_lock(&scheduler->lock);
+			}
+
+			if (status == LLMD_OK) {
+				job->num_evaluated += items[i].num_tokens;
+				scheduler->num_queued_tokens -= items[i].num_tokens;
+			}
+
+			if (status != LLMD_OK || llmd_scheduler_remaining(job) == 0) {
+				llmd_scheduler_complete(scheduler, job, status, &completed);
+			} else {
+				++num_chunks;
+			}
+		}
+
+		if (driver->interface->generate_batch == NULL) {
+			eval_ns = llmd_monotonic_ns() - start_ns;
+		}
+
+		struct llmd_batch_stats* stats = &scheduler->stats;
+		++stats->num_batches;
+		stats->num_items += num_items;
+		stats->num_tokens += num_tokens;
+		stats->num_partial_chunks += num_chunks;
+		stats->total_eval_ns += eval_ns;
+		stats->last_batch_items = num_items;
+		stats->last_batch_tokens = num_tokens;
+		stats->last_eval_ns = eval_ns;
+		if (num_tokens > stats->max_batch_tokens) {
+			stats->max_batch_tokens = num_tokens;
+		}
+
+		pthread_cond_broadcast(&scheduler->done_cond);
+
+		if (completed != NULL) {
+			pthread_mutex_unlock(&scheduler->lock);
+			llmd_scheduler_notify(completed);
+			pthread_mutex_lock(&scheduler->lock);
+		}
+	}
+
+	// Fail whatever is left
+	struct llmd_scheduler_job* completed = NULL;
+	while (scheduler->head != NULL) {
+		llmd_scheduler_complete(scheduler, scheduler->head, LLMD_ERR_INVALID, &completed);
+	}
+	pthread_cond_broadcast(&scheduler->done_cond);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	llmd_scheduler_notify(completed);
+
+	return NULL;
+}
+
+enum llmd_error
+llmd_scheduler_init(
+	struct llmd_host* host,
+	struct llmd_driver* driver,
+	unsigned int max_batch_tokens,
+	unsigned int max_wait_us,
+	struct llmd_scheduler* scheduler
+) {
+LLMD_TRY
+	bool lock_initialized = false;
+	bool work_cond_initialized = false;
+	bool done_cond_initialized = false;
+	pthread_condattr_t cond_attr;
+	bool cond_attr_initialized = false;
+
+	*scheduler = (struct llmd_scheduler) {
+		.host = host,
+		.driver = driver,
+		.max_batch_tokens = max_batch_tokens,
+		.max_wait_us = max_wait_us,
+	};
+
+	// Every item has at least one token
+	scheduler->batch_items = llmd_resize_buffer(host, scheduler->batch_items, max_batch_tokens);
+	scheduler->batch_jobs = llmd_resize_buffer(host, scheduler->batch_jobs, max_batch_tokens);
+	if (scheduler->batch_items == NULL || scheduler->batch_jobs == NULL) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+
+	if (pthread_mutex_init(&scheduler->lock, NULL) != 0) { LLMD_THROW(LLMD_ERR_OOM); }
+	lock_initialized = true;
+
+	if (pthread_condattr_init(&cond_attr) != 0) { LLMD_THROW(LLMD_ERR_OOM); }
+	cond_attr_initialized = true;
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+	if (pthread_cond_init(&scheduler->work_cond, &cond_attr) != 0) { LLMD_THROW(LLMD_ERR_OOM); }
+	work_cond_initialized = true;
+
+	if (pthread_cond_init(&scheduler->done_cond, NULL) != 0) { LLMD_THROW(LLMD_ERR_OOM); }
+	done_cond_initialized = true;
+
+	if (pthread_create(&scheduler->thread, NULL, llmd_scheduler_main, scheduler) != 0) {
+		LLMD_THROW(LLMD_ERR_OOM);
+	}
+
+	pthread_condattr_destroy(&cond_attr);
+	return LLMD_OK;
+LLMD_EXCEPT_BEGIN
+	if (done_cond_initialized) { pthread_cond_destroy(&scheduler->done_cond); }
+	if (work_cond_initialized) { pthread_cond_destroy(&scheduler->work_cond); }
+	if (cond_attr_initialized) { pthread_condattr_destroy(&cond_attr); }
+	if (lock_initialized) { pthread_mutex_destroy(&scheduler->lock); }
+	llmd_free_buffer(host, scheduler->batch_items);
+	llmd_free_buffer(host, scheduler->batch_jobs);
+LLMD_EXCEPT_END
+}
+
+void
+llmd_scheduler_cleanup(
+	struct llmd_scheduler* scheduler
+) {
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stop = true;
+	pthread_cond_signal(&scheduler->work_cond);
+	pthread_mutex_unlock(&scheduler->lock);
+	pthread_join(scheduler->thread, NULL);
+
+	pthread_cond_destroy(&scheduler->done_cond);
+	pthread_cond_destroy(&scheduler->work_cond);
+	pthread_mutex_destroy(&scheduler->lock);
+	llmd_free_buffer(scheduler->host, scheduler->batch_items);
+	llmd_free_buffer(scheduler->host, scheduler->batch_jobs);
+}
+
+// Must be called with the lock held
+static void
+llmd_scheduler_enqueue(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* jobs,
+	unsigned int num_jobs,
+	struct llmd_scheduler_job** completed_inout
+) {
+	uint64_t now_ns = llmd_monotonic_ns();
+
+	for (unsigned int i = 0; i < num_jobs; ++i) {
+		struct llmd_scheduler_job* job = &jobs[i];
+		job->num_evaluated = 0;
+		job->done = false;
+		job->enqueue_time_ns = now_ns;
+		job->next = NULL;
+
+		if (job->item.num_tokens == 0) {
+			job->status = LLMD_ERR_INVALID;
+			if (job->on_done != NULL) {
+				job->next = *completed_inout;
+				*completed_inout = job;
+			} else {
+				job->done = true;
+			}
+			continue;
+		}
+
+		if (scheduler->tail != NULL) {
+			scheduler->tail->next = job;
+		} else {
+			scheduler->head = job;
+		}
+		scheduler->tail = job;
+		scheduler->num_queued_tokens += job->item.num_tokens;
+	}
+	pthread_cond_signal(&scheduler->work_cond);
+}
+
+void
+llmd_scheduler_run(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* jobs,
+	unsigned int num_jobs
+) {
+	struct llmd_scheduler_job* completed = NULL;
+
+	pthread_mutex_lock(&scheduler->lock);
+	llmd_scheduler_enqueue(scheduler, jobs, num_jobs, &completed);
+
+	for (unsigned int i = 0; i < num_jobs; ++i) {
+		while (jobs[i].on_done == NULL && !jobs[i].done) {
+			pthread_cond_wait(&scheduler->done_cond, &scheduler->lock);
+		}
+	}
+	pthread_mutex_unlock(&scheduler->lock);
+
+	llmd_scheduler_notify(completed);
+}
+
+void
+llmd_scheduler_submit(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* jobs,
+	unsigned int num_jobs
+) {
+	struct llmd_scheduler_job* completed = NULL;
+
+	pthread_mutex_lock(&scheduler->lock);
+	llmd_scheduler_enqueue(scheduler, jobs, num_jobs, &completed);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	llmd_scheduler_notify(completed);
+}
+
+void
+llmd_scheduler_get_stats(
+	struct llmd_scheduler* scheduler,
+	struct llmd_batch_stats* stats_out
+) {
+	pthread_mutex_lock(&scheduler->lock);
+	*stats_out = scheduler->stats;
+	pthread_mutex_unlock(&scheduler->lock);
+}
@@ -0,0 +1,91 @@
+#ifndef LLMD_CORE_SCHEDULER_H
+#define LLMD_CORE_SCHEDULER_H
+
+#include <llmd/core.h>
+#include <llmd/utils/buffer.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A generate call waiting to be evaluated as part of a batch
+struct llmd_scheduler_job {
+	struct llmd_driver_generate_item item;
+	// Evaluate in a single chunk, even past the token budget.
+	// Needed when the output has a row for every token.
+	bool whole;
+
+	unsigned int num_evaluated;
+	enum llmd_error status;
+	bool done;
+
+	uint64_t enqueue_time_ns;
+	struct llmd_scheduler_job* next;
+
+	// Called on the scheduler thread without any lock held once the job is
+	// done. NULL for jobs waited on with llmd_scheduler_run.
+	void (*on_done)(struct llmd_scheduler_job* job);
+};
+
+// Collects jobs from many threads and evaluates them in iteration-level
+// batches on a dedicated thread.
+// Long prompts are split into chunks so decodes are not stuck behind them.
+struct llmd_scheduler {
+	struct llmd_host* host;
+	struct llmd_driver* driver;
+	unsigned int max_batch_tokens;
+	unsigned int max_wait_us;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t thread;
+	bool stop;
+
+	struct llmd_scheduler_job* head;
+	struct llmd_scheduler_job* tail;
+	unsigned int num_queued_tokens;
+
+	// Only used by the scheduler thread
+	llmd_buffer(struct llmd_driver_generate_item) batch_items;
+	llmd_buffer(struct llmd_scheduler_job*) batch_jobs;
+
+	struct llmd_batch_stats stats;
+};
+
+enum llmd_error
+llmd_scheduler_init(
+	struct llmd_host* host,
+	struct llmd_driver* driver,
+	unsigned int max_batch_tokens,
+	unsigned int max_wait_us,
+	struct llmd_scheduler* scheduler
+);
+
+void
+llmd_scheduler_cleanup(
+	struct llmd_scheduler* scheduler
+);
+
+// Block until every job is done
+void
+llmd_scheduler_run(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* jobs,
+	unsigned int num_jobs
+);
+
+// Queue jobs without waiting, each one must have on_done set
+void
+llmd_scheduler_submit(
+	struct llmd_scheduler* scheduler,
+	struct llmd_scheduler_job* jobs,
+	unsigned int num_jobs
+);
+
+void
+llmd_scheduler_get_stats(
+	struct llmd_scheduler* scheduler,
+	struct llmd_batch_stats* stats_out
+);
+
+#endif
@@ -0,0 +1,133 @@
+#include "state_cache.h"
+#include <llmd/utils/host.h>
+
+static size_t
+llmd_state_snapshot_size(const struct llmd_state_snapshot* snapshot) {
+	return snapshot->state_size + snapshot->num_tokens * sizeof(llmd_token_t);
+}
+
+static void
+llmd_state_cache_unlink(
+	struct llmd_state_cache* cache,
+	struct llmd_state_snapshot* snapshot
+) {
+	if (snapshot->prev != NULL) {
+		snapshot->prev->next = snapshot->next;
+	} else {
+		cache->head = snapshot->next;
+	}
+
+	if (snapshot->next != NULL) {
+		snapshot->next->prev = snapshot->prev;
+	} else {
+		cache->tail = snapshot->prev;
+	}
+
+	snapshot->prev = snapshot->next = NULL;
+	cache->size -= llmd_state_snapshot_size(snapshot);
+}
+
+void
+llmd_state_cache_init(
+	struct llmd_host* host,
+	size_t capacity,
+	struct llmd_state_cache* cache
+) {
+	*cache = (struct llmd_state_cache) {
+		.host = host,
+		.capacity = capacity,
+	};
+}
+
+void
+llmd_state_cache_cleanup(
+	struct llmd_state_cache* cache
+) {
+	struct llmd_state_snapshot* itr = cache->head;
+	while (itr != NULL) {
+		struct llmd_state_snapshot* next = itr->next;
+		llmd_free_state_snapshot(cache->host, itr);
+		itr = next;
+	}
+
+	cache->head = cache->tail = NULL;
+	cache->size = 0;
+}
+
+bool
+llmd_state_cache_insert(
+	struct llmd_state_cache* cache,
+	struct llmd_state_snapshot* snapshot
+) {
+	size_t size = llmd_state_snapshot_size(snapshot);
+	if (size > cache->capacity) {
+		llmd_free_state_snapshot(cache->host, snapshot);
+		return false;
+	}
+
+	while (cache->size + size > cache->capacity) {
+		struct llmd_state_snapshot* victim = cache->tail;
+		llmd_state_cache_unlink(cache, victim);
+		llmd_free_state_snapshot(cache->host, victim);
+	}
+
+	snapshot->prev = NULL;
+	snapshot->next = cache->head;
+	if (cache->head != NULL) {
+		cache->head->prev = snapshot;
+	} else {
+		cache->tail = snapshot;
+	}
+	cache->head = snapshot;
+	cache->size += size;
+
+	return true;
+}
+
+struct llmd_state_snapshot*
+llmd_state_cache_take_longest(
+	struct llmd_state_cache* cache,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int min_shared_prefix,
+	unsigned int* shared_prefix_out
+) {
+	struct llmd_state_snapshot* best = NULL;
+	unsigned int best_shared = min_shared_prefix;
+
+	for (
+		struct llmd_state_snapshot* itr = cache->head;
+		itr != NULL;
+		itr = itr->next
+	) {
+		unsigned int limit = itr->num_tokens < num_tokens ? itr->num_tokens : num_tokens;
+		if (limit <= best_shared) { continue; }
+
+		unsigned int shared = 0;
+		while (shared < limit && itr->tokens[shared] == tokens[shared]) { ++shared; }
+
+		if (shared > best_shared) {
+			best = itr;
+			best_shared = shared;
+		}
+	}
+
+	if (best != NULL) {
+		llmd_state_cache_unlink(cache, best);
+		*shared_prefix_out = best_shared;
+	}
+
+	return best;
+}
+
+void
+llmd_free_state_snapshot(
+	struct llmd_host* host,
+	struct llmd_state_snapshot* snapshot
+) {
+	if (snapshot == NULL) { return; }
+
+	llmd_free(host, snapshot->tokens);
+	llmd_free(host, snapshot->state);
+	llmd_free(host, snapshot);
+}
@@ -0,0 +1,69 @@
+#ifndef LLMD_CORE_STATE_CACHE_H
+#define LLMD_CORE_STATE_CACHE_H
+
+#include <llmd/core.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Evaluation state of a context swapped out to host memory together with the
+// tokens it was computed from
+struct llmd_state_snapshot {
+	llmd_token_t* tokens;
+	unsigned int num_tokens;
+
+	void* state;
+	size_t state_size;
+
+	struct llmd_state_snapshot* prev;
+	struct llmd_state_snapshot* next;
+};
+
+// A size bounded LRU list of snapshots
+struct llmd_state_cache {
+	struct llmd_host* host;
+	size_t capacity;
+	size_t size;
+
+	// Most recently inserted first
+	struct llmd_state_snapshot* head;
+	struct llmd_state_snapshot* tail;
+};
+
+void
+llmd_state_cache_init(
+	struct llmd_host* host,
+	size_t capacity,
+	struct llmd_state_cache* cache
+);
+
+void
+llmd_state_cache_cleanup(
+	struct llmd_state_cache* cache
+);
+
+// Takes ownership of the snapshot, evicting older ones to make room.
+// Returns false and frees the snapshot if it can never fit.
+bool
+llmd_state_cache_insert(
+	struct llmd_state_cache* cache,
+	struct llmd_state_snapshot* snapshot
+);
+
+// Remove and return the snapshot sharing the longest prefix with tokens if it
+// is longer than min_shared_prefix
+struct llmd_state_snapshot*
+llmd_state_cache_take_longest(
+	struct llmd_state_cache* cache,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int min_shared_prefix,
+	unsigned int* shared_prefix_out
+);
+
+void
+llmd_free_state_snapshot(
+	struct llmd_host* host,
+	struct llmd_state_snapshot* snapshot
+);
+
+#endif
@@ -0,0 +1,249 @@
+#include "token_cache.h"
+#include <llmd/utils/host.h>
+#include <string.h>
+
+#define LLMD_TOKEN_CACHE_MIN_BUCKETS 64
+
+static size_t
+llmd_token_cache_entry_size(
+	unsigned int num_chars,
+	unsigned int num_tokens
+) {
+	return sizeof(struct llmd_token_cache_entry)
+		+ num_tokens * sizeof(llmd_token_t)
+		+ num_chars;
+}
+
+static struct llmd_token_cache_entry**
+llmd_token_cache_bucket_of(
+	struct llmd_token_cache* cache,
+	uint64_t hash
+) {
+	return &cache->buckets[hash & (cache->num_buckets - 1)];
+}
+
+static void
+llmd_token_cache_unlink(
+	struct llmd_token_cache* cache,
+	struct llmd_token_cache_entry* entry
+) {
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void
+llmd_token_cache_push_front(
+	struct llmd_token_cache* cache,
+	struct llmd_token_cache_entry* entry
+) {
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head != NULL) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+static void
+llmd_token_cache_evict(
+	struct llmd_token_cache* cache,
+	struct llmd_token_cache_entry* victim
+) {
+	struct llmd_token_cache_entry** itr = llmd_token_cache_bucket_of(cache, victim->hash);
+	while (*itr != victim) { itr = &(*itr)->next_in_bucket; }
+	*itr = victim->next_in_bucket;
+
+	llmd_token_cache_unlink(cache, victim);
+	cache->size -= llmd_token_cache_entry_size(victim->num_chars, victim->num_tokens);
+	--cache->num_entries;
+	++cache->num_evictions;
+
+	llmd_free(cache->host, victim);
+}
+
+static bool
+llmd_token_cache_grow_buckets(
+	struct llmd_token_cache* cache
+) {
+	unsigned int num_buckets = cache->num_buckets > 0
+		? cache->num_buckets * 2
+		: LLMD_TOKEN_CACHE_MIN_BUCKETS;
+	struct llmd_token_cache_entry** buckets = llmd_malloc(
+		cache->host, sizeof(struct llmd_token_cache_entry*) * num_buckets
+	);
+	if (buckets == NULL) { return false; }
+	memset(buckets, 0, sizeof(struct llmd_token_cache_entry*) * num_buckets);
+
+	for (unsigned int i = 0; i < cache->num_buckets; ++i) {
+		struct llmd_token_cache_entry* itr = cache->buckets[i];
+		while (itr != NULL) {
+			struct llmd_token_cache_entry* next = itr->next_in_bucket;
+			struct llmd_token_cache_entry** bucket = &buckets[itr->hash & (num_buckets - 1)];
+			itr->next_in_bucket = *bucket;
+			*bucket = itr;
+			itr = next;
+		}
+	}
+
+	llmd_free(cache->host, cache->buckets);
+	cache->buckets = buckets;
+	cache->num_buckets = num_buckets;
+
+	return true;
+}
+
+void
+llmd_token_cache_init(
+	struct llmd_host* host,
+	size_t capacity,
+	struct llmd_token_cache* cache
+) {
+	*cache = (struct llmd_token_cache) {
+		.host = host,
+		.capacity = capacity,
+	};
+}
+
+void
+llmd_token_cache_cleanup(
+	struct llmd_token_cache* cache
+) {
+	struct llmd_token_cache_entry* itr = cache->head;
+	while (itr != NULL) {
+		struct llmd_token_cache_entry* next = itr->next;
+		llmd_free(cache->host, itr);
+		itr = next;
+	}
+
+	llmd_free(cache->host, cache->buckets);
+	cache->buckets = NULL;
+	cache->num_buckets = 0;
+	cache->num_entries = 0;
+	cache->head = cache->tail = NULL;
+	cache->size = 0;
+}
+
+uint64_t
+llmd_token_cache_hash(
+	const char* string,
+	unsigned int num_chars
+) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned int i = 0; i < num_chars; ++i) {
+		hash ^= (unsigned char)string[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+const struct llmd_token_cache_entry*
+llmd_token_cache_lookup(
+	struct llmd_token_cache* cache,
+	uint64_t hash,
+	const char* string,
+	unsigned int num_chars
+) {
+	if (cache->num_buckets > 0) {
+		for (
+			struct llmd_token_cache_entry* itr = *llmd_token_cache_bucket_of(cache, hash);
+			itr != NULL;
+			itr = itr->next_in_bucket
+		) {
+			if (
+				itr->hash == hash
+				&& itr->num_chars == num_chars
+				&& memcmp(itr->text, string, num_chars) == 0
+			) {
+				llmd_token_cache_unlink(cache, itr);
+				llmd_token_cache_push_front(cache, itr);
+				++cache->num_hits;
+				return itr;
+			}
+		}
+	}
+
+	++cache->num_misses;
+	return NULL;
+}
+
+bool
+llmd_token_cache_insert(
+	struct llmd_token_cache* cache,
+	uint64_t hash,
+	const char* string,
+	unsigned int num_chars,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+) {
+	size_t size = llmd_token_cache_entry_size(num_chars, num_tokens);
+	if (size > cache->capacity) { return false; }
+
+	// Another thread may have inserted the same string in the meantime
+	if (cache->num_buckets > 0) {
+		for (
+			struct llmd_token_cache_entry* itr = *llmd_token_cache_bucket_of(cache, hash);
+			itr != NULL;
+			itr = itr->next_in_bucket
+		) {
+			if (
+				itr->hash == hash
+				&& itr->num_chars == num_chars
+				&& memcmp(itr->text, string, num_chars) == 0
+			) {
+				return true;
+			}
+		}
+	}
+
+	if (
+		cache->num_entries >= cache->num_buckets
+		&& !llmd_token_cache_grow_buckets(cache)
+	) {
+		return false;
+	}
+
+	while (cache->size + size > cache->capacity) {
+		llmd_token_cache_evict(cache, cache->tail);
+	}
+
+	struct llmd_token_cache_entry* entry = llmd_malloc(cache->host, size);
+	if (entry == NULL) { return false; }
+
+	llmd_token_t* entry_tokens = (llmd_token_t*)(entry + 1);
+	char* entry_text = (char*)(entry_tokens + num_tokens);
+	memcpy(entry_tokens, tokens, num_tokens * sizeof(llmd_token_t));
+	memcpy(entry_text, string, num_chars);
+
+	*entry = (struct llmd_token_cache_entry) {
+		.hash = hash,
+		.num_chars = num_chars,
+		.num_tokens = num_tokens,
+		.text = entry_text,
+		.tokens = entry_tokens,
+	};
+
+	struct llmd_token_cache_entry** bucket = llmd_token_cache_bucket_of(cache, hash);
+	entry->next_in_bucket = *bucket;
+	*bucket = entry;
+	llmd_token_cache_push_front(cache, entry);
+
+	cache->size += size;
+	++cache->num_entries;
+
+	return true;
+}
@@ -0,0 +1,81 @@
+#ifndef LLMD_CORE_TOKEN_CACHE_H
+#define LLMD_CORE_TOKEN_CACHE_H
+
+#include <llmd/core.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The tokens of a string, allocated in one block with both arrays after it
+struct llmd_token_cache_entry {
+	uint64_t hash;
+	unsigned int num_chars;
+	unsigned int num_tokens;
+	const char* text;
+	const llmd_token_t* tokens;
+
+	struct llmd_token_cache_entry* prev;
+	struct llmd_token_cache_entry* next;
+	struct llmd_token_cache_entry* next_in_bucket;
+};
+
+// A size bounded LRU map from strings to their tokens
+struct llmd_token_cache {
+	struct llmd_host* host;
+	size_t capacity;
+	size_t size;
+
+	// Power of two number of chains
+	struct llmd_token_cache_entry** buckets;
+	unsigned int num_buckets;
+	unsigned int num_entries;
+
+	// Most recently used first
+	struct llmd_token_cache_entry* head;
+	struct llmd_token_cache_entry* tail;
+
+	uint64_t num_hits;
+	uint64_t num_misses;
+	uint64_t num_evictions;
+};
+
+void
+llmd_token_cache_init(
+	struct llmd_host* host,
+	size_t capacity,
+	struct llmd_token_cache* cache
+);
+
+void
+llmd_token_cache_cleanup(
+	struct llmd_token_cache* cache
+);
+
+uint64_t
+llmd_token_cache_hash(
+	const char* string,
+	unsigned int num_chars
+);
+
+// Returns NULL on a miss, a hit becomes the most recently used entry
+const struct llmd_token_cache_entry*
+llmd_token_cache_lookup(
+	struct llmd_token_cache* cache,
+	uint64_t hash,
+	const char* string,
+	unsigned int num_chars
+);
+
+// Evicts older entries to make room.
+// Returns false if the entry can never fit or memory runs out.
+bool
+llmd_token_cache_insert(
+	struct llmd_token_cache* cache,
+	uint64_t hash,
+	const char* string,
+	unsigned int num_chars,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+);
+
+#endif
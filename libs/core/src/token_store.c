@@ -0,0 +1,278 @@
+#include "token_store.h"
+#include <llmd/utils/host.h>
+#include <string.h>
+
+#define LLMD_TOKEN_STORE_MIN_BUCKETS 64
+
+static unsigned int
+llmd_token_seq_num_chunks(unsigned int length) {
+	return (length + LLMD_TOKEN_CHUNK_SIZE - 1) / LLMD_TOKEN_CHUNK_SIZE;
+}
+
+static uint64_t
+llmd_token_chunk_hash(const struct llmd_token_chunk* chunk) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned int i = 0; i < LLMD_TOKEN_CHUNK_SIZE; ++i) {
+		hash ^= (uint64_t)chunk->tokens[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static struct llmd_token_chunk**
+llmd_token_store_bucket_of(
+	struct llmd_token_store* store,
+	uint64_t hash
+) {
+	return &store->buckets[hash & (store->num_buckets - 1)];
+}
+
+static bool
+llmd_token_store_grow_buckets(
+	struct llmd_token_store* store
+) {
+	unsigned int num_buckets = store->num_buckets > 0
+		? store->num_buckets * 2
+		: LLMD_TOKEN_STORE_MIN_BUCKETS;
+	struct llmd_token_chunk** buckets = llmd_malloc(
+		store->host, sizeof(struct llmd_token_chunk*) * num_buckets
+	);
+	if (buckets == NULL) { return false; }
+	memset(buckets, 0, sizeof(struct llmd_token_chunk*) * num_buckets);
+
+	for (unsigned int i = 0; i < store->num_buckets; ++i) {
+		struct llmd_token_chunk* itr = store->buckets[i];
+		while (itr != NULL) {
+			struct llmd_token_chunk* next = itr->next_in_bucket;
+			struct llmd_token_chunk** bucket = &buckets[itr->hash & (num_buckets - 1)];
+			itr->next_in_bucket = *bucket;
+			*bucket = itr;
+			itr = next;
+		}
+	}
+
+	llmd_free(store->host, store->buckets);
+	store->buckets = buckets;
+	store->num_buckets = num_buckets;
+
+	return true;
+}
+
+static void
+llmd_token_chunk_release(
+	struct llmd_token_store* store,
+	struct llmd_token_chunk* chunk
+) {
+	if (chunk == NULL || --chunk->ref_count > 0) { return; }
+
+	if (chunk->interned) {
+		struct llmd_token_chunk** itr = llmd_token_store_bucket_of(store, chunk->hash);
+		while (*itr != chunk) { itr = &(*itr)->next_in_bucket; }
+		*itr = chunk->next_in_bucket;
+		--store->num_interned;
+	}
+
+	llmd_free(store->host, chunk);
+}
+
+// Returns the chunk to keep in place of a full, unshared one
+static struct llmd_token_chunk*
+llmd_token_chunk_intern(
+	struct llmd_token_store* store,
+	struct llmd_token_chunk* chunk
+) {
+	uint64_t hash = llmd_token_chunk_hash(chunk);
+
+	if (store->num_buckets > 0) {
+		for (
+			struct llmd_token_chunk* itr = *llmd_token_store_bucket_of(store, hash);
+			itr != NULL;
+			itr = itr->next_in_bucket
+		) {
+			if (
+				itr->hash == hash
+				&& memcmp(itr->tokens, chunk->tokens, sizeof(chunk->tokens)) == 0
+			) {
+				++itr->ref_count;
+				llmd_free(store->host, chunk);
+				return itr;
+			}
+		}
+	}
+
+	// Not being shared only costs memory
+	if (
+		store->num_interned >= store->num_buckets
+		&& !llmd_token_store_grow_buckets(store)
+	) {
+		return chunk;
+	}
+
+	struct llmd_token_chunk** bucket = llmd_token_store_bucket_of(store, hash);
+	chunk->hash = hash;
+	chunk->interned = true;
+	chunk->next_in_bucket = *bucket;
+	*bucket = chunk;
+	++store->num_interned;
+
+	return chunk;
+}
+
+void
+llmd_token_store_init(
+	struct llmd_host* host,
+	struct llmd_token_store* store
+) {
+	*store = (struct llmd_token_store) {
+		.host = host,
+	};
+}
+
+void
+llmd_token_store_cleanup(
+	struct llmd_token_store* store
+) {
+	llmd_free(store->host, store->buckets);
+	store->buckets = NULL;
+	store->num_buckets = 0;
+	store->num_interned = 0;
+}
+
+void
+llmd_token_seq_release(
+	struct llmd_token_store* store,
+	struct llmd_token_seq* seq
+) {
+	unsigned int num_chunks = llmd_token_seq_num_chunks(seq->length);
+	for (unsigned int i = 0; i < num_chunks; ++i) {
+		llmd_token_chunk_release(store, seq->chunks[i]);
+	}
+
+	llmd_free_buffer(store->host, seq->chunks);
+	seq->chunks = NULL;
+	seq->length = 0;
+}
+
+enum llmd_error
+llmd_token_seq_copy(
+	struct llmd_token_store* store,
+	struct llmd_token_seq* dest,
+	const struct llmd_token_seq* source
+) {
+	unsigned int num_chunks = llmd_token_seq_num_chunks(source->length);
+	llmd_token_seq_release(store, dest);
+	if (num_chunks == 0) { return LLMD_OK; }
+
+	dest->chunks = llmd_resize_buffer(store->host, dest->chunks, num_chunks);
+	if (dest->chunks == NULL) { return LLMD_ERR_OOM; }
+
+	for (unsigned int i = 0; i < num_chunks; ++i) {
+		dest->chunks[i] = source->chunks[i];
+		++dest->chunks[i]->ref_count;
+	}
+	dest->length = source->length;
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_token_seq_write(
+	struct llmd_token_store* store,
+	struct llmd_token_seq* seq,
+	unsigned int offset,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+) {
+	unsigned int end = offset + num_tokens;
+	unsigned int num_old_chunks = llmd_token_seq_num_chunks(seq->length);
+	unsigned int num_new_chunks = llmd_token_seq_num_chunks(end);
+	enum llmd_error status = LLMD_OK;
+
+	// Grow lazily
+	if (llmd_buffer_size(seq->chunks) < num_new_chunks) {
+		size_t capacity = llmd_buffer_size(seq->chunks) * 2;
+		if (capacity < num_new_chunks) { capacity = num_new_chunks; }
+
+		llmd_buffer(struct llmd_token_chunk*) chunks = llmd_resize_buffer(
+			store->host, seq->chunks, capacity
+		);
+		if (chunks == NULL) { return LLMD_ERR_OOM; }
+		seq->chunks = chunks;
+	}
+
+	for (unsigned int i = num_old_chunks; i < num_new_chunks; ++i) {
+		seq->chunks[i] = NULL;
+	}
+
+	unsigned int i = offset / LLMD_TOKEN_CHUNK_SIZE;
+	for (; i < num_new_chunks; ++i) {
+		unsigned int chunk_start = i * LLMD_TOKEN_CHUNK_SIZE;
+		unsigned int from = offset > chunk_start ? offset - chunk_start : 0;
+		unsigned int to = end - chunk_start < LLMD_TOKEN_CHUNK_SIZE
+			? end - chunk_start
+			: LLMD_TOKEN_CHUNK_SIZE;
+		struct llmd_token_chunk* chunk = seq->chunks[i];
+
+		if (chunk == NULL || chunk->ref_count > 1 || chunk->interned) {
+			struct llmd_token_chunk* copy = llmd_malloc(store->host, sizeof(*copy));
+			if (copy == NULL) {
+				status = LLMD_ERR_OOM;
+				break;
+			}
+
+			copy->ref_count = 1;
+			copy->interned = false;
+			copy->next_in_bucket = NULL;
+			if (chunk != NULL) {
+				memcpy(copy->tokens, chunk->tokens, from * sizeof(llmd_token_t));
+			}
+
+			llmd_token_chunk_release(store, chunk);
+			seq->chunks[i] = chunk = copy;
+		}
+
+		memcpy(
+			chunk->tokens + from,
+			tokens + (chunk_start + from - offset),
+			(to - from) * sizeof(llmd_token_t)
+		);
+
+		if (to == LLMD_TOKEN_CHUNK_SIZE) {
+			seq->chunks[i] = llmd_token_chunk_intern(store, chunk);
+		}
+	}
+
+	// Only what was written before an error is kept
+	unsigned int length = i < num_new_chunks ? i * LLMD_TOKEN_CHUNK_SIZE : end;
+	if (length < offset) { length = offset; }
+	unsigned int num_chunks = llmd_token_seq_num_chunks(length);
+	unsigned int num_filled = num_old_chunks > num_new_chunks ? num_old_chunks : num_new_chunks;
+	for (unsigned int j = num_chunks; j < num_filled; ++j) {
+		llmd_token_chunk_release(store, seq->chunks[j]);
+	}
+	seq->length = length;
+
+	return status;
+}
+
+void
+llmd_token_seq_read(
+	const struct llmd_token_seq* seq,
+	unsigned int offset,
+	unsigned int num_tokens,
+	llmd_token_t* tokens_out
+) {
+	while (num_tokens > 0) {
+		const struct llmd_token_chunk* chunk = seq->chunks[offset / LLMD_TOKEN_CHUNK_SIZE];
+		unsigned int from = offset % LLMD_TOKEN_CHUNK_SIZE;
+		unsigned int count = LLMD_TOKEN_CHUNK_SIZE - from;
+		if (count > num_tokens) { count = num_tokens; }
+
+		memcpy(tokens_out, chunk->tokens + from, count * sizeof(llmd_token_t));
+		tokens_out += count;
+		offset += count;
+		num_tokens -= count;
+	}
+}
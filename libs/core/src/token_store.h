@@ -0,0 +1,86 @@
+#ifndef LLMD_CORE_TOKEN_STORE_H
+#define LLMD_CORE_TOKEN_STORE_H
+
+#include <llmd/core.h>
+#include <llmd/utils/buffer.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LLMD_TOKEN_CHUNK_SIZE 256
+
+struct llmd_token_chunk {
+	unsigned int ref_count;
+	// Full chunks are immutable and can be found by content
+	bool interned;
+	uint64_t hash;
+	struct llmd_token_chunk* next_in_bucket;
+
+	llmd_token_t tokens[LLMD_TOKEN_CHUNK_SIZE];
+};
+
+// A token sequence made of chunks which may be shared with other sequences
+struct llmd_token_seq {
+	llmd_buffer(struct llmd_token_chunk*) chunks;
+	unsigned int length;
+};
+
+// Shares full chunks with the same content between sequences and copies
+// shared chunks on write.
+// Nothing here is thread-safe.
+struct llmd_token_store {
+	struct llmd_host* host;
+
+	// Power of two number of chains of interned chunks
+	struct llmd_token_chunk** buckets;
+	unsigned int num_buckets;
+	unsigned int num_interned;
+};
+
+void
+llmd_token_store_init(
+	struct llmd_host* host,
+	struct llmd_token_store* store
+);
+
+// All sequences must have been released
+void
+llmd_token_store_cleanup(
+	struct llmd_token_store* store
+);
+
+void
+llmd_token_seq_release(
+	struct llmd_token_store* store,
+	struct llmd_token_seq* seq
+);
+
+// Make dest share the chunks of source
+enum llmd_error
+llmd_token_seq_copy(
+	struct llmd_token_store* store,
+	struct llmd_token_seq* dest,
+	const struct llmd_token_seq* source
+);
+
+// Replace everything from offset onward with tokens.
+// offset must not be past the end.
+// On error, the sequence is left holding a valid but shorter prefix.
+enum llmd_error
+llmd_token_seq_write(
+	struct llmd_token_store* store,
+	struct llmd_token_seq* seq,
+	unsigned int offset,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens
+);
+
+void
+llmd_token_seq_read(
+	const struct llmd_token_seq* seq,
+	unsigned int offset,
+	unsigned int num_tokens,
+	llmd_token_t* tokens_out
+);
+
+#endif
@@ -19,6 +19,11 @@
 
 struct llmd_ipc_server_config {
 	const char* name;
+
+	// Longer prompts are evaluated this many tokens at a time and requests
+	// from other sessions are served between chunks.
+	// 0 evaluates them at once.
+	unsigned int prefill_chunk_size;
 };
 
 struct llmd_ipc_server;
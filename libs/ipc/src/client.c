@@ -3,6 +3,7 @@
 #include <llmd/core.h>
 #include <llmd/utils/host.h>
 #include <stdint.h>
+#include <pthread.h>
 
 struct llmd_ipc_context {
 	int descriptor;
@@ -16,6 +17,8 @@ struct llmd_ipc_client {
 	struct llmd_host* host;
 	struct llmd_ipc_client_config* config;
 
+	// Calls share one socket and the session memory
+	pthread_mutex_t lock;
 	int ipc_sock;
 
 	struct llmd_span session_mem;
@@ -42,7 +45,25 @@ llmd_ipc_begin_call(
 }
 
 static enum llmd_error
-llmd_ipc_end_call(
+llmd_ipc_send_call(
+	struct llmd_ipc_client* client,
+	struct llmd_rpc_buf* call
+) {
+	struct iovec iov = {
+		.iov_base = call->tmp_buf,
+		.iov_len = call->buf_cursor
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	LLMD_SYSCALL_CHECK(client->host, sendmsg(client->ipc_sock, &msg, 0));
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_ipc_receive_reply(
 	struct llmd_ipc_client* client,
 	struct llmd_rpc_buf* call,
 	unsigned int num_fds,
@@ -55,13 +76,12 @@ llmd_ipc_end_call(
 
 	struct iovec iov = {
 		.iov_base = call->tmp_buf,
-		.iov_len = call->buf_cursor
+		.iov_len = sizeof(call->tmp_buf)
 	};
 	struct msghdr msg = {
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
-	LLMD_SYSCALL_CHECK(client->host, sendmsg(client->ipc_sock, &msg, 0));
 
 	union {
 		char buf[CMSG_SPACE(sizeof(int) * LLMD_MAX_NUM_FDS)];
@@ -73,7 +93,6 @@ llmd_ipc_end_call(
 		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);;
 	}
 
-	iov.iov_len = sizeof(call->tmp_buf);
 	LLMD_SYSCALL_CHECK(client->host, recvmsg(client->ipc_sock, &msg, 0));
 
 	if (num_fds > 0) {
@@ -98,6 +117,22 @@ llmd_ipc_end_call(
 	return header.error;
 }
 
+static enum llmd_error
+llmd_ipc_end_call(
+	struct llmd_ipc_client* client,
+	struct llmd_rpc_buf* call,
+	unsigned int num_fds,
+	int* fds_out
+) {
+	if (num_fds > LLMD_MAX_NUM_FDS) {
+		return LLMD_ERR_INVALID;
+	}
+
+	enum llmd_error status;
+	LLMD_CHECK(llmd_ipc_send_call(client, call));
+	return llmd_ipc_receive_reply(client, call, num_fds, fds_out);
+}
+
 static enum llmd_error
 llmd_init_ipc_client(
 	struct llmd_ipc_client* client
@@ -136,7 +171,7 @@ llmd_init_ipc_client(
 }
 
 static enum llmd_error
-llmd_ipc_client_tokenize(
+llmd_ipc_client_tokenize_locked(
 	struct llmd_driver* header,
 	const char* string,
 	unsigned int num_chars,
@@ -170,7 +205,7 @@ llmd_ipc_client_tokenize(
 }
 
 static enum llmd_error
-llmd_ipc_client_get_model_info(
+llmd_ipc_client_get_model_info_locked(
 	struct llmd_driver* header,
 	struct llmd_model_info* info_out
 ) {
@@ -186,7 +221,7 @@ llmd_ipc_client_get_model_info(
 }
 
 static enum llmd_error
-llmd_ipc_client_decode_token(
+llmd_ipc_client_decode_token_locked(
 	struct llmd_driver* header,
 	llmd_token_t token,
 	char* string_out,
@@ -251,7 +286,7 @@ llmd_ipc_client_alloc_context(
 }
 
 static enum llmd_error
-llmd_ipc_client_create_context(
+llmd_ipc_client_create_context_locked(
 	struct llmd_driver* header,
 	int* descriptor_out
 ) {
@@ -285,7 +320,7 @@ llmd_ipc_client_create_context(
 }
 
 static enum llmd_error
-llmd_ipc_client_destroy_context(
+llmd_ipc_client_destroy_context_locked(
 	struct llmd_driver* header,
 	int descriptor
 ) {
@@ -315,16 +350,15 @@ llmd_ipc_client_destroy_context(
 }
 
 static enum llmd_error
-llmd_ipc_client_generate(
-	struct llmd_driver* header,
+llmd_ipc_client_send_generate_locked(
+	struct llmd_ipc_client* client,
 	int context_descriptor,
 	const llmd_token_t* tokens,
 	unsigned int num_tokens,
 	unsigned int offset,
-	float* logits_out
+	const struct llmd_logits_output* output
 ) {
 	enum llmd_error status;
-	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
 
 	if ((unsigned int)context_descriptor >= client->num_contexts) {
 		return LLMD_ERR_INVALID;
@@ -339,6 +373,17 @@ llmd_ipc_client_generate(
 		return LLMD_ERR_INVALID;
 	}
 
+	uint8_t mode = output != NULL ? (uint8_t)output->mode : (uint8_t)LLMD_LOGITS_NONE;
+	// The shared logits buffer only holds one row
+	if (mode == LLMD_LOGITS_ALL || mode == LLMD_LOGITS_POSITIONS) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	unsigned int top_k = mode == LLMD_LOGITS_TOP_K ? output->top_k : 0;
+	if (top_k * (sizeof(float) + sizeof(llmd_token_t)) > context->logits.size) {
+		return LLMD_ERR_INVALID;
+	}
+
 	memcpy((llmd_token_t*)context->context_window.ptr + offset, tokens, num_tokens * sizeof(llmd_token_t));
 
 	struct llmd_rpc_buf call;
@@ -346,13 +391,251 @@ llmd_ipc_client_generate(
 	LLMD_CHECK(llmd_rpc_write(&call, &context->descriptor, sizeof(context->descriptor)));
 	LLMD_CHECK(llmd_rpc_write(&call, &num_tokens, sizeof(num_tokens)));
 	LLMD_CHECK(llmd_rpc_write(&call, &offset, sizeof(offset)));
-	LLMD_CHECK(llmd_ipc_end_call(client, &call, 0, NULL));
+	LLMD_CHECK(llmd_rpc_write(&call, &mode, sizeof(mode)));
+	LLMD_CHECK(llmd_rpc_write(&call, &top_k, sizeof(top_k)));
+	return llmd_ipc_send_call(client, &call);
+}
+
+static enum llmd_error
+llmd_ipc_client_receive_generate_locked(
+	struct llmd_ipc_client* client,
+	int context_descriptor,
+	const struct llmd_logits_output* output
+) {
+	enum llmd_error status;
+	struct llmd_ipc_context* context = &client->contexts[context_descriptor];
 
-	memcpy(logits_out, context->logits.ptr, context->logits.size);
+	struct llmd_rpc_buf call;
+	LLMD_CHECK(llmd_ipc_receive_reply(client, &call, 0, NULL));
+
+	// Only copy what was asked for, the server packs top-k tokens right
+	// after their logits
+	if (output == NULL) { return LLMD_OK; }
+
+	switch (output->mode) {
+		case LLMD_LOGITS_FULL:
+			memcpy(output->logits, context->logits.ptr, context->logits.size);
+			break;
+		case LLMD_LOGITS_NONE:
+		case LLMD_LOGITS_ALL:
+		case LLMD_LOGITS_POSITIONS:
+			break;
+		case LLMD_LOGITS_TOP_K:
+			memcpy(output->logits, context->logits.ptr, output->top_k * sizeof(float));
+			memcpy(
+				output->tokens,
+				(float*)context->logits.ptr + output->top_k,
+				output->top_k * sizeof(llmd_token_t)
+			);
+			break;
+	}
 
 	return LLMD_OK;
 }
 
+static enum llmd_error
+llmd_ipc_client_generate_locked(
+	struct llmd_driver* header,
+	int context_descriptor,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output
+) {
+	enum llmd_error status;
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	LLMD_CHECK(llmd_ipc_client_send_generate_locked(
+		client, context_descriptor, tokens, num_tokens, offset, output
+	));
+	return llmd_ipc_client_receive_generate_locked(
+		client, context_descriptor, output
+	);
+}
+
+// Requests are sent ahead of their replies so the server can start on the
+// next context without waiting for the client to be scheduled.
+// The window keeps the socket buffers from filling up in both directions.
+#define LLMD_IPC_MAX_PIPELINED_CALLS 16
+
+static enum llmd_error
+llmd_ipc_client_generate_batch_locked(
+	struct llmd_driver* header,
+	const struct llmd_driver_generate_item* items,
+	unsigned int num_items
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	// Nothing is sent if any item is invalid
+	for (unsigned int i = 0; i < num_items; ++i) {
+		const struct llmd_driver_generate_item* item = &items[i];
+		if ((unsigned int)item->context_descriptor >= client->num_contexts) {
+			return LLMD_ERR_INVALID;
+		}
+
+		struct llmd_ipc_context* context = &client->contexts[item->context_descriptor];
+		if (
+			context->descriptor == -1
+			|| (item->offset + item->num_tokens) > (context->context_window.size / sizeof(llmd_token_t))
+		) {
+			return LLMD_ERR_INVALID;
+		}
+	}
+
+	enum llmd_error batch_status = LLMD_OK;
+	for (unsigned int start = 0; start < num_items; start += LLMD_IPC_MAX_PIPELINED_CALLS) {
+		unsigned int end = start + LLMD_IPC_MAX_PIPELINED_CALLS;
+		if (end > num_items) { end = num_items; }
+
+		unsigned int num_sent = start;
+		for (; num_sent < end; ++num_sent) {
+			const struct llmd_driver_generate_item* item = &items[num_sent];
+			enum llmd_error status = llmd_ipc_client_send_generate_locked(
+				client,
+				item->context_descriptor,
+				item->tokens, item->num_tokens, item->offset,
+				item->output
+			);
+			if (status != LLMD_OK) {
+				batch_status = status;
+				break;
+			}
+		}
+
+		// Drain every reply to keep the connection in sync
+		for (unsigned int i = start; i < num_sent; ++i) {
+			enum llmd_error status = llmd_ipc_client_receive_generate_locked(
+				client, items[i].context_descriptor, items[i].output
+			);
+			if (status != LLMD_OK && batch_status == LLMD_OK) {
+				batch_status = status;
+			}
+		}
+
+		if (batch_status != LLMD_OK) { break; }
+	}
+
+	return batch_status;
+}
+
+static enum llmd_error
+llmd_ipc_client_tokenize(
+	struct llmd_driver* header,
+	const char* string,
+	unsigned int num_chars,
+	llmd_token_t* tokens_out,
+	unsigned int* num_tokens_inout
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_tokenize_locked(
+		header, string, num_chars, tokens_out, num_tokens_inout
+	);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_ipc_client_get_model_info(
+	struct llmd_driver* header,
+	struct llmd_model_info* info_out
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_get_model_info_locked(header, info_out);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_ipc_client_decode_token(
+	struct llmd_driver* header,
+	llmd_token_t token,
+	char* string_out,
+	unsigned int* num_chars_inout
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_decode_token_locked(
+		header, token, string_out, num_chars_inout
+	);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_ipc_client_create_context(
+	struct llmd_driver* header,
+	int* descriptor_out
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_create_context_locked(
+		header, descriptor_out
+	);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_ipc_client_destroy_context(
+	struct llmd_driver* header,
+	int descriptor
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_destroy_context_locked(header, descriptor);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_ipc_client_generate(
+	struct llmd_driver* header,
+	int context_descriptor,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_generate_locked(
+		header, context_descriptor, tokens, num_tokens, offset, output
+	);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
+static enum llmd_error
+llmd_ipc_client_generate_batch(
+	struct llmd_driver* header,
+	const struct llmd_driver_generate_item* items,
+	unsigned int num_items
+) {
+	struct llmd_ipc_client* client = (struct llmd_ipc_client*)header;
+
+	pthread_mutex_lock(&client->lock);
+	enum llmd_error status = llmd_ipc_client_generate_batch_locked(
+		header, items, num_items
+	);
+	pthread_mutex_unlock(&client->lock);
+
+	return status;
+}
+
 static struct llmd_driver_interface llmd_ipc_client_interface = {
 	.get_model_info = llmd_ipc_client_get_model_info,
 	.tokenize = llmd_ipc_client_tokenize,
@@ -360,6 +643,7 @@ static struct llmd_driver_interface llmd_ipc_client_interface = {
 	.create_context = llmd_ipc_client_create_context,
 	.destroy_context = llmd_ipc_client_destroy_context,
 	.generate = llmd_ipc_client_generate,
+	.generate_batch = llmd_ipc_client_generate_batch,
 };
 
 enum llmd_error
@@ -389,6 +673,11 @@ llmd_create_ipc_client(
 		.ipc_sock = -1,
 	};
 
+	if (pthread_mutex_init(&client->lock, NULL) != 0) {
+		llmd_free(host, client);
+		return LLMD_ERR_OOM;
+	}
+
 	enum llmd_error status = llmd_init_ipc_client(client);
 	if (status != LLMD_OK) {
 		llmd_destroy_ipc_client(&client->header);
@@ -413,6 +702,7 @@ llmd_destroy_ipc_client(
 		llmd_ipc_cleanup_shared_mem(&client->session_mem);
 	}
 
+	pthread_mutex_destroy(&client->lock);
 	llmd_free(client->host, client);
 	return LLMD_OK;
 }
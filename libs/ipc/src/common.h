@@ -22,7 +22,7 @@
 #endif
 
 #define LLMD_MAX_NUM_FDS 2
-#define LLMD_RPC_VERSION 0
+#define LLMD_RPC_VERSION 1
 #define LLMD_TMP_BUF_SIZE 1024
 #define LLMD_CHECK(op) if ((status = (op)) != LLMD_OK) { return status; }
 
@@ -2,16 +2,30 @@
 #include <llmd/ipc/server.h>
 #include "common.h"
 #include <llmd/utils/host.h>
+#include <llmd/utils/vocab.h>
 #include <stdbool.h>
 #ifdef __linux__
 #include <poll.h>
 #include <fcntl.h>
 #endif
 
+// A long prompt evaluated a chunk at a time between other requests
+struct llmd_ipc_pending_generate {
+	struct llmd_ipc_client_context* context;
+	unsigned int num_tokens;
+	unsigned int offset;
+	unsigned int num_evaluated;
+	struct llmd_logits_output output;
+};
+
 struct llmd_ipc_session {
 	int ipc_sock;
 	struct pollfd* pollfd;
 
+	// The response is held back until it is done
+	bool generating;
+	struct llmd_ipc_pending_generate pending_generate;
+
 	struct llmd_span shared_mem;
 	struct llmd_rpc_buf buf;
 
@@ -46,9 +60,16 @@ struct llmd_ipc_server {
 	unsigned int num_contexts;
 	struct llmd_ipc_client_context* contexts;
 
+	unsigned int num_generating;
+	// Where the search for the next chunk to evaluate starts
+	unsigned int next_generating;
+	// Whether the last step let responses be sent before the next chunk
+	bool deferred_chunk;
+
 	size_t input_mem_size;
 	size_t output_mem_size;
 	struct llmd_model_info model_info;
+	struct llmd_vocab_table vocab_table;
 };
 
 static enum llmd_error
@@ -88,25 +109,12 @@ llmd_init_ipc_server(
 		&server->model_info
 	));
 
-	// Find the longest decoded token
-	unsigned int max_token_len = 0;
-	for (llmd_token_t token = 0; token < server->model_info.vocab_size; ++token) {
-		unsigned int num_chars = 0;
-		status = server->driver->interface->decode_token(
-			server->driver,
-			token,
-			NULL,
-			&num_chars
-		);
-
-		if (status != LLMD_OK && status != LLMD_ERR_BUF_SIZE) {
-			return status;
-		}
-
-		if (num_chars > max_token_len) {
-			max_token_len = num_chars;
-		}
-	}
+	// Decode requests are served from this instead of the driver
+	LLMD_CHECK(llmd_build_vocab_table(
+		server->host, server->driver,
+		server->model_info.vocab_size, &server->vocab_table
+	));
+	unsigned int max_token_len = server->vocab_table.max_token_length;
 
 	llmd_log(server->host, LLMD_LOG_INFO, "Longest token: %u", max_token_len);
 	server->input_mem_size = max_token_len * server->model_info.max_context_length;
@@ -134,6 +142,11 @@ llmd_ipc_handle_session_close(
 		context->owner = NULL;
 	}
 
+	if (session->generating) {
+		session->generating = false;
+		--server->num_generating;
+	}
+
 	llmd_ipc_cleanup_shared_mem(&session->shared_mem);
 	close(session->ipc_sock);
 
@@ -273,17 +286,18 @@ llmd_ipc_handle_decode_token(
 		return llmd_ipc_handle_invalid_rpc(server, session);
 	}
 
-	struct llmd_driver* driver = server->driver;
 	llmd_token_t token = 0;
 	LLMD_CHECK(llmd_rpc_read(&session->buf, &token, sizeof(token)));
 	if (token >= server->model_info.vocab_size) {
 		return llmd_ipc_handle_invalid_rpc(server, session);
 	}
 
-	unsigned int num_chars = server->input_mem_size;
-	status = driver->interface->decode_token(
-		driver, token, session->shared_mem.ptr, &num_chars
-	);
+	const struct llmd_vocab_table* vocab_table = &server->vocab_table;
+	unsigned int num_chars = vocab_table->offsets[token + 1] - vocab_table->offsets[token] - 1;
+	status = num_chars <= server->input_mem_size ? LLMD_OK : LLMD_ERR_BUF_SIZE;
+	if (status == LLMD_OK) {
+		memcpy(session->shared_mem.ptr, vocab_table->text + vocab_table->offsets[token], num_chars);
+	}
 
 	LLMD_CHECK(llmd_ipc_begin_response(session, status));
 	LLMD_CHECK(llmd_rpc_write(&session->buf, &num_chars, sizeof(num_chars)));
@@ -445,6 +459,11 @@ llmd_ipc_handle_generate(
 	LLMD_CHECK(llmd_rpc_read(&session->buf, &num_tokens, sizeof(num_tokens)));
 	LLMD_CHECK(llmd_rpc_read(&session->buf, &offset, sizeof(offset)));
 
+	uint8_t mode;
+	unsigned int top_k;
+	LLMD_CHECK(llmd_rpc_read(&session->buf, &mode, sizeof(mode)));
+	LLMD_CHECK(llmd_rpc_read(&session->buf, &top_k, sizeof(top_k)));
+
 	if ((unsigned int)descriptor >= server->num_contexts) {
 		return llmd_ipc_handle_invalid_rpc(server, session);
 	}
@@ -454,6 +473,41 @@ llmd_ipc_handle_generate(
 		return llmd_ipc_handle_invalid_rpc(server, session);
 	}
 
+	if (
+		mode > LLMD_LOGITS_TOP_K
+		|| top_k * (sizeof(float) + sizeof(llmd_token_t)) > context->logits.size
+	) {
+		return llmd_ipc_handle_invalid_rpc(server, session);
+	}
+
+	// Top-k tokens are packed right after their logits
+	struct llmd_logits_output output = {
+		.mode = (enum llmd_logits_mode)mode,
+		.top_k = top_k,
+		.logits = context->logits.ptr,
+		.tokens = (llmd_token_t*)((float*)context->logits.ptr + top_k),
+	};
+
+	if (
+		offset > server->model_info.max_context_length
+		|| num_tokens > server->model_info.max_context_length - offset
+	) {
+		return llmd_ipc_handle_invalid_rpc(server, session);
+	}
+
+	unsigned int chunk_size = server->config->prefill_chunk_size;
+	if (chunk_size > 0 && num_tokens > chunk_size) {
+		session->pending_generate = (struct llmd_ipc_pending_generate) {
+			.context = context,
+			.num_tokens = num_tokens,
+			.offset = offset,
+			.output = output,
+		};
+		session->generating = true;
+		++server->num_generating;
+		return LLMD_OK;
+	}
+
 	struct llmd_driver* driver = server->driver;
 	status = driver->interface->generate(
 		driver,
@@ -461,8 +515,49 @@ llmd_ipc_handle_generate(
 		(llmd_token_t*)context->context_window.ptr + offset,
 		num_tokens,
 		offset,
-		context->logits.ptr
+		&output
+	);
+
+	LLMD_CHECK(llmd_ipc_begin_response(session, status));
+	LLMD_CHECK(llmd_ipc_end_response(session));
+
+	return LLMD_OK;
+}
+
+// Evaluate the next chunk of a pending generate, responding after the last
+static enum llmd_error
+llmd_ipc_continue_generate(
+	struct llmd_ipc_server* server,
+	struct llmd_ipc_session* session
+) {
+	enum llmd_error status;
+	struct llmd_ipc_pending_generate* pending = &session->pending_generate;
+
+	unsigned int num_left = pending->num_tokens - pending->num_evaluated;
+	unsigned int num_tokens = num_left < server->config->prefill_chunk_size
+		? num_left
+		: server->config->prefill_chunk_size;
+	unsigned int offset = pending->offset + pending->num_evaluated;
+
+	// Only the last chunk produces logits
+	struct llmd_driver* driver = server->driver;
+	status = driver->interface->generate(
+		driver,
+		pending->context->descriptor,
+		(llmd_token_t*)pending->context->context_window.ptr + offset,
+		num_tokens,
+		offset,
+		num_tokens == num_left ? &pending->output : NULL
 	);
+	pending->num_evaluated += num_tokens;
+
+	if (status == LLMD_OK && pending->num_evaluated < pending->num_tokens) {
+		return LLMD_OK;
+	}
+
+	session->generating = false;
+	--server->num_generating;
+	session->pollfd->events = POLLOUT | POLLERR | POLLHUP;
 
 	LLMD_CHECK(llmd_ipc_begin_response(session, status));
 	LLMD_CHECK(llmd_ipc_end_response(session));
@@ -527,8 +622,11 @@ llmd_ipc_handle_session_readable(
 		return llmd_ipc_handle_session_close(server, session);
 	}
 
-	// Start polling for sending
-	session->pollfd->events = POLLOUT | POLLERR | POLLHUP;
+	// Start polling for sending, or only for errors until a pending generate
+	// is done
+	session->pollfd->events = session->generating
+		? POLLERR | POLLHUP
+		: POLLOUT | POLLERR | POLLHUP;
 
 	return LLMD_OK;
 }
@@ -700,7 +798,11 @@ static enum llmd_error
 llmd_step_ipc_server(
 	struct llmd_ipc_server* server
 ) {
-	int result = poll(server->poll_set, server->num_sessions + 1, -1);
+	// Pending generates are continued as soon as there is nothing to handle
+	int result = poll(
+		server->poll_set, server->num_sessions + 1,
+		server->num_generating > 0 ? 0 : -1
+	);
 	if (result < 0) {
 		if (errno != EINTR) {
 			llmd_log(server->host, LLMD_LOG_WARNING, "poll() returns %s", strerror(errno));
@@ -728,6 +830,35 @@ llmd_step_ipc_server(
 		}
 	}
 
+	// One chunk per step so requests which arrived meanwhile, such as single
+	// token decodes, are served between chunks.
+	// Responses which are ready go out first but a chunk is never put off for
+	// more than one step.
+	if (server->num_generating > 0 && !server->deferred_chunk) {
+		for (unsigned int i = 0; i < server->num_sessions; ++i) {
+			if ((server->sessions[i]->pollfd->events & POLLOUT) > 0) {
+				server->deferred_chunk = true;
+				return LLMD_OK;
+			}
+		}
+	}
+	server->deferred_chunk = false;
+
+	// Sessions take turns
+	for (unsigned int i = 0; i < server->num_sessions && server->num_generating > 0; ++i) {
+		unsigned int index = (server->next_generating + i) % server->num_sessions;
+		struct llmd_ipc_session* session = server->sessions[index];
+		if (!session->generating) { continue; }
+
+		if ((status = llmd_ipc_continue_generate(server, session))) {
+			llmd_log(server->host, LLMD_LOG_WARNING, "Error while handling session %p: %d", (void*)session, status);
+			llmd_ipc_handle_session_close(server, session);
+		}
+
+		server->next_generating = index + 1;
+		break;
+	}
+
 	return LLMD_OK;
 }
 
@@ -827,6 +958,7 @@ llmd_destroy_ipc_server(
 		llmd_ipc_cleanup_shared_mem(&context->logits);
 	}
 	llmd_free(server->host, server->contexts);
+	llmd_free_vocab_table(server->host, &server->vocab_table);
 
 	if (server->ipc_sock != -1) {
 		close(server->ipc_sock);
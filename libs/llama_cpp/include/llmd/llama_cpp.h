@@ -21,8 +21,43 @@
 struct llmd_llama_cpp_driver_config {
 	struct llama_context_params context_params;
 	const char* model_path;
+	// Threads evaluating a single token, 0 uses every CPU the driver runs on
 	unsigned int num_threads;
+	// Threads evaluating several tokens at once, 0 uses num_threads
+	unsigned int num_batch_threads;
+	// CPUs to run evaluation threads on, e.g. "0-15,32-47".
+	// NULL leaves them where the calling thread may run.
+	const char* cpus;
+	// Let llama.cpp spread its threads and memory over NUMA nodes
+	bool numa;
 	unsigned int max_contexts;
+	// How many llama contexts back the descriptors.
+	// The state of the others is parked in host memory, only as big as what
+	// was evaluated, and swapped in when they are used.
+	// 0 gives every descriptor its own.
+	unsigned int max_resident_contexts;
+};
+
+// Time spent evaluating, either single tokens or several at once
+struct llmd_llama_cpp_thread_stats {
+	uint64_t num_calls;
+	uint64_t num_tokens;
+	uint64_t wall_ns;
+	// wall_ns of every call multiplied by its number of threads
+	uint64_t thread_ns;
+};
+
+struct llmd_llama_cpp_stats {
+	struct llmd_llama_cpp_thread_stats decode;
+	struct llmd_llama_cpp_thread_stats prefill;
+	// CPU time of the whole process while at least one evaluation runs.
+	// Overlapping evaluations are counted once but work outside of the
+	// driver in the meantime is included.
+	uint64_t cpu_ns;
+	// cpu_ns over the thread_ns of decode and prefill
+	float utilization;
+	unsigned int num_threads;
+	unsigned int num_batch_threads;
 };
 
 #ifdef __cplusplus
@@ -41,6 +76,12 @@ llmd_destroy_llama_cpp_driver(
 	struct llmd_driver* driver
 );
 
+LLMD_LLAMA_CPP_API enum llmd_error
+llmd_get_llama_cpp_stats(
+	struct llmd_driver* driver,
+	struct llmd_llama_cpp_stats* stats_out
+);
+
 #ifdef LLMD_LLAMA_CPP_BUILD
 
 LLMD_LLAMA_CPP_API enum llmd_error
@@ -1,12 +1,44 @@
+#define _GNU_SOURCE
 #include <llmd/llama_cpp.h>
 #include <llmd/core.h>
 #include <llmd/utils/host.h>
 #include <llmd/utils/buffer.h>
 #include <llmd/utils/cfg.h>
+#include <llmd/utils/logits.h>
 #include <string.h>
 #include <errno.h>
 #include <llama.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// A llama context which holds the state of one descriptor at a time
+struct llmd_llama_cpp_slot {
+	struct llama_context* ctx;
+	// -1 when free
+	int descriptor;
+	// Calls using the context, it is not evicted while there are any
+	unsigned int num_users;
+	uint64_t last_used;
+	// Set while a state is copied in or out or the context is created, which
+	// is done without the lock. Nothing else touches the slot meanwhile.
+	bool busy;
+};
+
+struct llmd_llama_cpp_descriptor {
+	bool used;
+	// -1 when the state is parked
+	int slot;
+	// NULL if nothing was evaluated before parking
+	llmd_buffer(uint8_t) parked_state;
+	size_t parked_size;
+	int parked_num_tokens;
+};
 
 struct llmd_llama_cpp_driver {
 	struct llmd_driver header;
@@ -15,9 +47,304 @@ struct llmd_llama_cpp_driver {
 
 	llmd_buffer(char) tmp_str_buf;
 	struct llama_model* model;
-	struct llama_context* contexts[];
+
+	unsigned int num_threads;
+	unsigned int num_batch_threads;
+#ifdef __linux__
+	bool pinned;
+	cpu_set_t cpus;
+#endif
+
+	// Guards slots, descriptors and stats.
+	// A busy slot belongs to the call which marked it until it is cleared.
+	pthread_mutex_t lock;
+	struct llmd_llama_cpp_stats stats;
+	// Process CPU time is only read when the first evaluation starts and the
+	// last one ends so that concurrent ones are not counted twice
+	unsigned int num_evaluating;
+	uint64_t busy_start_cpu_ns;
+	pthread_cond_t slot_released;
+	uint64_t use_clock;
+	unsigned int num_slots;
+	struct llmd_llama_cpp_slot* slots;
+	struct llmd_llama_cpp_descriptor descriptors[];
 };
 
+static uint64_t
+llmd_llama_cpp_clock_ns(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+#ifdef __linux__
+// Parse a list like "0-3,8,10-11"
+static enum llmd_error
+llmd_llama_cpp_parse_cpus(const char* str, cpu_set_t* cpus_out) {
+	CPU_ZERO(cpus_out);
+
+	while (*str != '\0') {
+		char* end;
+		errno = 0;
+		unsigned long first = strtoul(str, &end, 10);
+		unsigned long last = first;
+		if (errno || end == str) { return LLMD_ERR_INVALID; }
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+			if (errno || end == str || last < first) { return LLMD_ERR_INVALID; }
+		}
+
+		if (last >= CPU_SETSIZE) { return LLMD_ERR_INVALID; }
+		for (unsigned long cpu = first; cpu <= last; ++cpu) {
+			CPU_SET(cpu, cpus_out);
+		}
+
+		str = end;
+		while (*str == ' ' || *str == '\n') { ++str; }
+		if (*str == ',') { ++str; }
+	}
+
+	return CPU_COUNT(cpus_out) > 0 ? LLMD_OK : LLMD_ERR_INVALID;
+}
+#endif
+
+// Evaluate in chunks of n_batch tokens.
+// llama.cpp only keeps the logits of the last chunk so when rows for every
+// token are wanted, everything is evaluated at once.
+static enum llmd_error
+llmd_llama_cpp_eval(
+	struct llmd_llama_cpp_driver* driver,
+	struct llama_context* ctx,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	bool every_row,
+	unsigned int* num_rows_out
+) {
+	unsigned int chunk_size = driver->config->context_params.n_batch > 0 && !every_row
+		? (unsigned int)driver->config->context_params.n_batch
+		: num_tokens;
+
+	unsigned int num_threads = num_tokens > 1
+		? driver->num_batch_threads
+		: driver->num_threads;
+
+#ifdef __linux__
+	// llama.cpp starts its threads for every evaluation and they inherit the
+	// affinity of the calling thread
+	cpu_set_t caller_cpus;
+	bool pinned = driver->pinned
+		&& pthread_getaffinity_np(pthread_self(), sizeof(caller_cpus), &caller_cpus) == 0
+		&& pthread_setaffinity_np(pthread_self(), sizeof(driver->cpus), &driver->cpus) == 0;
+#endif
+
+	pthread_mutex_lock(&driver->lock);
+	if (driver->num_evaluating++ == 0) {
+		driver->busy_start_cpu_ns = llmd_llama_cpp_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	}
+	pthread_mutex_unlock(&driver->lock);
+
+	uint64_t start_ns = llmd_llama_cpp_clock_ns(CLOCK_MONOTONIC);
+	int result = 0;
+	unsigned int num_rows = 0;
+	for (unsigned int i = 0; i < num_tokens && result == 0; i += num_rows) {
+		num_rows = num_tokens - i < chunk_size ? num_tokens - i : chunk_size;
+		result = llama_eval(
+			ctx, (const llama_token*)tokens + i, num_rows, offset + i, num_threads
+		);
+	}
+	uint64_t wall_ns = llmd_llama_cpp_clock_ns(CLOCK_MONOTONIC) - start_ns;
+
+#ifdef __linux__
+	if (pinned) {
+		pthread_setaffinity_np(pthread_self(), sizeof(caller_cpus), &caller_cpus);
+	}
+#endif
+
+	pthread_mutex_lock(&driver->lock);
+	if (--driver->num_evaluating == 0) {
+		driver->stats.cpu_ns +=
+			llmd_llama_cpp_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - driver->busy_start_cpu_ns;
+	}
+
+	if (result == 0) {
+		struct llmd_llama_cpp_thread_stats* stats = num_tokens > 1
+			? &driver->stats.prefill
+			: &driver->stats.decode;
+		++stats->num_calls;
+		stats->num_tokens += num_tokens;
+		stats->wall_ns += wall_ns;
+		stats->thread_ns += wall_ns * num_threads;
+	}
+	pthread_mutex_unlock(&driver->lock);
+
+	if (result != 0) {
+		return LLMD_ERR_IO;
+	}
+
+	*num_rows_out = num_rows;
+	return LLMD_OK;
+}
+
+// Must be called without the lock, on a busy slot
+static enum llmd_error
+llmd_llama_cpp_park(
+	struct llmd_llama_cpp_driver* driver,
+	struct llmd_llama_cpp_slot* slot
+) {
+	// The state is only as big as what was evaluated
+	llmd_buffer(uint8_t) state = NULL;
+	state = llmd_resize_buffer(driver->host, state, llama_get_state_size(slot->ctx));
+	if (state == NULL) { return LLMD_ERR_OOM; }
+
+	size_t size = llama_copy_state_data(slot->ctx, state);
+	llmd_buffer(uint8_t) trimmed_state = llmd_resize_buffer(driver->host, state, size);
+	if (trimmed_state != NULL) { state = trimmed_state; }
+	int num_tokens = llama_get_kv_cache_token_count(slot->ctx);
+
+	pthread_mutex_lock(&driver->lock);
+	struct llmd_llama_cpp_descriptor* descriptor = &driver->descriptors[slot->descriptor];
+	descriptor->parked_state = state;
+	descriptor->parked_size = size;
+	descriptor->parked_num_tokens = num_tokens;
+	descriptor->slot = -1;
+	slot->descriptor = -1;
+	pthread_mutex_unlock(&driver->lock);
+
+	return LLMD_OK;
+}
+
+// Must be called without the lock, on a busy slot.
+// Parks what the slot holds then loads a state into it, if any.
+static enum llmd_error
+llmd_llama_cpp_fill_slot(
+	struct llmd_llama_cpp_driver* driver,
+	struct llmd_llama_cpp_slot* slot,
+	const uint8_t* state,
+	size_t size
+) {
+	if (slot->descriptor >= 0) {
+		enum llmd_error status = llmd_llama_cpp_park(driver, slot);
+		if (status != LLMD_OK) { return status; }
+	}
+
+	if (slot->ctx == NULL) {
+		slot->ctx = llama_new_context_with_model(
+			driver->model,
+			driver->config->context_params
+		);
+		if (slot->ctx == NULL) { return LLMD_ERR_IO; }
+	}
+
+	if (state != NULL && llama_set_state_data(slot->ctx, (uint8_t*)state) != size) {
+		return LLMD_ERR_IO;
+	}
+
+	return LLMD_OK;
+}
+
+// Make the state of a descriptor resident and keep it so until released
+static enum llmd_error
+llmd_llama_cpp_acquire(
+	struct llmd_llama_cpp_driver* driver,
+	int descriptor_index,
+	struct llama_context** ctx_out
+) {
+	if (descriptor_index < 0 || descriptor_index >= (int)driver->config->max_contexts) {
+		return LLMD_ERR_INVALID;
+	}
+
+	enum llmd_error status = LLMD_OK;
+	struct llmd_llama_cpp_descriptor* descriptor = &driver->descriptors[descriptor_index];
+
+	pthread_mutex_lock(&driver->lock);
+	if (!descriptor->used) {
+		status = LLMD_ERR_INVALID;
+		goto end;
+	}
+
+	while (descriptor->slot < 0 || driver->slots[descriptor->slot].busy) {
+		// Another call is moving it in
+		if (descriptor->slot >= 0) {
+			pthread_cond_wait(&driver->slot_released, &driver->lock);
+			continue;
+		}
+
+		// A free slot first, then the least recently used idle one
+		struct llmd_llama_cpp_slot* victim = NULL;
+		for (unsigned int i = 0; i < driver->num_slots; ++i) {
+			struct llmd_llama_cpp_slot* slot = &driver->slots[i];
+			if (slot->busy) { continue; }
+
+			if (slot->descriptor < 0) {
+				victim = slot;
+				break;
+			}
+
+			if (
+				slot->num_users == 0
+				&& (victim == NULL || slot->last_used < victim->last_used)
+			) {
+				victim = slot;
+			}
+		}
+
+		if (victim == NULL) {
+			pthread_cond_wait(&driver->slot_released, &driver->lock);
+			continue;
+		}
+
+		// Copying states and creating a context are slow so they are done
+		// without the lock. The busy slot keeps both descriptors waiting.
+		llmd_buffer(uint8_t) state = descriptor->parked_state;
+		size_t size = descriptor->parked_size;
+		descriptor->parked_state = NULL;
+		descriptor->parked_size = 0;
+		descriptor->slot = (int)(victim - driver->slots);
+		victim->busy = true;
+		pthread_mutex_unlock(&driver->lock);
+
+		status = llmd_llama_cpp_fill_slot(driver, victim, state, size);
+
+		pthread_mutex_lock(&driver->lock);
+		victim->busy = false;
+		pthread_cond_broadcast(&driver->slot_released);
+		if (status != LLMD_OK) {
+			descriptor->parked_state = state;
+			descriptor->parked_size = size;
+			descriptor->slot = -1;
+			goto end;
+		}
+
+		llmd_free_buffer(driver->host, state);
+		victim->descriptor = descriptor_index;
+	}
+
+	struct llmd_llama_cpp_slot* slot = &driver->slots[descriptor->slot];
+	++slot->num_users;
+	slot->last_used = ++driver->use_clock;
+	*ctx_out = slot->ctx;
+
+end:
+	pthread_mutex_unlock(&driver->lock);
+	return status;
+}
+
+static void
+llmd_llama_cpp_release(
+	struct llmd_llama_cpp_driver* driver,
+	int descriptor_index
+) {
+	pthread_mutex_lock(&driver->lock);
+	struct llmd_llama_cpp_slot* slot = &driver->slots[driver->descriptors[descriptor_index].slot];
+	if (--slot->num_users == 0) {
+		pthread_cond_broadcast(&driver->slot_released);
+	}
+	pthread_mutex_unlock(&driver->lock);
+}
+
 static enum llmd_error
 llmd_llama_cpp_get_model_info(
 	struct llmd_driver* header,
@@ -40,27 +367,58 @@ llmd_llama_cpp_create_context(
 	int* descriptor_out
 ) {
 	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
+	enum llmd_error status = LLMD_ERR_OOM;
 
+	pthread_mutex_lock(&driver->lock);
 	for (unsigned int i = 0; i < driver->config->max_contexts; ++i) {
-		if (driver->contexts[i] != NULL) {
+		struct llmd_llama_cpp_descriptor* descriptor = &driver->descriptors[i];
+		if (descriptor->used) {
 			continue;
 		}
 
-		struct llama_context* ctx = llama_new_context_with_model(
-			driver->model,
-			driver->config->context_params
-		);
+		// Take a free slot right away so that every descriptor owns one when
+		// there are as many
+		struct llmd_llama_cpp_slot* free_slot = NULL;
+		for (unsigned int j = 0; j < driver->num_slots; ++j) {
+			struct llmd_llama_cpp_slot* slot = &driver->slots[j];
+			if (slot->descriptor < 0 && !slot->busy) {
+				free_slot = slot;
+				break;
+			}
+		}
 
-		if (ctx == NULL) {
-			return LLMD_ERR_IO;
+		*descriptor = (struct llmd_llama_cpp_descriptor) {
+			.used = true,
+			.slot = free_slot != NULL ? (int)(free_slot - driver->slots) : -1,
+		};
+
+		if (free_slot != NULL && free_slot->ctx == NULL) {
+			// Created without the lock like in llmd_llama_cpp_acquire
+			free_slot->busy = true;
+			pthread_mutex_unlock(&driver->lock);
+			status = llmd_llama_cpp_fill_slot(driver, free_slot, NULL, 0);
+			pthread_mutex_lock(&driver->lock);
+			free_slot->busy = false;
+			pthread_cond_broadcast(&driver->slot_released);
+
+			if (status != LLMD_OK) {
+				*descriptor = (struct llmd_llama_cpp_descriptor) { .slot = -1 };
+				break;
+			}
+		}
+
+		if (free_slot != NULL) {
+			free_slot->descriptor = (int)i;
+			free_slot->last_used = ++driver->use_clock;
 		}
 
-		driver->contexts[i] = ctx;
 		*descriptor_out = i;
-		return LLMD_OK;
+		status = LLMD_OK;
+		break;
 	}
 
-	return LLMD_ERR_OOM;
+	pthread_mutex_unlock(&driver->lock);
+	return status;
 }
 
 static enum llmd_error
@@ -70,17 +428,32 @@ llmd_llama_cpp_destroy_context(
 ) {
 	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
 
-	if (descriptor < 0 || descriptor > (int)driver->config->max_contexts) {
+	if (descriptor < 0 || descriptor >= (int)driver->config->max_contexts) {
 		return LLMD_ERR_INVALID;
 	}
 
-	struct llama_context* ctx = driver->contexts[descriptor];
-	if (ctx == NULL) {
+	pthread_mutex_lock(&driver->lock);
+	struct llmd_llama_cpp_descriptor* entry = &driver->descriptors[descriptor];
+	if (!entry->used) {
+		pthread_mutex_unlock(&driver->lock);
 		return LLMD_ERR_INVALID;
 	}
 
-	llama_free(ctx);
-	driver->contexts[descriptor] = NULL;
+	// It may be moving out of its slot
+	while (entry->slot >= 0 && driver->slots[entry->slot].busy) {
+		pthread_cond_wait(&driver->slot_released, &driver->lock);
+	}
+
+	if (entry->slot >= 0) {
+		struct llmd_llama_cpp_slot* slot = &driver->slots[entry->slot];
+		llama_free(slot->ctx);
+		slot->ctx = NULL;
+		slot->descriptor = -1;
+	}
+
+	llmd_free_buffer(driver->host, entry->parked_state);
+	*entry = (struct llmd_llama_cpp_descriptor) { .slot = -1 };
+	pthread_mutex_unlock(&driver->lock);
 
 	return LLMD_OK;
 }
@@ -145,32 +518,162 @@ llmd_llama_cpp_generate(
 	const llmd_token_t* tokens,
 	unsigned int num_tokens,
 	unsigned int offset,
-	float* logits_out
+	const struct llmd_logits_output* output
+) {
+	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
+
+	// Only contexts created with logits_all keep a row for every token
+	bool logits_all = driver->config->context_params.logits_all;
+	bool every_row = output != NULL
+		&& (output->mode == LLMD_LOGITS_ALL || output->mode == LLMD_LOGITS_POSITIONS);
+	if (every_row && !logits_all) {
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	struct llama_context* ctx;
+	enum llmd_error status = llmd_llama_cpp_acquire(driver, context_descriptor, &ctx);
+	if (status != LLMD_OK) {
+		return status;
+	}
+
+	unsigned int num_rows;
+	status = llmd_llama_cpp_eval(
+		driver, ctx, tokens, num_tokens, offset, every_row, &num_rows
+	);
+	if (status == LLMD_OK) {
+		llmd_write_logits_rows(
+			output,
+			llama_get_logits(ctx),
+			logits_all ? num_rows : 1,
+			llama_n_vocab_from_model(driver->model)
+		);
+	}
+
+	llmd_llama_cpp_release(driver, context_descriptor);
+	return status;
+}
+
+static enum llmd_error
+llmd_llama_cpp_save_state(
+	struct llmd_driver* header,
+	int context_descriptor,
+	void* state_out,
+	size_t* size_inout
 ) {
 	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
 
-	if (context_descriptor < 0 || context_descriptor > (int)driver->config->max_contexts) {
+	if (context_descriptor < 0 || context_descriptor >= (int)driver->config->max_contexts) {
 		return LLMD_ERR_INVALID;
 	}
 
-	struct llama_context* ctx = driver->contexts[context_descriptor];
-	if (ctx == NULL) {
+	// A parked state is returned as is
+	pthread_mutex_lock(&driver->lock);
+	struct llmd_llama_cpp_descriptor* descriptor = &driver->descriptors[context_descriptor];
+	if (descriptor->used && descriptor->parked_state != NULL) {
+		enum llmd_error status = LLMD_OK;
+		if (state_out == NULL || *size_inout < descriptor->parked_size) {
+			status = LLMD_ERR_BUF_SIZE;
+		} else {
+			memcpy(state_out, descriptor->parked_state, descriptor->parked_size);
+		}
+
+		*size_inout = descriptor->parked_size;
+		pthread_mutex_unlock(&driver->lock);
+		return status;
+	}
+	pthread_mutex_unlock(&driver->lock);
+
+	struct llama_context* ctx;
+	enum llmd_error status = llmd_llama_cpp_acquire(driver, context_descriptor, &ctx);
+	if (status != LLMD_OK) {
+		return status;
+	}
+
+	// This is an upper bound, the KV cache is only copied up to what was
+	// evaluated
+	size_t max_size = llama_get_state_size(ctx);
+	if (state_out == NULL || *size_inout < max_size) {
+		*size_inout = max_size;
+		status = LLMD_ERR_BUF_SIZE;
+	} else {
+		*size_inout = llama_copy_state_data(ctx, state_out);
+	}
+
+	llmd_llama_cpp_release(driver, context_descriptor);
+	return status;
+}
+
+static enum llmd_error
+llmd_llama_cpp_load_state(
+	struct llmd_driver* header,
+	int context_descriptor,
+	const void* state,
+	size_t size
+) {
+	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
+
+	struct llama_context* ctx;
+	enum llmd_error status = llmd_llama_cpp_acquire(driver, context_descriptor, &ctx);
+	if (status != LLMD_OK) {
+		return status;
+	}
+
+	if (size > llama_get_state_size(ctx)) {
+		status = LLMD_ERR_INVALID;
+	} else if (llama_set_state_data(ctx, (uint8_t*)state) != size) {
+		status = LLMD_ERR_IO;
+	}
+
+	llmd_llama_cpp_release(driver, context_descriptor);
+	return status;
+}
+
+static enum llmd_error
+llmd_llama_cpp_copy_context(
+	struct llmd_driver* header,
+	int source_descriptor,
+	int dest_descriptor,
+	unsigned int num_tokens
+) {
+	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
+
+	if (
+		source_descriptor < 0 || source_descriptor >= (int)driver->config->max_contexts
+		|| dest_descriptor < 0 || dest_descriptor >= (int)driver->config->max_contexts
+	) {
 		return LLMD_ERR_INVALID;
 	}
 
-	if (llama_eval(ctx, (const llama_token*)tokens, num_tokens, offset, 1)) {
-		return LLMD_ERR_IO;
+	// Both may not fit in the slots at once so the state goes through host
+	// memory.
+	// llama.cpp can only copy a whole state, anything past num_tokens is
+	// overwritten by the next evaluation.
+	size_t size = 0;
+	enum llmd_error status = llmd_llama_cpp_save_state(header, source_descriptor, NULL, &size);
+	if (status != LLMD_ERR_BUF_SIZE) {
+		return status == LLMD_OK ? LLMD_ERR_INVALID : status;
 	}
 
-	if (logits_out) {
-		memcpy(
-			logits_out,
-			llama_get_logits(ctx),
-			llama_n_vocab_from_model(driver->model) * sizeof(float)
-		);
+	uint8_t* state = llmd_malloc(driver->host, size);
+	if (state == NULL) {
+		return LLMD_ERR_OOM;
 	}
 
-	return LLMD_OK;
+	pthread_mutex_lock(&driver->lock);
+	struct llmd_llama_cpp_descriptor* source = &driver->descriptors[source_descriptor];
+	int num_evaluated = source->slot >= 0
+		? llama_get_kv_cache_token_count(driver->slots[source->slot].ctx)
+		: source->parked_num_tokens;
+	pthread_mutex_unlock(&driver->lock);
+
+	if ((int)num_tokens > num_evaluated) {
+		status = LLMD_ERR_INVALID;
+	} else if ((status = llmd_llama_cpp_save_state(header, source_descriptor, state, &size)) == LLMD_OK) {
+		status = llmd_llama_cpp_load_state(header, dest_descriptor, state, size);
+	}
+
+	llmd_free(driver->host, state);
+	return status;
 }
 
 static struct llmd_driver_interface llmd_llama_cpp_driver_interface = {
@@ -180,6 +683,9 @@ static struct llmd_driver_interface llmd_llama_cpp_driver_interface = {
 	.tokenize = llmd_llama_cpp_tokenize,
 	.decode_token = llmd_llama_cpp_decode_token,
 	.generate = llmd_llama_cpp_generate,
+	.save_state = llmd_llama_cpp_save_state,
+	.load_state = llmd_llama_cpp_load_state,
+	.copy_context = llmd_llama_cpp_copy_context,
 };
 
 enum llmd_error
@@ -192,12 +698,82 @@ llmd_create_llama_cpp_driver(
 		host = &llmd_default_host;
 	}
 
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+		CPU_ZERO(&cpus);
+	}
+
+	bool pinned = config->cpus != NULL;
+	if (pinned) {
+		cpu_set_t allowed_cpus = cpus;
+		if (llmd_llama_cpp_parse_cpus(config->cpus, &cpus) != LLMD_OK) {
+			llmd_log(host, LLMD_LOG_ERROR, "Invalid CPU list: %s", config->cpus);
+			return LLMD_ERR_INVALID;
+		}
+
+		if (CPU_COUNT(&allowed_cpus) > 0) {
+			CPU_AND(&cpus, &cpus, &allowed_cpus);
+		}
+
+		if (CPU_COUNT(&cpus) == 0) {
+			llmd_log(host, LLMD_LOG_ERROR, "None of the CPUs %s can be used", config->cpus);
+			return LLMD_ERR_INVALID;
+		}
+	}
+
+	long num_cpus = CPU_COUNT(&cpus);
+#else
+	if (config->cpus != NULL) {
+		llmd_log(host, LLMD_LOG_ERROR, "Pinning threads is not supported");
+		return LLMD_ERR_NOT_SUPPORTED;
+	}
+
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (num_cpus <= 0) { num_cpus = 1; }
+
+	unsigned int num_threads = config->num_threads > 0
+		? config->num_threads
+		: (unsigned int)num_cpus;
+	unsigned int num_batch_threads = config->num_batch_threads > 0
+		? config->num_batch_threads
+		: num_threads;
+
+	if (config->numa) {
+		llama_backend_init(true);
+	}
+
+	unsigned int num_slots = config->max_resident_contexts > 0
+		&& config->max_resident_contexts < config->max_contexts
+		? config->max_resident_contexts
+		: config->max_contexts;
+
 	struct llmd_llama_cpp_driver* driver = llmd_malloc(
 		host,
 		sizeof(struct llmd_llama_cpp_driver) +
-		sizeof(struct llmd_context*) * config->max_contexts
+		sizeof(struct llmd_llama_cpp_descriptor) * config->max_contexts
+	);
+	struct llmd_llama_cpp_slot* slots = llmd_malloc(
+		host, sizeof(struct llmd_llama_cpp_slot) * (num_slots > 0 ? num_slots : 1)
 	);
-	if (driver == NULL) {
+	if (driver == NULL || slots == NULL) {
+		llmd_free(host, slots);
+		llmd_free(host, driver);
+		return LLMD_ERR_OOM;
+	}
+
+	if (pthread_mutex_init(&driver->lock, NULL) != 0) {
+		llmd_free(host, slots);
+		llmd_free(host, driver);
+		return LLMD_ERR_OOM;
+	}
+
+	if (pthread_cond_init(&driver->slot_released, NULL) != 0) {
+		pthread_mutex_destroy(&driver->lock);
+		llmd_free(host, slots);
+		llmd_free(host, driver);
 		return LLMD_ERR_OOM;
 	}
 
@@ -208,21 +784,42 @@ llmd_create_llama_cpp_driver(
 
 	if (model == NULL) {
 		llmd_log(host, LLMD_LOG_ERROR, "Could not load model");
+		pthread_cond_destroy(&driver->slot_released);
+		pthread_mutex_destroy(&driver->lock);
+		llmd_free(host, slots);
 		llmd_free(host, driver);
 		return LLMD_ERR_IO;
 	}
 
-	*driver = (struct llmd_llama_cpp_driver) {
-		.header = {
-			.interface = &llmd_llama_cpp_driver_interface,
-		},
-		.host = host,
-		.config = config,
-		.model = model,
+	driver->header = (struct llmd_driver) {
+		.interface = &llmd_llama_cpp_driver_interface,
 	};
+	driver->host = host;
+	driver->config = config;
+	driver->tmp_str_buf = NULL;
+	driver->model = model;
+	driver->num_threads = num_threads;
+	driver->num_batch_threads = num_batch_threads;
+#ifdef __linux__
+	driver->pinned = pinned;
+	driver->cpus = cpus;
+#endif
+	driver->stats = (struct llmd_llama_cpp_stats) {
+		.num_threads = num_threads,
+		.num_batch_threads = num_batch_threads,
+	};
+	driver->num_evaluating = 0;
+	driver->busy_start_cpu_ns = 0;
+	driver->use_clock = 0;
+	driver->num_slots = num_slots;
+	driver->slots = slots;
+
+	for (unsigned int i = 0; i < num_slots; ++i) {
+		driver->slots[i] = (struct llmd_llama_cpp_slot) { .descriptor = -1 };
+	}
 
 	for (unsigned int i = 0; i < config->max_contexts; ++i) {
-		driver->contexts[i] = NULL;
+		driver->descriptors[i] = (struct llmd_llama_cpp_descriptor) { .slot = -1 };
 	}
 
 	*driver_out = &driver->header;
@@ -236,13 +833,20 @@ llmd_destroy_llama_cpp_driver(
 ) {
 	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
 
-	for (unsigned int i = 0; i < driver->config->max_contexts; ++i) {
-		struct llama_context* ctx = driver->contexts[i];
+	for (unsigned int i = 0; i < driver->num_slots; ++i) {
+		struct llama_context* ctx = driver->slots[i].ctx;
 		if (ctx != NULL) {
 			llama_free(ctx);
 		}
 	}
 
+	for (unsigned int i = 0; i < driver->config->max_contexts; ++i) {
+		llmd_free_buffer(driver->host, driver->descriptors[i].parked_state);
+	}
+
+	pthread_cond_destroy(&driver->slot_released);
+	pthread_mutex_destroy(&driver->lock);
+	llmd_free(driver->host, driver->slots);
 	llmd_free_buffer(driver->host, driver->tmp_str_buf);
 	llama_free_model(driver->model);
 	llmd_free(driver->host, driver);
@@ -250,6 +854,75 @@ llmd_destroy_llama_cpp_driver(
 	return LLMD_OK;
 }
 
+enum llmd_error
+llmd_get_llama_cpp_stats(
+	struct llmd_driver* header,
+	struct llmd_llama_cpp_stats* stats_out
+) {
+	struct llmd_llama_cpp_driver* driver = (struct llmd_llama_cpp_driver*)header;
+
+	pthread_mutex_lock(&driver->lock);
+	*stats_out = driver->stats;
+	pthread_mutex_unlock(&driver->lock);
+
+	uint64_t thread_ns = stats_out->decode.thread_ns + stats_out->prefill.thread_ns;
+	stats_out->utilization = thread_ns > 0
+		? (float)stats_out->cpu_ns / (float)thread_ns
+		: 0.f;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_llama_cpp_set_cpus(
+	struct llmd_host* host,
+	struct llmd_llama_cpp_driver_config* config,
+	const char* value
+) {
+	size_t len = strlen(value);
+	char* cpus = llmd_malloc(host, len + 1);
+	if (cpus == NULL) {
+		return LLMD_ERR_OOM;
+	}
+	memcpy(cpus, value, len + 1);
+
+	llmd_free(host, (void*)config->cpus);
+	config->cpus = cpus;
+	return LLMD_OK;
+}
+
+// Pin to the CPUs listed by sysfs for a node
+static enum llmd_error
+llmd_llama_cpp_set_numa_node(
+	struct llmd_host* host,
+	struct llmd_llama_cpp_driver_config* config,
+	const char* value
+) {
+	unsigned int node;
+	enum llmd_error status = llmd_cfg_parse_uint(value, 0, INT_MAX, &node);
+	if (status != LLMD_OK) {
+		return status;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		llmd_log(host, LLMD_LOG_ERROR, "Could not read %s", path);
+		return LLMD_ERR_IO;
+	}
+
+	char cpus[1024];
+	bool read = fgets(cpus, sizeof(cpus), file) != NULL;
+	fclose(file);
+	if (!read) {
+		return LLMD_ERR_IO;
+	}
+
+	cpus[strcspn(cpus, "\n")] = '\0';
+	return llmd_llama_cpp_set_cpus(host, config, cpus);
+}
+
 enum llmd_error
 llmd_begin_create_driver(
 	struct llmd_host* host,
@@ -286,14 +959,26 @@ llmd_set_driver_config(
 			return LLMD_OK;
 		} else if (strcmp(key, "max_contexts") == 0){
 			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->max_contexts);
+		} else if (strcmp(key, "max_resident_contexts") == 0){
+			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->max_resident_contexts);
 		} else {
 			return LLMD_ERR_INVALID;
 		}
 	} else if (strcmp(section, "llama_cpp") == 0) {
 		if (strcmp(key, "n_ctx") == 0) {
 			return llmd_cfg_parse_int(value, 0, INT_MAX, &config->context_params.n_ctx);
+		} else if (strcmp(key, "n_batch") == 0) {
+			return llmd_cfg_parse_int(value, 0, INT_MAX, &config->context_params.n_batch);
 		} else if (strcmp(key, "n_threads") == 0) {
 			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->num_threads);
+		} else if (strcmp(key, "n_batch_threads") == 0) {
+			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->num_batch_threads);
+		} else if (strcmp(key, "cpus") == 0) {
+			return llmd_llama_cpp_set_cpus(host, config, value);
+		} else if (strcmp(key, "numa_node") == 0) {
+			return llmd_llama_cpp_set_numa_node(host, config, value);
+		} else if (strcmp(key, "numa") == 0) {
+			return llmd_cfg_parse_bool(value, &config->numa);
 		} else if (strcmp(key, "n_gpu_layers") == 0) {
 			return llmd_cfg_parse_int(value, 0, INT_MAX, &config->context_params.n_gpu_layers);
 		} else if (strcmp(key, "main_gpu") == 0) {
@@ -306,6 +991,8 @@ llmd_set_driver_config(
 			return llmd_cfg_parse_bool(value, &config->context_params.use_mmap);
 		} else if (strcmp(key, "use_mlock") == 0) {
 			return llmd_cfg_parse_bool(value, &config->context_params.use_mlock);
+		} else if (strcmp(key, "logits_all") == 0) {
+			return llmd_cfg_parse_bool(value, &config->context_params.logits_all);
 		} else {
 			return LLMD_ERR_INVALID;
 		}
@@ -324,6 +1011,7 @@ llmd_end_create_driver(
 ) {
 	if (driver_out == NULL) {
 		llmd_free(host, (void*)config->model_path);
+		llmd_free(host, (void*)config->cpus);
 		llmd_free(host, config);
 		return LLMD_OK;
 	} else {
@@ -346,6 +1034,7 @@ llmd_destroy_driver(
 
 	llmd_destroy_llama_cpp_driver(header);
 	llmd_free(host, (void*)config->model_path);
+	llmd_free(host, (void*)config->cpus);
 	llmd_free(host, config);
 
 	return LLMD_OK;
@@ -0,0 +1,90 @@
+#ifndef LLMD_MOCK_H
+#define LLMD_MOCK_H
+
+#include <llmd/core.h>
+#include <stdint.h>
+
+#ifdef LLMD_MOCK_SHARED
+#    if defined(_WIN32) && !defined(__MINGW32__)
+#        ifdef LLMD_MOCK_BUILD
+#            define LLMD_MOCK_API __declspec(dllexport)
+#        else
+#            define LLMD_MOCK_API __declspec(dllimport)
+#        endif
+#    else
+#        define LLMD_MOCK_API __attribute__((visibility ("default")))
+#    endif
+#else
+#    define LLMD_MOCK_API
+#endif
+
+// A driver without a model for benchmarks and tests.
+// Logits are pseudo-random but only depend on the seed and the tokens of a
+// context so runs can be compared.
+// Strings are tokenized byte by byte, vocab_size must be at least 259.
+// Different contexts can be evaluated from different threads.
+struct llmd_mock_driver_config {
+	unsigned int vocab_size;
+	unsigned int max_context_length;
+	unsigned int max_contexts;
+	uint64_t seed;
+
+	// Every evaluation sleeps for prefill_us_per_token for all tokens except
+	// the last one of each item and decode_us_per_token once for the whole
+	// batch
+	unsigned int prefill_us_per_token;
+	unsigned int decode_us_per_token;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+LLMD_MOCK_API enum llmd_error
+llmd_create_mock_driver(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config* config,
+	struct llmd_driver** driver_out
+);
+
+LLMD_MOCK_API enum llmd_error
+llmd_destroy_mock_driver(
+	struct llmd_driver* driver
+);
+
+#ifdef LLMD_MOCK_BUILD
+
+LLMD_MOCK_API enum llmd_error
+llmd_begin_create_driver(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config** config
+);
+
+LLMD_MOCK_API enum llmd_error
+llmd_set_driver_config(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config* config,
+	const char* section,
+	const char* key,
+	const char* value
+);
+
+LLMD_MOCK_API enum llmd_error
+llmd_end_create_driver(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config* config,
+	struct llmd_driver** driver_out
+);
+
+LLMD_MOCK_API enum llmd_error
+llmd_destroy_driver(
+	struct llmd_driver* driver
+);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,618 @@
+#include <llmd/mock.h>
+#include <llmd/core.h>
+#include <llmd/utils/host.h>
+#include <llmd/utils/cfg.h>
+#include <llmd/utils/logits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#define LLMD_MOCK_NUM_SPECIAL_TOKENS 3
+#define LLMD_MOCK_MIN_VOCAB_SIZE (LLMD_MOCK_NUM_SPECIAL_TOKENS + 256)
+
+struct llmd_mock_context {
+	bool used;
+	unsigned int num_tokens;
+	// Hash of every prefix, logits at a position only depend on it
+	uint64_t* hashes;
+	// Per context so that different contexts can be evaluated concurrently
+	float* tmp_logits;
+};
+
+struct llmd_mock_driver {
+	struct llmd_driver header;
+	struct llmd_host* host;
+	struct llmd_mock_driver_config* config;
+
+	struct llmd_mock_context contexts[];
+};
+
+static uint64_t
+llmd_mock_mix(uint64_t x) {
+	// splitmix64 finalizer
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+static void
+llmd_mock_compute_logits(
+	uint64_t hash,
+	unsigned int vocab_size,
+	float* logits_out
+) {
+	for (unsigned int i = 0; i < vocab_size; ++i) {
+		uint64_t bits = llmd_mock_mix(hash + (uint64_t)i * 0x9e3779b97f4a7c15ull);
+		// Top 24 bits into [-8, 8)
+		logits_out[i] = (float)(bits >> 40) * (16.f / (float)(1 << 24)) - 8.f;
+	}
+}
+
+static void
+llmd_mock_sleep_us(uint64_t us) {
+	if (us == 0) { return; }
+
+	struct timespec duration = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+	while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {}
+}
+
+static struct llmd_mock_context*
+llmd_mock_context_of(
+	struct llmd_mock_driver* driver,
+	int descriptor
+) {
+	if (descriptor < 0 || descriptor >= (int)driver->config->max_contexts) {
+		return NULL;
+	}
+
+	struct llmd_mock_context* ctx = &driver->contexts[descriptor];
+	return ctx->used ? ctx : NULL;
+}
+
+static enum llmd_error
+llmd_mock_get_model_info(
+	struct llmd_driver* header,
+	struct llmd_model_info* info_out
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	info_out->bos_token = 1;
+	info_out->eos_token = 2;
+	info_out->nl_token = LLMD_MOCK_NUM_SPECIAL_TOKENS + '\n';
+	info_out->max_context_length = driver->config->max_context_length;
+	info_out->vocab_size = driver->config->vocab_size;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_create_context(
+	struct llmd_driver* header,
+	int* descriptor_out
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	for (unsigned int i = 0; i < driver->config->max_contexts; ++i) {
+		struct llmd_mock_context* ctx = &driver->contexts[i];
+		if (ctx->used) {
+			continue;
+		}
+
+		ctx->hashes = llmd_malloc(
+			driver->host, sizeof(uint64_t) * driver->config->max_context_length
+		);
+		if (ctx->hashes == NULL) {
+			return LLMD_ERR_OOM;
+		}
+
+		ctx->tmp_logits = llmd_malloc(
+			driver->host, sizeof(float) * driver->config->vocab_size
+		);
+		if (ctx->tmp_logits == NULL) {
+			llmd_free(driver->host, ctx->hashes);
+			ctx->hashes = NULL;
+			return LLMD_ERR_OOM;
+		}
+
+		ctx->used = true;
+		ctx->num_tokens = 0;
+		*descriptor_out = i;
+		return LLMD_OK;
+	}
+
+	return LLMD_ERR_OOM;
+}
+
+static enum llmd_error
+llmd_mock_destroy_context(
+	struct llmd_driver* header,
+	int descriptor
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	struct llmd_mock_context* ctx = llmd_mock_context_of(driver, descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	llmd_free(driver->host, ctx->hashes);
+	llmd_free(driver->host, ctx->tmp_logits);
+	ctx->hashes = NULL;
+	ctx->tmp_logits = NULL;
+	ctx->used = false;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_tokenize(
+	struct llmd_driver* header,
+	const char* string,
+	unsigned int num_chars,
+	llmd_token_t* tokens_out,
+	unsigned int* num_tokens_inout
+) {
+	(void)header;
+
+	if (num_chars > *num_tokens_inout) {
+		*num_tokens_inout = num_chars;
+		return LLMD_ERR_BUF_SIZE;
+	}
+
+	for (unsigned int i = 0; i < num_chars; ++i) {
+		tokens_out[i] = LLMD_MOCK_NUM_SPECIAL_TOKENS + (unsigned char)string[i];
+	}
+	*num_tokens_inout = num_chars;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_decode_token(
+	struct llmd_driver* header,
+	llmd_token_t token,
+	char* string_out,
+	unsigned int* num_chars_inout
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	if (token >= driver->config->vocab_size) {
+		return LLMD_ERR_INVALID;
+	}
+
+	char str[16];
+	unsigned int len;
+	if (token < LLMD_MOCK_NUM_SPECIAL_TOKENS) {
+		*num_chars_inout = 0;
+		return LLMD_OK;
+	} else if (token < LLMD_MOCK_MIN_VOCAB_SIZE) {
+		str[0] = (char)(token - LLMD_MOCK_NUM_SPECIAL_TOKENS);
+		len = 1;
+	} else {
+		// Tokens without a byte still need to be printable
+		len = (unsigned int)snprintf(str, sizeof(str), "<%u>", token);
+	}
+
+	if (len > *num_chars_inout) {
+		*num_chars_inout = len;
+		return LLMD_ERR_BUF_SIZE;
+	} else {
+		memcpy(string_out, str, len);
+		*num_chars_inout = len;
+		return LLMD_OK;
+	}
+}
+
+static enum llmd_error
+llmd_mock_eval(
+	struct llmd_mock_driver* driver,
+	int context_descriptor,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output
+) {
+	struct llmd_mock_context* ctx = llmd_mock_context_of(driver, context_descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	unsigned int vocab_size = driver->config->vocab_size;
+	if (
+		num_tokens == 0
+		|| offset > ctx->num_tokens
+		|| num_tokens > driver->config->max_context_length - offset
+	) {
+		return LLMD_ERR_INVALID;
+	}
+
+	uint64_t hash = offset > 0 ? ctx->hashes[offset - 1] : driver->config->seed;
+	for (unsigned int i = 0; i < num_tokens; ++i) {
+		hash = llmd_mock_mix(hash ^ tokens[i]);
+		ctx->hashes[offset + i] = hash;
+	}
+	ctx->num_tokens = offset + num_tokens;
+
+	const uint64_t* hashes = ctx->hashes + offset;
+	if (output == NULL || output->mode == LLMD_LOGITS_NONE) {
+		return LLMD_OK;
+	} else if (output->mode == LLMD_LOGITS_ALL) {
+		for (unsigned int i = 0; i < num_tokens; ++i) {
+			llmd_mock_compute_logits(
+				hashes[i], vocab_size, output->logits + (size_t)i * vocab_size
+			);
+		}
+	} else if (output->mode == LLMD_LOGITS_POSITIONS) {
+		for (unsigned int i = 0; i < output->num_positions; ++i) {
+			llmd_mock_compute_logits(
+				hashes[output->positions[i]], vocab_size,
+				output->logits + (size_t)i * vocab_size
+			);
+		}
+	} else {
+		llmd_mock_compute_logits(hashes[num_tokens - 1], vocab_size, ctx->tmp_logits);
+		llmd_write_logits_output(output, ctx->tmp_logits, vocab_size);
+	}
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_generate(
+	struct llmd_driver* header,
+	int context_descriptor,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	const struct llmd_logits_output* output
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	enum llmd_error status = llmd_mock_eval(
+		driver, context_descriptor, tokens, num_tokens, offset, output
+	);
+	if (status != LLMD_OK) {
+		return status;
+	}
+
+	llmd_mock_sleep_us(
+		(uint64_t)driver->config->prefill_us_per_token * (num_tokens - 1)
+		+ driver->config->decode_us_per_token
+	);
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_generate_batch(
+	struct llmd_driver* header,
+	const struct llmd_driver_generate_item* items,
+	unsigned int num_items
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	uint64_t num_prefill_tokens = 0;
+	for (unsigned int i = 0; i < num_items; ++i) {
+		enum llmd_error status = llmd_mock_eval(
+			driver,
+			items[i].context_descriptor,
+			items[i].tokens, items[i].num_tokens, items[i].offset,
+			items[i].output
+		);
+		if (status != LLMD_OK) {
+			return status;
+		}
+
+		num_prefill_tokens += items[i].num_tokens - 1;
+	}
+
+	// Like a real batch, all items share one decode pass
+	llmd_mock_sleep_us(
+		driver->config->prefill_us_per_token * num_prefill_tokens
+		+ driver->config->decode_us_per_token
+	);
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_save_state(
+	struct llmd_driver* header,
+	int context_descriptor,
+	void* state_out,
+	size_t* size_inout
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	struct llmd_mock_context* ctx = llmd_mock_context_of(driver, context_descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	if (state_out == NULL) {
+		*size_inout = sizeof(uint64_t) * (1 + (size_t)driver->config->max_context_length);
+		return LLMD_ERR_BUF_SIZE;
+	}
+
+	// The number of tokens then their hashes
+	size_t size = sizeof(uint64_t) * (1 + (size_t)ctx->num_tokens);
+	if (*size_inout < size) {
+		*size_inout = size;
+		return LLMD_ERR_BUF_SIZE;
+	}
+
+	uint64_t num_tokens = ctx->num_tokens;
+	memcpy(state_out, &num_tokens, sizeof(num_tokens));
+	memcpy((uint64_t*)state_out + 1, ctx->hashes, sizeof(uint64_t) * ctx->num_tokens);
+	*size_inout = size;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_load_state(
+	struct llmd_driver* header,
+	int context_descriptor,
+	const void* state,
+	size_t size
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	struct llmd_mock_context* ctx = llmd_mock_context_of(driver, context_descriptor);
+	if (ctx == NULL) {
+		return LLMD_ERR_INVALID;
+	}
+
+	uint64_t num_tokens;
+	if (size < sizeof(num_tokens)) {
+		return LLMD_ERR_INVALID;
+	}
+	memcpy(&num_tokens, state, sizeof(num_tokens));
+
+	if (
+		num_tokens > driver->config->max_context_length
+		|| size != sizeof(uint64_t) * (1 + num_tokens)
+	) {
+		return LLMD_ERR_INVALID;
+	}
+
+	memcpy(ctx->hashes, (const uint64_t*)state + 1, sizeof(uint64_t) * num_tokens);
+	ctx->num_tokens = (unsigned int)num_tokens;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_copy_context(
+	struct llmd_driver* header,
+	int source_descriptor,
+	int dest_descriptor,
+	unsigned int num_tokens
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	struct llmd_mock_context* source = llmd_mock_context_of(driver, source_descriptor);
+	struct llmd_mock_context* dest = llmd_mock_context_of(driver, dest_descriptor);
+	if (source == NULL || dest == NULL || num_tokens > source->num_tokens) {
+		return LLMD_ERR_INVALID;
+	}
+
+	memcpy(dest->hashes, source->hashes, sizeof(uint64_t) * num_tokens);
+	dest->num_tokens = num_tokens;
+
+	return LLMD_OK;
+}
+
+static enum llmd_error
+llmd_mock_shift_context(
+	struct llmd_driver* header,
+	int context_descriptor,
+	unsigned int num_keep,
+	unsigned int num_discard,
+	unsigned int num_tokens
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	struct llmd_mock_context* ctx = llmd_mock_context_of(driver, context_descriptor);
+	if (
+		ctx == NULL
+		|| num_tokens > ctx->num_tokens
+		|| num_keep > num_tokens
+		|| num_discard > num_tokens - num_keep
+	) {
+		return LLMD_ERR_INVALID;
+	}
+
+	// Later tokens keep the hashes they had like a real KV cache keeps their
+	// keys and values
+	memmove(
+		ctx->hashes + num_keep,
+		ctx->hashes + num_keep + num_discard,
+		sizeof(uint64_t) * (num_tokens - num_keep - num_discard)
+	);
+	ctx->num_tokens = num_tokens - num_discard;
+
+	return LLMD_OK;
+}
+
+static struct llmd_driver_interface llmd_mock_driver_interface = {
+	.create_context = llmd_mock_create_context,
+	.destroy_context = llmd_mock_destroy_context,
+	.get_model_info = llmd_mock_get_model_info,
+	.tokenize = llmd_mock_tokenize,
+	.decode_token = llmd_mock_decode_token,
+	.generate = llmd_mock_generate,
+	.generate_batch = llmd_mock_generate_batch,
+	.save_state = llmd_mock_save_state,
+	.load_state = llmd_mock_load_state,
+	.copy_context = llmd_mock_copy_context,
+	.shift_context = llmd_mock_shift_context,
+};
+
+enum llmd_error
+llmd_create_mock_driver(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config* config,
+	struct llmd_driver** driver_out
+) {
+	if (host == NULL) {
+		host = &llmd_default_host;
+	}
+
+	if (
+		config->vocab_size < LLMD_MOCK_MIN_VOCAB_SIZE
+		|| config->max_context_length == 0
+		|| config->max_contexts == 0
+	) {
+		llmd_log(host, LLMD_LOG_ERROR, "Invalid mock driver config");
+		return LLMD_ERR_INVALID;
+	}
+
+	struct llmd_mock_driver* driver = llmd_malloc(
+		host,
+		sizeof(struct llmd_mock_driver) +
+		sizeof(struct llmd_mock_context) * config->max_contexts
+	);
+	if (driver == NULL) {
+		return LLMD_ERR_OOM;
+	}
+
+	*driver = (struct llmd_mock_driver) {
+		.header = {
+			.interface = &llmd_mock_driver_interface,
+		},
+		.host = host,
+		.config = config,
+	};
+
+	for (unsigned int i = 0; i < config->max_contexts; ++i) {
+		driver->contexts[i] = (struct llmd_mock_context) { .used = false };
+	}
+
+	*driver_out = &driver->header;
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_destroy_mock_driver(
+	struct llmd_driver* header
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+
+	for (unsigned int i = 0; i < driver->config->max_contexts; ++i) {
+		llmd_free(driver->host, driver->contexts[i].hashes);
+		llmd_free(driver->host, driver->contexts[i].tmp_logits);
+	}
+
+	llmd_free(driver->host, driver);
+
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_begin_create_driver(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config** config_out
+) {
+	struct llmd_mock_driver_config* config = llmd_malloc(
+		host,
+		sizeof(struct llmd_mock_driver_config)
+	);
+	if (config == NULL) {
+		return LLMD_ERR_OOM;
+	}
+
+	*config = (struct llmd_mock_driver_config) {
+		.vocab_size = 32000,
+		.max_context_length = 2048,
+		.max_contexts = 8,
+	};
+
+	*config_out = config;
+	return LLMD_OK;
+}
+
+enum llmd_error
+llmd_set_driver_config(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config* config,
+	const char* section,
+	const char* key,
+	const char* value
+) {
+	(void)host;
+
+	if (strcmp(section, "main") == 0) {
+		if (strcmp(key, "max_contexts") == 0) {
+			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->max_contexts);
+		} else {
+			return LLMD_ERR_INVALID;
+		}
+	} else if (strcmp(section, "mock") == 0) {
+		if (strcmp(key, "vocab_size") == 0) {
+			return llmd_cfg_parse_uint(value, LLMD_MOCK_MIN_VOCAB_SIZE, INT_MAX, &config->vocab_size);
+		} else if (strcmp(key, "n_ctx") == 0) {
+			return llmd_cfg_parse_uint(value, 1, INT_MAX, &config->max_context_length);
+		} else if (strcmp(key, "seed") == 0) {
+			unsigned int seed;
+			enum llmd_error status = llmd_cfg_parse_uint(value, 0, UINT_MAX, &seed);
+			if (status == LLMD_OK) {
+				config->seed = seed;
+			}
+			return status;
+		} else if (strcmp(key, "prefill_us_per_token") == 0) {
+			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->prefill_us_per_token);
+		} else if (strcmp(key, "decode_us_per_token") == 0) {
+			return llmd_cfg_parse_uint(value, 0, INT_MAX, &config->decode_us_per_token);
+		} else {
+			return LLMD_ERR_INVALID;
+		}
+	} else if (strcmp(section, "llmd") == 0) {
+		return LLMD_OK;
+	} else {
+		return LLMD_ERR_INVALID;
+	}
+}
+
+enum llmd_error
+llmd_end_create_driver(
+	struct llmd_host* host,
+	struct llmd_mock_driver_config* config,
+	struct llmd_driver** driver_out
+) {
+	if (driver_out == NULL) {
+		llmd_free(host, config);
+		return LLMD_OK;
+	}
+
+	enum llmd_error status = llmd_create_mock_driver(host, config, driver_out);
+	if (status != LLMD_OK) {
+		llmd_free(host, config);
+	}
+
+	return status;
+}
+
+enum llmd_error
+llmd_destroy_driver(
+	struct llmd_driver* header
+) {
+	struct llmd_mock_driver* driver = (struct llmd_mock_driver*)header;
+	struct llmd_host* host = driver->host;
+	struct llmd_mock_driver_config* config = driver->config;
+
+	llmd_destroy_mock_driver(header);
+	llmd_free(host, config);
+
+	return LLMD_OK;
+}
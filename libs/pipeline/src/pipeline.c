@@ -51,6 +51,7 @@ struct lm_pipeline_ctx {
 	struct llmd_host* host;
 	struct llmd_arena_allocator allocator;
 	struct llmd_model_info model_info;
+	const struct llmd_vocab_table* vocab_table;
 	struct llmd_context* lm;
 	struct llmd_generate_handle* gen_handle;
 
@@ -130,6 +131,10 @@ lm_pipeline_run(
 		return status;
 	}
 
+	if ((status = llmd_get_vocab_table(session, &ctx->vocab_table)) != LLMD_OK) {
+		return status;
+	}
+
 	// Ensure a large enough buffer for context tokens
 	size_t required_token_buf_size = ctx->model_info.max_context_length;
 	if (llmd_buffer_size(ctx->token_buf) < required_token_buf_size) {
@@ -146,15 +151,7 @@ lm_pipeline_run(
 	}
 
 	// Ensure a large enough buffer for context strings
-	unsigned int max_token_length = 0;
-	for (llmd_token_t i = 0; i < ctx->model_info.vocab_size; ++i) {
-		unsigned int token_length = 0;
-		if ((status = llmd_decode_token(lm, i, NULL, &token_length)) != LLMD_OK) {
-			return status;
-		}
-
-		max_token_length = token_length > max_token_length ? token_length : max_token_length;
-	}
+	unsigned int max_token_length = ctx->vocab_table->max_token_length;
 
 	// Add 1 for NULL terminator
 	size_t required_text_buf_size = ctx->model_info.vocab_size * max_token_length + 1;
@@ -461,7 +458,10 @@ lm_pipeline_get_next_logits(struct lm_pipeline_ctx* ctx) {
 				ctx->token_buf + ctx->eval_offset,
 				ctx->token_offset - ctx->eval_offset,
 				ctx->eval_offset,
-				ctx->logit_buf
+				&(struct llmd_logits_output) {
+					.mode = LLMD_LOGITS_FULL,
+					.logits = ctx->logit_buf,
+				}
 			)
 		);
 
@@ -507,11 +507,11 @@ static bool
 lm_pipeline_match_prefixes(llmd_token_t id, void* userdata) {
 	struct lm_prefix_set* prefix_set = userdata;
 	struct lm_pipeline_ctx* ctx = prefix_set->ctx;
-	const char* token_text;
-	unsigned int text_len;
-	lm_pipeline_check(
-		llmd_decode_token(prefix_set->ctx->lm, id, &token_text, &text_len)
-	);
+
+	// Called for every token in the vocabulary so go to the table directly
+	const struct llmd_vocab_table* vocab_table = ctx->vocab_table;
+	const char* token_text = vocab_table->text + vocab_table->offsets[id];
+	unsigned int text_len = vocab_table->offsets[id + 1] - vocab_table->offsets[id] - 1;
 
 	for (unsigned int i = 0; i < prefix_set->num_prefixes; ++i) {
 		size_t prefix_len = prefix_set->str_lens[i];
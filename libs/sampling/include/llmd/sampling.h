@@ -39,6 +39,11 @@ struct llmd_sampling_mirostat_v2_state {
 	float* scratch_buf;
 };
 
+struct llmd_sampling_random_picker_state {
+	struct llmd_sampling_rng rng;
+	float temperature;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -130,6 +135,17 @@ llmd_sampling_pick_mirostat_v2(
 	struct llmd_sampling_mirostat_v2_state* mirostat_v2
 );
 
+// Pickers, e.g. for llmd_generate_speculative
+
+LLMD_SAMPLING_API struct llmd_token_picker
+llmd_sampling_init_argmax_picker(void);
+
+// Temperature then a weighted random pick
+LLMD_SAMPLING_API struct llmd_token_picker
+llmd_sampling_init_random_picker(
+	struct llmd_sampling_random_picker_state* state
+);
+
 #ifdef __cplusplus
 }
 #endif
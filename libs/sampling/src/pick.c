@@ -73,3 +73,35 @@ llmd_sampling_pick_mirostat_v2(
 
 	return token;
 }
+
+static llmd_token_t
+llmd_sampling_argmax_pick(void* state, float* logits, unsigned int num_logits) {
+	(void)state;
+	return llmd_sampling_pick_argmax(num_logits, logits);
+}
+
+struct llmd_token_picker
+llmd_sampling_init_argmax_picker(void) {
+	return (struct llmd_token_picker){
+		.pick = llmd_sampling_argmax_pick,
+	};
+}
+
+static llmd_token_t
+llmd_sampling_random_pick(void* state, float* logits, unsigned int num_logits) {
+	struct llmd_sampling_random_picker_state* random = state;
+
+	llmd_sampling_apply_temperature(num_logits, logits, random->temperature);
+	llmd_sampling_softmax(num_logits, logits, logits);
+	return llmd_sampling_pick_weighted_random(num_logits, logits, &random->rng);
+}
+
+struct llmd_token_picker
+llmd_sampling_init_random_picker(
+	struct llmd_sampling_random_picker_state* state
+) {
+	return (struct llmd_token_picker){
+		.pick = llmd_sampling_random_pick,
+		.state = state,
+	};
+}
@@ -0,0 +1,132 @@
+#ifndef LLMD_UTILS_LOGITS_H
+#define LLMD_UTILS_LOGITS_H
+
+#include <llmd/core.h>
+#include <string.h>
+
+// Min-heap on logit so the root is the smallest of the current top k
+static inline void
+llmd_logits_heap_sift_down(
+	float* logits,
+	llmd_token_t* tokens,
+	unsigned int size,
+	unsigned int index
+) {
+	while (true) {
+		unsigned int smallest = index;
+		unsigned int left = index * 2 + 1;
+		unsigned int right = left + 1;
+
+		if (left < size && logits[left] < logits[smallest]) { smallest = left; }
+		if (right < size && logits[right] < logits[smallest]) { smallest = right; }
+		if (smallest == index) { break; }
+
+		float tmp_logit = logits[index];
+		logits[index] = logits[smallest];
+		logits[smallest] = tmp_logit;
+
+		llmd_token_t tmp_token = tokens[index];
+		tokens[index] = tokens[smallest];
+		tokens[smallest] = tmp_token;
+
+		index = smallest;
+	}
+}
+
+// Write the highest k logits and their tokens in descending order.
+// k must be in [1, num_logits].
+static inline void
+llmd_select_top_k_logits(
+	const float* logits,
+	unsigned int num_logits,
+	unsigned int k,
+	float* logits_out,
+	llmd_token_t* tokens_out
+) {
+	for (unsigned int i = 0; i < k; ++i) {
+		logits_out[i] = logits[i];
+		tokens_out[i] = (llmd_token_t)i;
+	}
+
+	for (unsigned int i = k / 2; i-- > 0;) {
+		llmd_logits_heap_sift_down(logits_out, tokens_out, k, i);
+	}
+
+	// Most logits lose against the root so this is mostly a linear scan
+	for (unsigned int i = k; i < num_logits; ++i) {
+		if (logits[i] > logits_out[0]) {
+			logits_out[0] = logits[i];
+			tokens_out[0] = (llmd_token_t)i;
+			llmd_logits_heap_sift_down(logits_out, tokens_out, k, 0);
+		}
+	}
+
+	// Heap sort, popping the minimum to the back
+	for (unsigned int size = k; size > 1; --size) {
+		float tmp_logit = logits_out[0];
+		logits_out[0] = logits_out[size - 1];
+		logits_out[size - 1] = tmp_logit;
+
+		llmd_token_t tmp_token = tokens_out[0];
+		tokens_out[0] = tokens_out[size - 1];
+		tokens_out[size - 1] = tmp_token;
+
+		llmd_logits_heap_sift_down(logits_out, tokens_out, size - 1, 0);
+	}
+}
+
+// For drivers: fill an output from a row of logits
+static inline void
+llmd_write_logits_output(
+	const struct llmd_logits_output* output,
+	const float* logits,
+	unsigned int num_logits
+) {
+	if (output == NULL) { return; }
+
+	switch (output->mode) {
+		case LLMD_LOGITS_FULL:
+			memcpy(output->logits, logits, num_logits * sizeof(float));
+			break;
+		case LLMD_LOGITS_NONE:
+			break;
+		case LLMD_LOGITS_TOP_K:
+			llmd_select_top_k_logits(
+				logits, num_logits,
+				output->top_k < num_logits ? output->top_k : num_logits,
+				output->logits, output->tokens
+			);
+			break;
+		case LLMD_LOGITS_ALL:
+		case LLMD_LOGITS_POSITIONS:
+			// Need every row, see llmd_write_logits_rows
+			break;
+	}
+}
+
+// For drivers: fill an output from one row of logits per evaluated token
+static inline void
+llmd_write_logits_rows(
+	const struct llmd_logits_output* output,
+	const float* rows,
+	unsigned int num_rows,
+	unsigned int num_logits
+) {
+	if (output != NULL && output->mode == LLMD_LOGITS_ALL) {
+		memcpy(output->logits, rows, (size_t)num_rows * num_logits * sizeof(float));
+	} else if (output != NULL && output->mode == LLMD_LOGITS_POSITIONS) {
+		for (unsigned int i = 0; i < output->num_positions; ++i) {
+			memcpy(
+				output->logits + (size_t)i * num_logits,
+				rows + (size_t)output->positions[i] * num_logits,
+				num_logits * sizeof(float)
+			);
+		}
+	} else {
+		llmd_write_logits_output(
+			output, rows + (size_t)(num_rows - 1) * num_logits, num_logits
+		);
+	}
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef LLMD_UTILS_VOCAB_H
+#define LLMD_UTILS_VOCAB_H
+
+#include <llmd/core.h>
+#include "buffer.h"
+#include "host.h"
+
+// Decode every token of a driver into one blob
+static inline enum llmd_error
+llmd_build_vocab_table(
+	struct llmd_host* host,
+	struct llmd_driver* driver,
+	unsigned int vocab_size,
+	struct llmd_vocab_table* table_out
+) {
+	llmd_buffer(char) text = NULL;
+	unsigned int* offsets = llmd_malloc(host, sizeof(unsigned int) * (vocab_size + 1));
+	if (offsets == NULL) { return LLMD_ERR_OOM; }
+
+	enum llmd_error status = LLMD_OK;
+	unsigned int text_size = 0;
+	unsigned int max_token_length = 0;
+	for (llmd_token_t token = 0; token < vocab_size; ++token) {
+		offsets[token] = text_size;
+
+		unsigned int num_chars;
+		while (true) {
+			// Always keep room for the null terminator
+			size_t capacity = llmd_buffer_size(text);
+			num_chars = capacity > text_size ? (unsigned int)(capacity - text_size - 1) : 0;
+			status = driver->interface->decode_token(
+				driver, token,
+				capacity > text_size ? text + text_size : NULL, &num_chars
+			);
+
+			if (status == LLMD_OK && text_size + num_chars < capacity) { break; }
+			if (status != LLMD_OK && status != LLMD_ERR_BUF_SIZE) { goto end; }
+
+			size_t new_capacity = capacity > 0 ? capacity * 2 : 4096;
+			while (new_capacity < (size_t)text_size + num_chars + 1) {
+				new_capacity *= 2;
+			}
+
+			llmd_buffer(char) new_text = llmd_resize_buffer(host, text, new_capacity);
+			if (new_text == NULL) {
+				status = LLMD_ERR_OOM;
+				goto end;
+			}
+			text = new_text;
+		}
+
+		text[text_size + num_chars] = '\0';
+		text_size += num_chars + 1;
+		max_token_length = num_chars > max_token_length ? num_chars : max_token_length;
+	}
+	offsets[vocab_size] = text_size;
+
+	// Give back the slack from doubling
+	if (text_size > 0) {
+		llmd_buffer(char) trimmed_text = llmd_resize_buffer(host, text, text_size);
+		if (trimmed_text != NULL) { text = trimmed_text; }
+	}
+
+	*table_out = (struct llmd_vocab_table) {
+		.num_tokens = vocab_size,
+		.max_token_length = max_token_length,
+		.text = text,
+		.offsets = offsets,
+	};
+
+end:
+	if (status != LLMD_OK) {
+		llmd_free_buffer(host, text);
+		llmd_free(host, offsets);
+	}
+
+	return status;
+}
+
+static inline void
+llmd_free_vocab_table(
+	struct llmd_host* host,
+	struct llmd_vocab_table* table
+) {
+	llmd_free_buffer(host, (char*)table->text);
+	llmd_free(host, (unsigned int*)table->offsets);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef LLMD_TEST_COMMON_H
+#define LLMD_TEST_COMMON_H
+
+#include <llmd/core.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+#define CHECK_OK(op) \
+	do { \
+		enum llmd_error check_status = (op); \
+		if (check_status != LLMD_OK) { \
+			fprintf( \
+				stderr, "%s:%d: %s returns %d (%s)\n", \
+				__FILE__, __LINE__, #op, check_status, llmd_error_to_str(check_status) \
+			); \
+			exit(1); \
+		} \
+	} while (0)
+
+#endif
@@ -0,0 +1,92 @@
+// A batch which needs more pooled contexts than the pool holds must fail
+// right away instead of waiting in the admission queue for itself
+#include "common.h"
+#include <llmd/mock.h>
+#include <time.h>
+
+#define VOCAB_SIZE 300
+#define MAX_POOLED_CONTEXTS 2
+#define NUM_CONTEXTS (MAX_POOLED_CONTEXTS + 1)
+#define NUM_TOKENS 4
+
+static void
+prepare(
+	struct llmd_context** contexts,
+	struct llmd_generate_request* requests,
+	unsigned int num_requests,
+	const llmd_token_t* tokens
+) {
+	for (unsigned int i = 0; i < num_requests; ++i) {
+		struct llmd_generate_handle* handle;
+		CHECK_OK(llmd_begin_generate(contexts[i], &handle));
+		requests[i] = (struct llmd_generate_request) {
+			.generate_handle = handle,
+			.tokens = tokens,
+			.num_tokens = NUM_TOKENS,
+			.offset = 0,
+		};
+	}
+}
+
+static void
+finish(struct llmd_generate_request* requests, unsigned int num_requests) {
+	for (unsigned int i = 0; i < num_requests; ++i) {
+		CHECK_OK(llmd_end_generate(requests[i].generate_handle));
+	}
+}
+
+int
+main(void) {
+	struct llmd_mock_driver_config driver_config = {
+		.vocab_size = VOCAB_SIZE,
+		.max_context_length = 64,
+		.max_contexts = NUM_CONTEXTS,
+		.seed = 42,
+	};
+	struct llmd_driver* driver;
+	CHECK_OK(llmd_create_mock_driver(NULL, &driver_config, &driver));
+
+	struct llmd_session_config config = {
+		.admission_timeout_ms = 60000,
+		.max_pooled_contexts = MAX_POOLED_CONTEXTS,
+	};
+	struct llmd_session* session;
+	CHECK_OK(llmd_create_session(NULL, driver, &config, &session));
+
+	struct llmd_context* contexts[NUM_CONTEXTS];
+	for (unsigned int i = 0; i < NUM_CONTEXTS; ++i) {
+		CHECK_OK(llmd_create_context(session, LLMD_CONTEXT_MIN_UPLOAD, &contexts[i]));
+	}
+
+	const llmd_token_t tokens[NUM_TOKENS] = { 'a', 'b', 'c', 'd' };
+	struct llmd_generate_request requests[NUM_CONTEXTS];
+
+	// Waiting would only end with the admission timeout
+	prepare(contexts, requests, NUM_CONTEXTS, tokens);
+	time_t start = time(NULL);
+	CHECK(llmd_generate_next_batch(requests, NUM_CONTEXTS) == LLMD_ERR_OOM);
+	CHECK(time(NULL) - start < 10);
+	for (unsigned int i = 0; i < NUM_CONTEXTS; ++i) {
+		CHECK(requests[i].status == LLMD_ERR_OOM);
+	}
+	finish(requests, NUM_CONTEXTS);
+
+	struct llmd_session_stats stats;
+	CHECK_OK(llmd_get_session_stats(session, &stats));
+	CHECK(stats.num_ooms == 1);
+
+	// A batch which fits still runs
+	prepare(contexts, requests, MAX_POOLED_CONTEXTS, tokens);
+	CHECK_OK(llmd_generate_next_batch(requests, MAX_POOLED_CONTEXTS));
+	for (unsigned int i = 0; i < MAX_POOLED_CONTEXTS; ++i) {
+		CHECK_OK(requests[i].status);
+	}
+	finish(requests, MAX_POOLED_CONTEXTS);
+
+	for (unsigned int i = 0; i < NUM_CONTEXTS; ++i) {
+		CHECK_OK(llmd_destroy_context(contexts[i]));
+	}
+	CHECK_OK(llmd_destroy_session(session));
+	CHECK_OK(llmd_destroy_mock_driver(driver));
+	return 0;
+}
@@ -0,0 +1,302 @@
+// Rows of logits must not depend on how the scheduler splits a call
+#include "common.h"
+#include <llmd/mock.h>
+#include <math.h>
+#include <string.h>
+
+#define VOCAB_SIZE 300
+#define NUM_TOKENS 200
+#define MAX_BATCH_TOKENS 16
+
+static const unsigned int positions[] = { 199, 3, 150, 0, 16, 15 };
+#define NUM_POSITIONS (sizeof(positions) / sizeof(positions[0]))
+
+static struct llmd_session*
+create_session(struct llmd_driver* driver, unsigned int max_batch_tokens) {
+	struct llmd_session_config config = {
+		.max_batch_tokens = max_batch_tokens,
+		.max_batch_wait_us = 100,
+	};
+	struct llmd_session* session;
+	CHECK_OK(llmd_create_session(NULL, driver, &config, &session));
+	return session;
+}
+
+// Evaluate each sequence in its own context, all in one batch
+static void
+evaluate(
+	struct llmd_driver* driver,
+	unsigned int max_batch_tokens,
+	unsigned int num_sequences,
+	llmd_token_t (*tokens)[NUM_TOKENS],
+	const struct llmd_logits_output* outputs
+) {
+	struct llmd_session* session = create_session(driver, max_batch_tokens);
+	struct llmd_context* contexts[2];
+	struct llmd_generate_handle* handles[2];
+	struct llmd_generate_request requests[2];
+
+	for (unsigned int i = 0; i < num_sequences; ++i) {
+		CHECK_OK(llmd_create_context(session, LLMD_CONTEXT_DIRECT, &contexts[i]));
+		CHECK_OK(llmd_begin_generate(contexts[i], &handles[i]));
+		requests[i] = (struct llmd_generate_request) {
+			.generate_handle = handles[i],
+			.tokens = tokens[i],
+			.num_tokens = NUM_TOKENS,
+			.offset = 0,
+			.output = &outputs[i],
+		};
+	}
+
+	if (num_sequences == 1) {
+		CHECK_OK(llmd_generate_next(handles[0], tokens[0], NUM_TOKENS, 0, &outputs[0]));
+	} else {
+		CHECK_OK(llmd_generate_next_batch(requests, num_sequences));
+		for (unsigned int i = 0; i < num_sequences; ++i) {
+			CHECK_OK(requests[i].status);
+		}
+	}
+
+	for (unsigned int i = 0; i < num_sequences; ++i) {
+		CHECK_OK(llmd_end_generate(handles[i]));
+		CHECK_OK(llmd_destroy_context(contexts[i]));
+	}
+	CHECK_OK(llmd_destroy_session(session));
+}
+
+static void
+check_mode(
+	struct llmd_driver* driver,
+	enum llmd_logits_mode mode,
+	unsigned int num_sequences,
+	llmd_token_t (*tokens)[NUM_TOKENS]
+) {
+	size_t num_rows = mode == LLMD_LOGITS_ALL ? NUM_TOKENS : NUM_POSITIONS;
+	size_t size = sizeof(float) * VOCAB_SIZE * num_rows;
+	struct llmd_logits_output expected[2] = { 0 };
+	struct llmd_logits_output actual[2] = { 0 };
+
+	for (unsigned int i = 0; i < num_sequences; ++i) {
+		expected[i] = (struct llmd_logits_output) {
+			.mode = mode,
+			.logits = malloc(size),
+			.positions = positions,
+			.num_positions = NUM_POSITIONS,
+		};
+		actual[i] = expected[i];
+		actual[i].logits = malloc(size);
+		CHECK(expected[i].logits != NULL && actual[i].logits != NULL);
+		memset(actual[i].logits, 0, size);
+	}
+
+	evaluate(driver, 0, num_sequences, tokens, expected);
+	evaluate(driver, MAX_BATCH_TOKENS, num_sequences, tokens, actual);
+
+	for (unsigned int i = 0; i < num_sequences; ++i) {
+		CHECK(memcmp(expected[i].logits, actual[i].logits, size) == 0);
+		free(expected[i].logits);
+		free(actual[i].logits);
+	}
+}
+
+static void
+score(
+	struct llmd_driver* driver,
+	unsigned int max_batch_tokens,
+	const llmd_token_t* tokens,
+	float* log_probs_out
+) {
+	struct llmd_session* session = create_session(driver, max_batch_tokens);
+	struct llmd_context* context;
+	struct llmd_generate_handle* handle;
+
+	CHECK_OK(llmd_create_context(session, LLMD_CONTEXT_DIRECT, &context));
+	CHECK_OK(llmd_begin_generate(context, &handle));
+	CHECK_OK(llmd_score_tokens(handle, tokens, NUM_TOKENS, 0, log_probs_out));
+	CHECK_OK(llmd_end_generate(handle));
+	CHECK_OK(llmd_destroy_context(context));
+	CHECK_OK(llmd_destroy_session(session));
+}
+
+static void
+check_scores(struct llmd_driver* driver, const llmd_token_t* tokens) {
+	float expected[NUM_TOKENS - 1];
+	float actual[NUM_TOKENS - 1];
+
+	score(driver, 0, tokens, expected);
+	score(driver, MAX_BATCH_TOKENS, tokens, actual);
+	CHECK(memcmp(expected, actual, sizeof(expected)) == 0);
+}
+
+#define NUM_GENERATED 64
+#define NUM_DRAFT_TOKENS 20
+
+static llmd_token_t
+pick_max(void* state, float* logits, unsigned int num_logits) {
+	(void)state;
+
+	llmd_token_t best = 0;
+	for (unsigned int i = 1; i < num_logits; ++i) {
+		if (logits[i] > logits[best]) { best = (llmd_token_t)i; }
+	}
+
+	return best;
+}
+
+// Samples from the softmax of the logits, state is the seed
+static llmd_token_t
+pick_sample(void* state, float* logits, unsigned int num_logits) {
+	unsigned int* seed = state;
+	*seed = *seed * 1103515245u + 12345u;
+	float target = (float)((*seed >> 16) & 0x7fff) / 32768.f;
+
+	float max_logit = logits[pick_max(NULL, logits, num_logits)];
+	float sum = 0.f;
+	for (unsigned int i = 0; i < num_logits; ++i) {
+		logits[i] = expf(logits[i] - max_logit);
+		sum += logits[i];
+	}
+
+	target *= sum;
+	for (unsigned int i = 0; i < num_logits; ++i) {
+		target -= logits[i];
+		if (target < 0.f) { return (llmd_token_t)i; }
+	}
+
+	return (llmd_token_t)(num_logits - 1);
+}
+
+typedef llmd_token_t (*pick_fn_t)(void* state, float* logits, unsigned int num_logits);
+
+// Generation with the given picker, with a draft model if one is given
+static void
+generate(
+	struct llmd_driver* driver,
+	struct llmd_driver* draft_driver,
+	pick_fn_t pick,
+	unsigned int max_batch_tokens,
+	const llmd_token_t* prompt,
+	unsigned int num_prompt_tokens,
+	llmd_token_t* tokens_out
+) {
+	struct llmd_session* session = create_session(driver, max_batch_tokens);
+	struct llmd_context* context;
+	struct llmd_generate_handle* handle;
+	CHECK_OK(llmd_create_context(session, LLMD_CONTEXT_DIRECT, &context));
+	CHECK_OK(llmd_begin_generate(context, &handle));
+
+	const llmd_token_t* input = prompt;
+	unsigned int num_input_tokens = num_prompt_tokens;
+	unsigned int offset = 0;
+	unsigned int num_generated = 0;
+	unsigned int seed = 1;
+	unsigned int draft_seed = 2;
+
+	if (draft_driver == NULL) {
+		float logits[VOCAB_SIZE];
+		struct llmd_logits_output output = {
+			.mode = LLMD_LOGITS_FULL,
+			.logits = logits,
+		};
+
+		while (num_generated < NUM_GENERATED) {
+			CHECK_OK(llmd_generate_next(handle, input, num_input_tokens, offset, &output));
+			offset += num_input_tokens;
+			tokens_out[num_generated] = pick(&seed, logits, VOCAB_SIZE);
+			input = &tokens_out[num_generated++];
+			num_input_tokens = 1;
+		}
+	} else {
+		struct llmd_session* draft_session = create_session(draft_driver, max_batch_tokens);
+		struct llmd_context* draft_context;
+		struct llmd_generate_handle* draft_handle;
+		CHECK_OK(llmd_create_context(draft_session, LLMD_CONTEXT_DIRECT, &draft_context));
+		CHECK_OK(llmd_begin_generate(draft_context, &draft_handle));
+
+		struct llmd_speculative_config config = {
+			.num_draft_tokens = NUM_DRAFT_TOKENS,
+			.picker = { .pick = pick, .state = &seed },
+			.draft_picker = { .pick = pick, .state = &draft_seed },
+		};
+		while (num_generated < NUM_GENERATED) {
+			unsigned int num_tokens;
+			CHECK_OK(
+				llmd_generate_speculative(
+					handle, draft_handle,
+					input, num_input_tokens, offset,
+					&config,
+					tokens_out + num_generated, &num_tokens
+				)
+			);
+			offset += num_input_tokens + num_tokens - 1;
+			num_generated += num_tokens;
+			input = &tokens_out[num_generated - 1];
+			num_input_tokens = 1;
+		}
+
+		CHECK_OK(llmd_end_generate(draft_handle));
+		CHECK_OK(llmd_destroy_context(draft_context));
+		CHECK_OK(llmd_destroy_session(draft_session));
+	}
+
+	CHECK_OK(llmd_end_generate(handle));
+	CHECK_OK(llmd_destroy_context(context));
+	CHECK_OK(llmd_destroy_session(session));
+}
+
+// Verifying drafts must give what generation without a draft gives
+static void
+check_speculative(
+	struct llmd_driver* driver,
+	struct llmd_driver* draft_driver,
+	pick_fn_t pick,
+	const llmd_token_t* prompt
+) {
+	llmd_token_t expected[NUM_GENERATED + NUM_DRAFT_TOKENS];
+	llmd_token_t actual[NUM_GENERATED + NUM_DRAFT_TOKENS];
+
+	generate(driver, NULL, pick, 0, prompt, 40, expected);
+	generate(driver, draft_driver, pick, 0, prompt, 40, actual);
+	CHECK(memcmp(expected, actual, sizeof(llmd_token_t) * NUM_GENERATED) == 0);
+	generate(driver, draft_driver, pick, MAX_BATCH_TOKENS, prompt, 40, actual);
+	CHECK(memcmp(expected, actual, sizeof(llmd_token_t) * NUM_GENERATED) == 0);
+}
+
+int
+main(void) {
+	struct llmd_mock_driver_config config = {
+		.vocab_size = VOCAB_SIZE,
+		.max_context_length = 512,
+		.max_contexts = 4,
+		.seed = 42,
+	};
+	struct llmd_driver* driver;
+	CHECK_OK(llmd_create_mock_driver(NULL, &config, &driver));
+
+	llmd_token_t tokens[2][NUM_TOKENS];
+	for (unsigned int i = 0; i < NUM_TOKENS; ++i) {
+		tokens[0][i] = (i * 7 + 3) % VOCAB_SIZE;
+		tokens[1][i] = (i * 13 + 5) % VOCAB_SIZE;
+	}
+
+	check_mode(driver, LLMD_LOGITS_ALL, 1, tokens);
+	check_mode(driver, LLMD_LOGITS_POSITIONS, 1, tokens);
+	check_mode(driver, LLMD_LOGITS_ALL, 2, tokens);
+	check_mode(driver, LLMD_LOGITS_POSITIONS, 2, tokens);
+	check_scores(driver, tokens[0]);
+
+	// Drafts from the same model are always accepted, from another one they
+	// almost never are.
+	// Sampling also rejects guesses of the same model.
+	check_speculative(driver, driver, pick_max, tokens[0]);
+	check_speculative(driver, driver, pick_sample, tokens[0]);
+	config.seed = 43;
+	struct llmd_driver* draft_driver;
+	CHECK_OK(llmd_create_mock_driver(NULL, &config, &draft_driver));
+	check_speculative(driver, draft_driver, pick_max, tokens[0]);
+	check_speculative(driver, draft_driver, pick_sample, tokens[0]);
+	CHECK_OK(llmd_destroy_mock_driver(draft_driver));
+
+	CHECK_OK(llmd_destroy_mock_driver(driver));
+	return 0;
+}
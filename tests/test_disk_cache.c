@@ -0,0 +1,145 @@
+// Files of the disk cache must only be used when intact and written for the
+// same model, and their LRU order must survive a restart
+#define _GNU_SOURCE
+#include "common.h"
+#include "disk_cache.h"
+#include <llmd/utils/host.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MODEL_HASH 0x1234
+#define NUM_TOKENS 4
+#define STATE_SIZE 1000
+
+static char dir[] = "/tmp/llmd-test-disk-cache-XXXXXX";
+static size_t file_size;
+
+static void
+file_path(uint64_t key, char* path_out, size_t size) {
+	snprintf(path_out, size, "%s/%016llx.kv", dir, (unsigned long long)key);
+}
+
+static unsigned int
+count_files(void) {
+	DIR* handle = opendir(dir);
+	CHECK(handle != NULL);
+
+	unsigned int count = 0;
+	struct dirent* dirent;
+	while ((dirent = readdir(handle)) != NULL) {
+		if (dirent->d_name[0] != '.') { ++count; }
+	}
+	closedir(handle);
+
+	return count;
+}
+
+static void
+init(struct llmd_disk_cache* cache, size_t capacity, uint64_t model_hash) {
+	CHECK_OK(llmd_disk_cache_init(&llmd_default_host, dir, capacity, model_hash, cache));
+}
+
+// Each write gets a later modification time than the previous one
+static uint64_t
+write_entry(struct llmd_disk_cache* cache, llmd_token_t first_token) {
+	llmd_token_t tokens[NUM_TOKENS] = { first_token, 1, 2, 3 };
+	unsigned char state[STATE_SIZE];
+	memset(state, first_token, sizeof(state));
+
+	struct llmd_disk_cache_entry* entry;
+	char* tmp_path;
+	usleep(20000);
+	CHECK_OK(llmd_disk_cache_write(cache, tokens, NUM_TOKENS, state, STATE_SIZE, &entry, &tmp_path));
+	uint64_t key = entry->key;
+	file_size = entry->file_size;
+	llmd_disk_cache_commit(cache, entry, tmp_path);
+
+	return key;
+}
+
+static struct llmd_disk_cache_entry*
+find(struct llmd_disk_cache* cache, llmd_token_t first_token) {
+	llmd_token_t tokens[NUM_TOKENS] = { first_token, 1, 2, 3 };
+	unsigned int shared;
+	struct llmd_disk_cache_entry* entry = llmd_disk_cache_find_longest(
+		cache, tokens, NUM_TOKENS, 0, &shared
+	);
+	CHECK(entry == NULL || shared == NUM_TOKENS);
+
+	return entry;
+}
+
+static void
+check_map(struct llmd_disk_cache* cache, llmd_token_t first_token) {
+	struct llmd_disk_cache_entry* entry = find(cache, first_token);
+	CHECK(entry != NULL);
+
+	struct llmd_disk_cache_mapping mapping;
+	usleep(20000);
+	CHECK_OK(llmd_disk_cache_map(cache, entry, &mapping));
+	CHECK(mapping.num_tokens == NUM_TOKENS && mapping.state_size == STATE_SIZE);
+	CHECK(((const unsigned char*)mapping.state)[STATE_SIZE - 1] == first_token);
+	llmd_disk_cache_unmap(&mapping);
+}
+
+int
+main(void) {
+	CHECK(mkdtemp(dir) != NULL);
+	struct llmd_disk_cache cache;
+	char path[256];
+
+	// Using b makes a the least recently used
+	init(&cache, 0, MODEL_HASH);
+	uint64_t key_a = write_entry(&cache, 'a');
+	uint64_t key_b = write_entry(&cache, 'b');
+	uint64_t key_c = write_entry(&cache, 'c');
+	CHECK(cache.num_writes == 3 && count_files() == 3);
+	check_map(&cache, 'b');
+	llmd_disk_cache_cleanup(&cache);
+
+	// A crash while writing leaves a temporary file behind
+	snprintf(path, sizeof(path), "%s/tmp-crashed", dir);
+	int fd = open(path, O_CREAT | O_WRONLY, 0644);
+	CHECK(fd >= 0);
+	close(fd);
+
+	// Files of another model are kept but not used
+	init(&cache, 0, MODEL_HASH + 1);
+	CHECK(cache.num_entries == 0 && cache.num_rejected == 3);
+	CHECK(access(path, F_OK) != 0);
+	CHECK(count_files() == 3);
+	llmd_disk_cache_cleanup(&cache);
+
+	// Only two files fit and the order comes from the previous run
+	init(&cache, 2 * file_size, MODEL_HASH);
+	CHECK(cache.num_entries == 2 && cache.num_evictions == 1);
+	CHECK(cache.head->key == key_b && cache.tail->key == key_c);
+	file_path(key_a, path, sizeof(path));
+	CHECK(access(path, F_OK) != 0);
+	CHECK(find(&cache, 'a') == NULL);
+	check_map(&cache, 'c');
+	llmd_disk_cache_cleanup(&cache);
+
+	// A damaged file is rejected on use and deleted
+	file_path(key_b, path, sizeof(path));
+	fd = open(path, O_WRONLY);
+	CHECK(fd >= 0);
+	CHECK(pwrite(fd, "x", 1, lseek(fd, 0, SEEK_END) - 1) == 1);
+	close(fd);
+
+	init(&cache, 0, MODEL_HASH);
+	CHECK(cache.num_entries == 2);
+	struct llmd_disk_cache_mapping mapping;
+	CHECK(llmd_disk_cache_map(&cache, find(&cache, 'b'), &mapping) == LLMD_ERR_INVALID);
+	CHECK(cache.num_rejected == 1 && cache.num_entries == 1);
+	CHECK(access(path, F_OK) != 0);
+	check_map(&cache, 'c');
+	llmd_disk_cache_cleanup(&cache);
+
+	file_path(key_c, path, sizeof(path));
+	CHECK(unlink(path) == 0);
+	CHECK(rmdir(dir) == 0);
+	return 0;
+}
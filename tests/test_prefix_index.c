@@ -0,0 +1,145 @@
+// Lookups in the prefix index must agree with a scan of every entry
+#include "common.h"
+#include "prefix_index.h"
+#include <llmd/utils/host.h>
+#include <limits.h>
+#include <string.h>
+
+#define NUM_ENTRIES 24
+#define MAX_TOKENS 48
+#define NUM_ITERATIONS 100000
+
+struct test_entry {
+	struct llmd_prefix_entry entry;
+	llmd_token_t tokens[MAX_TOKENS];
+	unsigned int num_tokens;
+	bool idle;
+};
+
+static struct test_entry entries[NUM_ENTRIES];
+
+static unsigned int
+next_random(unsigned int* seed) {
+	*seed = *seed * 1103515245u + 12345u;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static unsigned int
+shared_prefix(const struct test_entry* entry, const llmd_token_t* tokens, unsigned int num_tokens) {
+	unsigned int length = entry->num_tokens < num_tokens ? entry->num_tokens : num_tokens;
+	unsigned int i = 0;
+	while (i < length && entry->tokens[i] == tokens[i]) { ++i; }
+	return i;
+}
+
+static void
+check_lookups(struct llmd_prefix_index* index, const llmd_token_t* tokens, unsigned int num_tokens) {
+	bool any_idle = false;
+	unsigned int longest = 0;
+	unsigned int least_discard = UINT_MAX;
+	unsigned int least_discard_shared = 0;
+	for (unsigned int i = 0; i < NUM_ENTRIES; ++i) {
+		if (!entries[i].idle) { continue; }
+
+		any_idle = true;
+		unsigned int shared = shared_prefix(&entries[i], tokens, num_tokens);
+		unsigned int discard = entries[i].num_tokens - shared;
+		if (shared > longest) { longest = shared; }
+		if (
+			discard < least_discard
+			|| (discard == least_discard && shared > least_discard_shared)
+		) {
+			least_discard = discard;
+			least_discard_shared = shared;
+		}
+	}
+
+	struct llmd_prefix_entry* found;
+	unsigned int shared;
+	CHECK_OK(llmd_prefix_index_find_longest(index, tokens, num_tokens, &found, &shared));
+	if (!any_idle) {
+		CHECK(found == NULL);
+	} else {
+		struct test_entry* entry = llmd_container_of(found, struct test_entry, entry);
+		CHECK(found != NULL && entry->idle);
+		CHECK(shared == longest);
+		CHECK(shared_prefix(entry, tokens, num_tokens) == shared);
+	}
+
+	CHECK_OK(llmd_prefix_index_find_least_discard(index, tokens, num_tokens, &found, &shared));
+	if (!any_idle) {
+		CHECK(found == NULL);
+	} else {
+		struct test_entry* entry = llmd_container_of(found, struct test_entry, entry);
+		CHECK(found != NULL && entry->idle);
+		CHECK(shared == least_discard_shared);
+		CHECK(shared_prefix(entry, tokens, num_tokens) == shared);
+		CHECK(entry->num_tokens - shared == least_discard);
+	}
+}
+
+int
+main(void) {
+	struct llmd_prefix_index index;
+	CHECK_OK(llmd_prefix_index_init(&llmd_default_host, &index));
+	for (unsigned int i = 0; i < NUM_ENTRIES; ++i) {
+		llmd_prefix_index_add(&index, &entries[i].entry);
+	}
+
+	unsigned int seed = 1;
+	for (unsigned int iteration = 0; iteration < NUM_ITERATIONS; ++iteration) {
+		struct test_entry* entry = &entries[next_random(&seed) % NUM_ENTRIES];
+
+		switch (next_random(&seed) % 4) {
+			case 0:
+				entry->idle = next_random(&seed) % 2;
+				llmd_prefix_index_set_idle(&index, &entry->entry, entry->idle);
+				break;
+			case 1: {
+				// Rewrite the tail from a tiny alphabet so that entries share
+				// prefixes and sometimes rewrite what they already hold
+				unsigned int keep = next_random(&seed) % (entry->num_tokens + 1);
+				unsigned int length = keep + next_random(&seed) % 8;
+				if (length > MAX_TOKENS) { length = MAX_TOKENS; }
+				for (unsigned int i = keep; i < length; ++i) {
+					entry->tokens[i] = next_random(&seed) % 3;
+				}
+				entry->num_tokens = length;
+				CHECK_OK(llmd_prefix_index_update(&index, &entry->entry, entry->tokens, keep, length));
+			} break;
+			case 2:
+				llmd_prefix_index_remove(&index, &entry->entry);
+				llmd_prefix_index_add(&index, &entry->entry);
+				entry->num_tokens = 0;
+				entry->idle = false;
+				break;
+			default: {
+				llmd_token_t tokens[MAX_TOKENS];
+				unsigned int num_tokens = next_random(&seed) % MAX_TOKENS;
+				for (unsigned int i = 0; i < num_tokens; ++i) {
+					tokens[i] = next_random(&seed) % 3;
+				}
+				// Often start like an existing entry
+				if (next_random(&seed) % 2) {
+					unsigned int length = entry->num_tokens < num_tokens
+						? entry->num_tokens
+						: num_tokens;
+					memcpy(tokens, entry->tokens, length * sizeof(llmd_token_t));
+				}
+				check_lookups(&index, tokens, num_tokens);
+			} break;
+		}
+	}
+
+	for (unsigned int i = 0; i < NUM_ENTRIES; ++i) {
+		llmd_prefix_index_remove(&index, &entries[i].entry);
+	}
+	// Every node but the root is released
+	CHECK(index.nodes[0].ref_count == 0);
+	CHECK(index.nodes[0].idle_count == 0);
+	CHECK(index.nodes[0].min_idle_end == LLMD_PREFIX_NIL);
+	CHECK(index.num_slots_used == 0);
+
+	llmd_prefix_index_cleanup(&index);
+	return 0;
+}
@@ -0,0 +1,195 @@
+// Many threads share one session and its pool of physical contexts.
+// Every result is checked against a private session which only one thread
+// uses.
+#include "common.h"
+#include <llmd/mock.h>
+#include <pthread.h>
+#include <string.h>
+
+#define VOCAB_SIZE 300
+#define MAX_CONTEXT_LENGTH 64
+#define NUM_THREADS 8
+#define NUM_ITERATIONS 1000
+#define NUM_CONTEXTS 4
+#define SYSTEM_PROMPT_LENGTH 8
+#define MAX_TOKENS 48
+
+struct worker {
+	pthread_t thread;
+	struct llmd_session* session;
+	unsigned int seed;
+};
+
+static struct llmd_mock_driver_config driver_config = {
+	.vocab_size = VOCAB_SIZE,
+	.max_context_length = MAX_CONTEXT_LENGTH,
+	// A direct context and its fork for every thread and a few pooled ones
+	.max_contexts = NUM_THREADS * 2 + 4,
+	.seed = 42,
+};
+
+static unsigned int
+next_random(unsigned int* seed) {
+	*seed = *seed * 1103515245u + 12345u;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static void
+evaluate(
+	struct llmd_context* context,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset,
+	float* logits_out
+) {
+	struct llmd_generate_handle* handle;
+	struct llmd_logits_output output = {
+		.mode = LLMD_LOGITS_FULL,
+		.logits = logits_out,
+	};
+
+	CHECK_OK(llmd_begin_generate(context, &handle));
+	CHECK_OK(llmd_generate_next(handle, tokens + offset, num_tokens - offset, offset, &output));
+	CHECK_OK(llmd_end_generate(handle));
+}
+
+static void
+check(
+	struct llmd_context* context,
+	struct llmd_context* reference,
+	const llmd_token_t* tokens,
+	unsigned int num_tokens,
+	unsigned int offset
+) {
+	float expected[VOCAB_SIZE];
+	float actual[VOCAB_SIZE];
+
+	evaluate(reference, tokens, num_tokens, 0, expected);
+	evaluate(context, tokens, num_tokens, offset, actual);
+	CHECK(memcmp(expected, actual, sizeof(actual)) == 0);
+}
+
+static void*
+run_worker(void* userdata) {
+	struct worker* worker = userdata;
+	unsigned int seed = worker->seed;
+
+	struct llmd_driver* reference_driver;
+	struct llmd_session* reference_session;
+	struct llmd_context* reference;
+	struct llmd_mock_driver_config reference_config = driver_config;
+	reference_config.max_contexts = 1;
+	CHECK_OK(llmd_create_mock_driver(NULL, &reference_config, &reference_driver));
+	CHECK_OK(llmd_create_session(NULL, reference_driver, NULL, &reference_session));
+	CHECK_OK(llmd_create_context(reference_session, LLMD_CONTEXT_DIRECT, &reference));
+
+	struct llmd_context* contexts[NUM_CONTEXTS];
+	llmd_token_t tokens[NUM_CONTEXTS][MAX_TOKENS];
+	unsigned int num_tokens[NUM_CONTEXTS] = { 0 };
+	for (unsigned int i = 0; i < NUM_CONTEXTS; ++i) {
+		// The context type enum doubles as an index
+		CHECK_OK(llmd_create_context(worker->session, (enum llmd_context_type)i, &contexts[i]));
+	}
+
+	for (unsigned int iteration = 0; iteration < NUM_ITERATIONS; ++iteration) {
+		unsigned int index = next_random(&seed) % NUM_CONTEXTS;
+		llmd_token_t* context_tokens = tokens[index];
+
+		// Rewind to a random point then append from a tiny alphabet.
+		// Every sequence starts with the same system prompt so pooled
+		// contexts are shared between threads.
+		unsigned int offset = next_random(&seed) % (num_tokens[index] + 1);
+		unsigned int length = offset + 1 + next_random(&seed) % 8;
+		if (length > MAX_TOKENS) {
+			offset = 0;
+			length = SYSTEM_PROMPT_LENGTH + 1;
+		}
+		for (unsigned int i = offset; i < length; ++i) {
+			context_tokens[i] = i < SYSTEM_PROMPT_LENGTH
+				? 'a' + i
+				: 'a' + next_random(&seed) % 3;
+		}
+		check(contexts[index], reference, context_tokens, length, offset);
+		num_tokens[index] = length;
+
+		if (next_random(&seed) % 8 == 0 && length < MAX_TOKENS) {
+			struct llmd_context* child;
+			llmd_token_t child_tokens[MAX_TOKENS];
+			memcpy(child_tokens, context_tokens, length * sizeof(llmd_token_t));
+			child_tokens[length] = 'z';
+
+			CHECK_OK(llmd_fork_context(contexts[index], &child));
+			check(child, reference, child_tokens, length + 1, length);
+			CHECK_OK(llmd_destroy_context(child));
+		}
+
+		if (next_random(&seed) % 16 == 0) {
+			const llmd_token_t* string_tokens;
+			unsigned int num_string_tokens;
+			CHECK_OK(llmd_tokenize(contexts[index], "hello", 5, &string_tokens, &num_string_tokens));
+			CHECK(num_string_tokens == 5);
+		}
+	}
+
+	for (unsigned int i = 0; i < NUM_CONTEXTS; ++i) {
+		CHECK_OK(llmd_destroy_context(contexts[i]));
+	}
+
+	CHECK_OK(llmd_destroy_context(reference));
+	CHECK_OK(llmd_destroy_session(reference_session));
+	CHECK_OK(llmd_destroy_mock_driver(reference_driver));
+	return NULL;
+}
+
+static void
+stress(
+	struct llmd_driver* driver,
+	enum llmd_eviction_policy eviction_policy,
+	unsigned int max_batch_tokens
+) {
+	struct llmd_session_config config = {
+		.admission_timeout_ms = 60000,
+		.max_pooled_contexts = 3,
+		.eviction_policy = eviction_policy,
+		.swap_space_size = 1 << 20,
+		.tokenize_cache_size = 1 << 12,
+		.max_batch_tokens = max_batch_tokens,
+		.max_batch_wait_us = 100,
+	};
+	struct llmd_session* session;
+	CHECK_OK(llmd_create_session(NULL, driver, &config, &session));
+
+	struct worker workers[NUM_THREADS];
+	for (unsigned int i = 0; i < NUM_THREADS; ++i) {
+		workers[i] = (struct worker) {
+			.session = session,
+			.seed = i + 1,
+		};
+		CHECK(pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) == 0);
+	}
+
+	for (unsigned int i = 0; i < NUM_THREADS; ++i) {
+		CHECK(pthread_join(workers[i].thread, NULL) == 0);
+	}
+
+	struct llmd_session_stats stats;
+	CHECK_OK(llmd_get_session_stats(session, &stats));
+	// Pooled contexts were actually shared
+	CHECK(stats.num_prefix_hits > 0);
+	CHECK(stats.num_ooms == 0);
+	CHECK((stats.batch.num_batches > 0) == (max_batch_tokens > 0));
+	CHECK_OK(llmd_destroy_session(session));
+}
+
+int
+main(void) {
+	struct llmd_driver* driver;
+	CHECK_OK(llmd_create_mock_driver(NULL, &driver_config, &driver));
+
+	stress(driver, LLMD_EVICT_LRU, 0);
+	stress(driver, LLMD_EVICT_LEAST_VALUABLE, 0);
+	stress(driver, LLMD_EVICT_LFU, 16);
+
+	CHECK_OK(llmd_destroy_mock_driver(driver));
+	return 0;
+}
@@ -0,0 +1,184 @@
+// Token sequences must read back what was written to them whatever chunks
+// they share, including when allocations fail
+#include "common.h"
+#include "token_store.h"
+#include <llmd/utils/host.h>
+#include <string.h>
+
+#define NUM_SEQS 8
+#define MAX_TOKENS (LLMD_TOKEN_CHUNK_SIZE * 5)
+#define NUM_ITERATIONS 20000
+
+struct test_host {
+	struct llmd_host header;
+	unsigned int seed;
+	bool failing;
+	int num_allocations;
+};
+
+struct test_seq {
+	struct llmd_token_seq seq;
+	llmd_token_t tokens[MAX_TOKENS];
+};
+
+static struct test_seq seqs[NUM_SEQS];
+
+static unsigned int
+next_random(unsigned int* seed) {
+	*seed = *seed * 1103515245u + 12345u;
+	return (*seed >> 16) & 0x7fff;
+}
+
+// Fails some allocations and counts those which are live
+static void*
+test_realloc(struct llmd_host* header, void* ptr, size_t size) {
+	struct test_host* host = (struct test_host*)header;
+
+	if (size == 0) {
+		if (ptr != NULL) { --host->num_allocations; }
+		free(ptr);
+		return NULL;
+	}
+
+	if (host->failing && next_random(&host->seed) % 16 == 0) {
+		return NULL;
+	}
+
+	void* result = realloc(ptr, size);
+	if (result != NULL && ptr == NULL) { ++host->num_allocations; }
+	return result;
+}
+
+static struct llmd_host_interface test_host_interface = {
+	.realloc = test_realloc,
+	.log = llmd_default_log,
+};
+
+static void
+check_seq(const struct test_seq* seq) {
+	static llmd_token_t tokens[MAX_TOKENS];
+	llmd_token_seq_read(&seq->seq, 0, seq->seq.length, tokens);
+	CHECK(memcmp(tokens, seq->tokens, seq->seq.length * sizeof(llmd_token_t)) == 0);
+}
+
+// Writes from a tiny alphabet so that full chunks are often interned
+static void
+write_seq(struct llmd_token_store* store, struct test_seq* seq, unsigned int* seed) {
+	static llmd_token_t tokens[MAX_TOKENS];
+	unsigned int old_length = seq->seq.length;
+	unsigned int offset = next_random(seed) % (old_length + 1);
+	unsigned int num_tokens = next_random(seed) % (MAX_TOKENS - offset + 1);
+	// Truncation is a write of nothing
+	if (next_random(seed) % 8 == 0) { num_tokens = 0; }
+	for (unsigned int i = 0; i < num_tokens; ++i) {
+		tokens[i] = next_random(seed) % 2;
+	}
+
+	enum llmd_error status = llmd_token_seq_write(store, &seq->seq, offset, tokens, num_tokens);
+	if (status == LLMD_OK) {
+		CHECK(seq->seq.length == offset + num_tokens);
+		memcpy(seq->tokens + offset, tokens, num_tokens * sizeof(llmd_token_t));
+		return;
+	}
+
+	// Either nothing changed or a prefix of the new content is left
+	CHECK(status == LLMD_ERR_OOM);
+	unsigned int length = seq->seq.length;
+	if (length == old_length) {
+		static llmd_token_t actual[MAX_TOKENS];
+		llmd_token_seq_read(&seq->seq, 0, length, actual);
+		if (memcmp(actual, seq->tokens, length * sizeof(llmd_token_t)) == 0) { return; }
+	}
+
+	CHECK(length >= offset && length <= offset + num_tokens);
+	memcpy(seq->tokens + offset, tokens, (length - offset) * sizeof(llmd_token_t));
+}
+
+static void
+check_sharing(struct llmd_token_store* store) {
+	static llmd_token_t tokens[LLMD_TOKEN_CHUNK_SIZE * 2 + 1];
+	for (unsigned int i = 0; i < LLMD_TOKEN_CHUNK_SIZE * 2 + 1; ++i) {
+		tokens[i] = i;
+	}
+
+	struct llmd_token_seq a = { 0 };
+	struct llmd_token_seq b = { 0 };
+	struct llmd_token_seq c = { 0 };
+
+	// Full chunks with the same content are shared, the partial one is not
+	CHECK_OK(llmd_token_seq_write(store, &a, 0, tokens, LLMD_TOKEN_CHUNK_SIZE * 2 + 1));
+	CHECK_OK(llmd_token_seq_write(store, &b, 0, tokens, LLMD_TOKEN_CHUNK_SIZE * 2 + 1));
+	CHECK(a.chunks[0] == b.chunks[0] && a.chunks[1] == b.chunks[1]);
+	CHECK(a.chunks[2] != b.chunks[2]);
+	CHECK(store->num_interned == 2);
+
+	// A copy shares every chunk until it is written
+	CHECK_OK(llmd_token_seq_copy(store, &c, &a));
+	CHECK(c.length == a.length && c.chunks[2] == a.chunks[2]);
+	CHECK(a.chunks[2]->ref_count == 2);
+
+	llmd_token_t token = 42;
+	CHECK_OK(llmd_token_seq_write(store, &c, LLMD_TOKEN_CHUNK_SIZE * 2, &token, 1));
+	CHECK(c.chunks[2] != a.chunks[2] && a.chunks[2]->ref_count == 1);
+	CHECK(c.chunks[1] == a.chunks[1]);
+	llmd_token_seq_read(&a, LLMD_TOKEN_CHUNK_SIZE * 2, 1, &token);
+	CHECK(token == LLMD_TOKEN_CHUNK_SIZE * 2);
+
+	// Writing into an interned chunk copies it
+	CHECK_OK(llmd_token_seq_write(store, &c, 1, &token, 1));
+	CHECK(c.length == 2 && c.chunks[0] != a.chunks[0]);
+	CHECK(a.chunks[0]->ref_count == 2);
+
+	llmd_token_seq_release(store, &a);
+	llmd_token_seq_release(store, &b);
+	llmd_token_seq_release(store, &c);
+	CHECK(store->num_interned == 0);
+}
+
+int
+main(void) {
+	struct test_host host = {
+		.header = { .interface = &test_host_interface },
+		.seed = 1,
+	};
+	struct llmd_token_store store;
+	llmd_token_store_init(&host.header, &store);
+
+	check_sharing(&store);
+
+	unsigned int seed = 1;
+	for (unsigned int iteration = 0; iteration < NUM_ITERATIONS; ++iteration) {
+		struct test_seq* seq = &seqs[next_random(&seed) % NUM_SEQS];
+		host.failing = next_random(&seed) % 4 == 0;
+
+		if (next_random(&seed) % 4 == 0) {
+			struct test_seq* source = &seqs[next_random(&seed) % NUM_SEQS];
+			if (source != seq) {
+				enum llmd_error status = llmd_token_seq_copy(&store, &seq->seq, &source->seq);
+				if (status == LLMD_OK) {
+					CHECK(seq->seq.length == source->seq.length);
+					memcpy(seq->tokens, source->tokens, sizeof(seq->tokens));
+				} else {
+					CHECK(status == LLMD_ERR_OOM && seq->seq.length == 0);
+				}
+			}
+		} else {
+			write_seq(&store, seq, &seed);
+		}
+
+		host.failing = false;
+		for (unsigned int i = 0; i < NUM_SEQS; ++i) {
+			check_seq(&seqs[i]);
+		}
+	}
+
+	for (unsigned int i = 0; i < NUM_SEQS; ++i) {
+		llmd_token_seq_release(&store, &seqs[i].seq);
+	}
+	CHECK(store.num_interned == 0);
+	llmd_token_store_cleanup(&store);
+	// Every chunk was released exactly once
+	CHECK(host.num_allocations == 0);
+
+	return 0;
+}